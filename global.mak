@@ -51,9 +51,11 @@ INCLUDE_PATHS +=	-I. \
 
 
 LIBS += -lglib-2.0 \
+			-lgthread-2.0 \
 			-lintl \
 			-lws2_32 \
 			-lpurple \
+			-lz \
 			$(PIDGIN_TOP)/pidgin$(PLUGIN_SUFFIX)
 			
 PURPLE_LIBS = -L$(GTK_TOP)/lib -L$(PURPLE_TOP) $(LIBS)
@@ -87,12 +89,23 @@ LIBDIR := $(shell pkg-config --variable=libdir $(PIDGIN_NAME) 2> /dev/null || ec
 
 # LINUX and others, use pkg-config
 PURPLE_LIBS = $(shell pkg-config --libs purple)
+# zlib, for compressed HTTP body
+PURPLE_LIBS += -lz
+# timeline decoding threads
+PURPLE_LIBS += $(shell pkg-config --libs gthread-2.0)
 PURPLE_DATAROOT_DIR = $(shell pkg-config --variable=datarootdir purple)
 PURPLE_CFLAGS = $(CFLAGS) -DPURPLE_PLUGINS -DENABLE_NLS -DMBPURPLE_VERSION=\"$(VERSION)$(SUBVERSION)\"
 PURPLE_CFLAGS += $(shell pkg-config --cflags purple)
 PURPLE_CFLAGS += $(shell pkg-config --cflags pidgin)
 #PURPLE_CFLAGS += -Wall -pthread -I. -g -O2 -pipe -fPIC -DPIC 
 PURPLE_CFLAGS += -Wall -pthread -I. -g -pipe -fPIC -DPIC
+# TLS session resumption, only works when libpurple uses its GnuTLS plugin. Set to 1 in local.mak to enable
+# Unsupported outside libpurple 2.7.0 to 2.x, it depends on private data of ssl-gnutls and is disabled there
+USE_GNUTLS_RESUME ?= 0
+ifeq ($(strip $(USE_GNUTLS_RESUME)), 1)
+PURPLE_CFLAGS += -DMB_USE_GNUTLS $(shell pkg-config --cflags gnutls)
+PURPLE_LIBS += $(shell pkg-config --libs gnutls)
+endif
 PLUGIN_SUFFIX := .so
 EXE_SUFFIX := 
 
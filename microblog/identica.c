@@ -157,6 +157,41 @@ gboolean plugin_load(PurplePlugin *plugin)
 	_mb_conf[TC_USE_HTTPS].conf = g_strdup("use_https");
 	_mb_conf[TC_USE_HTTPS].def_bool = FALSE;
 	
+	_mb_conf[TC_KEEP_ALIVE].conf = g_strdup("keep_alive");
+	_mb_conf[TC_KEEP_ALIVE].def_bool = TRUE;
+	option = purple_account_option_bool_new(_("Keep connections open between requests"), _mb_conf[TC_KEEP_ALIVE].conf, _mb_conf[TC_KEEP_ALIVE].def_bool);
+	prpl_info->protocol_options = g_list_append(prpl_info->protocol_options, option);
+
+	_mb_conf[TC_USE_JSON].conf = g_strdup("use_json");
+	_mb_conf[TC_USE_JSON].def_bool = FALSE;
+	option = purple_account_option_bool_new(_("Use JSON format"), _mb_conf[TC_USE_JSON].conf, _mb_conf[TC_USE_JSON].def_bool);
+	prpl_info->protocol_options = g_list_append(prpl_info->protocol_options, option);
+
+	_mb_conf[TC_DECODE_WORKERS].conf = g_strdup("decode_workers");
+	_mb_conf[TC_DECODE_WORKERS].def_int = 2;
+	option = purple_account_option_int_new(_("Timeline decoding threads (0 to decode on main loop)"), _mb_conf[TC_DECODE_WORKERS].conf, _mb_conf[TC_DECODE_WORKERS].def_int);
+	prpl_info->protocol_options = g_list_append(prpl_info->protocol_options, option);
+
+	_mb_conf[TC_MAX_IN_FLIGHT].conf = g_strdup("max_requests");
+	_mb_conf[TC_MAX_IN_FLIGHT].def_int = MB_SCHED_MAX_IN_FLIGHT;
+	option = purple_account_option_int_new(_("Maximum requests at once"), _mb_conf[TC_MAX_IN_FLIGHT].conf, _mb_conf[TC_MAX_IN_FLIGHT].def_int);
+	prpl_info->protocol_options = g_list_append(prpl_info->protocol_options, option);
+
+	_mb_conf[TC_MAX_HOST_IN_FLIGHT].conf = g_strdup("max_host_requests");
+	_mb_conf[TC_MAX_HOST_IN_FLIGHT].def_int = MB_SCHED_MAX_PER_HOST;
+	option = purple_account_option_int_new(_("Maximum requests at once to one server, all accounts"), _mb_conf[TC_MAX_HOST_IN_FLIGHT].conf, _mb_conf[TC_MAX_HOST_IN_FLIGHT].def_int);
+	prpl_info->protocol_options = g_list_append(prpl_info->protocol_options, option);
+
+	_mb_conf[TC_REQUEST_TIMEOUT].conf = g_strdup("request_timeout");
+	_mb_conf[TC_REQUEST_TIMEOUT].def_int = MB_TIMEOUT_TOTAL;
+	option = purple_account_option_int_new(_("Timeline request timeout in seconds (0 for none)"), _mb_conf[TC_REQUEST_TIMEOUT].conf, _mb_conf[TC_REQUEST_TIMEOUT].def_int);
+	prpl_info->protocol_options = g_list_append(prpl_info->protocol_options, option);
+
+	_mb_conf[TC_IO_THREAD].conf = g_strdup("io_thread");
+	_mb_conf[TC_IO_THREAD].def_bool = FALSE;
+	option = purple_account_option_bool_new(_("Read plain HTTP responses on a separate thread"), _mb_conf[TC_IO_THREAD].conf, _mb_conf[TC_IO_THREAD].def_bool);
+	prpl_info->protocol_options = g_list_append(prpl_info->protocol_options, option);
+
 	_mb_conf[TC_STATUS_UPDATE].conf = g_strdup("status_update");
 	_mb_conf[TC_STATUS_UPDATE].def_str = g_strdup("/api/statuses/update.xml");
 	option = purple_account_option_string_new(_("Status update path"), _mb_conf[TC_STATUS_UPDATE].conf, _mb_conf[TC_STATUS_UPDATE].def_str);
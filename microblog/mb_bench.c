@@ -0,0 +1,1571 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * Micro benchmark for Microblog internals
+ *
+ * Usage: mb_bench <benchmark> [args]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include <purple.h>
+
+#include "mb_http.h"
+#include "twitter.h"
+#include "tw_decode.h"
+#include "mb_urlenc.h"
+#include "mb_oauth_sign.h"
+#include "mb_state.h"
+#include "tw_sched.h"
+#include "tw_stream.h"
+
+typedef int (*MbBenchFunc)(int argc, char * argv[]);
+
+typedef struct _MbBench {
+	const char * name;
+	MbBenchFunc func;
+	const char * desc;
+} MbBench;
+
+// Deterministic random, so every run sees the same input
+static guint32 bench_seed = 12345;
+
+static guint32 bench_rand(guint32 max)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return ((bench_seed >> 8) % max);
+}
+
+/*
+	Fill buffer with printable random text
+*/
+static void bench_fill_text(gchar * buf, gint len)
+{
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789<>/=\"\r\n";
+	gint i;
+
+	for(i = 0; i < len; i++) {
+		buf[i] = chars[bench_rand(sizeof(chars) - 1)];
+	}
+}
+
+/*
+	Feed response to a fresh MbHttpData in pieces of random size up to max_piece bytes
+
+	@return MbHttpData after feeding, caller must free it
+*/
+static MbHttpData * bench_feed(const gchar * resp, gint resp_len, gint max_piece)
+{
+	MbHttpData * data = mb_http_data_new();
+	gint pos = 0, piece;
+
+	while(pos < resp_len) {
+		piece = (max_piece > 1) ? (gint)bench_rand(max_piece) + 1 : 1;
+		if(piece > resp_len - pos) {
+			piece = resp_len - pos;
+		}
+		mb_http_data_post_read(data, resp + pos, piece);
+		pos += piece;
+	}
+	return data;
+}
+
+/*
+	Chunked transfer-encoding decoder
+
+	args: [body size in MB] [rounds]
+*/
+static int bench_chunked(int argc, char * argv[])
+{
+	static const gint pieces[] = { 7, 1460, 16384, G_MAXINT };
+	gint body_len = ( (argc > 0) ? atoi(argv[0]) : 4) * 1024 * 1024;
+	gint rounds = (argc > 1) ? atoi(argv[1]) : 5;
+	gchar * body;
+	GString * resp;
+	gint pos, chunk, i, r;
+	GTimer * timer;
+	MbHttpData * data;
+	gdouble elapsed;
+	int retval = 0;
+
+	body = g_malloc(body_len);
+	bench_fill_text(body, body_len);
+
+	resp = g_string_sized_new(body_len + body_len / 100 + 1024);
+	g_string_append(resp, "HTTP/1.1 200 OK\r\nContent-Type: application/xml; charset=utf-8\r\nTransfer-Encoding: chunked\r\n\r\n");
+	for(pos = 0; pos < body_len; pos += chunk) {
+		chunk = bench_rand(16384) + 1;
+		if(chunk > body_len - pos) {
+			chunk = body_len - pos;
+		}
+		if(bench_rand(10) == 0) {
+			g_string_append_printf(resp, "%x;ext=1\r\n", chunk);
+		} else {
+			g_string_append_printf(resp, "%X\r\n", chunk);
+		}
+		g_string_append_len(resp, body + pos, chunk);
+		g_string_append(resp, "\r\n");
+	}
+	g_string_append(resp, "0\r\n\r\n");
+
+	printf("chunked: body = %d bytes, encoded = %d bytes, %d rounds\n", body_len, (gint)resp->len, rounds);
+	timer = g_timer_new();
+	for(i = 0; i < (gint)(sizeof(pieces) / sizeof(pieces[0])); i++) {
+		elapsed = 0;
+		for(r = 0; r < rounds; r++) {
+			g_timer_start(timer);
+			data = bench_feed(resp->str, resp->len, pieces[i]);
+			g_timer_stop(timer);
+			elapsed += g_timer_elapsed(timer, NULL);
+
+			if( (data->state != MB_HTTP_STATE_FINISHED) || (data->content->len != body_len) ||
+					(memcmp(data->content->str, body, body_len) != 0) ) {
+				printf("chunked: decoded content mismatch, piece = %d\n", pieces[i]);
+				retval = 1;
+			}
+			mb_http_data_free(data);
+		}
+		printf("  pieces up to %10d bytes: %8.2f ms/round, %8.2f MB/s\n", pieces[i],
+				elapsed * 1000 / rounds, (resp->len * (gdouble)rounds) / (elapsed * 1024 * 1024));
+	}
+	g_timer_destroy(timer);
+	g_string_free(resp, TRUE);
+	g_free(body);
+	return retval;
+}
+
+/*
+	Random status text, with characters that need escaping in XML and JSON
+*/
+static void bench_status_text(GString * text)
+{
+	static const char * words[] = { "hello", "world", "&", "<b>", "\"quoted\"", "caf\xc3\xa9", "http://example.com/x?a=1&b=2",
+		"@someone", "#tag", "it's", "back\\slash", "tab\there" };
+	gint n = bench_rand(20) + 3, i;
+
+	g_string_truncate(text, 0);
+	for(i = 0; i < n; i++) {
+		if(i > 0) {
+			g_string_append_c(text, ' ');
+		}
+		g_string_append(text, words[bench_rand(sizeof(words) / sizeof(words[0]))]);
+	}
+}
+
+static void bench_append_xml(GString * out, const gchar * name, const gchar * value, gint indent)
+{
+	gchar * escaped = g_markup_escape_text(value, -1);
+
+	g_string_append_printf(out, "%*s<%s>%s</%s>\n", indent, "", name, escaped, name);
+	g_free(escaped);
+}
+
+static void bench_append_json(GString * out, const gchar * name, const gchar * value, gboolean quote)
+{
+	const gchar * p;
+
+	g_string_append_printf(out, "\"%s\":", name);
+	if(!quote) {
+		g_string_append_printf(out, "%s,", value);
+		return;
+	}
+	g_string_append_c(out, '"');
+	for(p = value; *p; p++) {
+		switch(*p) {
+			case '"' : g_string_append(out, "\\\""); break;
+			case '\\' : g_string_append(out, "\\\\"); break;
+			case '/' : g_string_append(out, "\\/"); break;
+			case '\t' : g_string_append(out, "\\t"); break;
+			default : g_string_append_c(out, *p); break;
+		}
+	}
+	g_string_append(out, "\",");
+}
+
+/*
+	User part of a status, in both formats
+*/
+static void bench_append_user(GString * xml, GString * json, gint indent, guint32 uid)
+{
+	gchar * name = g_strdup_printf("user%u", uid);
+	gchar * id = g_strdup_printf("%u", uid);
+	gchar * url = g_strdup_printf("http://a1.twimg.com/profile_images/%u/avatar_normal.png", uid * 7);
+
+	g_string_append_printf(xml, "%*s<user>\n", indent, "");
+	g_string_append(json, "\"user\":{");
+	bench_append_xml(xml, "id", id, indent + 2); bench_append_json(json, "id", id, FALSE);
+	bench_append_xml(xml, "name", "Some Name", indent + 2); bench_append_json(json, "name", "Some Name", TRUE);
+	bench_append_xml(xml, "screen_name", name, indent + 2); bench_append_json(json, "screen_name", name, TRUE);
+	bench_append_xml(xml, "location", "Bangkok, Thailand", indent + 2); bench_append_json(json, "location", "Bangkok, Thailand", TRUE);
+	bench_append_xml(xml, "description", "Just another user of the service", indent + 2); bench_append_json(json, "description", "Just another user of the service", TRUE);
+	bench_append_xml(xml, "profile_image_url", url, indent + 2); bench_append_json(json, "profile_image_url", url, TRUE);
+	bench_append_xml(xml, "url", "", indent + 2); bench_append_json(json, "url", "null", FALSE);
+	bench_append_xml(xml, "protected", (uid % 5) ? "false" : "true", indent + 2); bench_append_json(json, "protected", (uid % 5) ? "false" : "true", FALSE);
+	bench_append_xml(xml, "followers_count", "123", indent + 2); bench_append_json(json, "followers_count", "123", FALSE);
+	bench_append_xml(xml, "friends_count", "45", indent + 2); bench_append_json(json, "friends_count", "45", FALSE);
+	bench_append_xml(xml, "created_at", "Tue Mar 03 10:00:00 +0000 2009", indent + 2); bench_append_json(json, "created_at", "Tue Mar 03 10:00:00 +0000 2009", TRUE);
+	bench_append_xml(xml, "statuses_count", "6789", indent + 2); bench_append_json(json, "statuses_count", "6789", FALSE);
+	g_string_append_printf(xml, "%*s</user>\n", indent, "");
+	g_string_truncate(json, json->len - 1);
+	g_string_append(json, "},");
+	g_free(url);
+	g_free(id);
+	g_free(name);
+}
+
+/*
+	Status without user part, in both formats
+*/
+static void bench_append_status_fields(GString * xml, GString * json, gint indent, mb_status_t id, gint sec, GString * text)
+{
+	gchar * id_str = g_strdup_printf("%llu", id);
+	gchar * created_at = g_strdup_printf("Wed Aug 27 13:%02d:%02d +0000 2008", (sec / 60) % 60, sec % 60);
+
+	bench_append_xml(xml, "created_at", created_at, indent); bench_append_json(json, "created_at", created_at, TRUE);
+	bench_append_xml(xml, "id", id_str, indent); bench_append_json(json, "id", id_str, FALSE);
+	bench_append_xml(xml, "text", text->str, indent); bench_append_json(json, "text", text->str, TRUE);
+	bench_append_xml(xml, "source", "<a href=\"http://example.com/\">client</a>", indent); bench_append_json(json, "source", "<a href=\"http://example.com/\">client</a>", TRUE);
+	bench_append_xml(xml, "truncated", "false", indent); bench_append_json(json, "truncated", "false", FALSE);
+	bench_append_xml(xml, "in_reply_to_status_id", "", indent); bench_append_json(json, "in_reply_to_status_id", "null", FALSE);
+	bench_append_xml(xml, "favorited", "false", indent); bench_append_json(json, "favorited", "false", FALSE);
+	g_free(created_at);
+	g_free(id_str);
+}
+
+/*
+	Same timeline in XML and JSON, like statuses/friends_timeline.xml and .json
+*/
+static void bench_make_timeline(gint count, GString * xml, GString * json)
+{
+	GString * text = g_string_new(NULL);
+	mb_status_t id = 4294967296123ULL;
+	gint i;
+
+	g_string_append(xml, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<statuses type=\"array\">\n");
+	g_string_append_c(json, '[');
+	for(i = 0; i < count; i++) {
+		id -= bench_rand(1000) + 1;
+		g_string_append(xml, "<status>\n");
+		g_string_append_c(json, '{');
+		bench_status_text(text);
+		bench_append_status_fields(xml, json, 2, id, count - i, text);
+		bench_append_user(xml, json, 2, bench_rand(50) + 1);
+		if(bench_rand(8) == 0) {
+			// retweet
+			g_string_append(xml, "  <retweeted_status>\n");
+			g_string_append(json, "\"retweeted_status\":{");
+			bench_status_text(text);
+			bench_append_status_fields(xml, json, 4, id - 100000, 0, text);
+			bench_append_user(xml, json, 4, bench_rand(50) + 1);
+			g_string_append(xml, "  </retweeted_status>\n");
+			g_string_truncate(json, json->len - 1);
+			g_string_append(json, "},");
+		} else {
+			g_string_append(json, "\"retweeted_status\":null,");
+		}
+		g_string_append(xml, "</status>\n");
+		g_string_truncate(json, json->len - 1);
+		g_string_append(json, "},");
+	}
+	g_string_append(xml, "</statuses>\n");
+	g_string_truncate(json, json->len - 1);
+	g_string_append_c(json, ']');
+	g_string_free(text, TRUE);
+}
+
+/*
+	Decode document through a decoder, in pieces of max_piece bytes
+*/
+static MbMsgBatch * bench_decode_pieces(TwitterMsgDecoder * dec, const gchar * buf, gint len, gint max_piece)
+{
+	time_t last_msg_time = 0;
+	gint pos, piece;
+
+	for(pos = 0; pos < len; pos += piece) {
+		piece = (max_piece < len - pos) ? max_piece : len - pos;
+		tw_decoder_feed(dec, buf + pos, piece);
+	}
+	return tw_decoder_finish(dec, &last_msg_time);
+}
+
+static gboolean bench_msg_batch_equal(MbMsgBatch * a, MbMsgBatch * b)
+{
+	TwitterMsg * ma, * mb;
+	guint i;
+
+	if(a->len != b->len) {
+		return FALSE;
+	}
+	for(i = 0; i < a->len; i++) {
+		ma = mb_msg_batch_index(a, i);
+		mb = mb_msg_batch_index(b, i);
+		if( (ma->id != mb->id) || (ma->msg_time != mb->msg_time) || (ma->is_protected != mb->is_protected) ||
+				(strcmp(ma->from, mb->from) != 0) || (strcmp(ma->msg_txt, mb->msg_txt) != 0) ||
+				(strcmp(ma->avatar_url, mb->avatar_url) != 0) ) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+	XML and JSON timeline decoding
+
+	args: [statuses] [rounds]
+*/
+static int bench_decode(int argc, char * argv[])
+{
+	static const gint pieces[] = { 1460, G_MAXINT };
+	gint count = (argc > 0) ? atoi(argv[0]) : 200;
+	gint rounds = (argc > 1) ? atoi(argv[1]) : 50;
+	GString * docs[2];
+	static const char * names[] = { "xml", "json" };
+	MbMsgBatch * msgs[2];
+	TwitterMsgDecoder * dec;
+	time_t last_msg_time = 0;
+	GTimer * timer;
+	gdouble elapsed;
+	gint f, i, r;
+	int retval = 0;
+
+	docs[0] = g_string_new(NULL);
+	docs[1] = g_string_new(NULL);
+	bench_make_timeline(count, docs[0], docs[1]);
+
+	for(f = 0; f < 2; f++) {
+		msgs[f] = tw_decode(docs[f]->str, docs[f]->len, TW_DECODE_TIMELINE, &last_msg_time);
+	}
+	if( (msgs[0]->len != (guint)count) || !bench_msg_batch_equal(msgs[0], msgs[1]) ) {
+		printf("decode: XML and JSON results differ, %d and %d statuses\n", msgs[0]->len, msgs[1]->len);
+		retval = 1;
+	}
+
+	printf("decode: %d statuses, %d rounds\n", count, rounds);
+	timer = g_timer_new();
+	dec = tw_decoder_new(TW_DECODE_TIMELINE);
+	for(f = 0; f < 2; f++) {
+		printf("  %-4s %8d bytes\n", names[f], (gint)docs[f]->len);
+		for(i = 0; i < (gint)(sizeof(pieces) / sizeof(pieces[0])); i++) {
+			elapsed = 0;
+			for(r = 0; r < rounds; r++) {
+				MbMsgBatch * decoded;
+
+				g_timer_start(timer);
+				decoded = bench_decode_pieces(dec, docs[f]->str, docs[f]->len, pieces[i]);
+				g_timer_stop(timer);
+				elapsed += g_timer_elapsed(timer, NULL);
+
+				if(!bench_msg_batch_equal(decoded, msgs[f])) {
+					printf("decode: %s result depends on piece size %d\n", names[f], pieces[i]);
+					retval = 1;
+				}
+				mb_msg_batch_free(decoded);
+			}
+			printf("    pieces of %10d bytes: %8.3f ms/round, %8.2f MB/s, %8.2f us/status\n", pieces[i],
+					elapsed * 1000 / rounds, (docs[f]->len * (gdouble)rounds) / (elapsed * 1024 * 1024),
+					elapsed * 1000000 / ((gdouble)rounds * count));
+		}
+		mb_msg_batch_free(msgs[f]);
+		g_string_free(docs[f], TRUE);
+	}
+	tw_decoder_free(dec);
+	g_timer_destroy(timer);
+	return retval;
+}
+
+/*
+	Compress buf, window_bits selects gzip (31), zlib (15) or raw deflate (-15)
+*/
+static GString * bench_compress(const gchar * buf, gint len, gint window_bits)
+{
+	GString * out = g_string_sized_new(len / 2 + 64);
+	z_stream strm;
+	gchar tmp[16384];
+	gint ret;
+
+	memset(&strm, 0, sizeof(strm));
+	deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+	strm.next_in = (Bytef *)buf;
+	strm.avail_in = len;
+	do {
+		strm.next_out = (Bytef *)tmp;
+		strm.avail_out = sizeof(tmp);
+		ret = deflate(&strm, Z_FINISH);
+		g_string_append_len(out, tmp, sizeof(tmp) - strm.avail_out);
+	} while(ret == Z_OK);
+	deflateEnd(&strm);
+	return out;
+}
+
+/*
+	Compressed timeline response, with Content-Length or chunked
+
+	args: [statuses] [rounds]
+*/
+static int bench_gzip(int argc, char * argv[])
+{
+	static const struct {
+		const char * name;
+		gint window_bits;
+		gboolean chunked;
+	} cases[] = {
+		{"identity", 0, FALSE},
+		{"gzip", 15 + 16, FALSE},
+		{"gzip", 15 + 16, TRUE},
+		{"deflate", 15, TRUE},
+		{"deflate", -15, TRUE}, //< raw deflate, sent by some servers
+	};
+	static const gint pieces[] = { 1460, 16384 };
+	gint count = (argc > 0) ? atoi(argv[0]) : 200;
+	gint rounds = (argc > 1) ? atoi(argv[1]) : 50;
+	GString * xml = g_string_new(NULL), * json = g_string_new(NULL);
+	GString * body, * resp;
+	gint c, i, r, pos, chunk;
+	GTimer * timer;
+	MbHttpData * data;
+	gdouble elapsed;
+	int retval = 0;
+
+	bench_make_timeline(count, xml, json);
+	printf("gzip: %d statuses, %d bytes of XML, %d rounds\n", count, (gint)xml->len, rounds);
+	timer = g_timer_new();
+	for(c = 0; c < (gint)(sizeof(cases) / sizeof(cases[0])); c++) {
+		if(cases[c].window_bits == 0) {
+			body = g_string_new_len(xml->str, xml->len);
+		} else {
+			body = bench_compress(xml->str, xml->len, cases[c].window_bits);
+		}
+		resp = g_string_sized_new(body->len + 1024);
+		g_string_append(resp, "HTTP/1.1 200 OK\r\nContent-Type: application/xml; charset=utf-8\r\n");
+		if(cases[c].window_bits != 0) {
+			g_string_append_printf(resp, "Content-Encoding: %s\r\n", cases[c].name);
+		}
+		if(cases[c].chunked) {
+			g_string_append(resp, "Transfer-Encoding: chunked\r\n\r\n");
+			for(pos = 0; pos < (gint)body->len; pos += chunk) {
+				chunk = MIN((gint)bench_rand(4096) + 1, (gint)body->len - pos);
+				g_string_append_printf(resp, "%x\r\n", chunk);
+				g_string_append_len(resp, body->str + pos, chunk);
+				g_string_append(resp, "\r\n");
+			}
+			g_string_append(resp, "0\r\n\r\n");
+		} else {
+			g_string_append_printf(resp, "Content-Length: %d\r\n\r\n", (gint)body->len);
+			g_string_append_len(resp, body->str, body->len);
+		}
+
+		printf("  %-8s %-14s %8d bytes on wire\n", cases[c].window_bits < 0 ? "raw" : cases[c].name,
+				cases[c].chunked ? "chunked" : "content-length", (gint)resp->len);
+		for(i = 0; i < (gint)(sizeof(pieces) / sizeof(pieces[0])); i++) {
+			elapsed = 0;
+			for(r = 0; r < rounds; r++) {
+				g_timer_start(timer);
+				data = bench_feed(resp->str, resp->len, pieces[i]);
+				g_timer_stop(timer);
+				elapsed += g_timer_elapsed(timer, NULL);
+
+				if( (data->state != MB_HTTP_STATE_FINISHED) || (data->content_len != (gint)xml->len) ||
+						(memcmp(data->content->str, xml->str, xml->len) != 0) ) {
+					printf("gzip: decoded content mismatch, piece = %d\n", pieces[i]);
+					retval = 1;
+				}
+				mb_http_data_free(data);
+			}
+			printf("    pieces up to %6d bytes: %8.3f ms/round, %8.2f MB/s decoded\n", pieces[i],
+					elapsed * 1000 / rounds, (xml->len * (gdouble)rounds) / (elapsed * 1024 * 1024));
+		}
+		g_string_free(resp, TRUE);
+		g_string_free(body, TRUE);
+	}
+	g_timer_destroy(timer);
+	g_string_free(xml, TRUE);
+	g_string_free(json, TRUE);
+	return retval;
+}
+
+static const char bench_fixed_headers[] = "User-Agent:mbpurple/0.3\r\n" \
+"Accept: */*\r\n" \
+"X-Twitter-Client: mbpurple\r\n" \
+"X-Twitter-Client-Version: 0.1\r\n" \
+"X-Twitter-Client-Url: http://microblog-purple.googlecode.com/files/mb-0.3.0.xml\r\n" \
+"Pragma: no-cache\r\n";
+
+/*
+	Build one timeline request like twitter_fetch_new_messages does
+
+	@return prepared request, caller must free it
+*/
+static MbHttpData * bench_build_request(MbHttpTemplate * tmpl, gint i)
+{
+	MbHttpData * data = mb_http_data_new();
+	gchar etag[32];
+
+	data->type = HTTP_GET;
+	data->port = 80;
+	mb_http_data_set_host(data, "api.twitter.com");
+	mb_http_data_set_path(data, "/1/statuses/friends_timeline.xml");
+	if(tmpl) {
+		mb_http_data_set_template(data, tmpl);
+	} else {
+		mb_http_data_set_fixed_headers(data, bench_fixed_headers);
+		mb_http_data_set_header(data, "Host", "api.twitter.com");
+		mb_http_data_set_basicauth(data, "someuser", "somepassword");
+	}
+	mb_http_data_add_param_int(data, "count", 200);
+	mb_http_data_add_param_ull(data, "since_id", 12345678901ULL + i);
+	snprintf(etag, sizeof(etag), "\"%08x\"", i);
+	mb_http_data_set_header(data, "If-None-Match", etag);
+	mb_http_data_set_header(data, "Connection", "keep-alive");
+	mb_http_data_prepare_write(data);
+	return data;
+}
+
+/*
+	Request building, with and without per-account template
+
+	args: [requests]
+*/
+static int bench_request(int argc, char * argv[])
+{
+	static const char * modes[] = { "per request headers", "template, writev", "template, flattened" };
+	gint count = (argc > 0) ? atoi(argv[0]) : 200000;
+	gint mode, i, len[3] = { 0, 0, 0 };
+	MbHttpTemplate * tmpl;
+	MbHttpData * data;
+	GTimer * timer;
+	gdouble elapsed;
+
+	printf("request: %d requests\n", count);
+	tmpl = mb_http_template_new("bench", "api.twitter.com", bench_fixed_headers, "someuser", "somepassword");
+	timer = g_timer_new();
+	for(mode = 0; mode < 3; mode++) {
+		g_timer_start(timer);
+		for(i = 0; i < count; i++) {
+			data = bench_build_request( (mode > 0) ? tmpl : NULL, i);
+			if(mode == 2) {
+				mb_http_data_flatten(data);
+			}
+			if(i == 0) {
+				len[mode] = data->packet_len + (data->packet_whole ? 0 : tmpl->len);
+			}
+			mb_http_data_free(data);
+		}
+		g_timer_stop(timer);
+		elapsed = g_timer_elapsed(timer, NULL);
+		printf("  %-20s %6d bytes, %10.0f requests/s\n", modes[mode], len[mode], count / elapsed);
+	}
+	g_timer_destroy(timer);
+	mb_http_template_unref(tmpl);
+	if( (len[0] != len[1]) || (len[1] != len[2]) ) {
+		printf("request: size of requests differ\n");
+		return 1;
+	}
+	return 0;
+}
+
+#define BENCH_URLENC_INPUTS 256
+
+/*
+	Encode with purple_url_encode like call sites did, or with mb_url_encode to exact size buffer
+
+	@return total length of output
+*/
+static gsize bench_urlenc_round(gchar ** inputs, gint impl)
+{
+	gsize total = 0, len;
+	gchar * out;
+	gint i;
+
+	for(i = 0; i < BENCH_URLENC_INPUTS; i++) {
+		if(impl < 0) {
+			out = g_strdup(purple_url_encode(inputs[i]));
+			total += strlen(out);
+		} else {
+			len = strlen(inputs[i]);
+			out = g_malloc(mb_url_encode_len(inputs[i], len) + 1);
+			total += mb_url_encode(out, inputs[i], len);
+		}
+		g_free(out);
+	}
+	return total;
+}
+
+static gsize bench_urldec_round(gchar ** inputs, gint impl)
+{
+	gsize total = 0, len;
+	gchar * out;
+	gint i;
+
+	for(i = 0; i < BENCH_URLENC_INPUTS; i++) {
+		if(impl < 0) {
+			out = g_strdup(purple_url_decode(inputs[i]));
+			total += strlen(out);
+		} else {
+			len = strlen(inputs[i]);
+			out = g_malloc(len + 1);
+			total += mb_url_decode(out, inputs[i], len);
+		}
+		g_free(out);
+	}
+	return total;
+}
+
+/*
+	Percent-encoding of parameters, status text and OAuth signature base, against libpurple
+
+	args: [rounds]
+*/
+static int bench_urlenc(int argc, char * argv[])
+{
+	static const char * kinds[] = { "token", "status", "sigbase" };
+	gint rounds = (argc > 0) ? atoi(argv[0]) : 2000;
+	gchar * inputs[3][BENCH_URLENC_INPUTS], * encoded[BENCH_URLENC_INPUTS];
+	gchar * expect, * got;
+	GString * text = g_string_new(NULL);
+	gsize in_len[3] = { 0, 0, 0 }, enc_len = 0, out_len;
+	gint best, impl, k, i, r;
+	GTimer * timer;
+	gdouble elapsed;
+	int retval = 0;
+
+	best = mb_urlenc_set_impl(MB_URLENC_AVX2);
+	for(i = 0; i < BENCH_URLENC_INPUTS; i++) {
+		inputs[0][i] = g_strdup_printf("%u-%08xAbCdEfGhIjKlMnOpQrStUvWxYz_%08x", bench_rand(100000000),
+				bench_rand(0x7fffffff), bench_rand(0x7fffffff));
+		bench_status_text(text);
+		inputs[1][i] = g_strdup(text->str);
+		encoded[i] = mb_url_encode_dup(text->str);
+		inputs[2][i] = g_strdup_printf("oauth_consumer_key=PCWAdQpyyR12ysdHiPXHg&oauth_nonce=%08x&oauth_signature_method=HMAC-SHA1&"
+				"oauth_timestamp=%u&oauth_token=%s&oauth_version=1.0&status=%s",
+				bench_rand(0x7fffffff), 1280000000 + bench_rand(100000000), inputs[0][i], encoded[i]);
+		for(k = 0; k < 3; k++) {
+			in_len[k] += strlen(inputs[k][i]);
+		}
+		enc_len += strlen(encoded[i]);
+	}
+
+	// Check against libpurple first, inputs are short enough for its static buffer
+	for(impl = MB_URLENC_SCALAR; impl <= best; impl++) {
+		mb_urlenc_set_impl(impl);
+		for(k = 0; k < 3; k++) {
+			for(i = 0; i < BENCH_URLENC_INPUTS; i++) {
+				expect = g_strdup(purple_url_encode(inputs[k][i]));
+				got = mb_url_encode_dup(inputs[k][i]);
+				if(strcmp(expect, got) != 0) {
+					printf("urlenc: %s differs from purple_url_encode for ##%s##\n", mb_urlenc_impl_name(impl), inputs[k][i]);
+					retval = 1;
+				}
+				g_free(expect);
+				g_free(got);
+			}
+		}
+	}
+
+	printf("urlenc: %d inputs of each kind, %d rounds, %s is the best this CPU runs\n", BENCH_URLENC_INPUTS, rounds,
+			mb_urlenc_impl_name(best));
+	timer = g_timer_new();
+	for(k = 0; k < 4; k++) {
+		printf("  %s, average %d bytes\n", (k < 3) ? kinds[k] : "decode status",
+				(gint)(((k < 3) ? in_len[k] : enc_len) / BENCH_URLENC_INPUTS));
+		for(impl = -1; impl <= best; impl++) {
+			if(impl >= 0) {
+				mb_urlenc_set_impl(impl);
+			}
+			out_len = 0;
+			g_timer_start(timer);
+			for(r = 0; r < rounds; r++) {
+				out_len += (k < 3) ? bench_urlenc_round(inputs[k], impl) : bench_urldec_round(encoded, impl);
+			}
+			g_timer_stop(timer);
+			elapsed = g_timer_elapsed(timer, NULL);
+			printf("    %-8s %8.2f MB/s, %10.0f strings/s\n", (impl < 0) ? "libpurple" : mb_urlenc_impl_name(impl),
+					((k < 3) ? in_len[k] : enc_len) * (gdouble)rounds / (elapsed * 1024 * 1024),
+					BENCH_URLENC_INPUTS * (gdouble)rounds / elapsed);
+			if( (out_len / rounds) != ((k < 3) ? bench_urlenc_round(inputs[k], best) : bench_urldec_round(encoded, best)) ) {
+				printf("urlenc: output length differs\n");
+				retval = 1;
+			}
+		}
+	}
+	g_timer_destroy(timer);
+	mb_urlenc_set_impl(best);
+
+	for(i = 0; i < BENCH_URLENC_INPUTS; i++) {
+		for(k = 0; k < 3; k++) {
+			g_free(inputs[k][i]);
+		}
+		g_free(encoded[i]);
+	}
+	g_string_free(text, TRUE);
+	return retval;
+}
+
+/*
+	Signature the way mb_oauth did before the signer: param string, libpurple encoding and HMAC
+
+	@return signature, caller must free it. base is set to signature base, caller must free it
+*/
+static gchar * bench_oauth_reference(MbHttpData * data, const gchar * url, int type, const gchar * c_secret,
+		const gchar * t_secret, gchar ** base)
+{
+	PurpleCipherContext * context;
+	gchar * param_str, * encoded_url, * encoded_param, * secret, * retval = NULL;
+	guchar digest[128];
+	size_t out_len;
+
+	param_str = g_malloc(data->params_len + 1);
+	mb_http_data_encode_param(data, param_str, data->params_len, TRUE);
+	encoded_url = g_strdup(purple_url_encode(url));
+	encoded_param = g_strdup(purple_url_encode(param_str));
+	*base = g_strdup_printf("%s&%s&%s", (type == HTTP_GET) ? "GET" : "POST", encoded_url, encoded_param);
+	g_free(param_str);
+	g_free(encoded_url);
+	g_free(encoded_param);
+
+	secret = g_strdup_printf("%s&%s", c_secret, t_secret ? t_secret : "");
+	context = purple_cipher_context_new_by_name("hmac", NULL);
+	purple_cipher_context_set_option(context, "hash", "sha1");
+	purple_cipher_context_set_key(context, (guchar *)secret);
+	purple_cipher_context_append(context, (guchar *)*base, strlen(*base));
+	if(purple_cipher_context_digest(context, sizeof(digest), digest, &out_len)) {
+		retval = purple_base64_encode(digest, out_len);
+	}
+	purple_cipher_context_destroy(context);
+	g_free(secret);
+	return retval;
+}
+
+/*
+	Request with parameters like mb_oauth_set_http_data adds
+*/
+static MbHttpData * bench_oauth_request(gint i, GString * text)
+{
+	MbHttpData * data = mb_http_data_new();
+	gchar nonce[16];
+
+	data->type = (i % 4) ? HTTP_GET : HTTP_POST;
+	snprintf(nonce, sizeof(nonce), "%08x%04x", bench_rand(0x7fffffff), bench_rand(0xffff));
+	mb_http_data_add_param(data, "oauth_consumer_key", "PCWAdQpyyR12ysdHiPXHg");
+	mb_http_data_add_param(data, "oauth_nonce", nonce);
+	mb_http_data_add_param(data, "oauth_signature_method", "HMAC-SHA1");
+	mb_http_data_add_param_ull(data, "oauth_timestamp", 1280000000 + bench_rand(100000000));
+	mb_http_data_add_param(data, "oauth_version", "1.0");
+	mb_http_data_add_param(data, "oauth_token", "12345678-AbCdEfGhIjKlMnOpQrStUvWxYz0123456789abcdef");
+	if(data->type == HTTP_POST) {
+		bench_status_text(text);
+		mb_http_data_add_param(data, "status", text->str);
+	} else {
+		mb_http_data_add_param_int(data, "count", 200);
+		mb_http_data_add_param_ull(data, "since_id", 12345678901ULL + i);
+	}
+	mb_http_data_sort_param(data);
+	return data;
+}
+
+/*
+	OAuth signatures with per-account signer, against libpurple HMAC
+
+	args: [requests] [rounds]
+*/
+static int bench_oauth(int argc, char * argv[])
+{
+	static const char c_secret[] = "zOVWVhxNGo5pWCHmkGXOEVdHZxVbCSlHRxnqZAfcH0"; //< key longer than a SHA-1 block with token secret
+	static const char t_secret[] = "aBcDeFgHiJkLmNoPqRsTuVwXyZ0123456789AbCdEf";
+	static const char url[] = "http://api.twitter.com/1/statuses/friends_timeline.xml";
+	gint count = (argc > 0) ? atoi(argv[0]) : 256;
+	gint rounds = (argc > 1) ? atoi(argv[1]) : 200;
+	MbHttpData ** reqs = g_new(MbHttpData *, count);
+	GString * text = g_string_new(NULL);
+	MbOauthSigner signer;
+	gchar sig[MB_OAUTH_SIG_LEN], * ref_sig, * ref_base;
+	gint i, r, mode;
+	GTimer * timer;
+	gdouble elapsed;
+	int retval = 0;
+
+	if(!purple_ciphers_find_cipher("hmac")) {
+		purple_signals_init();
+		purple_ciphers_init();
+	}
+	mb_oauth_signer_init(&signer);
+	for(i = 0; i < count; i++) {
+		reqs[i] = bench_oauth_request(i, text);
+	}
+
+	// Same base and signature as before, with short and long keys
+	for(i = 0; i < count; i++) {
+		const gchar * t = (i % 2) ? t_secret : NULL;
+
+		mb_oauth_signer_set_key(&signer, c_secret, t);
+		mb_oauth_signer_sign(&signer, reqs[i], url, reqs[i]->type, sig);
+		ref_sig = bench_oauth_reference(reqs[i], url, reqs[i]->type, c_secret, t, &ref_base);
+		if( !ref_sig || (strcmp(ref_base, signer.base->str) != 0) || (strcmp(ref_sig, sig) != 0) ) {
+			printf("oauth: signature differs, base = ##%s##\n  libpurple %s, signer %s\n", ref_base, ref_sig, sig);
+			retval = 1;
+		}
+		g_free(ref_sig);
+		g_free(ref_base);
+	}
+
+	printf("oauth: %d requests, %d rounds\n", count, rounds);
+	timer = g_timer_new();
+	mb_oauth_signer_set_key(&signer, c_secret, t_secret);
+	for(mode = 0; mode < 2; mode++) {
+		g_timer_start(timer);
+		for(r = 0; r < rounds; r++) {
+			for(i = 0; i < count; i++) {
+				if(mode == 0) {
+					g_free(bench_oauth_reference(reqs[i], url, reqs[i]->type, c_secret, t_secret, &ref_base));
+					g_free(ref_base);
+				} else {
+					mb_oauth_signer_set_key(&signer, c_secret, t_secret);
+					mb_oauth_signer_sign(&signer, reqs[i], url, reqs[i]->type, sig);
+				}
+			}
+		}
+		g_timer_stop(timer);
+		elapsed = g_timer_elapsed(timer, NULL);
+		printf("  %-10s %10.0f signatures/s\n", (mode == 0) ? "libpurple" : "signer", (count * (gdouble)rounds) / elapsed);
+	}
+	printf("  signer derived HMAC state %u times for %u signatures\n", signer.stat_rekey, signer.stat_signed);
+	g_timer_destroy(timer);
+
+	mb_oauth_signer_free(&signer);
+	for(i = 0; i < count; i++) {
+		mb_http_data_free(reqs[i]);
+	}
+	g_free(reqs);
+	g_string_free(text, TRUE);
+	return retval;
+}
+
+/*
+	Stand-ins for the plug-in around tw_stream.c, so the real stream client runs without libpurple core
+
+	Timers go through libpurple's event loop API and are fired by the bench, stream requests never reach mb_net.c.
+*/
+typedef struct _BenchTimer {
+	guint id;
+	guint ms;
+	GSourceFunc func;
+	gpointer data;
+} BenchTimer;
+
+typedef struct _BenchPlugin {
+	GList * timers;
+	guint timer_last;
+	MbConnData * conn_data; //< stream request in flight
+	guint connects; //< stream requests sent
+	guint catchup_polls; //< friends timeline polls asked by stream
+	gboolean streamed; //< polling of friends timeline is stopped
+	GArray * got; //< ids of delivered statuses
+} BenchPlugin;
+
+static BenchPlugin bench_plugin;
+
+static guint bench_timeout_add(guint interval, GSourceFunc func, gpointer data)
+{
+	BenchTimer * timer = g_new(BenchTimer, 1);
+
+	timer->id = ++bench_plugin.timer_last;
+	timer->ms = interval;
+	timer->func = func;
+	timer->data = data;
+	bench_plugin.timers = g_list_append(bench_plugin.timers, timer);
+	return timer->id;
+}
+
+static guint bench_timeout_add_seconds(guint interval, GSourceFunc func, gpointer data)
+{
+	return bench_timeout_add(interval * 1000, func, data);
+}
+
+static BenchTimer * bench_timer_find(guint id)
+{
+	GList * it;
+
+	for(it = bench_plugin.timers; it; it = g_list_next(it)) {
+		if(((BenchTimer *)it->data)->id == id) {
+			return it->data;
+		}
+	}
+	return NULL;
+}
+
+static gboolean bench_timeout_remove(guint id)
+{
+	BenchTimer * timer = bench_timer_find(id);
+
+	if(!timer) {
+		return FALSE;
+	}
+	bench_plugin.timers = g_list_remove(bench_plugin.timers, timer);
+	g_free(timer);
+	return TRUE;
+}
+
+static PurpleEventLoopUiOps bench_loop_ops = {
+	bench_timeout_add,
+	bench_timeout_remove,
+	NULL,
+	NULL,
+	NULL,
+	bench_timeout_add_seconds,
+	NULL,
+	NULL,
+	NULL,
+};
+
+/*
+	Fire timer like main loop would, it stays if callback returns TRUE
+
+	@return interval of timer in ms, 0 if there's no such timer
+*/
+static guint bench_timer_fire(guint id)
+{
+	BenchTimer * timer = bench_timer_find(id);
+	guint ms;
+
+	if(!timer) {
+		return 0;
+	}
+	ms = timer->ms;
+	if(!timer->func(timer->data)) {
+		bench_timeout_remove(id);
+	}
+	return ms;
+}
+
+static void bench_timers_clear(void)
+{
+	while(bench_plugin.timers) {
+		bench_timeout_remove(((BenchTimer *)bench_plugin.timers->data)->id);
+	}
+}
+
+MbConnData * twitter_init_stream_connection(MbAccount * ma, const char * url, MbHandlerFunc handler)
+{
+	MbConnData * conn_data = g_new0(MbConnData, 1);
+
+	conn_data->ma = ma;
+	conn_data->request = mb_http_data_new();
+	conn_data->response = mb_http_data_new();
+	conn_data->handler = handler;
+	conn_data->is_stream = TRUE;
+	mb_http_data_set_url(conn_data->request, url);
+	return conn_data;
+}
+
+void mb_conn_process_request(MbConnData * data)
+{
+	bench_plugin.conn_data = data;
+	bench_plugin.connects++;
+}
+
+void mb_conn_data_free(MbConnData * conn_data)
+{
+	if(bench_plugin.conn_data == conn_data) {
+		bench_plugin.conn_data = NULL;
+	}
+	mb_http_data_free(conn_data->request);
+	mb_http_data_free(conn_data->response);
+	g_free(conn_data);
+}
+
+TwitterTimeLineReq * twitter_new_tlr(const char * path, const char * name, int id, int count, const char * sys_msg)
+{
+	TwitterTimeLineReq * tlr = g_new0(TwitterTimeLineReq, 1);
+
+	tlr->path = g_strdup(path);
+	tlr->name = g_strdup(name);
+	tlr->timeline_id = id;
+	tlr->count = count;
+	tlr->use_since_id = TRUE;
+	tlr->sched_slot = -1;
+	return tlr;
+}
+
+void twitter_deliver_messages(MbAccount * ma, TwitterTimeLineReq * tlr, MbMsgBatch * msgs, time_t last_msg_time)
+{
+	gint i;
+
+	// stream delivers newest first, like a timeline response
+	for(i = (gint)msgs->len - 1; i >= 0; i--) {
+		g_array_append_val(bench_plugin.got, mb_msg_batch_index(msgs, i)->id);
+	}
+	mb_msg_batch_free(msgs);
+	g_free(tlr->path);
+	g_free(tlr->name);
+	g_free(tlr);
+}
+
+void tw_sched_catch_up(TwitterSched * sched, gint config)
+{
+	if(config == TC_FRIENDS_TIMELINE) {
+		bench_plugin.catchup_polls++;
+	}
+}
+
+void tw_sched_set_streamed(TwitterSched * sched, gint config, gboolean streamed)
+{
+	bench_plugin.streamed = streamed;
+}
+
+unsigned long long mb_state_get_timeline(MbState * state, const gchar * key)
+{
+	return 0;
+}
+
+/*
+	Account for stream, friends timeline setting is left at its default
+*/
+static void bench_stream_account(MbAccount * ma, PurpleAccount * account, MbConfig * conf)
+{
+	memset(account, 0, sizeof(PurpleAccount));
+	account->settings = g_hash_table_new(g_str_hash, g_str_equal);
+	memset(conf, 0, sizeof(MbConfig) * TC_MAX);
+	conf[TC_FRIENDS_TIMELINE].conf = "twitter_friends_timeline";
+	conf[TC_FRIENDS_TIMELINE].def_str = "/1/statuses/home_timeline.json";
+	conf[TC_FRIENDS_USER].def_str = "twitter.com";
+	memset(ma, 0, sizeof(MbAccount));
+	ma->account = account;
+	ma->mb_conf = conf;
+	// only compared against NULL by stream
+	ma->sched = (TwitterSched *)&bench_plugin;
+	purple_eventloop_set_ui_ops(&bench_loop_ops);
+	memset(&bench_plugin, 0, sizeof(bench_plugin));
+	bench_plugin.got = g_array_new(FALSE, FALSE, sizeof(mb_status_t));
+}
+
+static void bench_stream_account_free(PurpleAccount * account)
+{
+	bench_timers_clear();
+	g_array_free(bench_plugin.got, TRUE);
+	g_hash_table_destroy(account->settings);
+}
+
+/*
+	End stream request like mb_net.c does, handler is called then request is freed
+*/
+static void bench_stream_end(const gchar * status_line, const gchar * error)
+{
+	MbConnData * conn_data = bench_plugin.conn_data;
+
+	if(status_line) {
+		mb_http_data_post_read(conn_data->response, status_line, strlen(status_line));
+	}
+	conn_data->handler(conn_data, conn_data->handler_data, error);
+	mb_conn_data_free(conn_data);
+}
+
+/*
+	Reconnect delays of stream after each kind of failure
+
+	args: none
+*/
+static int bench_reconnect(int argc, char * argv[])
+{
+	static const gint net_delays[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 16 };
+	static const gint closed_delays[] = { 1 };
+	static const gint http_delays[] = { 10, 20, 40, 80, 160, 320, 320 };
+	static const gint rate_delays[] = { 60, 120, 240, 480, 600, 600 };
+	static const char http_503[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+	static const char http_420[] = "HTTP/1.1 420 Enhance Your Calm\r\nContent-Length: 0\r\n\r\n";
+	static const char http_401[] = "HTTP/1.1 401 Unauthorized\r\nContent-Length: 0\r\n\r\n";
+	static const char http_200[] = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+	MbAccount ma;
+	PurpleAccount account;
+	MbConfig conf[TC_MAX];
+	TwitterStream * stream;
+	GString * out = g_string_new(NULL);
+	gint i, delay;
+	guint connects;
+	int retval = 0;
+
+	bench_stream_account(&ma, &account, conf);
+	stream = tw_stream_new(&ma, "https://userstream.twitter.com/2/user.json");
+	tw_stream_start(stream);
+
+#define BENCH_RECONNECT_CHECK(name, delays, status_line, error) \
+	g_string_truncate(out, 0); \
+	for(i = 0; i < (gint)(sizeof(delays) / sizeof(delays[0])); i++) { \
+		connects = bench_plugin.connects; \
+		bench_stream_end(status_line, error); \
+		delay = bench_timer_fire(stream->reconnect_timer) / 1000; \
+		g_string_append_printf(out, " %d", delay); \
+		if( (delay != delays[i]) || (bench_plugin.connects != connects + 1) ) { \
+			retval = 1; \
+		} \
+	} \
+	printf("reconnect: after %-15s%s seconds\n", name, out->str);
+
+#define BENCH_RECONNECT_LIVE() \
+	mb_http_data_post_read(bench_plugin.conn_data->response, http_200, strlen(http_200)); \
+	bench_timer_fire(stream->deliver_timer); \
+	if( (stream->state != TW_STREAM_LIVE) || (stream->backoff != 0) || !bench_plugin.streamed) { \
+		printf("reconnect: stream not live, state = %d, backoff = %d\n", stream->state, stream->backoff); \
+		retval = 1; \
+	}
+
+	BENCH_RECONNECT_CHECK("network error", net_delays, NULL, "Connection reset by peer");
+	// live stream forgets backoff and falls back to polling when it ends
+	BENCH_RECONNECT_LIVE();
+	BENCH_RECONNECT_CHECK("stream closed", closed_delays, NULL, NULL);
+	if(bench_plugin.streamed || (stream->stat_fallbacks != 1) ) {
+		printf("reconnect: polling not resumed after stream ended\n");
+		retval = 1;
+	}
+	// short delay of last network error is below the floor of HTTP errors
+	BENCH_RECONNECT_CHECK("HTTP 503", http_delays, http_503, NULL);
+	BENCH_RECONNECT_LIVE();
+	BENCH_RECONNECT_CHECK("stream closed", closed_delays, NULL, NULL);
+	BENCH_RECONNECT_CHECK("HTTP 420", rate_delays, http_420, NULL);
+	if( (stream->stat_connects != 2) || (bench_plugin.catchup_polls != 2) ) {
+		printf("reconnect: connects = %u, catch-up polls = %u\n", stream->stat_connects, bench_plugin.catchup_polls);
+		retval = 1;
+	}
+#undef BENCH_RECONNECT_LIVE
+#undef BENCH_RECONNECT_CHECK
+
+	// refused for good, polling only
+	bench_stream_end(http_401, NULL);
+	connects = bench_plugin.connects;
+	tw_stream_start(stream);
+	printf("reconnect: after %-15s polling only\n", "HTTP 401");
+	if( (stream->state != TW_STREAM_OFF) || stream->reconnect_timer || (bench_plugin.connects != connects) ) {
+		printf("reconnect: stream not off after 401, state = %d\n", stream->state);
+		retval = 1;
+	}
+
+	tw_stream_free(stream);
+	bench_stream_account_free(&account);
+	g_string_free(out, TRUE);
+	return retval;
+}
+
+#ifndef _WIN32
+#define BENCH_STREAM_STALL_MS 500 //< server pauses half of it midway, silence this long after the end is a stall
+
+typedef struct _BenchStreamServer {
+	gint fd; //< listening socket
+	GString * wire; //< whole response, chunked
+	gint pause_at; //< offset of wire to pause at
+	gint max_piece; //< largest write
+} BenchStreamServer;
+
+/*
+	Streaming API body, statuses oldest first with keep-alive lines, delete notices and friends list in between
+*/
+static void bench_make_stream(gint count, gint max_chunk, GString * wire, GArray * ids)
+{
+	GString * body = g_string_new("{\"friends\":[12,34,56]}\r\n");
+	GString * xml = g_string_new(NULL), * text = g_string_new(NULL);
+	mb_status_t id = 4294967296123ULL;
+	gint i, pos, chunk;
+
+	for(i = 0; i < count; i++) {
+		id += bench_rand(1000) + 1;
+		if(bench_rand(10) == 0) {
+			g_string_append(body, "\r\n");
+		}
+		if(bench_rand(7) == 0) {
+			g_string_append_printf(body, "{\"delete\":{\"status\":{\"id\":%llu,\"user_id\":12}}}\r\n", id - 500);
+		}
+		g_string_append_c(body, '{');
+		bench_status_text(text);
+		bench_append_status_fields(xml, body, 2, id, i, text);
+		bench_append_user(xml, body, 2, bench_rand(50) + 1);
+		g_string_truncate(body, body->len - 1);
+		g_string_append(body, "}\r\n");
+		g_array_append_val(ids, id);
+	}
+
+	g_string_append(wire, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nTransfer-Encoding: chunked\r\n\r\n");
+	for(pos = 0; pos < (gint)body->len; pos += chunk) {
+		chunk = bench_rand(max_chunk) + 1;
+		if(chunk > (gint)body->len - pos) {
+			chunk = body->len - pos;
+		}
+		g_string_append_printf(wire, "%x\r\n", chunk);
+		g_string_append_len(wire, body->str + pos, chunk);
+		g_string_append(wire, "\r\n");
+	}
+	g_string_free(text, TRUE);
+	g_string_free(xml, TRUE);
+	g_string_free(body, TRUE);
+}
+
+/*
+	Stand-in for stream server, plays wire to one client then falls silent without closing
+*/
+static gpointer bench_stream_serve(gpointer data)
+{
+	BenchStreamServer * server = data;
+	GRand * rand = g_rand_new_with_seed(54321);
+	GString * req = g_string_new(NULL);
+	gchar buf[4096];
+	gint fd, n, pos, piece;
+
+	fd = accept(server->fd, NULL, NULL);
+	while(!strstr(req->str, "\r\n\r\n") && ( (n = read(fd, buf, sizeof(buf))) > 0) ) {
+		g_string_append_len(req, buf, n);
+	}
+	for(pos = 0; pos < (gint)server->wire->len; pos += piece) {
+		piece = g_rand_int_range(rand, 1, server->max_piece + 1);
+		if(piece > (gint)server->wire->len - pos) {
+			piece = server->wire->len - pos;
+		}
+		if( (pos < server->pause_at) && (pos + piece >= server->pause_at) ) {
+			// quiet for a while, but not long enough to count as stall
+			g_usleep(BENCH_STREAM_STALL_MS * 1000 / 2);
+		}
+		if(write(fd, server->wire->str + pos, piece) != piece) {
+			break;
+		}
+	}
+	// wait for client to give up
+	while(read(fd, buf, sizeof(buf)) > 0);
+	close(fd);
+	g_string_free(req, TRUE);
+	g_rand_free(rand);
+	return NULL;
+}
+
+/*
+	Streaming API through a local server, read by tw_stream.c
+
+	args: [statuses]
+*/
+static int bench_stream(int argc, char * argv[])
+{
+	static const gint pieces[] = { 16, 1460, 16384 };
+	static const char request[] = "GET /2/user.json HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n";
+	gint count = (argc > 0) ? atoi(argv[0]) : 2000;
+	BenchStreamServer server;
+	MbAccount ma;
+	PurpleAccount account;
+	MbConfig conf[TC_MAX];
+	TwitterStream * stream;
+	struct sockaddr_in addr;
+	socklen_t addr_len;
+	struct pollfd pfd;
+	GArray * ids;
+	GThread * thread;
+	GTimer * timer;
+	gchar buf[MB_MAXBUFF];
+	gint fd, n, i;
+	gboolean stalled, kept;
+	int retval = 0;
+
+	timer = g_timer_new();
+	for(i = 0; i < (gint)(sizeof(pieces) / sizeof(pieces[0])); i++) {
+		ids = g_array_new(FALSE, FALSE, sizeof(mb_status_t));
+		server.wire = g_string_new(NULL);
+		server.max_piece = pieces[i];
+		bench_make_stream(count, 4096, server.wire, ids);
+		server.pause_at = server.wire->len / 2;
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr_len = sizeof(addr);
+		server.fd = socket(AF_INET, SOCK_STREAM, 0);
+		if( (bind(server.fd, (struct sockaddr *)&addr, addr_len) != 0) || (listen(server.fd, 1) != 0) ||
+				(getsockname(server.fd, (struct sockaddr *)&addr, &addr_len) != 0) ) {
+			printf("stream: can not listen on loopback\n");
+			return 1;
+		}
+#if GLIB_CHECK_VERSION(2, 32, 0)
+		thread = g_thread_new("bench_stream", bench_stream_serve, &server);
+#else
+		thread = g_thread_create(bench_stream_serve, &server, TRUE, NULL);
+#endif
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if( (connect(fd, (struct sockaddr *)&addr, addr_len) != 0) || (write(fd, request, strlen(request)) != (gssize)strlen(request)) ) {
+			printf("stream: can not connect to local server\n");
+			return 1;
+		}
+		bench_stream_account(&ma, &account, conf);
+		stream = tw_stream_new(&ma, "http://127.0.0.1/2/user.json");
+		tw_stream_start(stream);
+
+		kept = stalled = FALSE;
+		g_timer_start(timer);
+		g_timer_stop(timer);
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		for(;;) {
+			if(poll(&pfd, 1, BENCH_STREAM_STALL_MS) == 0) {
+				// stall check on a fresh stream keeps it
+				bench_timer_fire(stream->stall_timer);
+				kept = (bench_plugin.conn_data != NULL);
+				// server is silent, make it silent long enough for the stream to give up
+				stream->last_data -= TW_STREAM_STALL;
+				bench_timer_fire(stream->stall_timer);
+				stalled = (bench_plugin.conn_data == NULL);
+				break;
+			}
+			if( (n = read(fd, buf, sizeof(buf))) <= 0) {
+				break;
+			}
+			g_timer_continue(timer);
+			mb_http_data_post_read(bench_plugin.conn_data->response, buf, n);
+			// deliver like main loop would, once reading is done
+			bench_timer_fire(stream->deliver_timer);
+			g_timer_stop(timer);
+		}
+		close(fd);
+		g_thread_join(thread);
+		close(server.fd);
+
+		if( (stream->stat_connects != 1) || (bench_plugin.catchup_polls != 1) || !kept || !stalled || (stream->stat_stalls != 1) ||
+				bench_plugin.streamed || (stream->stat_fallbacks != 1) || !stream->reconnect_timer ||
+				(bench_plugin.got->len != ids->len) || (memcmp(bench_plugin.got->data, ids->data, ids->len * sizeof(mb_status_t)) != 0) ) {
+			printf("stream: pieces up to %d bytes, got %u of %u statuses, connects = %u, catch-up polls = %u, stall detected = %d, polling resumed = %d\n",
+					pieces[i], bench_plugin.got->len, ids->len, stream->stat_connects, bench_plugin.catchup_polls, stalled, !bench_plugin.streamed);
+			retval = 1;
+		}
+		printf("stream: pieces up to %5d bytes, %u statuses in order, %8.2f ms receiving, %8.2f MB/s\n", pieces[i], bench_plugin.got->len,
+				g_timer_elapsed(timer, NULL) * 1000, server.wire->len / (g_timer_elapsed(timer, NULL) * 1024 * 1024));
+
+		tw_stream_free(stream);
+		bench_stream_account_free(&account);
+		g_string_free(server.wire, TRUE);
+		g_array_free(ids, TRUE);
+	}
+	g_timer_destroy(timer);
+	return retval;
+}
+
+typedef struct _BenchRecvServer {
+	gint fd; //< one end of socketpair
+	GString * wire;
+	gint max_piece; //< largest write
+} BenchRecvServer;
+
+static gpointer bench_recv_serve(gpointer data)
+{
+	BenchRecvServer * server = data;
+	gsize pos = 0;
+	gssize n;
+
+	while(pos < server->wire->len) {
+		n = write(server->fd, server->wire->str + pos, MIN((gsize)server->max_piece, server->wire->len - pos));
+		if(n <= 0) {
+			break;
+		}
+		pos += n;
+	}
+	return NULL;
+}
+
+/*
+	Read one response from fd, either the old way through a fixed buffer or through rb
+
+	Statistics of the fixed buffer are counted into rb as well.
+*/
+static MbHttpData * bench_recv_response(gint fd, gboolean adaptive, MbHttpRecvBuf * rb)
+{
+	MbHttpData * response = mb_http_data_new();
+	gchar buf[MB_MAXBUFF];
+	gchar * target;
+	gint len, n;
+
+	while(response->state != MB_HTTP_STATE_FINISHED) {
+		if(adaptive) {
+			target = mb_http_recv_prepare(rb, response, &len);
+			n = read(fd, target, len);
+			len = mb_http_recv_done(rb, response, n);
+			if(n <= 0) {
+				break;
+			}
+			if(len > 0) {
+				mb_http_data_post_read(response, rb->buf, len);
+			}
+		} else {
+			n = read(fd, buf, sizeof(buf));
+			if(n <= 0) {
+				break;
+			}
+			rb->stat_reads++;
+			rb->stat_bytes += n;
+			rb->stat_copied += n;
+			mb_http_data_post_read(response, buf, n);
+		}
+	}
+	return response;
+}
+
+/*
+	Receive path over a socketpair, fixed buffer copied into parser against adaptive receive buffer
+
+	args: [body size in MB] [rounds]
+*/
+static int bench_recv(int argc, char * argv[])
+{
+	static const gint pieces[] = { 1460, 65536, G_MAXINT };
+	static const char * framings[] = { "length", "chunked" };
+	static const char * modes[] = { "fixed", "adaptive" };
+	gint body_len = ( (argc > 0) ? atoi(argv[0]) : 4) * 1024 * 1024;
+	gint rounds = (argc > 1) ? atoi(argv[1]) : 3;
+	gchar * body;
+	GString * wire[2];
+	BenchRecvServer server;
+	MbHttpRecvBuf rb;
+	MbHttpData * response;
+	GThread * thread;
+	GTimer * timer;
+	gdouble elapsed, mb;
+	gint sv[2], pos, chunk, f, p, m, r;
+	int retval = 0;
+
+	body = g_malloc(body_len);
+	bench_fill_text(body, body_len);
+	wire[0] = g_string_sized_new(body_len + 1024);
+	g_string_append_printf(wire[0], "HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\nContent-Length: %d\r\n\r\n", body_len);
+	g_string_append_len(wire[0], body, body_len);
+	wire[1] = g_string_sized_new(body_len + body_len / 100 + 1024);
+	g_string_append(wire[1], "HTTP/1.1 200 OK\r\nContent-Type: application/json; charset=utf-8\r\nTransfer-Encoding: chunked\r\n\r\n");
+	for(pos = 0; pos < body_len; pos += chunk) {
+		chunk = bench_rand(16384) + 1;
+		if(chunk > body_len - pos) {
+			chunk = body_len - pos;
+		}
+		g_string_append_printf(wire[1], "%X\r\n", chunk);
+		g_string_append_len(wire[1], body + pos, chunk);
+		g_string_append(wire[1], "\r\n");
+	}
+	g_string_append(wire[1], "0\r\n\r\n");
+
+	printf("recv: body = %d bytes, %d rounds, fixed buffer is %d bytes, adaptive is %d to %d bytes\n",
+			body_len, rounds, MB_MAXBUFF, MB_HTTP_RECV_MIN, MB_HTTP_RECV_MAX);
+	timer = g_timer_new();
+	for(f = 0; f < 2; f++) {
+		for(p = 0; p < (gint)(sizeof(pieces) / sizeof(pieces[0])); p++) {
+			for(m = 0; m < 2; m++) {
+				elapsed = 0;
+				mb_http_recv_init(&rb);
+				for(r = 0; r < rounds; r++) {
+					if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+						printf("recv: can not create socketpair\n");
+						return 1;
+					}
+					server.fd = sv[1];
+					server.wire = wire[f];
+					server.max_piece = pieces[p];
+#if GLIB_CHECK_VERSION(2, 32, 0)
+					thread = g_thread_new("bench_recv", bench_recv_serve, &server);
+#else
+					thread = g_thread_create(bench_recv_serve, &server, TRUE, NULL);
+#endif
+					g_timer_start(timer);
+					response = bench_recv_response(sv[0], m, &rb);
+					g_timer_stop(timer);
+					elapsed += g_timer_elapsed(timer, NULL);
+					g_thread_join(thread);
+					close(sv[0]);
+					close(sv[1]);
+
+					if( (response->state != MB_HTTP_STATE_FINISHED) || (response->content->len != body_len) ||
+							(memcmp(response->content->str, body, body_len) != 0) ) {
+						printf("recv: content mismatch, %s, %s, pieces up to %d\n", framings[f], modes[m], pieces[p]);
+						retval = 1;
+					}
+					mb_http_data_free(response);
+				}
+				mb = (gdouble)rb.stat_bytes / (1024 * 1024);
+				printf("  %-7s %-8s writes up to %10d: %7.1f reads/MB, %9.0f bytes copied/MB, %8.2f MB/s\n",
+						framings[f], modes[m], pieces[p], rb.stat_reads / mb, rb.stat_copied / mb,
+						(wire[f]->len * (gdouble)rounds) / (elapsed * 1024 * 1024));
+				mb_http_recv_free(&rb);
+			}
+		}
+	}
+	g_timer_destroy(timer);
+	g_string_free(wire[0], TRUE);
+	g_string_free(wire[1], TRUE);
+	g_free(body);
+	return retval;
+}
+#endif
+
+static MbBench benches[] = {
+	{"chunked", bench_chunked, "decode chunked HTTP body split at random boundaries"},
+	{"decode", bench_decode, "decode same timeline in XML and JSON"},
+	{"gzip", bench_gzip, "receive timeline with gzip or deflate Content-Encoding"},
+	{"request", bench_request, "build timeline requests with and without template"},
+	{"urlenc", bench_urlenc, "percent-encode parameters and status text, scalar and SIMD"},
+	{"oauth", bench_oauth, "sign OAuth requests with cached HMAC state and with libpurple"},
+	{"reconnect", bench_reconnect, "stream reconnect delays after network, HTTP and rate limit errors"},
+#ifndef _WIN32
+	{"stream", bench_stream, "streaming API from a local server, split writes, pause and stall"},
+	{"recv", bench_recv, "receive big response over socketpair, fixed buffer against adaptive buffer"},
+#endif
+	{NULL, NULL, NULL},
+};
+
+int main(int argc, char * argv[])
+{
+	MbBench * b;
+	int retval = 0;
+	gboolean found = FALSE;
+
+	for(b = benches; b->name; b++) {
+		if( (argc < 2) || (strcmp(argv[1], "all") == 0) ) {
+			retval |= b->func(0, NULL);
+			found = TRUE;
+		} else if(strcmp(argv[1], b->name) == 0) {
+			retval |= b->func(argc - 2, argv + 2);
+			found = TRUE;
+		}
+	}
+	if(!found) {
+		printf("usage: %s [all|benchmark] [args]\n", argv[0]);
+		for(b = benches; b->name; b++) {
+			printf("  %-12s %s\n", b->name, b->desc);
+		}
+		return 1;
+	}
+	return retval;
+}
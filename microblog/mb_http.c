@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <sys/param.h>
+#include <zlib.h>
 
 #include <purple.h>
 
@@ -36,9 +37,12 @@
 #	include <arpa/inet.h>
 #	include <sys/socket.h>
 #	include <netinet/in.h>
+#	include <sys/uio.h>
 #endif
 
 #include "mb_http.h"
+#include "mb_urlenc.h"
+#include "mb_util.h"
 
 // function below might be static instead
 static MbHttpParam * mb_http_param_new(void)
@@ -98,7 +102,13 @@ MbHttpData * mb_http_data_new(void)
 	data->content_type = NULL;
 	data->content = NULL;
 	data->chunked_content = NULL;
+	data->chunk_state = MB_HTTP_CHUNK_SIZE;
+	data->chunk_remaining = 0;
 	data->content_len = 0;
+	data->content_sink = NULL;
+	data->content_sink_data = NULL;
+	data->sink_active = FALSE;
+	data->sink_len = 0;
 
 	data->status = -1;
 	data->type = HTTP_GET; //< default is get
@@ -106,6 +116,21 @@ MbHttpData * mb_http_data_new(void)
 
 	data->packet = NULL;
 	data->cur_packet = NULL;
+	data->packet_len = 0;
+
+	data->header_line_start = 0;
+	data->header_views = NULL;
+	data->body_len = 0;
+	data->body_expected = -1;
+
+	data->content_encoding = MB_HTTP_ENCODING_IDENTITY;
+	data->inflate_state = MB_HTTP_INFLATE_INIT;
+	data->inflater = NULL;
+	data->spare_content = NULL;
+
+	data->tmpl = NULL;
+	data->packet_whole = FALSE;
+	data->write_offset = 0;
 
 	return data;
 }
@@ -161,6 +186,19 @@ void mb_http_data_free(MbHttpData * data) {
 		purple_debug_info(MB_HTTPID, "freeing packet\n");
 		g_free(data->packet);
 	}
+	if(data->header_views) {
+		g_array_free(data->header_views, TRUE);
+	}
+	if(data->inflater) {
+		inflateEnd(data->inflater);
+		g_free(data->inflater);
+	}
+	if(data->spare_content) {
+		g_string_free(data->spare_content, TRUE);
+	}
+	if(data->tmpl) {
+		mb_http_template_unref(data->tmpl);
+	}
 	purple_debug_info(MB_HTTPID, "freeing self\n");
 	g_free(data);
 }
@@ -210,11 +248,67 @@ void mb_http_data_truncate(MbHttpData * data)
 		g_string_free(data->content, TRUE);
 		data->content = NULL;
 	}
+	if(data->chunked_content) {
+		g_string_free(data->chunked_content, TRUE);
+		data->chunked_content = NULL;
+	}
+	data->chunk_state = MB_HTTP_CHUNK_SIZE;
+	data->chunk_remaining = 0;
+	data->sink_active = FALSE;
+	data->sink_len = 0;
 	if(data->packet) {
 		g_free(data->packet);
 		data->packet = NULL;
 		data->cur_packet = NULL;
+		data->packet_len = 0;
+	}
+	data->header_line_start = 0;
+	if(data->header_views) {
+		g_array_set_size(data->header_views, 0);
+	}
+	data->body_len = 0;
+	data->body_expected = -1;
+	data->content_encoding = MB_HTTP_ENCODING_IDENTITY;
+	data->inflate_state = MB_HTTP_INFLATE_INIT;
+	if(data->tmpl) {
+		mb_http_template_unref(data->tmpl);
+		data->tmpl = NULL;
 	}
+	data->packet_whole = FALSE;
+	data->write_offset = 0;
+}
+
+void mb_http_data_recycle(MbHttpData * data)
+{
+	GString * content = data->content;
+
+	// content must look absent to the next request, keep its buffer aside instead
+	data->content = NULL;
+	mb_http_data_truncate(data);
+	if(content) {
+		if( (content->allocated_len <= MB_HTTP_SPARE_MAX) &&
+				( !data->spare_content || (data->spare_content->allocated_len < content->allocated_len) ) ) {
+			if(data->spare_content) g_string_free(data->spare_content, TRUE);
+			g_string_truncate(content, 0);
+			data->spare_content = content;
+		} else {
+			g_string_free(content, TRUE);
+		}
+	}
+
+	if(data->host) {
+		g_free(data->host);
+		data->host = NULL;
+	}
+	if(data->path) {
+		g_free(data->path);
+		data->path = NULL;
+	}
+	data->proto = MB_HTTP;
+	data->port = 80;
+	data->type = HTTP_GET;
+	data->content_sink = NULL;
+	data->content_sink_data = NULL;
 }
 
 void mb_http_data_set_url(MbHttpData * data, const gchar * url)
@@ -312,6 +406,39 @@ void mb_http_data_set_content_type(MbHttpData * data, const gchar * type) {
 	data->content_type = g_strdup(type);
 }
 
+void mb_http_data_set_content_sink(MbHttpData * data, MbHttpContentSink sink, gpointer user_data)
+{
+	data->content_sink = sink;
+	data->content_sink_data = user_data;
+}
+
+static void mb_http_data_copy_header(gpointer key, gpointer value, gpointer user_data)
+{
+	MbHttpData * data = user_data;
+
+	g_hash_table_replace(data->headers, g_strdup(key), g_strdup(value));
+}
+
+void mb_http_data_copy_response(MbHttpData * dst, MbHttpData * src)
+{
+	dst->status = src->status;
+	g_hash_table_foreach(src->headers, mb_http_data_copy_header, dst);
+	if(src->content) {
+		if(!dst->content && dst->spare_content) {
+			dst->content = dst->spare_content;
+			dst->spare_content = NULL;
+		}
+		if(dst->content) {
+			g_string_truncate(dst->content, 0);
+		} else {
+			dst->content = g_string_sized_new(src->content->len + 1);
+		}
+		g_string_append_len(dst->content, src->content->str, src->content->len);
+	}
+	dst->content_len = src->content_len;
+	dst->state = src->state;
+}
+
 void mb_http_data_set_content(MbHttpData * data, const gchar * content, gssize len)
 {
 	if(data->content) {
@@ -343,6 +470,81 @@ void mb_http_data_set_fixed_headers(MbHttpData * data, const gchar * headers)
 	data->headers_len += strlen(data->fixed_headers);
 }
 
+/*
+	Value of Authorization header for basic authentication
+*/
+static gchar * mb_http_basicauth_value(const gchar * user, const gchar * passwd)
+{
+	gchar * merged_tmp, *encoded_tmp, *value_tmp;
+	gsize authen_len;
+
+	if(passwd == NULL) {
+		purple_debug_info(MB_HTTPID, "Password not set! Shouldn't we ask for it?\n");
+		// TODO: This prevents crashing, however ...
+		// we should either ask for the users password or disable basic http altogether.
+		passwd = "";
+	}
+
+	authen_len = strlen(user) + strlen(passwd) + 1;
+	merged_tmp = g_strdup_printf("%s:%s", user, passwd);
+	encoded_tmp = purple_base64_encode((const guchar *)merged_tmp, authen_len);
+	//g_strlcpy(output, encoded_temp, len);
+	g_free(merged_tmp);
+	value_tmp = g_strdup_printf("Basic %s", encoded_tmp);
+	g_free(encoded_tmp);
+	return value_tmp;
+}
+
+MbHttpTemplate * mb_http_template_new(const gchar * key, const gchar * host, const gchar * fixed_headers, const gchar * user, const gchar * passwd)
+{
+	MbHttpTemplate * tmpl = g_new0(MbHttpTemplate, 1);
+	GString * block = g_string_sized_new(512);
+	gchar * auth;
+
+	g_string_append_printf(block, "Host: %s\r\n", host);
+	if(fixed_headers) {
+		g_string_append(block, fixed_headers);
+	}
+	if(user) {
+		auth = mb_http_basicauth_value(user, passwd);
+		g_string_append_printf(block, "Authorization: %s\r\n", auth);
+		g_free(auth);
+	}
+	// end of header part
+	g_string_append(block, "\r\n");
+
+	tmpl->key = g_strdup(key);
+	tmpl->len = block->len;
+	tmpl->block = g_string_free(block, FALSE);
+	tmpl->ref = 1;
+	return tmpl;
+}
+
+MbHttpTemplate * mb_http_template_ref(MbHttpTemplate * tmpl)
+{
+	tmpl->ref++;
+	return tmpl;
+}
+
+void mb_http_template_unref(MbHttpTemplate * tmpl)
+{
+	if(--tmpl->ref > 0) {
+		return;
+	}
+	g_free(tmpl->key);
+	g_free(tmpl->block);
+	g_free(tmpl);
+}
+
+void mb_http_data_set_template(MbHttpData * data, MbHttpTemplate * tmpl)
+{
+	mb_http_template_ref(tmpl);
+	if(data->tmpl) {
+		mb_http_template_unref(data->tmpl);
+	}
+	data->tmpl = tmpl;
+}
+
 static gint mb_http_data_param_key_pred(gconstpointer a, gconstpointer key)
 {
 	const MbHttpParam * p = (const MbHttpParam *)a;
@@ -451,29 +653,31 @@ int mb_http_data_encode_param(MbHttpData *data, char * buf, int len, gboolean ur
 {
 	GList * it;
 	MbHttpParam * p;
-	int cur_len = 0, ret_len = 0;
+	int cur_len = 0, ret_len = 0, key_len, val_len;
 	char * cur_buf = buf;
 
 	purple_debug_info(MB_HTTPID, "%s called, len = %d\n", __FUNCTION__, len);
 	if(data->params) {
-		gchar * encoded_val = NULL;
 		for(it = g_list_first(data->params); it; it = g_list_next(it)) {
 			p = it->data;
 			purple_debug_info(MB_HTTPID, "%s: key = %s, value = %s\n", __FUNCTION__, p->key, p->value);
 			// Only encode value here, so _ in key will not be translated
+			key_len = strlen(p->key);
+			val_len = strlen(p->value);
+			ret_len = key_len + 1 + (url_encode ? mb_url_encode_len(p->value, val_len) : val_len) + 1;
+			if(cur_len + ret_len >= len) {
+				purple_debug_info(MB_HTTPID, "len is too small, len = %d, cur_len = %d\n", len, cur_len + ret_len);
+				return cur_len + ret_len;
+			}
+			memcpy(cur_buf, p->key, key_len);
+			cur_buf[key_len] = '=';
 			if(url_encode) {
-				encoded_val = g_strdup(purple_url_encode(p->value));
+				mb_url_encode(cur_buf + key_len + 1, p->value, val_len);
 			} else {
-				encoded_val = g_strdup(p->value);
+				memcpy(cur_buf + key_len + 1, p->value, val_len);
 			}
-			ret_len = snprintf(cur_buf, len - cur_len, "%s=%s&", p->key, encoded_val);
-			g_free(encoded_val);
-			purple_debug_info(MB_HTTPID, "len = %d, cur_len = %d, cur_buf = ##%s##\n", len, cur_len, cur_buf);
+			cur_buf[ret_len - 1] = '&';
 			cur_len += ret_len;
-			if(cur_len >= len) {
-				purple_debug_info(MB_HTTPID, "len is too small, len = %d, cur_len = %d\n", len, cur_len);
-				return cur_len;
-			}
 			cur_buf += ret_len;
 		}
 		cur_buf--;
@@ -522,23 +726,28 @@ void mb_http_data_prepare_write(MbHttpData * data)
 
 	if(data->path == NULL) return;
 
+        // GET and POST must use full URL when using proxies
+        // length calculated as length of "unknown" + 3 digits for "://" + 5
+        // digits for port + length of data->path + a few bytes extra
+        url_len = sizeof(gchar) * (MAXHOSTNAMELEN + 20 + strlen(data->path));
+        url = (gchar *) g_malloc0(url_len + 1);
+        mb_http_data_get_url(data, url, url_len);
+
 	// assemble all headers
 	// I don't sure how hash table will behave, so assemple everything should be better
-	packet_len = data->headers_len + data->params_len + MAXHOSTNAMELEN + 10 + strlen(data->path) + 100; //< for \r\n\r\n and GET|POST and other stuff
-	if(data->content) {
+	// headers_len and params_len are upper bounds already, the rest is counted exactly
+	packet_len = strlen("POST ") + strlen(url) + data->params_len + strlen(" HTTP/1.1\r\n") + data->headers_len;
+	if(data->content_type) {
+		packet_len += strlen("Content-Type: \r\n") + strlen(data->content_type);
+	}
+	packet_len += strlen(MB_HTTP_ACCEPT_ENCODING) + strlen("Content-Length: 2147483647\r\n") + strlen("\r\n");
+	if(data->content && !data->tmpl) {
 		packet_len += data->content->len;
 	}
 	if(data->packet) g_free(data->packet);
 	data->packet = g_malloc0(packet_len + 1);
 	cur_packet = data->packet;
 
-        // GET and POST must use full URL when using proxies
-        // length calculated as length of "unknown" + 3 digits for "://" + 5
-        // digits for port + length of data->path + a few bytes extra
-        url_len = sizeof(gchar) * (MAXHOSTNAMELEN + 20 + strlen(data->path));
-        url = (gchar *) g_malloc0(url_len + 1);
-        mb_http_data_get_url(data, url, url_len);
-
 	// GET|POST and parameter part
 	if(data->type == HTTP_GET) {
 		len = sprintf(cur_packet, "GET %s", url);
@@ -592,12 +801,28 @@ void mb_http_data_prepare_write(MbHttpData * data)
 		cur_packet += strlen(data->fixed_headers);
 	}
 
+	// we can inflate compressed body
+	if(!g_hash_table_lookup(data->headers, "Accept-Encoding")) {
+		strcpy(cur_packet, MB_HTTP_ACCEPT_ENCODING);
+		cur_packet += strlen(MB_HTTP_ACCEPT_ENCODING);
+	}
+
 	// content-length, if needed
 	if(data->content) {
 		len = sprintf(cur_packet, "Content-Length: %d\r\n", (int)data->content->len);
 		cur_packet += len;
 	}
 
+	if(data->tmpl) {
+		// template ends the header part, content is written from where it is
+		data->packet_len = cur_packet - data->packet;
+		data->cur_packet = data->packet;
+		data->packet_whole = FALSE;
+		data->write_offset = 0;
+		purple_debug_info(MB_HTTPID, "prepared packet = %s%s\n", data->packet, data->tmpl->block);
+		return;
+	}
+
 	// end header part
 	len = sprintf(cur_packet, "\r\n");
 	cur_packet += len;
@@ -616,227 +841,559 @@ void mb_http_data_prepare_write(MbHttpData * data)
 
 	// reset back to head of packet, ready to transfer
 	data->cur_packet = data->packet;
+	data->packet_whole = TRUE;
 
 	purple_debug_info(MB_HTTPID, "prepared packet = %s\n", data->packet);
 }
 
-void mb_http_data_post_read(MbHttpData * data, const gchar * buf, gint buf_len)
+void mb_http_data_flatten(MbHttpData * data)
+{
+	gint content_len, len;
+	gchar * packet;
+
+	if(data->packet_whole || (data->packet == NULL)) {
+		return;
+	}
+	content_len = data->content ? data->content->len : 0;
+	len = data->packet_len + data->tmpl->len + content_len;
+	packet = g_malloc(len + 1);
+	memcpy(packet, data->packet, data->packet_len);
+	memcpy(packet + data->packet_len, data->tmpl->block, data->tmpl->len);
+	if(content_len > 0) {
+		memcpy(packet + data->packet_len + data->tmpl->len, data->content->str, content_len);
+	}
+	packet[len] = '\0';
+
+	g_free(data->packet);
+	data->packet = packet;
+	data->packet_len = len;
+	data->cur_packet = packet + data->write_offset;
+	data->packet_whole = TRUE;
+}
+
+/*
+	Append buf to the header block in data->packet, grow the buffer by doubling
+*/
+static void mb_http_data_packet_append(MbHttpData * data, const gchar * buf, gint len)
+{
+	gint used = data->cur_packet - data->packet;
+	gint new_len;
+
+	if( (used + len + 1) > data->packet_len) {
+		new_len = (data->packet_len > 0) ? data->packet_len : MB_HTTP_HEADER_BUFF;
+		while(new_len < (used + len + 1)) {
+			new_len *= 2;
+		}
+		data->packet = g_realloc(data->packet, new_len);
+		data->packet_len = new_len;
+		data->cur_packet = data->packet + used;
+	}
+	memcpy(data->cur_packet, buf, len);
+	data->cur_packet += len;
+	(*data->cur_packet) = '\0';
+}
+
+/*
+	Append decoded body bytes to data->content
+*/
+static void mb_http_data_content_append(MbHttpData * data, const gchar * buf, gint len)
+{
+	if(data->sink_active) {
+		data->content_sink(data, buf, len, data->content_sink_data);
+		data->sink_len += len;
+		return;
+	}
+	if(!data->content && data->spare_content) {
+		data->content = data->spare_content;
+		data->spare_content = NULL;
+	}
+	if(!data->content) {
+		// Content-Length comes from server, don't trust it with memory
+		data->content = g_string_sized_new( (data->body_expected > 0) ? MIN(data->body_expected, MB_HTTP_PREALLOC_MAX) : MB_MAXBUFF);
+	}
+	g_string_append_len(data->content, buf, len);
+}
+
+/*
+	Inflate compressed body bytes into content
+
+	Inflater is created for the first compressed response and reset for the next ones.
+*/
+static void mb_http_data_inflate(MbHttpData * data, const gchar * buf, gint len)
+{
+	z_stream * strm;
+	gchar out[MB_MAXBUFF];
+	gint window_bits, ret, produced;
+	guchar first;
+
+	if( (len <= 0) || (data->inflate_state == MB_HTTP_INFLATE_DONE) ) {
+		return;
+	}
+	if(data->inflate_state == MB_HTTP_INFLATE_INIT) {
+		// 15 + 32 detects gzip or zlib header, some servers send deflate without zlib header though
+		window_bits = 15 + 32;
+		first = (guchar)buf[0];
+		if( (data->content_encoding == MB_HTTP_ENCODING_DEFLATE) && !( ((first & 0x0f) == Z_DEFLATED) && ((first >> 4) <= 7) ) ) {
+			window_bits = -15;
+		}
+		if(data->inflater) {
+			ret = inflateReset2(data->inflater, window_bits);
+		} else {
+			data->inflater = g_new0(z_stream, 1);
+			ret = inflateInit2(data->inflater, window_bits);
+		}
+		if(ret != Z_OK) {
+			mb_debug_info(MB_HTTPID, "can not initialize inflate, %d\n", ret);
+			data->inflate_state = MB_HTTP_INFLATE_DONE;
+			return;
+		}
+		data->inflate_state = MB_HTTP_INFLATE_RUNNING;
+	}
+
+	strm = data->inflater;
+	strm->next_in = (Bytef *)buf;
+	strm->avail_in = len;
+	do {
+		strm->next_out = (Bytef *)out;
+		strm->avail_out = sizeof(out);
+		ret = inflate(strm, Z_NO_FLUSH);
+		produced = sizeof(out) - strm->avail_out;
+		if(produced > 0) {
+			mb_http_data_content_append(data, out, produced);
+		}
+		if(ret == Z_STREAM_END) {
+			data->inflate_state = MB_HTTP_INFLATE_DONE;
+			break;
+		}
+		if( (ret != Z_OK) && (ret != Z_BUF_ERROR) ) {
+			// broken stream, keep what we have
+			mb_debug_info(MB_HTTPID, "failed to inflate body, %d, %s\n", ret, strm->msg ? strm->msg : "");
+			data->inflate_state = MB_HTTP_INFLATE_DONE;
+			break;
+		}
+	} while( (strm->avail_in > 0) || (strm->avail_out == 0) );
+}
+
+/*
+	Append raw body bytes, after chunked decoding if any
+*/
+static void mb_http_data_body_append(MbHttpData * data, const gchar * buf, gint len)
+{
+	if(data->content_encoding == MB_HTTP_ENCODING_IDENTITY) {
+		mb_http_data_content_append(data, buf, len);
+	} else {
+		mb_http_data_inflate(data, buf, len);
+	}
+}
+
+/*
+	Record one complete header line, located at [start, start + len) in packet without CRLF
+*/
+static void mb_http_data_header_line(MbHttpData * data, gint start, gint len)
 {
-	gint packet_len = (buf_len > MB_MAXBUFF) ? buf_len : MB_MAXBUFF;
-	gint cur_pos_len, whole_len;
-	gchar * delim, * cur_pos, *content_start = NULL;
-	gchar * key, *value, *key_value_sep;
-	gboolean continue_to_next_state = FALSE;
+	gchar * line = data->packet + start;
+	gchar * sep;
+	MbHttpHeaderView view;
+
+	if( (data->status < 0) && (len > 5) && (strncmp(line, "HTTP/", 5) == 0) ) {
+		// status line, packet is always NUL-terminated so strtoul stops in time
+		sep = memchr(line, ' ', len);
+		if(sep) {
+			data->status = (gint)strtoul(sep + 1, NULL, 10);
+		}
+		return;
+	}
+	if( (sep = memchr(line, ':', len)) == NULL) {
+		mb_debug_info(MB_HTTPID, "an invalid line? line = #%.*s#\n", len, line);
+		return;
+	}
+	view.key_offset = start;
+	view.key_len = sep - line;
+	while( (view.key_len > 0) && isspace((guchar)line[view.key_len - 1]) ) {
+		view.key_len--;
+	}
+	view.value_offset = (sep + 1) - data->packet;
+	view.value_len = len - ((sep - line) + 1);
+	while( (view.value_len > 0) && isspace((guchar)data->packet[view.value_offset]) ) {
+		view.value_offset++;
+		view.value_len--;
+	}
+	while( (view.value_len > 0) && isspace((guchar)data->packet[view.value_offset + view.value_len - 1]) ) {
+		view.value_len--;
+	}
+	g_array_append_val(data->header_views, view);
+}
 
-	if(buf_len <= 0) return;
-	switch(data->state) {
-		case MB_HTTP_STATE_INIT :
-			if(data->packet) {
-				g_free(data->packet);
+/*
+	Header block is complete, materialize headers and decide how the body is framed
+*/
+static void mb_http_data_header_finish(MbHttpData * data)
+{
+	MbHttpHeaderView * view;
+	gchar * key, * value;
+	guint i;
+
+	for(i = 0; i < data->header_views->len; i++) {
+		view = &g_array_index(data->header_views, MbHttpHeaderView, i);
+		key = g_strndup(data->packet + view->key_offset, view->key_len);
+		value = g_strndup(data->packet + view->value_offset, view->value_len);
+
+		if(strcasecmp(key, "Content-Length") == 0) {
+			data->body_expected = (gint)strtoul(value, NULL, 10);
+			data->content_len = data->body_expected;
+		} else if( (strcasecmp(key, "Transfer-Encoding") == 0) && (purple_strcasestr(value, "chunked") != NULL) ) {
+			// this is for identi.ca
+			mb_debug_info(MB_HTTPID, "chunked data transfer\n");
+			if(data->chunked_content) {
+				g_string_free(data->chunked_content, TRUE);
 			}
-			data->packet = g_malloc0(packet_len);
-			data->packet_len = packet_len;
-			data->cur_packet = data->packet;
-			data->state = MB_HTTP_STATE_HEADER;
-			//break; //< purposely move to next step
-		case MB_HTTP_STATE_HEADER :
-			//printf("processing header\n");
-			// at this state, no data at all, so this should be the very first chunk of data
-			// reallocate buffer if we don't have enough
-			cur_pos_len = data->cur_packet - data->packet;
-			if( (data->packet_len - cur_pos_len) < buf_len) {
-				//printf("reallocate buffer\n");
-				data->packet_len += (buf_len * 2);
-				data->packet = g_realloc(data->packet, data->packet_len);
-				data->cur_packet = data->packet + cur_pos_len;
+			data->chunked_content = g_string_new(NULL);
+			data->chunk_state = MB_HTTP_CHUNK_SIZE;
+			data->chunk_remaining = 0;
+		} else if(strcasecmp(key, "Content-Encoding") == 0) {
+			if( (strcasecmp(value, "gzip") == 0) || (strcasecmp(value, "x-gzip") == 0) ) {
+				data->content_encoding = MB_HTTP_ENCODING_GZIP;
+			} else if(strcasecmp(value, "deflate") == 0) {
+				data->content_encoding = MB_HTTP_ENCODING_DEFLATE;
 			}
-			memcpy(data->cur_packet, buf, buf_len);
-			whole_len = (data->cur_packet - data->packet) + buf_len;
-
-			// decipher header
-			cur_pos = data->packet;
-			//printf("initial_cur_pos = #%s#\n", cur_pos);
-			while( (delim = strstr(cur_pos, "\r\n")) != NULL) {
-				if( strncmp(delim, "\r\n\r\n", 4) == 0 ) {
-					// we reach the content now
-					content_start = delim + 4;
-					//printf("found content = %s\n", content_start);
+		}
+		// key and value are owned by hash table now
+		g_hash_table_insert(data->headers, key, value);
+	}
+
+	// content is always there once header is parsed, even if body is empty
+	if(data->content) {
+		g_string_truncate(data->content, 0);
+	} else {
+		mb_http_data_content_append(data, "", 0);
+	}
+	data->sink_len = 0;
+	data->sink_active = data->content_sink && data->content_sink(data, NULL, 0, data->content_sink_data);
+	data->state = MB_HTTP_STATE_CONTENT;
+	if( (data->status == 204) || (data->status == HTTP_MOVED_TEMPORARILY) ) {
+		// no body at all
+		data->content_len = 0;
+		data->state = MB_HTTP_STATE_FINISHED;
+	} else if(data->chunked_content) {
+		// chunk length decides the body, Content-Length must be ignored
+		data->body_expected = -1;
+		data->content_len = 0;
+	} else if(data->body_expected == 0) {
+		data->state = MB_HTTP_STATE_FINISHED;
+	}
+}
+
+/*
+	Scan new bytes for end of header lines
+
+	@return number of bytes in buf consumed by header part
+*/
+static gint mb_http_data_parse_header(MbHttpData * data, const gchar * buf, gint buf_len)
+{
+	const gchar * cur = buf, * nl;
+	gint line_end, line_len;
+
+	while( (nl = memchr(cur, '\n', buf_len - (cur - buf))) != NULL) {
+		mb_http_data_packet_append(data, cur, (nl + 1) - cur);
+		cur = nl + 1;
+
+		line_end = (data->cur_packet - data->packet) - 1;
+		line_len = line_end - data->header_line_start;
+		if( (line_len > 0) && (data->packet[line_end - 1] == '\r') ) {
+			line_len--;
+		}
+		if(line_len == 0) {
+			// empty line, we reach the content now
+			mb_http_data_header_finish(data);
+			return cur - buf;
+		}
+		mb_http_data_header_line(data, data->header_line_start, line_len);
+		data->header_line_start = line_end + 1;
+	}
+	// keep the partial line, it'll be completed by next call
+	mb_http_data_packet_append(data, cur, buf_len - (cur - buf));
+	return buf_len;
+}
+
+/*
+	Parse hexadecimal chunk size, chunk extension after ';' is ignored
+
+	Leading spaces are not allowed by RFC 7230, but some servers and proxies send them.
+
+	@return chunk size, or -1 if line is not a valid chunk size
+*/
+static gint mb_http_chunk_size(const gchar * line, gint len)
+{
+	gint i, start, size = 0, digit;
+
+	for(start = 0; (start < len) && ( (line[start] == ' ') || (line[start] == '\t') ); start++);
+	for(i = start; i < len; i++) {
+		if(g_ascii_isxdigit(line[i])) {
+			digit = g_ascii_xdigit_value(line[i]);
+			if(size > ((G_MAXINT - digit) >> 4)) {
+				return -1;
+			}
+			size = (size << 4) + digit;
+		} else if( (line[i] == ';') || (line[i] == ' ') || (line[i] == '\t') ) {
+			break;
+		} else {
+			return -1;
+		}
+	}
+	return (i > start) ? size : -1;
+}
+
+/*
+	Streaming decoder for chunked body
+
+	Payload goes directly from buf into content, only partial size/trailer lines are kept in chunked_content.
+
+	@return number of bytes in buf consumed, decoding stops at the end of the body
+*/
+static gint mb_http_data_parse_chunked(MbHttpData * data, const gchar * buf, gint buf_len)
+{
+	const gchar * cur = buf, * end = buf + buf_len, * nl, * line;
+	gint line_len, take;
+	GString * stash = data->chunked_content;
+
+	while( (cur < end) && (data->state != MB_HTTP_STATE_FINISHED) ) {
+		switch(data->chunk_state) {
+			case MB_HTTP_CHUNK_DATA :
+				take = MIN(end - cur, data->chunk_remaining);
+				mb_http_data_body_append(data, cur, take);
+				data->chunk_remaining -= take;
+				cur += take;
+				if(data->chunk_remaining == 0) {
+					data->chunk_state = MB_HTTP_CHUNK_DATA_END;
 				}
-				(*delim) = '\0';
-				//printf("cur_pos = %s\n", cur_pos);
-				if(strncmp(cur_pos, "HTTP/1.0", 7) == 0) {
-					// first line
-					data->status = (gint)strtoul(&cur_pos[9], NULL, 10);
-					//printf("data->status = %d\n", data->status);
+				break;
+			case MB_HTTP_CHUNK_DATA_END :
+				// CRLF after payload, be lenient about bare LF
+				if( (*cur) == '\r') {
+					cur++;
 				} else {
-					//Header line
-					if( (key_value_sep = strchr(cur_pos, ':')) != NULL) {
-						//printf("header line\n");
-						(*key_value_sep) = '\0';
-						key = cur_pos;
-						value = key_value_sep + 1;
-						key = g_strstrip(key);
-						value = g_strstrip(value);
-
-						if(strcasecmp(key, "Content-Length") == 0) {
-							data->content_len = (gint)strtoul(value, NULL, 10);
-						} else if (strcasecmp(key, "Transfer-Encoding") == 0) {
-							// Actually I should check for the value
-							// AFAIK, Transfer-Encoding only valid value is chunked
-							// Anyways, this is for identi.ca
-							purple_debug_info(MB_HTTPID, "chunked data transfer\n");
-							if(data->chunked_content) {
-								g_string_free(data->chunked_content, TRUE);
-							}
-							data->chunked_content = g_string_new(NULL);
-							// Need to goes into CONTENT state to decode the first chunk
-						}
-						mb_http_data_set_header(data, key, value);
-					} else {
-						// invalid header?
-						// do nothing for now
-						purple_debug_info(MB_HTTPID, "an invalid line? line = #%s#", cur_pos);
+					if( (*cur) == '\n') {
+						cur++;
 					}
+					data->chunk_state = MB_HTTP_CHUNK_SIZE;
 				}
-				if(content_start) {
+				break;
+			case MB_HTTP_CHUNK_SIZE :
+			case MB_HTTP_CHUNK_TRAILER :
+				if( (nl = memchr(cur, '\n', end - cur)) == NULL) {
+					g_string_append_len(stash, cur, end - cur);
+					cur = end;
 					break;
 				}
-				cur_pos = delim + 2;
-			}
-			if(content_start) {
-				// copy the rest of data as content and free everything
-				if(data->content != NULL) {
-					g_string_free(data->content, TRUE);
-				}
-				if(data->chunked_content) {
-					data->chunked_content = g_string_new_len(content_start, whole_len - (content_start - data->packet));
-					data->content = g_string_new(NULL);
-					continue_to_next_state = TRUE;
-					purple_debug_info(MB_HTTPID, "we'll continue to next state (STATE_CONTENT)\n");
+				if(stash->len > 0) {
+					g_string_append_len(stash, cur, nl - cur);
+					line = stash->str;
+					line_len = stash->len;
 				} else {
-					data->content = g_string_new_len(content_start, whole_len - (content_start - data->packet));
-				}
-				g_free(data->packet);
-				data->cur_packet = data->packet = NULL;
-				data->packet_len = 0;
-				data->state = MB_HTTP_STATE_CONTENT;
-			} else {
-				// copy the rest of string to the beginning
-				if( (cur_pos - data->packet) < whole_len) {
-					gint tmp_len = whole_len - (cur_pos - data->packet);
-					gchar * tmp = g_malloc(tmp_len);
-
-					memcpy(tmp, cur_pos, tmp_len);
-					memcpy(data->packet, tmp, tmp_len);
-					g_free(tmp);
-
-					data->cur_packet = data->packet + tmp_len;
+					line = cur;
+					line_len = nl - cur;
 				}
-			}
-			if(!continue_to_next_state) {
-				break;
-			}
-		case MB_HTTP_STATE_CONTENT :
-			if(data->chunked_content) {
-				if(!continue_to_next_state) { //< already have buffer from previous state
-					// Buffer is not already here
-					g_string_append_len(data->chunked_content, buf, buf_len);
+				cur = nl + 1;
+				if( (line_len > 0) && (line[line_len - 1] == '\r') ) {
+					line_len--;
 				}
-				// decode the chunked content and put it in content
-				for(;;) {
-					purple_debug_info(MB_HTTPID, "current data in chunked_content = #%s#\n", data->chunked_content->str);
-					cur_pos = strstr(data->chunked_content->str, "\r\n");
-					if(!cur_pos) {
-						// Content will only be what can be decoded
-						purple_debug_info(MB_HTTPID, "can't find any CRLF\n");
-						break;
-					}
-					if(cur_pos == data->chunked_content->str) {
-						g_string_erase(data->chunked_content, 0, 2);
-						continue;
-					}
-					(*cur_pos) = '\0';
-					cur_pos_len = strtoul(data->chunked_content->str, NULL, 16);
-					purple_debug_info(MB_HTTPID, "chunk length = %d, %x\n", cur_pos_len, cur_pos_len);
-					(*cur_pos) = '\r';
-					if(cur_pos_len == 0) {
-						// we got everything
-						purple_debug_info(MB_HTTPID, "got 0 size chunk, end of message\n");
+
+				if(data->chunk_state == MB_HTTP_CHUNK_TRAILER) {
+					if(line_len == 0) {
 						data->state = MB_HTTP_STATE_FINISHED;
-						data->content_len = data->content->len;
-						break;
+						data->content_len = data->content->len + data->sink_len;
 					}
-					if( (data->chunked_content->len - (cur_pos - data->chunked_content->str)) >= cur_pos_len ) {
-						// copy the string to content, then shift the rest of chunked_content
-						purple_debug_info(MB_HTTPID, "appending chunk\n");
-						g_string_append_len(data->content, cur_pos + 2, cur_pos_len);
-						purple_debug_info(MB_HTTPID, "current content = #%s#\n", data->content->str);
-						g_string_erase(data->chunked_content, 0, (cur_pos + 2 + cur_pos_len) - data->chunked_content->str);
+				} else if(line_len > 0) {
+					data->chunk_remaining = mb_http_chunk_size(line, line_len);
+					if(data->chunk_remaining < 0) {
+						// broken stream, keep what we have
+						mb_debug_info(MB_HTTPID, "invalid chunk size line = #%.*s#\n", line_len, line);
+						data->chunk_remaining = 0;
+						data->state = MB_HTTP_STATE_FINISHED;
+						data->content_len = data->content->len + data->sink_len;
+					} else if(data->chunk_remaining == 0) {
+						// we got everything, only trailer left
+						data->chunk_state = MB_HTTP_CHUNK_TRAILER;
 					} else {
-						// we need more data
-						purple_debug_info(MB_HTTPID, "data is not enough, need more\n");
-						break;
+						data->chunk_state = MB_HTTP_CHUNK_DATA;
 					}
 				}
-			} else {
-				g_string_append_len(data->content, buf, buf_len);
-				if(data->content->len >= data->content_len) {
-					data->state = MB_HTTP_STATE_FINISHED;
-				}
-			}
-			break;
-		case MB_HTTP_STATE_FINISHED :
-			break;
+				g_string_truncate(stash, 0);
+				break;
+		}
 	}
+	return cur - buf;
 }
 
-void mb_http_data_set_basicauth(MbHttpData * data, const gchar * user, const gchar * passwd)
+gint mb_http_data_post_read(MbHttpData * data, const gchar * buf, gint buf_len)
 {
-	gchar * merged_tmp, *encoded_tmp, *value_tmp;
-	gsize authen_len;
+	gint consumed = 0, take;
 
-	if(passwd == NULL) {
-		purple_debug_info(MB_HTTPID, "Password not set! Shouldn't we ask for it?\n");
-		// TODO: This prevents crashing, however ...
-		// we should either ask for the users password or disable basic http altogether.
-		passwd = "";
+	if( (buf_len <= 0) || (data->state == MB_HTTP_STATE_FINISHED) ) return 0;
+
+	if(data->state == MB_HTTP_STATE_INIT) {
+		// reuse header buffer from previous response, if any
+		data->cur_packet = data->packet;
+		data->header_line_start = 0;
+		if(data->header_views) {
+			g_array_set_size(data->header_views, 0);
+		} else {
+			data->header_views = g_array_new(FALSE, FALSE, sizeof(MbHttpHeaderView));
+		}
+		data->body_len = 0;
+		data->body_expected = -1;
+		data->content_encoding = MB_HTTP_ENCODING_IDENTITY;
+		data->inflate_state = MB_HTTP_INFLATE_INIT;
+		data->state = MB_HTTP_STATE_HEADER;
 	}
 
-	authen_len = strlen(user) + strlen(passwd) + 1;
-	merged_tmp = g_strdup_printf("%s:%s", user, passwd);
-	encoded_tmp = purple_base64_encode((const guchar *)merged_tmp, authen_len);
-	//g_strlcpy(output, encoded_temp, len);
-	g_free(merged_tmp);
-	value_tmp = g_strdup_printf("Basic %s", encoded_tmp);
-	g_free(encoded_tmp);
+	if(data->state == MB_HTTP_STATE_HEADER) {
+		consumed = mb_http_data_parse_header(data, buf, buf_len);
+		buf += consumed;
+		buf_len -= consumed;
+	}
+
+	if( (data->state != MB_HTTP_STATE_CONTENT) || (buf_len <= 0) ) {
+		return consumed;
+	}
+
+	// body part, bytes go straight from buf to content
+	if(data->chunked_content) {
+		take = mb_http_data_parse_chunked(data, buf, buf_len);
+	} else if(data->body_expected >= 0) {
+		take = MIN(buf_len, data->body_expected - data->body_len);
+		mb_http_data_body_append(data, buf, take);
+		if( (data->body_len + take) >= data->body_expected) {
+			data->state = MB_HTTP_STATE_FINISHED;
+			// Content-Length is the size on the wire, not of inflated body
+			data->content_len = data->content->len + data->sink_len;
+		}
+	} else {
+		// no length given, read until connection is closed
+		take = buf_len;
+		mb_http_data_body_append(data, buf, take);
+		data->content_len = data->content->len + data->sink_len;
+	}
+	data->body_len += take;
+	return consumed + take;
+}
+
+void mb_http_data_set_basicauth(MbHttpData * data, const gchar * user, const gchar * passwd)
+{
+	gchar * value_tmp;
+
+	value_tmp = mb_http_basicauth_value(user, passwd);
 	mb_http_data_set_header(data, "Authorization", value_tmp);
 	g_free(value_tmp);
 }
 
+void mb_http_recv_init(MbHttpRecvBuf * rb)
+{
+	memset(rb, 0, sizeof(MbHttpRecvBuf));
+	rb->size = MB_HTTP_RECV_MIN;
+}
+
+void mb_http_recv_free(MbHttpRecvBuf * rb)
+{
+	g_free(rb->buf);
+	rb->buf = NULL;
+	rb->alloc = 0;
+}
+
+gchar * mb_http_recv_prepare(MbHttpRecvBuf * rb, MbHttpData * data, gint * len)
+{
+	gint left;
+
+	rb->direct = NULL;
+	if(data && (data->state == MB_HTTP_STATE_CONTENT) && (data->body_expected >= 0) && !data->chunked_content &&
+			(data->content_encoding == MB_HTTP_ENCODING_IDENTITY) && !data->sink_active && data->content) {
+		// content was sized from Content-Length, so this rarely moves it, at most one read ahead of arrived bytes
+		left = MIN(data->body_expected - data->body_len, MB_HTTP_RECV_MAX);
+		if(left > 0) {
+			rb->direct = data->content;
+			rb->direct_from = data->content->len;
+			g_string_set_size(data->content, rb->direct_from + left);
+			(*len) = left;
+			return data->content->str + rb->direct_from;
+		}
+	}
+	if(rb->alloc != rb->size) {
+		// old bytes are all consumed, no need to keep them
+		g_free(rb->buf);
+		rb->buf = g_malloc(rb->size);
+		rb->alloc = rb->size;
+	}
+	(*len) = rb->size;
+	return rb->buf;
+}
+
+gint mb_http_recv_done(MbHttpRecvBuf * rb, MbHttpData * data, gint retval)
+{
+	gint saved_errno = errno;
+
+	rb->stat_reads++;
+	if(rb->direct) {
+		g_string_set_size(rb->direct, rb->direct_from + MAX(retval, 0));
+		rb->direct = NULL;
+		if(retval > 0) {
+			rb->stat_bytes += retval;
+			data->body_len += retval;
+			if(data->body_len >= data->body_expected) {
+				data->state = MB_HTTP_STATE_FINISHED;
+				data->content_len = data->content->len + data->sink_len;
+			}
+			retval = 0;
+		}
+	} else if(retval > 0) {
+		rb->stat_bytes += retval;
+		rb->stat_copied += retval;
+		if(retval == rb->size) {
+			rb->size = MIN(rb->size * 2, MB_HTTP_RECV_MAX);
+			rb->short_reads = 0;
+		} else if(retval >= rb->size / 4) {
+			rb->short_reads = 0;
+		} else if(++rb->short_reads >= MB_HTTP_RECV_SHRINK) {
+			rb->size = MAX(rb->size / 2, MB_HTTP_RECV_MIN);
+			rb->short_reads = 0;
+		}
+	}
+	errno = saved_errno;
+	return retval;
+}
+
+// shared by every mb_http_data_read, main loop only
+static MbHttpRecvBuf mb_http_read_buf;
+
 static gint _do_read(gint fd, PurpleSslConnection * ssl, MbHttpData * data)
 {
-	gint retval;
+	gint retval, saved_errno, len;
 	gchar * buffer;
 
 	purple_debug_info(MB_HTTPID, "_do_read called\n");
-	buffer = g_malloc0(MB_MAXBUFF + 1);
+	if(mb_http_read_buf.size == 0) {
+		mb_http_recv_init(&mb_http_read_buf);
+	}
+	buffer = mb_http_recv_prepare(&mb_http_read_buf, data, &len);
 	if(ssl) {
-		retval = purple_ssl_read(ssl, buffer, MB_MAXBUFF);
+		retval = purple_ssl_read(ssl, buffer, len);
 	} else {
-		retval = read(fd, buffer, MB_MAXBUFF);
+		retval = read(fd, buffer, len);
 	}
+	len = mb_http_recv_done(&mb_http_read_buf, data, retval);
+	// caller needs errno to tell EAGAIN apart
+	saved_errno = errno;
 	purple_debug_info(MB_HTTPID, "retval = %d\n", retval);
-	purple_debug_info(MB_HTTPID, "buffer = %s\n", buffer);
-	if(retval > 0) {
-		mb_http_data_post_read(data, buffer, retval);
+	if(len > 0) {
+		mb_http_data_post_read(data, buffer, len);
 	} else if(retval == 0) {
-		data->state = MB_HTTP_STATE_FINISHED;
-		if(data->packet) {
-			g_free(data->packet);
+		// connection closed, this only completes a body that has no length
+		if( (data->state == MB_HTTP_STATE_CONTENT) && !data->chunked_content && (data->body_expected < 0) ) {
+			data->content_len = data->content->len + data->sink_len;
+			data->state = MB_HTTP_STATE_FINISHED;
 		}
 	}
-	g_free(buffer);
 	purple_debug_info(MB_HTTPID, "before return in _do_read\n");
+	errno = saved_errno;
 
 	return retval;
 }
@@ -851,22 +1408,79 @@ gint mb_http_data_ssl_read(PurpleSslConnection * ssl, MbHttpData * data)
 	return _do_read(0, ssl, data);
 }
 
+#ifndef _WIN32
+/*
+	Write packet, template and content of a templated request with one system call
+
+	@param left set to number of bytes left before this write
+*/
+static gint _do_writev(gint fd, MbHttpData * data, gint * left)
+{
+	struct iovec iov[3];
+	const gchar * bufs[3];
+	gint lens[3], i, n = 0, skip = data->write_offset, retval;
+
+	bufs[0] = data->packet;
+	lens[0] = data->packet_len;
+	bufs[1] = data->tmpl->block;
+	lens[1] = data->tmpl->len;
+	bufs[2] = data->content ? data->content->str : NULL;
+	lens[2] = data->content ? data->content->len : 0;
+	(*left) = 0;
+	for(i = 0; i < 3; i++) {
+		if(skip >= lens[i]) {
+			skip -= lens[i];
+			continue;
+		}
+		iov[n].iov_base = (gchar *)bufs[i] + skip;
+		iov[n].iov_len = lens[i] - skip;
+		(*left) += iov[n].iov_len;
+		skip = 0;
+		n++;
+	}
+	retval = writev(fd, iov, n);
+	if(retval > 0) {
+		data->write_offset += retval;
+	}
+	return retval;
+}
+#endif
+
 static gint _do_write(gint fd, PurpleSslConnection * ssl, MbHttpData * data)
 {
-	gint retval, cur_packet_len;
+	gint retval, cur_packet_len, saved_errno;
 
 	purple_debug_info(MB_HTTPID, "preparing HTTP data chunk\n");
 	if(data->packet == NULL) {
 		mb_http_data_prepare_write(data);
 	}
-	// Do SSL-write, then update cur_packet to proper position. Exit if already exceeding the length
-	purple_debug_info(MB_HTTPID, "writing data %s\n", data->cur_packet);
-	cur_packet_len = data->packet_len - (data->cur_packet - data->packet);
+#ifdef _WIN32
+	// no scatter-gather write for sockets here
+	mb_http_data_flatten(data);
+#else
 	if(ssl) {
-		retval = purple_ssl_write(ssl, data->cur_packet, cur_packet_len);
+		// one record for the whole request
+		mb_http_data_flatten(data);
+	}
+#endif
+	if(data->packet_whole) {
+		// Do SSL-write, then update cur_packet to proper position. Exit if already exceeding the length
+		purple_debug_info(MB_HTTPID, "writing data %s\n", data->cur_packet);
+		cur_packet_len = data->packet_len - (data->cur_packet - data->packet);
+		if(ssl) {
+			retval = purple_ssl_write(ssl, data->cur_packet, cur_packet_len);
+		} else {
+			retval = write(fd, data->cur_packet, cur_packet_len);
+		}
 	} else {
-		retval = write(fd, data->cur_packet, cur_packet_len);
+#ifndef _WIN32
+		retval = _do_writev(fd, data, &cur_packet_len);
+#else
+		// not reached, packet is always flattened above
+		retval = cur_packet_len = 0;
+#endif
 	}
+	saved_errno = errno;
 	if(retval >= cur_packet_len)  {
 		// everything is written
 		purple_debug_info(MB_HTTPID, "we sent all data\n");
@@ -874,11 +1488,13 @@ static gint _do_write(gint fd, PurpleSslConnection * ssl, MbHttpData * data)
 		g_free(data->packet);
 		data->cur_packet = data->packet = NULL;
 		data->packet_len = 0;
+		data->write_offset = 0;
 		//return retval;
-	} else if( (retval > 0) && (retval < cur_packet_len)) {
+	} else if( (retval > 0) && (retval < cur_packet_len) && data->packet_whole) {
 		purple_debug_info(MB_HTTPID, "more data must be sent\n");
 		data->cur_packet = data->cur_packet + retval;
 	}
+	errno = saved_errno;
 	return retval;
 }
 
@@ -80,7 +80,74 @@ enum MbHttpState {
 	MB_HTTP_STATE_FINISHED = 3,
 };
 
+/*
+	Decoder state for Transfer-Encoding: chunked
+*/
+enum MbHttpChunkState {
+	MB_HTTP_CHUNK_SIZE = 0, //< reading chunk-size line
+	MB_HTTP_CHUNK_DATA = 1, //< reading chunk payload
+	MB_HTTP_CHUNK_DATA_END = 2, //< reading CRLF after payload
+	MB_HTTP_CHUNK_TRAILER = 3, //< reading trailer, until empty line
+};
+
+/*
+	Content-Encoding of received body
+*/
+enum MbHttpEncoding {
+	MB_HTTP_ENCODING_IDENTITY = 0,
+	MB_HTTP_ENCODING_GZIP = 1,
+	MB_HTTP_ENCODING_DEFLATE = 2,
+};
+
+enum MbHttpInflateState {
+	MB_HTTP_INFLATE_INIT = 0, //< no compressed byte seen yet
+	MB_HTTP_INFLATE_RUNNING = 1,
+	MB_HTTP_INFLATE_DONE = 2, //< end of compressed stream or broken stream, rest of body is dropped
+};
+
 #define MB_MAXBUFF 10240
+#define MB_HTTP_SPARE_MAX (512 * 1024) //< content buffer bigger than this is not kept by mb_http_data_recycle
+#define MB_HTTP_PREALLOC_MAX (1024 * 1024) //< most of Content-Length allocated up front, content grows as bytes arrive beyond it
+#define MB_HTTP_HEADER_BUFF 1024
+#define MB_HTTP_RECV_MIN 4096 //< read size of a fresh receive buffer
+#define MB_HTTP_RECV_MAX (256 * 1024)
+#define MB_HTTP_RECV_SHRINK 8 //< short reads in a row before read size is halved
+#define MB_HTTP_ACCEPT_ENCODING "Accept-Encoding: gzip, deflate\r\n"
+
+/*
+	A received header line, stored as offset/length into MbHttpData::packet
+*/
+typedef struct _MbHttpHeaderView {
+	gint key_offset;
+	gint key_len;
+	gint value_offset;
+	gint value_len;
+} MbHttpHeaderView;
+
+struct _MbHttpData;
+struct z_stream_s;
+
+/*
+	Headers shared by every request of an account, serialized once
+
+	Holds Host, fixed headers and basic authorization, followed by the empty line
+	that ends the header block. A request using it only builds its request line
+	and per-request headers, the template and body are written after them.
+*/
+typedef struct _MbHttpTemplate {
+	gchar * key; //< what the template was built from, to tell when it's out of date
+	gchar * block;
+	gint len;
+	gint ref;
+} MbHttpTemplate;
+
+/*
+	Receive decoded body bytes as they arrive
+
+	Called with buf == NULL once the headers are parsed, return TRUE to take the body.
+	Body bytes are then passed here instead of being kept in content.
+*/
+typedef gboolean (*MbHttpContentSink)(struct _MbHttpData * data, const gchar * buf, gint len, gpointer user_data);
 
 typedef struct _MbHttpData {
 	gchar * host;
@@ -102,10 +169,17 @@ typedef struct _MbHttpData {
 	gchar * content_type;
 	GString * content;
 	// Chunked, in case of Transfer-Encoding: chunked
+	// chunked_content only keeps a partial chunk-size or trailer line between reads
 	GString * chunked_content;
+	gint chunk_state;
+	gint chunk_remaining; //< payload bytes left in current chunk
 	gint content_len;
 	// For receiving side, content_len is the size of content, determined by content-length header
 	// For sending side, content_len is never used.
+	MbHttpContentSink content_sink;
+	gpointer content_sink_data;
+	gboolean sink_active; //< body of current response goes to content_sink
+	gint sink_len; //< body bytes passed to content_sink
 	
 	gint status;
 	gint type;
@@ -114,6 +188,24 @@ typedef struct _MbHttpData {
 	gchar * packet;
 	gchar * cur_packet;
 	gint packet_len;
+
+	// Incremental response parser
+	// For receiving side, packet holds the raw header block and packet_len is its allocated size
+	gint header_line_start; //< offset in packet of the header line being scanned
+	GArray * header_views; //< MbHttpHeaderView of each header line, pointing into packet
+	gint body_len; //< raw body bytes received so far
+	gint body_expected; //< raw body bytes expected from Content-Length, -1 if unknown
+
+	// Compressed body, inflated before it goes to content or content_sink
+	gint content_encoding;
+	gint inflate_state;
+	struct z_stream_s * inflater; //< kept for next response on the same MbHttpData
+	GString * spare_content; //< emptied content buffer from mb_http_data_recycle, taken by next body
+
+	// Sending side with template, packet holds request line and per-request headers only
+	MbHttpTemplate * tmpl;
+	gboolean packet_whole; //< packet holds the whole request, cur_packet tells what's written
+	gint write_offset; //< bytes written over packet, template and content when packet is not whole
 } MbHttpData;
 
 typedef struct _MbHttpParam {
@@ -121,6 +213,26 @@ typedef struct _MbHttpParam {
 	gchar * value;
 } MbHttpParam;
 
+/*
+	Reusable receive buffer of a connection
+
+	Read size doubles while reads fill the buffer, so big timeline bodies take fewer reads,
+	and is halved again after a run of short reads. Body with known length and no encoding
+	doesn't go through the buffer at all, it's read straight into content.
+*/
+typedef struct _MbHttpRecvBuf {
+	gchar * buf;
+	gint alloc; //< allocated size of buf
+	gint size; //< bytes asked by next read into buf
+	gint short_reads; //< reads in a row that used less than a quarter of size
+	GString * direct; //< content the pending read goes into, NULL if it goes to buf
+	gsize direct_from; //< length of direct before the read
+
+	guint stat_reads; //< read calls
+	unsigned long long stat_bytes; //< bytes received
+	unsigned long long stat_copied; //< bytes received into buf, copied again by parser
+} MbHttpRecvBuf;
+
 /*
 	Create new MbHttpData
 	
@@ -153,6 +265,35 @@ extern gint mb_http_data_read(gint fd, MbHttpData * data);
 */
 extern gint mb_http_data_ssl_read(PurpleSslConnection * ssl, MbHttpData * data);
 
+/*
+	Initialize receive buffer, nothing is allocated until the first read
+*/
+extern void mb_http_recv_init(MbHttpRecvBuf * rb);
+
+/*
+	Free memory of receive buffer, it can be used again after mb_http_recv_init
+*/
+extern void mb_http_recv_free(MbHttpRecvBuf * rb);
+
+/*
+	Get where the next read should go
+
+	@param data response the bytes are for, NULL if no response is expected
+	@param len set to number of bytes to read
+	@return either buf of rb, or the end of data's content, mb_http_recv_done must be called after reading
+*/
+extern gchar * mb_http_recv_prepare(MbHttpRecvBuf * rb, MbHttpData * data, gint * len);
+
+/*
+	Account result of read into buffer from mb_http_recv_prepare, errno is kept
+
+	@param data same as given to mb_http_recv_prepare
+	@param retval what read returned
+	@return number of bytes in buf of rb to be fed to mb_http_data_post_read,
+	        0 if they went straight into data, retval if nothing was read
+*/
+extern gint mb_http_recv_done(MbHttpRecvBuf * rb, MbHttpData * data, gint retval);
+
 /*
 	Write a Http data to a stream
 	
@@ -248,6 +389,28 @@ extern gchar * mb_http_data_get_header(MbHttpData * data, const gchar * key);
 */
 extern void mb_http_data_set_fixed_headers(MbHttpData * data, const gchar * headers);
 
+/*
+	Create request template
+
+	@param key caller's description of what went into the template, kept in key, so it must not hold secrets
+	@param host value of Host header
+	@param fixed_headers other constant headers, each line MUST ends with \r\n
+	@param user user for basic authorization, NULL for none
+	@param passwd password for basic authorization
+	@return template with one reference, release with mb_http_template_unref
+*/
+extern MbHttpTemplate * mb_http_template_new(const gchar * key, const gchar * host, const gchar * fixed_headers, const gchar * user, const gchar * passwd);
+extern MbHttpTemplate * mb_http_template_ref(MbHttpTemplate * tmpl);
+extern void mb_http_template_unref(MbHttpTemplate * tmpl);
+
+/*
+	Use template for outgoing data, instead of Host, fixed headers and basic authorization
+	
+	@param data MbHttpData
+	@param tmpl template, a reference is taken
+*/
+extern void mb_http_data_set_template(MbHttpData * data, MbHttpTemplate * tmpl);
+
 /*
 	Add new www-urlencoded parameter to data
 	
@@ -326,23 +489,66 @@ extern gboolean mb_http_data_rm_param(MbHttpData * data, const gchar * key);
 */
 extern void mb_http_data_truncate(MbHttpData * data);
 
+/*
+	Make data ready for an unrelated request, like it's just created
+	Header table, header index, inflater and content buffer are kept for reuse
+	
+	@param data MbHttpData
+*/
+extern void mb_http_data_recycle(MbHttpData * data);
+
 
 /*
    	Prepare packet for writing to destination
-	data->packet will be ready-to-send gchar * after this call
+	data->packet will be ready-to-send gchar * after this call, unless template is used.
+	With template packet holds only request line and per-request headers, see mb_http_data_flatten
+	gzip and deflate are accepted unless Accept-Encoding header is already set
  */
 extern void mb_http_data_prepare_write(MbHttpData * data);
 
 /*
-   	Parse red to MbHttpData
+	Copy template and body after the prepared packet, so packet holds the whole request
+	Does nothing if packet is already whole
  */
-extern void mb_http_data_post_read(MbHttpData * data, const gchar * buf, gint buf_len);
+extern void mb_http_data_flatten(MbHttpData * data);
+
+/*
+	Parse received bytes into MbHttpData
+
+	Can be called repeatedly as data arrives, parser state is kept inside data.
+	data->state is MB_HTTP_STATE_FINISHED once the whole response is received.
+	Body with gzip or deflate Content-Encoding is inflated as it arrives.
+
+	@return number of bytes consumed, less than buf_len if buf holds more than this response
+ */
+extern gint mb_http_data_post_read(MbHttpData * data, const gchar * buf, gint buf_len);
 
 /**
  * Set content type header
  */
 extern void mb_http_data_set_content_type(MbHttpData * data, const gchar * type);
 
+/**
+ * Set a sink to decode response body while it's being received
+ *
+ * Sink is kept across mb_http_data_truncate, so it also applies to retried requests
+ *
+ * @param data MbHttpData of response
+ * @param sink content sink, NULL to keep body in content as usual
+ * @param user_data passed to sink
+ */
+extern void mb_http_data_set_content_sink(MbHttpData * data, MbHttpContentSink sink, gpointer user_data);
+
+/*
+ * Copy status, headers and content of a received response
+ *
+ * Content sink of dst is not called, body that went to sink of src is not copied
+ *
+ * @param dst response of a request that was never sent
+ * @param src finished response
+ */
+extern void mb_http_data_copy_response(MbHttpData * dst, MbHttpData * src);
+
 #ifdef __cplusplus
 }
 #endif
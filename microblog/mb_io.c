@@ -0,0 +1,464 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <debug.h>
+#include <eventloop.h>
+
+#include "mb_http.h"
+#include "mb_io.h"
+#include "mb_util.h"
+
+#define DBGID "mb_io"
+
+#if defined(__linux__)
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MB_IO_READS 8 //< reads of one socket per wakeup, so a busy socket doesn't hold the lock for long
+#define MB_IO_STOP 0 //< epoll tag of stop eventfd, sockets are tagged with their serial
+
+struct _MbIoConn {
+	guint serial; //< epoll tag, events of removed socket are recognized by it
+	gint fd;
+	MbIoFunc func;
+	gpointer owner;
+	GQueue * expected; //< MbHttpData, head is being parsed, under mb_io lock
+	MbHttpRecvBuf recv; //< I/O thread only
+	gboolean dead; //< closed or broken, not watched anymore, under mb_io lock
+};
+
+typedef struct _MbIoEvent {
+	guint serial;
+	gint event;
+	MbHttpData * response;
+	gint error;
+} MbIoEvent;
+
+// Shared by all accounts, touched from main thread only except where noted
+static gint mb_io_users = 0;
+static GThread * mb_io_thread = NULL;
+static gint mb_io_epoll = -1;
+static gint mb_io_stop_fd = -1; //< written by main thread to stop I/O thread
+static gint mb_io_wake_fd = -1; //< written by I/O thread when ring has events
+static guint mb_io_wake_handler = 0;
+static guint mb_io_last_serial = MB_IO_STOP;
+static GHashTable * mb_io_conns = NULL; //< serial -> MbIoConn, changed by main thread under mb_io lock
+static gint mb_io_stopping = 0; //< any thread
+G_LOCK_DEFINE_STATIC(mb_io);
+
+// Events from I/O thread, the only producer, to main thread, the only consumer
+static MbIoEvent mb_io_ring[MB_IO_RING_SIZE];
+static gint mb_io_ring_head = 0; //< next event to take, advanced by main thread
+static gint mb_io_ring_tail = 0; //< next free slot, advanced by I/O thread
+
+// Statistics, counted by I/O thread
+static gint mb_io_stat_wakeups = 0;
+static gint mb_io_stat_responses = 0;
+static gint mb_io_stat_stalls = 0; //< ring was full
+
+static gboolean mb_io_ring_push(const MbIoEvent * ev)
+{
+	gint tail = g_atomic_int_get(&mb_io_ring_tail);
+	gint next = (tail + 1) % MB_IO_RING_SIZE;
+
+	if(next == g_atomic_int_get(&mb_io_ring_head)) {
+		return FALSE;
+	}
+	mb_io_ring[tail] = *ev;
+	g_atomic_int_set(&mb_io_ring_tail, next);
+	return TRUE;
+}
+
+static gboolean mb_io_ring_pop(MbIoEvent * ev)
+{
+	gint head = g_atomic_int_get(&mb_io_ring_head);
+
+	if(head == g_atomic_int_get(&mb_io_ring_tail)) {
+		return FALSE;
+	}
+	*ev = mb_io_ring[head];
+	g_atomic_int_set(&mb_io_ring_head, (head + 1) % MB_IO_RING_SIZE);
+	return TRUE;
+}
+
+static void mb_io_wake(gint fd)
+{
+	guint64 one = 1;
+	ssize_t retval;
+
+	retval = write(fd, &one, sizeof(one));
+	(void)retval;
+}
+
+/*
+	Collect event on I/O thread, it's pushed to ring by mb_io_flush once mb_io lock is released
+*/
+static void mb_io_post(GArray * out, MbIoConn * io, gint event, MbHttpData * response, gint error)
+{
+	MbIoEvent ev;
+
+	ev.serial = io->serial;
+	ev.event = event;
+	ev.response = response;
+	ev.error = error;
+	g_array_append_val(out, ev);
+}
+
+/*
+	Push collected events to ring, I/O thread only
+
+	Must not hold mb_io lock, main thread might be waiting for it in mb_io_remove instead of draining ring.
+*/
+static void mb_io_flush(GArray * out)
+{
+	guint i = 0;
+
+	while( (i < out->len) && !g_atomic_int_get(&mb_io_stopping) ) {
+		if(mb_io_ring_push(&g_array_index(out, MbIoEvent, i))) {
+			i++;
+			continue;
+		}
+		// main loop is behind, let it catch up
+		g_atomic_int_inc(&mb_io_stat_stalls);
+		mb_io_wake(mb_io_wake_fd);
+		g_usleep(1000);
+	}
+	if(out->len > 0) {
+		mb_io_wake(mb_io_wake_fd);
+		g_array_set_size(out, 0);
+	}
+}
+
+/*
+	Stop watching broken socket, I/O thread only, with mb_io lock held
+*/
+static void mb_io_kill(MbIoConn * io, GArray * out, gint error)
+{
+	io->dead = TRUE;
+	epoll_ctl(mb_io_epoll, EPOLL_CTL_DEL, io->fd, NULL);
+	mb_io_post(out, io, MB_IO_CLOSED, NULL, error);
+}
+
+/*
+	Read and parse ready socket, I/O thread only, with mb_io lock held
+*/
+static void mb_io_read(MbIoConn * io, GArray * out)
+{
+	gchar * buf;
+	MbHttpData * response;
+	gint retval, len, pos, consumed, reads;
+
+	for(reads = 0; reads < MB_IO_READS; reads++) {
+		response = g_queue_peek_head(io->expected);
+		buf = mb_http_recv_prepare(&io->recv, response, &len);
+		retval = read(io->fd, buf, len);
+		len = mb_http_recv_done(&io->recv, response, retval);
+		if(retval < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN) {
+				return;
+			}
+		}
+		if(retval <= 0) {
+			response = g_queue_peek_head(io->expected);
+			if( (retval == 0) && response && (response->state == MB_HTTP_STATE_CONTENT) &&
+					(response->body_expected < 0) && !response->chunked_content) {
+				// body was delimited by closing the connection
+				response->state = MB_HTTP_STATE_FINISHED;
+				g_queue_pop_head(io->expected);
+				g_atomic_int_inc(&mb_io_stat_responses);
+				mb_io_post(out, io, MB_IO_FINISHED, response, 0);
+			}
+			mb_io_kill(io, out, (retval < 0) ? errno : 0);
+			return;
+		}
+		if(len == 0) {
+			// body went straight into head response
+			if(response->state == MB_HTTP_STATE_FINISHED) {
+				g_queue_pop_head(io->expected);
+				g_atomic_int_inc(&mb_io_stat_responses);
+				mb_io_post(out, io, MB_IO_FINISHED, response, 0);
+			}
+			continue;
+		}
+		// same as mb_conn_do_read, bytes go to the head response until it's complete
+		for(pos = 0; pos < len; pos += consumed) {
+			response = g_queue_peek_head(io->expected);
+			if(!response) {
+				mb_io_kill(io, out, -1);
+				return;
+			}
+			if(response->state == MB_HTTP_STATE_INIT) {
+				mb_io_post(out, io, MB_IO_FIRST_BYTE, response, 0);
+			}
+			consumed = mb_http_data_post_read(response, buf + pos, len - pos);
+			if(response->state != MB_HTTP_STATE_FINISHED) {
+				break;
+			}
+			g_queue_pop_head(io->expected);
+			g_atomic_int_inc(&mb_io_stat_responses);
+			mb_io_post(out, io, MB_IO_FINISHED, response, 0);
+		}
+	}
+}
+
+/*
+	I/O thread, must not call into libpurple
+*/
+static gpointer mb_io_run(gpointer data)
+{
+	struct epoll_event events[MB_IO_EVENTS];
+	GArray * out = g_array_new(FALSE, FALSE, sizeof(MbIoEvent));
+	MbIoConn * io;
+	gint n, i;
+	gboolean running = TRUE;
+
+	while(running) {
+		n = epoll_wait(mb_io_epoll, events, MB_IO_EVENTS, -1);
+		if(n < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		g_atomic_int_inc(&mb_io_stat_wakeups);
+		for(i = 0; i < n; i++) {
+			if(events[i].data.u32 == MB_IO_STOP) {
+				running = FALSE;
+				break;
+			}
+			G_LOCK(mb_io);
+			io = g_hash_table_lookup(mb_io_conns, GUINT_TO_POINTER(events[i].data.u32));
+			if(io && !io->dead) {
+				mb_io_read(io, out);
+			}
+			G_UNLOCK(mb_io);
+		}
+		mb_io_flush(out);
+	}
+	g_array_free(out, TRUE);
+	return NULL;
+}
+
+/*
+	Take events from ring on main thread
+*/
+static void mb_io_wake_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+	guint64 count;
+	ssize_t retval;
+	MbIoEvent ev;
+	MbIoConn * io;
+
+	retval = read(mb_io_wake_fd, &count, sizeof(count));
+	(void)retval;
+	// func might remove sockets or even stop the thread, look everything up again each time
+	while(mb_io_conns && mb_io_ring_pop(&ev)) {
+		// main thread is the only one changing the table, no need to lock for lookup
+		io = g_hash_table_lookup(mb_io_conns, GUINT_TO_POINTER(ev.serial));
+		if(!io) {
+			continue;
+		}
+		io->func(io->owner, ev.event, ev.response, ev.error);
+	}
+}
+
+static void mb_io_close_fds(void)
+{
+	if(mb_io_epoll >= 0) close(mb_io_epoll);
+	if(mb_io_stop_fd >= 0) close(mb_io_stop_fd);
+	if(mb_io_wake_fd >= 0) close(mb_io_wake_fd);
+	mb_io_epoll = mb_io_stop_fd = mb_io_wake_fd = -1;
+}
+
+gboolean mb_io_ref(void)
+{
+	struct epoll_event ev;
+	GError * error = NULL;
+
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	if(!g_thread_supported()) {
+		purple_debug_info(DBGID, "threads are not initialized, reading on main loop\n");
+		return FALSE;
+	}
+#endif
+	if(!mb_io_thread) {
+		// parser keeps quiet when it runs on I/O thread
+		mb_set_main_thread();
+		mb_io_epoll = epoll_create(MB_IO_EVENTS);
+		mb_io_stop_fd = eventfd(0, 0);
+		mb_io_wake_fd = eventfd(0, 0);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = MB_IO_STOP;
+		if( (mb_io_epoll < 0) || (mb_io_stop_fd < 0) || (mb_io_wake_fd < 0) ||
+				(fcntl(mb_io_wake_fd, F_SETFL, O_NONBLOCK) < 0) ||
+				(epoll_ctl(mb_io_epoll, EPOLL_CTL_ADD, mb_io_stop_fd, &ev) < 0) ) {
+			purple_debug_info(DBGID, "can not set up epoll, %s\n", g_strerror(errno));
+			mb_io_close_fds();
+			return FALSE;
+		}
+		mb_io_conns = g_hash_table_new(g_direct_hash, g_direct_equal);
+		mb_io_ring_head = mb_io_ring_tail = 0;
+		mb_io_stopping = 0;
+#if GLIB_CHECK_VERSION(2, 32, 0)
+		mb_io_thread = g_thread_try_new(DBGID, mb_io_run, NULL, &error);
+#else
+		mb_io_thread = g_thread_create(mb_io_run, NULL, TRUE, &error);
+#endif
+		if(!mb_io_thread) {
+			purple_debug_info(DBGID, "can not start I/O thread, %s\n", error ? error->message : "");
+			if(error) g_error_free(error);
+			g_hash_table_destroy(mb_io_conns);
+			mb_io_conns = NULL;
+			mb_io_close_fds();
+			return FALSE;
+		}
+		mb_io_wake_handler = purple_input_add(mb_io_wake_fd, PURPLE_INPUT_READ, mb_io_wake_cb, NULL);
+	}
+	mb_io_users++;
+	purple_debug_info(DBGID, "%d accounts share I/O thread\n", mb_io_users);
+	return TRUE;
+}
+
+void mb_io_unref(void)
+{
+	if( (mb_io_users <= 0) || (--mb_io_users > 0) ) {
+		return;
+	}
+	g_atomic_int_set(&mb_io_stopping, 1);
+	mb_io_wake(mb_io_stop_fd);
+	g_thread_join(mb_io_thread);
+	mb_io_thread = NULL;
+	purple_input_remove(mb_io_wake_handler);
+	mb_io_wake_handler = 0;
+	// every account removed its sockets already
+	g_hash_table_destroy(mb_io_conns);
+	mb_io_conns = NULL;
+	mb_io_close_fds();
+}
+
+MbIoConn * mb_io_add(gint fd, MbIoFunc func, gpointer owner)
+{
+	MbIoConn * io = g_new0(MbIoConn, 1);
+	struct epoll_event ev;
+
+	if(++mb_io_last_serial == MB_IO_STOP) {
+		mb_io_last_serial++;
+	}
+	io->serial = mb_io_last_serial;
+	io->fd = fd;
+	io->func = func;
+	io->owner = owner;
+	io->expected = g_queue_new();
+	mb_http_recv_init(&io->recv);
+
+	// in the table before epoll can report it
+	G_LOCK(mb_io);
+	g_hash_table_insert(mb_io_conns, GUINT_TO_POINTER(io->serial), io);
+	G_UNLOCK(mb_io);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = io->serial;
+	if(epoll_ctl(mb_io_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		purple_debug_info(DBGID, "can not watch socket %d, %s\n", fd, g_strerror(errno));
+		io->dead = TRUE;
+		mb_io_remove(io);
+		return NULL;
+	}
+	return io;
+}
+
+void mb_io_expect(MbIoConn * io, MbHttpData * response)
+{
+	G_LOCK(mb_io);
+	g_queue_push_tail(io->expected, response);
+	G_UNLOCK(mb_io);
+}
+
+void mb_io_remove(MbIoConn * io)
+{
+	G_LOCK(mb_io);
+	if(!io->dead) {
+		epoll_ctl(mb_io_epoll, EPOLL_CTL_DEL, io->fd, NULL);
+	}
+	g_hash_table_remove(mb_io_conns, GUINT_TO_POINTER(io->serial));
+	G_UNLOCK(mb_io);
+	g_queue_free(io->expected);
+	mb_http_recv_free(&io->recv);
+	g_free(io);
+}
+
+void mb_io_describe(GString * out)
+{
+	if(!mb_io_thread) {
+		g_string_append(out, "off");
+		return;
+	}
+	g_string_append_printf(out, "%d accounts, %u sockets, %d wakeups, %d responses, %d stalls",
+			mb_io_users, g_hash_table_size(mb_io_conns), g_atomic_int_get(&mb_io_stat_wakeups),
+			g_atomic_int_get(&mb_io_stat_responses), g_atomic_int_get(&mb_io_stat_stalls));
+}
+
+#else
+
+// epoll only, every other platform reads on main loop
+
+gboolean mb_io_ref(void)
+{
+	purple_debug_info(DBGID, "I/O thread is not supported, reading on main loop\n");
+	return FALSE;
+}
+
+void mb_io_unref(void)
+{
+}
+
+MbIoConn * mb_io_add(gint fd, MbIoFunc func, gpointer owner)
+{
+	return NULL;
+}
+
+void mb_io_expect(MbIoConn * io, MbHttpData * response)
+{
+}
+
+void mb_io_remove(MbIoConn * io)
+{
+}
+
+void mb_io_describe(GString * out)
+{
+	g_string_append(out, "off");
+}
+
+#endif
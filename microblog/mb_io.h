@@ -0,0 +1,121 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * Response reading on a network I/O thread
+ *
+ * Plain HTTP connections of all accounts can be read by one thread waiting on epoll.
+ * The thread parses responses as bytes arrive and hands events back to the GLib main loop
+ * through a single producer, single consumer ring and an eventfd, so response handlers
+ * still run on the main thread. Connecting and writing requests stay on the main loop.
+ *
+ * Only plain HTTP responses read as a whole go there, which are timeline polls of accounts not
+ * using HTTPS. TLS is read through libpurple's SSL API, which isn't thread safe. Streams and
+ * responses with a content sink run plug-in code for each piece, so they stay on the main loop.
+ */
+
+#ifndef __MB_IO__
+#define __MB_IO__
+
+#include <glib.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include "mb_http.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MB_IO_RING_SIZE 1024 //< events waiting for main loop, I/O thread stalls when it's full
+#define MB_IO_EVENTS 64 //< ready sockets taken per epoll_wait
+
+enum MbIoEvent {
+	MB_IO_FIRST_BYTE = 0, //< first byte of response arrived
+	MB_IO_FINISHED = 1, //< whole response is parsed
+	MB_IO_CLOSED = 2, //< socket is closed or broken, nothing more is read from it
+};
+
+typedef struct _MbIoConn MbIoConn;
+
+/*
+	Take event of a socket on main thread
+
+	@param owner as given to mb_io_add
+	@param event one of MbIoEvent
+	@param response the response event is about, NULL for MB_IO_CLOSED
+	@param error for MB_IO_CLOSED, errno of failed read, 0 if peer closed, -1 if bytes arrived while no response was expected
+*/
+typedef void (*MbIoFunc)(gpointer owner, gint event, MbHttpData * response, gint error);
+
+/*
+	Start or share I/O thread
+
+	@return FALSE if I/O thread is not available, account should read on main loop then
+*/
+extern gboolean mb_io_ref(void);
+
+/*
+	Release I/O thread, last user stops it
+
+	Every socket must be removed before.
+*/
+extern void mb_io_unref(void);
+
+/*
+	Let I/O thread read a connected, non-blocking socket
+
+	Socket stays owned by caller, it must be removed with mb_io_remove before closing it.
+
+	@return handle of socket, NULL if it can't be watched
+*/
+extern MbIoConn * mb_io_add(gint fd, MbIoFunc func, gpointer owner);
+
+/*
+	Expect one more response on socket, responses are parsed in order they are expected
+
+	@param response response to parse into, caller must not touch it until MB_IO_FINISHED or mb_io_remove
+*/
+extern void mb_io_expect(MbIoConn * io, MbHttpData * response);
+
+/*
+	Stop reading socket, events of it not taken yet are dropped
+
+	Waits until I/O thread is done with the socket, expected responses can be used right after.
+*/
+extern void mb_io_remove(MbIoConn * io);
+
+/*
+	Append statistics of I/O thread to out
+*/
+extern void mb_io_describe(GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,436 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/*
+	Incremental JSON tokenizer
+
+	Strings without escapes that are complete within one feed are passed to the callback
+	straight from the input buffer. Only tokens split between feeds or containing escapes
+	are copied into parser->token, which is reused for the whole document.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "mb_json.h"
+
+enum MbJsonState {
+	MB_JSON_S_VALUE = 0, //< expecting a value
+	MB_JSON_S_VALUE_OR_END, //< after '['
+	MB_JSON_S_KEY_OR_END, //< after '{'
+	MB_JSON_S_KEY, //< after ',' in object
+	MB_JSON_S_COLON,
+	MB_JSON_S_COMMA_OR_END, //< after a value in container
+	MB_JSON_S_STRING,
+	MB_JSON_S_STRING_ESC, //< after '\' in string
+	MB_JSON_S_STRING_U, //< reading hex digits of \u
+	MB_JSON_S_LITERAL, //< number, true, false or null
+	MB_JSON_S_ERROR,
+};
+
+#define MB_JSON_IS_SPACE(c) ( ((c) == ' ') || ((c) == '\n') || ((c) == '\r') || ((c) == '\t') )
+#define MB_JSON_IS_LITERAL(c) ( g_ascii_isalnum(c) || ((c) == '-') || ((c) == '+') || ((c) == '.') )
+
+MbJsonParser * mb_json_parser_new(MbJsonFunc func, gpointer user_data)
+{
+	MbJsonParser * parser = g_new0(MbJsonParser, 1);
+
+	parser->func = func;
+	parser->user_data = user_data;
+	parser->token = g_string_sized_new(256);
+	mb_json_parser_reset(parser);
+	return parser;
+}
+
+void mb_json_parser_free(MbJsonParser * parser)
+{
+	g_string_free(parser->token, TRUE);
+	g_free(parser);
+}
+
+void mb_json_parser_reset(MbJsonParser * parser)
+{
+	parser->state = MB_JSON_S_VALUE;
+	parser->depth = 0;
+	g_string_truncate(parser->token, 0);
+	parser->token_is_key = FALSE;
+	parser->ucs = 0;
+	parser->ucs_digits = 0;
+	parser->high_surrogate = 0;
+	parser->values = 0;
+	parser->error = NULL;
+}
+
+static gboolean mb_json_fail(MbJsonParser * parser, const gchar * error)
+{
+	parser->state = MB_JSON_S_ERROR;
+	parser->error = error;
+	return FALSE;
+}
+
+static gboolean mb_json_emit(MbJsonParser * parser, gint token, const gchar * text, gint len)
+{
+	if(!parser->func(parser, token, text, len, parser->user_data)) {
+		return mb_json_fail(parser, "stopped by callback");
+	}
+	return TRUE;
+}
+
+/*
+	A value is complete, decide what may come next
+*/
+static void mb_json_value_done(MbJsonParser * parser)
+{
+	if(parser->depth > 0) {
+		parser->state = MB_JSON_S_COMMA_OR_END;
+	} else {
+		parser->state = MB_JSON_S_VALUE;
+		parser->values++;
+	}
+}
+
+static gboolean mb_json_push(MbJsonParser * parser, gchar c)
+{
+	if(parser->depth >= MB_JSON_MAX_DEPTH) {
+		return mb_json_fail(parser, "nested too deep");
+	}
+	parser->stack[parser->depth++] = c;
+	if(c == '{') {
+		parser->state = MB_JSON_S_KEY_OR_END;
+		return mb_json_emit(parser, MB_JSON_OBJECT_START, NULL, 0);
+	}
+	parser->state = MB_JSON_S_VALUE_OR_END;
+	return mb_json_emit(parser, MB_JSON_ARRAY_START, NULL, 0);
+}
+
+static gboolean mb_json_pop(MbJsonParser * parser, gchar c)
+{
+	if( (parser->depth == 0) || (parser->stack[parser->depth - 1] != ( (c == '}') ? '{' : '[' )) ) {
+		return mb_json_fail(parser, "unbalanced brackets");
+	}
+	if(!mb_json_emit(parser, (c == '}') ? MB_JSON_OBJECT_END : MB_JSON_ARRAY_END, NULL, 0)) {
+		return FALSE;
+	}
+	parser->depth--;
+	mb_json_value_done(parser);
+	return TRUE;
+}
+
+/*
+	Check number syntax, -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+*/
+static gboolean mb_json_is_number(const gchar * s, gint len)
+{
+	const gchar * end = s + len;
+
+	if( (s < end) && (*s == '-') ) s++;
+	if( (s >= end) || !g_ascii_isdigit(*s) ) return FALSE;
+	if(*s == '0') {
+		s++;
+	} else {
+		while( (s < end) && g_ascii_isdigit(*s) ) s++;
+	}
+	if( (s < end) && (*s == '.') ) {
+		s++;
+		if( (s >= end) || !g_ascii_isdigit(*s) ) return FALSE;
+		while( (s < end) && g_ascii_isdigit(*s) ) s++;
+	}
+	if( (s < end) && ( (*s == 'e') || (*s == 'E') ) ) {
+		s++;
+		if( (s < end) && ( (*s == '+') || (*s == '-') ) ) s++;
+		if( (s >= end) || !g_ascii_isdigit(*s) ) return FALSE;
+		while( (s < end) && g_ascii_isdigit(*s) ) s++;
+	}
+	return (s == end);
+}
+
+static gboolean mb_json_literal(MbJsonParser * parser, const gchar * text, gint len)
+{
+	gint token;
+
+	if( (len == 4) && (strncmp(text, "true", 4) == 0) ) {
+		token = MB_JSON_TRUE;
+	} else if( (len == 5) && (strncmp(text, "false", 5) == 0) ) {
+		token = MB_JSON_FALSE;
+	} else if( (len == 4) && (strncmp(text, "null", 4) == 0) ) {
+		token = MB_JSON_NULL;
+	} else if(mb_json_is_number(text, len)) {
+		token = MB_JSON_NUMBER;
+	} else {
+		return mb_json_fail(parser, "invalid literal");
+	}
+	if(!mb_json_emit(parser, token, text, len)) {
+		return FALSE;
+	}
+	mb_json_value_done(parser);
+	return TRUE;
+}
+
+static gboolean mb_json_string_done(MbJsonParser * parser, const gchar * text, gint len)
+{
+	if(parser->token_is_key) {
+		parser->state = MB_JSON_S_COLON;
+		return mb_json_emit(parser, MB_JSON_KEY, text, len);
+	}
+	if(!mb_json_emit(parser, MB_JSON_STRING, text, len)) {
+		return FALSE;
+	}
+	mb_json_value_done(parser);
+	return TRUE;
+}
+
+/*
+	Append the code point of a finished \u escape, pairing up surrogates
+*/
+static void mb_json_append_ucs(MbJsonParser * parser, guint32 ucs)
+{
+	if( (ucs >= 0xD800) && (ucs <= 0xDBFF) ) {
+		if(parser->high_surrogate) {
+			g_string_append_unichar(parser->token, 0xFFFD);
+		}
+		parser->high_surrogate = ucs;
+		return;
+	}
+	if( (ucs >= 0xDC00) && (ucs <= 0xDFFF) ) {
+		if(parser->high_surrogate) {
+			ucs = 0x10000 + ((parser->high_surrogate - 0xD800) << 10) + (ucs - 0xDC00);
+		} else {
+			ucs = 0xFFFD;
+		}
+	} else if(parser->high_surrogate) {
+		g_string_append_unichar(parser->token, 0xFFFD);
+	}
+	parser->high_surrogate = 0;
+	g_string_append_unichar(parser->token, ucs);
+}
+
+gboolean mb_json_parser_feed(MbJsonParser * parser, const gchar * buf, gint len)
+{
+	const gchar * cur = buf, * end = buf + len, * start;
+	gboolean in_place = FALSE; //< current string/literal starts in buf and is not copied yet
+	gchar c;
+
+	if(parser->state == MB_JSON_S_ERROR) {
+		return FALSE;
+	}
+	while(cur < end) {
+		switch(parser->state) {
+			case MB_JSON_S_STRING :
+				if(parser->high_surrogate && (*cur != '\\') ) {
+					// lone high surrogate
+					g_string_append_unichar(parser->token, 0xFFFD);
+					parser->high_surrogate = 0;
+					in_place = FALSE;
+				}
+				start = cur;
+				while( (cur < end) && (*cur != '"') && (*cur != '\\') && ((guchar)*cur >= 0x20) ) {
+					cur++;
+				}
+				if(cur == end) {
+					g_string_append_len(parser->token, start, cur - start);
+					in_place = FALSE;
+					break;
+				}
+				if(*cur == '"') {
+					cur++;
+					if(in_place) {
+						// no escapes, straight from input buffer
+						in_place = FALSE;
+						if(!mb_json_string_done(parser, start, cur - start - 1)) return FALSE;
+					} else {
+						g_string_append_len(parser->token, start, cur - start - 1);
+						if(!mb_json_string_done(parser, parser->token->str, parser->token->len)) return FALSE;
+					}
+				} else if(*cur == '\\') {
+					g_string_append_len(parser->token, start, cur - start);
+					in_place = FALSE;
+					cur++;
+					parser->state = MB_JSON_S_STRING_ESC;
+				} else {
+					return mb_json_fail(parser, "control character in string");
+				}
+				break;
+
+			case MB_JSON_S_STRING_ESC :
+				c = *cur++;
+				parser->state = MB_JSON_S_STRING;
+				if(c == 'u') {
+					parser->ucs = 0;
+					parser->ucs_digits = 0;
+					parser->state = MB_JSON_S_STRING_U;
+					break;
+				}
+				if(parser->high_surrogate) {
+					g_string_append_unichar(parser->token, 0xFFFD);
+					parser->high_surrogate = 0;
+				}
+				switch(c) {
+					case '"' :
+					case '\\' :
+					case '/' :
+						g_string_append_c(parser->token, c);
+						break;
+					case 'b' :
+						g_string_append_c(parser->token, '\b');
+						break;
+					case 'f' :
+						g_string_append_c(parser->token, '\f');
+						break;
+					case 'n' :
+						g_string_append_c(parser->token, '\n');
+						break;
+					case 'r' :
+						g_string_append_c(parser->token, '\r');
+						break;
+					case 't' :
+						g_string_append_c(parser->token, '\t');
+						break;
+					default :
+						return mb_json_fail(parser, "invalid escape");
+				}
+				break;
+
+			case MB_JSON_S_STRING_U :
+				c = *cur++;
+				if(!g_ascii_isxdigit(c)) {
+					return mb_json_fail(parser, "invalid \\u escape");
+				}
+				parser->ucs = (parser->ucs << 4) | g_ascii_xdigit_value(c);
+				if(++parser->ucs_digits == 4) {
+					mb_json_append_ucs(parser, parser->ucs);
+					parser->state = MB_JSON_S_STRING;
+				}
+				break;
+
+			case MB_JSON_S_LITERAL :
+				start = cur;
+				while( (cur < end) && MB_JSON_IS_LITERAL(*cur) ) {
+					cur++;
+				}
+				if(cur == end) {
+					g_string_append_len(parser->token, start, cur - start);
+					in_place = FALSE;
+					break;
+				}
+				// delimiter is left for the next state
+				if(in_place) {
+					in_place = FALSE;
+					if(!mb_json_literal(parser, start, cur - start)) return FALSE;
+				} else {
+					g_string_append_len(parser->token, start, cur - start);
+					if(!mb_json_literal(parser, parser->token->str, parser->token->len)) return FALSE;
+				}
+				break;
+
+			case MB_JSON_S_ERROR :
+				return FALSE;
+
+			default :
+				c = *cur;
+				if(MB_JSON_IS_SPACE(c)) {
+					cur++;
+					break;
+				}
+				switch(parser->state) {
+					case MB_JSON_S_KEY_OR_END :
+						if(c == '}') {
+							cur++;
+							if(!mb_json_pop(parser, c)) return FALSE;
+							break;
+						}
+						// fall through
+					case MB_JSON_S_KEY :
+						if(c != '"') {
+							return mb_json_fail(parser, "expecting member name");
+						}
+						cur++;
+						g_string_truncate(parser->token, 0);
+						parser->token_is_key = TRUE;
+						parser->state = MB_JSON_S_STRING;
+						in_place = TRUE;
+						break;
+
+					case MB_JSON_S_COLON :
+						if(c != ':') {
+							return mb_json_fail(parser, "expecting ':'");
+						}
+						cur++;
+						parser->state = MB_JSON_S_VALUE;
+						break;
+
+					case MB_JSON_S_COMMA_OR_END :
+						cur++;
+						if(c == ',') {
+							parser->state = (parser->stack[parser->depth - 1] == '{') ? MB_JSON_S_KEY : MB_JSON_S_VALUE;
+						} else if( (c == '}') || (c == ']') ) {
+							if(!mb_json_pop(parser, c)) return FALSE;
+						} else {
+							return mb_json_fail(parser, "expecting ',' or end of container");
+						}
+						break;
+
+					case MB_JSON_S_VALUE_OR_END :
+						if(c == ']') {
+							cur++;
+							if(!mb_json_pop(parser, c)) return FALSE;
+							break;
+						}
+						// fall through
+					case MB_JSON_S_VALUE :
+						if( (c == '{') || (c == '[') ) {
+							cur++;
+							if(!mb_json_push(parser, c)) return FALSE;
+						} else if(c == '"') {
+							cur++;
+							g_string_truncate(parser->token, 0);
+							parser->token_is_key = FALSE;
+							parser->state = MB_JSON_S_STRING;
+							in_place = TRUE;
+						} else if( (c == '-') || g_ascii_isdigit(c) || (c == 't') || (c == 'f') || (c == 'n') ) {
+							g_string_truncate(parser->token, 0);
+							parser->state = MB_JSON_S_LITERAL;
+							in_place = TRUE;
+						} else {
+							return mb_json_fail(parser, "expecting value");
+						}
+						break;
+				}
+				break;
+		}
+	}
+	return TRUE;
+}
+
+gboolean mb_json_parser_end(MbJsonParser * parser)
+{
+	if( (parser->state == MB_JSON_S_LITERAL) && (parser->depth == 0) ) {
+		// a top-level number has no delimiter after it
+		mb_json_literal(parser, parser->token->str, parser->token->len);
+	}
+	if(parser->state == MB_JSON_S_ERROR) {
+		return FALSE;
+	}
+	if( (parser->state != MB_JSON_S_VALUE) || (parser->depth > 0) ) {
+		parser->error = "unexpected end of input";
+		return FALSE;
+	}
+	return (parser->values > 0);
+}
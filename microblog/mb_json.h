@@ -0,0 +1,130 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+*
+* Incremental JSON tokenizer for Microblog
+*
+* Input can be fed in pieces of any size, each token is reported to a callback
+* as soon as it's complete. No tree is built.
+*
+*/
+
+#ifndef __MB_JSON__
+#define __MB_JSON__
+
+#include <glib.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MB_JSON_MAX_DEPTH 64
+
+enum MbJsonToken {
+	MB_JSON_OBJECT_START = 0,
+	MB_JSON_OBJECT_END = 1,
+	MB_JSON_ARRAY_START = 2,
+	MB_JSON_ARRAY_END = 3,
+	MB_JSON_KEY = 4, //< member name, value comes as the next token
+	MB_JSON_STRING = 5,
+	MB_JSON_NUMBER = 6, //< text is the number as written, so 64-bit ids are not rounded
+	MB_JSON_TRUE = 7,
+	MB_JSON_FALSE = 8,
+	MB_JSON_NULL = 9,
+};
+
+struct _MbJsonParser;
+
+/*
+	Called for each token
+
+	text is unescaped UTF-8 for keys and strings, literal text for other scalars, NULL for containers.
+	text is only valid during the call and is not NUL-terminated.
+
+	@return TRUE to continue, FALSE to stop parsing
+*/
+typedef gboolean (*MbJsonFunc)(struct _MbJsonParser * parser, gint token, const gchar * text, gint len, gpointer user_data);
+
+typedef struct _MbJsonParser {
+	MbJsonFunc func;
+	gpointer user_data;
+
+	gint state;
+	gint depth; //< number of open containers, including the one being started or ended in callback
+	gchar stack[MB_JSON_MAX_DEPTH]; //< '{' or '[' of each open container
+	GString * token; //< string or literal split between feeds, or containing escapes
+	gboolean token_is_key;
+	guint32 ucs; //< code point of \u escape being read
+	gint ucs_digits;
+	guint32 high_surrogate; //< first half of a surrogate pair, 0 if none
+	guint values; //< number of complete top-level values
+	const gchar * error; //< reason of failure, NULL if no error
+} MbJsonParser;
+
+/*
+	Create new parser
+
+	@param func token callback
+	@param user_data passed to func
+	@return new parser, free with mb_json_parser_free
+*/
+extern MbJsonParser * mb_json_parser_new(MbJsonFunc func, gpointer user_data);
+
+/*
+	Free parser
+*/
+extern void mb_json_parser_free(MbJsonParser * parser);
+
+/*
+	Throw away parser state, ready for new input
+*/
+extern void mb_json_parser_reset(MbJsonParser * parser);
+
+/*
+	Feed next piece of input
+
+	Several top-level values may follow each other, separated by whitespace.
+
+	@return FALSE if input is invalid or callback stopped parsing, parser->error has the reason
+*/
+extern gboolean mb_json_parser_feed(MbJsonParser * parser, const gchar * buf, gint len);
+
+/*
+	Input is complete, flush a pending top-level number
+
+	@return TRUE if input was one or more complete values
+*/
+extern gboolean mb_json_parser_end(MbJsonParser * parser);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,138 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <string.h>
+
+#include "mb_msg.h"
+
+MbMsgBatch * mb_msg_batch_new(void)
+{
+	MbMsgBatch * batch = g_new0(MbMsgBatch, 1);
+
+	return batch;
+}
+
+static void mb_msg_free_strs(GSList * strs)
+{
+	GSList * it;
+
+	for(it = strs; it; it = g_slist_next(it)) {
+		g_free(it->data);
+	}
+	g_slist_free(strs);
+}
+
+void mb_msg_batch_free(MbMsgBatch * batch)
+{
+	mb_msg_free_strs(batch->blocks);
+	mb_msg_free_strs(batch->big_strs);
+	g_free(batch->msgs);
+	g_free(batch);
+}
+
+void mb_msg_batch_clear(MbMsgBatch * batch)
+{
+	GSList * it;
+
+	batch->len = 0;
+	mb_msg_free_strs(batch->big_strs);
+	batch->big_strs = NULL;
+	if(batch->blocks == NULL) {
+		return;
+	}
+	for(it = batch->blocks; it->next; it = batch->blocks) {
+		g_free(it->data);
+		batch->blocks = g_slist_delete_link(batch->blocks, it);
+	}
+	batch->block_cur = batch->blocks->data;
+	batch->block_left = MB_MSG_BLOCK_SIZE;
+}
+
+MbMsg * mb_msg_batch_add(MbMsgBatch * batch)
+{
+	MbMsg * msg;
+
+	if(batch->len == batch->alloc) {
+		batch->alloc = batch->alloc ? batch->alloc * 2 : 32;
+		batch->msgs = g_renew(MbMsg, batch->msgs, batch->alloc);
+	}
+	msg = &batch->msgs[batch->len++];
+	memset(msg, 0, sizeof(MbMsg));
+	return msg;
+}
+
+gchar * mb_msg_batch_strndup(MbMsgBatch * batch, const gchar * str, gsize len)
+{
+	gchar * retval;
+
+	if(len + 1 > batch->block_left) {
+		if(len + 1 > MB_MSG_BLOCK_SIZE / 4) {
+			// don't waste rest of current block for a big string
+			retval = g_malloc(len + 1);
+			batch->big_strs = g_slist_prepend(batch->big_strs, retval);
+			memcpy(retval, str, len);
+			retval[len] = '\0';
+			return retval;
+		}
+		batch->block_cur = g_malloc(MB_MSG_BLOCK_SIZE);
+		batch->block_left = MB_MSG_BLOCK_SIZE;
+		batch->blocks = g_slist_prepend(batch->blocks, batch->block_cur);
+	}
+	retval = batch->block_cur;
+	memcpy(retval, str, len);
+	retval[len] = '\0';
+	batch->block_cur += len + 1;
+	batch->block_left -= len + 1;
+	return retval;
+}
+
+void mb_msg_batch_reverse(MbMsgBatch * batch)
+{
+	MbMsg tmp;
+	guint i, j;
+
+	for(i = 0, j = batch->len; i + 1 < j; i++, j--) {
+		tmp = batch->msgs[i];
+		batch->msgs[i] = batch->msgs[j - 1];
+		batch->msgs[j - 1] = tmp;
+	}
+}
+
+MbMsg * mb_msg_copy(const MbMsg * msg)
+{
+	MbMsg * retval = g_new(MbMsg, 1);
+
+	(*retval) = (*msg);
+	retval->avatar_url = g_strdup(msg->avatar_url);
+	retval->from = g_strdup(msg->from);
+	retval->msg_txt = g_strdup(msg->msg_txt);
+	return retval;
+}
+
+void mb_msg_free(MbMsg * msg)
+{
+	g_free(msg->avatar_url);
+	g_free(msg->from);
+	g_free(msg->msg_txt);
+	g_free(msg);
+}
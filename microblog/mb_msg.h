@@ -0,0 +1,124 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+*
+* Batch of messages decoded from one response
+*
+* Messages are kept in a flat array and all their strings come from a few
+* large blocks, so the whole batch is released at once. Strings of a message
+* in batch must not be freed or replaced, use mb_msg_copy to get a message
+* that can be modified.
+*
+*/
+
+#ifndef __MB_MSG__
+#define __MB_MSG__
+
+#include <glib.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include "twitter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MB_MSG_BLOCK_SIZE 16384
+
+typedef struct _MbMsgBatch {
+	MbMsg * msgs; //< messages, in order they were added
+	guint len;
+	guint alloc; //< allocated size of msgs
+
+	GSList * blocks; //< string blocks of MB_MSG_BLOCK_SIZE, current block first
+	GSList * big_strs; //< strings too big for a block, allocated separately
+	gchar * block_cur; //< free space in current block
+	gsize block_left;
+} MbMsgBatch;
+
+/*
+	Get message at index, pointer is valid until next mb_msg_batch_add
+*/
+#define mb_msg_batch_index(batch, i) (&(batch)->msgs[(i)])
+
+/*
+	Create new empty batch
+
+	@return new batch, free with mb_msg_batch_free
+*/
+extern MbMsgBatch * mb_msg_batch_new(void);
+
+/*
+	Free batch, all messages and strings in it
+*/
+extern void mb_msg_batch_free(MbMsgBatch * batch);
+
+/*
+	Remove all messages, first string block is kept for next use
+*/
+extern void mb_msg_batch_clear(MbMsgBatch * batch);
+
+/*
+	Add new message to batch
+
+	@return zero-filled message, valid until next call
+*/
+extern MbMsg * mb_msg_batch_add(MbMsgBatch * batch);
+
+/*
+	Copy string into batch
+
+	@param str string to copy, needs not to be NUL-terminated
+	@param len length of str
+	@return NUL-terminated copy, lives as long as batch
+*/
+extern gchar * mb_msg_batch_strndup(MbMsgBatch * batch, const gchar * str, gsize len);
+
+/*
+	Reverse order of messages, oldest first becomes newest first like timelines
+*/
+extern void mb_msg_batch_reverse(MbMsgBatch * batch);
+
+/*
+	Copy a message out of batch, every string is allocated separately
+
+	@return new message, free with mb_msg_free
+*/
+extern MbMsg * mb_msg_copy(const MbMsg * msg);
+
+/*
+	Free a message from mb_msg_copy
+*/
+extern void mb_msg_free(MbMsg * msg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -51,18 +51,103 @@
 
 #include <util.h>
 #include <debug.h>
+#include <proxy.h>
+#include <sslconn.h>
+#include <eventloop.h>
 #include "mb_net.h"
+#include "mb_io.h"
+
+#ifdef MB_USE_GNUTLS
+#	include <version.h>
+// private data layout of ssl-gnutls and its deferred handshake are only known for libpurple 2.7.0 up to 2.x
+#	if !PURPLE_VERSION_CHECK(2, 7, 0) || PURPLE_VERSION_CHECK(3, 0, 0)
+#		warning "USE_GNUTLS_RESUME is not supported with this libpurple, TLS session resumption is disabled"
+#		undef MB_USE_GNUTLS
+#	endif
+#endif
+#ifdef MB_USE_GNUTLS
+#	include <plugin.h>
+#	include <gnutls/gnutls.h>
+#endif
+
+enum MbConnState {
+	MB_CONN_CONNECTING = 0,
+	MB_CONN_BUSY = 1,
+	MB_CONN_IDLE = 2,
+};
+
+/*
+	A persistent HTTP/1.1 connection
+*/
+typedef struct _MbConn {
+	MbConnPool * pool;
+	MbAccount * ma;
+	gchar * host;
+	gint port;
+	gboolean is_ssl;
+	gint state;
+
+	gint fd;
+	PurpleSslConnection * ssl;
+	PurpleProxyConnectData * connect_data;
+	guint read_handler;
+	guint write_handler;
+	guint idle_timer;
+	MbHttpRecvBuf recv; //< reads on main loop go through here
+	gint64 connect_start; //< when connecting started, for TLS handshake latency
+	gboolean threaded; //< responses are read by I/O thread
+	MbIoConn * io; //< socket on I/O thread, NULL while connecting or if it couldn't be added
+
+	GQueue * inflight; //< MbConnData sent on this connection, head is the one whose response is being read
+	GList * write_cur; //< link in inflight being written, NULL if all requests are sent
+	gboolean pipe_answered; //< a response was completed while more requests were waiting behind it
+	guint requests; //< number of requests completed on this connection
+} MbConn;
+
+const gchar mb_conn_timeout_error[] = "Request timed out";
+const gchar mb_conn_cancelled_error[] = "Request cancelled";
+
+static guint mb_conn_last_id = 0; //< id of the newest MbConnData
 
 // Caller of request retry function
 static gboolean mb_conn_retry_request(gpointer data);
 // Fetch URL callback
 static void mb_conn_fetch_url_cb(PurpleUtilFetchUrlData * url_data, gpointer user_data, const gchar * url_text, gsize len, const gchar * error_message);
+// Common path after a response is received or the request failed
+static void mb_conn_request_done(MbConnData * conn_data, const gchar * error_message);
+// Hand request to a persistent connection
+static void mb_conn_pool_dispatch(MbConnPool * pool, MbConnData * data);
+static void mb_conn_pool_schedule_pump(MbConnPool * pool);
+static void mb_conn_close(MbConn * conn);
+static void mb_conn_uncoalesce(MbConnData * data);
+static void mb_sched_release(MbConnData * data, gboolean run);
+static void mb_sched_run(void);
+static void mb_breaker_record(MbConnData * data, gboolean failed);
+static void mb_conn_schedule_retry(MbConnData * conn_data);
+static GList * mb_conn_drop(MbConn * conn, const gchar * error_message);
+static gboolean mb_conn_can_resend(MbConnData * conn_data);
+static gint64 mb_sched_now(void);
  
 MbConnData * mb_conn_data_new(MbAccount * ma, const gchar * host, gint port, MbHandlerFunc handler, gboolean is_ssl)
 {
 	MbConnData * conn_data = NULL;
+	MbConnPool * pool = ma->conn_pool;
+	gint i;
 	
-	conn_data = g_new(MbConnData, 1);
+	if(pool && pool->free_data) {
+		// request and response were recycled when this one was freed
+		conn_data = pool->free_data->data;
+		pool->free_data = g_slist_delete_link(pool->free_data, pool->free_data);
+		pool->free_data_len--;
+		pool->stat_data_hit++;
+	} else {
+		conn_data = g_new(MbConnData, 1);
+		conn_data->request = mb_http_data_new();
+		conn_data->response = mb_http_data_new();
+		if(pool) {
+			pool->stat_data_miss++;
+		}
+	}
 	
 	conn_data->host = g_strdup(host);
 	conn_data->port = port;
@@ -75,8 +160,6 @@ MbConnData * mb_conn_data_new(MbAccount * ma, const gchar * host, gint port, MbH
 	conn_data->max_retry = 0;
 	//conn_data->conn_data = NULL;
 	conn_data->is_ssl = is_ssl;
-	conn_data->request = mb_http_data_new();
-	conn_data->response = mb_http_data_new();
 	if(conn_data->is_ssl) {
 		conn_data->request->proto = MB_HTTPS;
 	} else {
@@ -84,6 +167,31 @@ MbConnData * mb_conn_data_new(MbAccount * ma, const gchar * host, gint port, MbH
 	}
 
 	conn_data->fetch_url_data = NULL;
+	conn_data->conn = NULL;
+	conn_data->stale_retried = FALSE;
+	conn_data->is_stream = FALSE;
+	conn_data->sent = FALSE;
+	conn_data->coalesce_key = NULL;
+	conn_data->leader = NULL;
+	conn_data->waiters = NULL;
+	conn_data->shared = FALSE;
+	conn_data->leader_sink = NULL;
+	conn_data->leader_sink_data = NULL;
+	conn_data->priority = MB_PRIO_TIMELINE;
+	conn_data->admitted = FALSE;
+	conn_data->queued_at = 0;
+	conn_data->retry_timer = 0;
+	conn_data->retry_delay = 0;
+	if(++mb_conn_last_id == 0) {
+		mb_conn_last_id++;
+	}
+	conn_data->id = mb_conn_last_id;
+	for(i = 0; i < MB_DEADLINE_MAX; i++) {
+		conn_data->timeout[i] = -1;
+	}
+	conn_data->phase = MB_PHASE_NONE;
+	conn_data->phase_timer = 0;
+	conn_data->total_timer = 0;
 	
 	purple_debug_info(MB_NET, "new: create conn_data = %p\n", conn_data);
 	ma->conn_data_list = g_slist_prepend(ma->conn_data_list, conn_data);
@@ -91,25 +199,187 @@ MbConnData * mb_conn_data_new(MbAccount * ma, const gchar * host, gint port, MbH
 	return conn_data;
 }
 
-void mb_conn_data_free(MbConnData * conn_data)
+/*
+	Leader won't answer identical requests waiting for it, send them on their own unless account is going away
+*/
+static void mb_conn_resend_waiters(MbConnData * conn_data)
 {
-	purple_debug_info(MB_NET, "%s: conn_data = %p\n", __FUNCTION__, conn_data);
+	GList * waiters, * it;
+
+	waiters = conn_data->waiters;
+	conn_data->waiters = NULL;
+	for(it = waiters; it; it = g_list_next(it)) {
+		((MbConnData *)it->data)->leader = NULL;
+	}
+	for(it = waiters; it; it = g_list_next(it)) {
+		if(conn_data->ma->state != PURPLE_DISCONNECTED) {
+			mb_conn_process_request(it->data);
+		}
+	}
+	g_list_free(waiters);
+}
+
+static void mb_conn_clear_deadlines(MbConnData * conn_data)
+{
+	if(conn_data->phase_timer) {
+		purple_timeout_remove(conn_data->phase_timer);
+		conn_data->phase_timer = 0;
+	}
+	if(conn_data->total_timer) {
+		purple_timeout_remove(conn_data->total_timer);
+		conn_data->total_timer = 0;
+	}
+	conn_data->phase = MB_PHASE_NONE;
+}
+
+/*
+	Take request off whatever is sending it, without calling handler
+*/
+static void mb_conn_detach(MbConnData * conn_data)
+{
+	MbConn * conn;
 
+	mb_conn_clear_deadlines(conn_data);
+	if(conn_data->retry_timer) {
+		purple_timeout_remove(conn_data->retry_timer);
+		conn_data->retry_timer = 0;
+	}
 	if(conn_data->fetch_url_data) {
 		purple_util_fetch_url_cancel(conn_data->fetch_url_data);
+		conn_data->fetch_url_data = NULL;
+	}
+
+	if(conn_data->conn) {
+		// connection is in the middle of this request, it can't be reused
+		// other requests pipelined on it go back to wait for another connection
+		conn = conn_data->conn;
+		conn_data->conn = NULL;
+		g_queue_remove(conn->inflight, conn_data);
+		mb_conn_drop(conn, NULL);
+		mb_conn_pool_schedule_pump(conn_data->ma->conn_pool);
+	} else if(conn_data->ma->conn_pool) {
+		g_queue_remove(conn_data->ma->conn_pool->wait_queue, conn_data);
+		conn_data->ma->conn_pool->batch = g_list_remove(conn_data->ma->conn_pool->batch, conn_data);
+	}
+}
+
+/*
+	Fail request with error_message wherever it is
+*/
+static void mb_conn_abort(MbConnData * conn_data, const gchar * error_message)
+{
+	MbConnPool * pool = conn_data->ma->conn_pool;
+
+	if(pool) {
+		if(error_message == mb_conn_cancelled_error) {
+			pool->stat_cancelled++;
+		} else {
+			pool->stat_timeouts++;
+		}
+	}
+	mb_conn_detach(conn_data);
+	mb_conn_request_done(conn_data, error_message);
+}
+
+static gboolean mb_conn_phase_timeout_cb(gpointer data)
+{
+	MbConnData * conn_data = (MbConnData *)data;
+
+	purple_debug_info(MB_NET, "%p got no %s in %d seconds\n", conn_data, (conn_data->phase == MB_PHASE_CONNECT) ? "connection" : "response",
+			conn_data->timeout[(conn_data->phase == MB_PHASE_CONNECT) ? MB_DEADLINE_CONNECT : MB_DEADLINE_TTFB]);
+	conn_data->phase_timer = 0;
+	mb_conn_abort(conn_data, mb_conn_timeout_error);
+	return FALSE;
+}
+
+static gboolean mb_conn_total_timeout_cb(gpointer data)
+{
+	MbConnData * conn_data = (MbConnData *)data;
+
+	purple_debug_info(MB_NET, "%p not finished in %d seconds\n", conn_data, conn_data->timeout[MB_DEADLINE_TOTAL]);
+	conn_data->total_timer = 0;
+	mb_conn_abort(conn_data, mb_conn_timeout_error);
+	return FALSE;
+}
+
+/*
+	Move request to next phase, the deadline of that phase starts now
+*/
+static void mb_conn_set_phase(MbConnData * conn_data, gint phase)
+{
+	gint timeout = 0;
+
+	if(conn_data->phase_timer) {
+		purple_timeout_remove(conn_data->phase_timer);
+		conn_data->phase_timer = 0;
 	}
+	conn_data->phase = phase;
+	if(phase == MB_PHASE_CONNECT) {
+		timeout = conn_data->timeout[MB_DEADLINE_CONNECT];
+	} else if(phase == MB_PHASE_WAIT) {
+		timeout = conn_data->timeout[MB_DEADLINE_TTFB];
+	}
+	if(timeout > 0) {
+		conn_data->phase_timer = purple_timeout_add_seconds(timeout, mb_conn_phase_timeout_cb, conn_data);
+	}
+}
+
+/*
+	Start deadlines of admitted request
+
+	@param own_connection whether it goes through MbConn, purple_util_fetch_url doesn't tell when it's connected so only total deadline applies there
+*/
+static void mb_conn_arm_deadlines(MbConnData * conn_data, gboolean own_connection)
+{
+	MbConnPool * pool = conn_data->ma->conn_pool;
+	gint i;
+
+	for(i = 0; i < MB_DEADLINE_MAX; i++) {
+		if(conn_data->timeout[i] < 0) {
+			conn_data->timeout[i] = pool ? pool->timeout[conn_data->priority][i] : 0;
+		}
+	}
+	mb_conn_clear_deadlines(conn_data);
+	if(conn_data->timeout[MB_DEADLINE_TOTAL] > 0) {
+		conn_data->total_timer = purple_timeout_add_seconds(conn_data->timeout[MB_DEADLINE_TOTAL], mb_conn_total_timeout_cb, conn_data);
+	}
+	mb_conn_set_phase(conn_data, own_connection ? MB_PHASE_CONNECT : MB_PHASE_BODY);
+}
+
+gboolean mb_conn_cancel(MbAccount * ma, guint id)
+{
+	GSList * it;
+
+	for(it = ma->conn_data_list; it; it = g_slist_next(it)) {
+		if(((MbConnData *)it->data)->id == id) {
+			purple_debug_info(MB_NET, "cancelling %p\n", it->data);
+			mb_conn_abort(it->data, mb_conn_cancelled_error);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void mb_conn_data_free(MbConnData * conn_data)
+{
+	MbConnPool * pool;
+
+	purple_debug_info(MB_NET, "%s: conn_data = %p\n", __FUNCTION__, conn_data);
+
+	// requests of a closing account must not take the freed place
+	mb_sched_release(conn_data, conn_data->ma->state != PURPLE_DISCONNECTED);
+	mb_conn_uncoalesce(conn_data);
+	if(conn_data->waiters) {
+		mb_conn_resend_waiters(conn_data);
+	}
+	mb_conn_detach(conn_data);
 
 	if(conn_data->host) {
 		purple_debug_info(MB_NET, "freeing host name\n");
 		g_free(conn_data->host);
+		conn_data->host = NULL;
 	}
 
-	purple_debug_info(MB_NET, "freeing HTTP data->response\n");
-	if(conn_data->response)	mb_http_data_free(conn_data->response);
-
-	purple_debug_info(MB_NET, "freeing HTTP data->request\n");
-	if(conn_data->request)	mb_http_data_free(conn_data->request);
-
 	purple_debug_info(MB_NET, "unregistering conn_data from MbAccount\n");
 	if(conn_data->ma->conn_data_list) {
 		GSList * list = g_slist_find(conn_data->ma->conn_data_list, conn_data);
@@ -117,6 +387,29 @@ void mb_conn_data_free(MbConnData * conn_data)
 			conn_data->ma->conn_data_list = g_slist_delete_link(conn_data->ma->conn_data_list, list);
 		}
 	}
+
+	pool = conn_data->ma->conn_pool;
+	if(pool && conn_data->request && conn_data->response && (pool->free_data_len < MB_CONN_DATA_FREE_MAX)) {
+		// keep it for the next request, header tables and buffers stay allocated
+		purple_debug_info(MB_NET, "recycling conn_data %p\n", conn_data);
+		mb_http_data_recycle(conn_data->request);
+		mb_http_data_recycle(conn_data->response);
+		conn_data->fetch_url_data = NULL;
+		conn_data->handler = NULL;
+		conn_data->handler_data = NULL;
+		conn_data->prepare_handler = NULL;
+		conn_data->prepare_handler_data = NULL;
+		pool->free_data = g_slist_prepend(pool->free_data, conn_data);
+		pool->free_data_len++;
+		return;
+	}
+
+	purple_debug_info(MB_NET, "freeing HTTP data->response\n");
+	if(conn_data->response)	mb_http_data_free(conn_data->response);
+
+	purple_debug_info(MB_NET, "freeing HTTP data->request\n");
+	if(conn_data->request)	mb_http_data_free(conn_data->request);
+
 	purple_debug_info(MB_NET, "freeing self at %p\n", conn_data);
 	g_free(conn_data);
 }
@@ -149,26 +442,86 @@ gchar * mb_conn_url_unparse(MbConnData * data)
 }
 
 
-void mb_conn_fetch_url_cb(PurpleUtilFetchUrlData * url_data, gpointer user_data, const gchar * url_text, gsize len, const gchar * error_message)
+/*
+	Give final response of leader to requests waiting on it, before handler of leader might take content away
+
+	Leader has used up retries for all of them when it fails, so waiters don't retry on their own.
+*/
+static void mb_conn_answer_waiters(MbConnData * leader, const gchar * error_message)
+{
+	GList * waiters = leader->waiters, * it;
+	MbConnData * waiter;
+
+	leader->waiters = NULL;
+	for(it = waiters; it; it = g_list_next(it)) {
+		((MbConnData *)it->data)->leader = NULL;
+	}
+	for(it = waiters; it; it = g_list_next(it)) {
+		waiter = it->data;
+		if(!error_message) {
+			mb_http_data_copy_response(waiter->response, leader->response);
+			waiter->shared = TRUE;
+		} else {
+			waiter->retry = MAX(waiter->retry, waiter->max_retry);
+		}
+		mb_conn_request_done(waiter, error_message);
+	}
+	g_list_free(waiters);
+}
+
+/*
+	Whether request can be sent again after a network error without repeating what it did
+*/
+static gboolean mb_conn_can_resend(MbConnData * conn_data)
+{
+	return (conn_data->request->type == HTTP_GET) || !conn_data->sent;
+}
+
+static void mb_conn_request_done(MbConnData * conn_data, const gchar * error_message)
 {
-	MbConnData * conn_data = (MbConnData *)user_data;
 	MbAccount * ma = conn_data->ma;
+	GList * it;
 	gint retval;
 
-	purple_debug_info(MB_NET, "%s: url_data = %p\n", __FUNCTION__, url_data);
-	// in whatever situation, url_data should be handled only by libpurple
-	conn_data->fetch_url_data = NULL;
-
+	mb_conn_clear_deadlines(conn_data);
+	// only requests which really went to the host tell about its health
+	if(conn_data->admitted && (error_message != mb_conn_cancelled_error)) {
+		mb_breaker_record(conn_data, (error_message != NULL) || (conn_data->response->status >= 500));
+	}
+	// next requests can go while handlers run, identical GETs from now on need a new response
+	mb_sched_release(conn_data, TRUE);
+	mb_conn_uncoalesce(conn_data);
+	if(conn_data->waiters && (error_message == mb_conn_cancelled_error) ) {
+		// only this one was cancelled
+		mb_conn_resend_waiters(conn_data);
+	}
 	if(error_message != NULL) {
+		// network error or deadline, handler only sees it once retries are used up
+		// a POST which might have reached the server goes to handler right away, it must not be posted twice
+		// cancelled request is never retried
+		if(!conn_data->is_stream && (error_message != mb_conn_cancelled_error) && mb_conn_can_resend(conn_data) &&
+				(conn_data->retry < conn_data->max_retry) && (ma->state != PURPLE_DISCONNECTED)) {
+			conn_data->retry++;
+			purple_debug_info(MB_NET, "network error on %p: %s, retry %d, max_retry = %d\n", conn_data, error_message, conn_data->retry, conn_data->max_retry);
+			// waiters stay with it and see the response of the retry from the beginning
+			for(it = conn_data->waiters; it; it = g_list_next(it)) {
+				mb_http_data_truncate(((MbConnData *)it->data)->response);
+			}
+			mb_conn_schedule_retry(conn_data);
+			return;
+		}
+		if(conn_data->waiters) {
+			mb_conn_answer_waiters(conn_data, error_message);
+		}
+		// account stays online, breaker and scheduler back off from a failing host
 		if(conn_data->handler) {
 			retval = conn_data->handler(conn_data, conn_data->handler_data, error_message);
 		}
-		if(ma->gc != NULL) {
-			purple_connection_error_reason(ma->gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, error_message);
-		}
         mb_conn_data_free(conn_data);
 	} else {
-		mb_http_data_post_read(conn_data->response, url_text, len);
+		if(conn_data->waiters) {
+			mb_conn_answer_waiters(conn_data, NULL);
+		}
 		if(conn_data->handler) {
 
 			purple_debug_info(MB_NET, "going to call handler\n");
@@ -184,9 +537,7 @@ void mb_conn_fetch_url_cb(PurpleUtilFetchUrlData * url_data, gpointer user_data,
 				conn_data->retry++;
 				if(conn_data->retry <= conn_data->max_retry) {
 					purple_debug_info(MB_NET, "handler return -1, conn_data %p, retry %d, max_retry = %d\n", conn_data, conn_data->retry, conn_data->max_retry);
-					mb_http_data_truncate(conn_data->response);
-					// retry again in 1 second
-					purple_timeout_add_seconds(1, mb_conn_retry_request, conn_data);
+					mb_conn_schedule_retry(conn_data);
 				} else {
 					purple_debug_info(MB_NET, "retry exceed %d > %d\n", conn_data->retry, conn_data->max_retry);
 					mb_conn_data_free(conn_data);
@@ -196,31 +547,1554 @@ void mb_conn_fetch_url_cb(PurpleUtilFetchUrlData * url_data, gpointer user_data,
 	}
 }
 
-static gboolean mb_conn_retry_request(gpointer data)
+void mb_conn_fetch_url_cb(PurpleUtilFetchUrlData * url_data, gpointer user_data, const gchar * url_text, gsize len, const gchar * error_message)
 {
-	MbConnData * conn_data = (MbConnData *)data;
+	MbConnData * conn_data = (MbConnData *)user_data;
 
-	mb_conn_process_request(conn_data);
-	return FALSE;
+	purple_debug_info(MB_NET, "%s: url_data = %p\n", __FUNCTION__, url_data);
+	// in whatever situation, url_data should be handled only by libpurple
+	conn_data->fetch_url_data = NULL;
+
+	if(error_message == NULL) {
+		mb_http_data_post_read(conn_data->response, url_text, len);
+	}
+	mb_conn_request_done(conn_data, error_message);
 }
 
-void mb_conn_process_request(MbConnData * data)
+/*
+	Request scheduler, shared by all accounts
+*/
+static GList * mb_sched_pools = NULL; //< every MbConnPool, the one served last goes to the end
+static GHashTable * mb_sched_hosts = NULL; //< "host:port:ssl" -> requests in flight by all accounts
+static gboolean mb_sched_running = FALSE;
+static gboolean mb_sched_again = FALSE;
+static GHashTable * mb_breakers = NULL; //< "host:port:ssl" -> MbBreaker, hosts which failed at least once
+#ifdef MB_USE_GNUTLS
+static GHashTable * mb_tls_sessions = NULL; //< "host:port" -> gnutls_datum_t, last TLS session of host
+#endif
+
+/*
+	Persistent connection pool
+*/
+MbConnPool * mb_conn_pool_new(void)
 {
-	gchar * url;
+	MbConnPool * pool = g_new0(MbConnPool, 1);
+	gint i;
 
-	purple_debug_info(MB_NET, "NEW mb_conn_process_request, conn_data = %p\n", data);
+	pool->conns = NULL;
+	pool->wait_queue = g_queue_new();
+	pool->max_per_host = MB_CONN_MAX_PER_HOST;
+	pool->idle_timeout = MB_CONN_IDLE_TIMEOUT;
+	pool->no_pipeline = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	// keys belong to MbConnData
+	pool->pending = g_hash_table_new(g_str_hash, g_str_equal);
+	for(i = 0; i < MB_PRIO_MAX; i++) {
+		pool->sched_queue[i] = g_queue_new();
+	}
+	pool->max_in_flight = MB_SCHED_MAX_IN_FLIGHT;
+	pool->max_host_in_flight = MB_SCHED_MAX_PER_HOST;
+	mb_conn_pool_set_timeouts(pool, MB_PRIO_INTERACTIVE, MB_TIMEOUT_CONNECT, MB_TIMEOUT_TTFB / 2, MB_TIMEOUT_TOTAL / 2);
+	mb_conn_pool_set_timeouts(pool, MB_PRIO_TIMELINE, MB_TIMEOUT_CONNECT, MB_TIMEOUT_TTFB, MB_TIMEOUT_TOTAL);
+	// backfill pages are big and nobody waits for them
+	mb_conn_pool_set_timeouts(pool, MB_PRIO_BACKGROUND, MB_TIMEOUT_CONNECT, MB_TIMEOUT_TTFB, MB_TIMEOUT_TOTAL * 2);
+	mb_sched_pools = g_list_append(mb_sched_pools, pool);
+	return pool;
+}
 
-	purple_debug_info(MB_NET, "connecting to %s on port %hd\n", data->host, data->port);
+void mb_conn_pool_free(MbConnPool * pool)
+{
+	GSList * it;
+	MbConnData * conn_data;
+	gint i;
 
-	if(data->prepare_handler) {
-		data->prepare_handler(data, data->prepare_handler_data, NULL);
+	purple_debug_info(MB_NET, "%s: %u new, %u reused, %u pipelined, %u stale, %u idle closed, %u data hit, %u data miss, %u coalesced\n", __FUNCTION__,
+			pool->stat_new, pool->stat_reused, pool->stat_pipelined, pool->stat_stale, pool->stat_idle_closed,
+			pool->stat_data_hit, pool->stat_data_miss, pool->stat_coalesced);
+	if(pool->pump_timer) {
+		purple_timeout_remove(pool->pump_timer);
 	}
-	url = mb_conn_url_unparse(data);
+	while(pool->conns) {
+		mb_conn_close(pool->conns->data);
+	}
+	for(it = pool->free_data; it; it = g_slist_next(it)) {
+		conn_data = it->data;
+		mb_http_data_free(conn_data->request);
+		mb_http_data_free(conn_data->response);
+		g_free(conn_data);
+	}
+	g_slist_free(pool->free_data);
+	g_list_free(pool->batch);
+	g_queue_free(pool->wait_queue);
+	g_hash_table_destroy(pool->no_pipeline);
+	g_hash_table_destroy(pool->pending);
+	for(i = 0; i < MB_PRIO_MAX; i++) {
+		g_queue_free(pool->sched_queue[i]);
+	}
+	mb_sched_pools = g_list_remove(mb_sched_pools, pool);
+	if(!mb_sched_pools) {
+		// last account is gone
+		if(mb_breakers) {
+			g_hash_table_destroy(mb_breakers);
+			mb_breakers = NULL;
+		}
+		if(mb_sched_hosts) {
+			g_hash_table_destroy(mb_sched_hosts);
+			mb_sched_hosts = NULL;
+		}
+#ifdef MB_USE_GNUTLS
+		if(mb_tls_sessions) {
+			g_hash_table_destroy(mb_tls_sessions);
+			mb_tls_sessions = NULL;
+		}
+#endif
+	}
+	g_free(pool);
+}
 
-	// we manage user_agent by ourself so ignore this completely
-	mb_http_data_prepare_write(data->request);
-	data->fetch_url_data = purple_util_fetch_url_request(url, TRUE, "", TRUE, data->request->packet, TRUE, mb_conn_fetch_url_cb, (gpointer)data);
-	g_free(url);
+void mb_conn_pool_set_timeouts(MbConnPool * pool, gint priority, gint connect, gint ttfb, gint total)
+{
+	pool->timeout[priority][MB_DEADLINE_CONNECT] = connect;
+	pool->timeout[priority][MB_DEADLINE_TTFB] = ttfb;
+	pool->timeout[priority][MB_DEADLINE_TOTAL] = total;
+}
+
+guint mb_conn_pool_count(MbConnPool * pool, gboolean idle_only)
+{
+	GList * it;
+	guint count = 0;
+
+	for(it = pool->conns; it; it = g_list_next(it)) {
+		if(!idle_only || ( ((MbConn *)it->data)->state == MB_CONN_IDLE) ) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/*
+	Whether response of data should be read by I/O thread
+
+	SSL connections are read through libpurple, content sinks and streams are called as bytes arrive,
+	those are all kept on main loop.
+*/
+static gboolean mb_conn_wants_io(MbConnData * data)
+{
+	return data->ma->use_io && !data->is_ssl && !data->is_stream && !data->response->content_sink;
+}
+
+static gboolean mb_conn_match(MbConn * conn, MbConnData * data)
+{
+	return (conn->port == data->port) && (conn->is_ssl == data->is_ssl) && (strcmp(conn->host, data->host) == 0) &&
+			(conn->threaded == mb_conn_wants_io(data));
+}
+
+static gboolean mb_conn_data_same_host(MbConnData * a, MbConnData * b)
+{
+	return (a->port == b->port) && (a->is_ssl == b->is_ssl) && (strcmp(a->host, b->host) == 0) &&
+			(mb_conn_wants_io(a) == mb_conn_wants_io(b));
+}
+
+static gchar * mb_conn_host_key(const gchar * host, gint port, gboolean is_ssl)
+{
+	return g_strdup_printf("%s:%d:%d", host, port, is_ssl ? 1 : 0);
+}
+
+/*
+	Whether data can be sent behind other requests on the same connection
+*/
+static gboolean mb_conn_can_pipeline(MbConnPool * pool, MbConnData * data)
+{
+	gchar * key;
+	gboolean retval;
+
+	// only idempotent requests, a POST might be repeated if the pipeline is broken
+	if(data->request->type != HTTP_GET) {
+		return FALSE;
+	}
+	// stream response never ends, nothing behind it would be answered
+	if(data->is_stream) {
+		return FALSE;
+	}
+	key = mb_conn_host_key(data->host, data->port, data->is_ssl);
+	retval = (g_hash_table_lookup(pool->no_pipeline, key) == NULL);
+	g_free(key);
+	return retval;
+}
+
+/*
+	Detach the request from the connection and rewind it, so it can be sent again
+*/
+static void mb_conn_rewind(MbConnData * data)
+{
+	data->conn = NULL;
+	if(data->request->packet) {
+		data->request->cur_packet = data->request->packet;
+		data->request->write_offset = 0;
+	}
+	mb_http_data_truncate(data->response);
+	if(data->phase != MB_PHASE_NONE) {
+		// waits for a connection again
+		mb_conn_set_phase(data, MB_PHASE_CONNECT);
+	}
+}
+
+#ifdef MB_USE_GNUTLS
+/*
+	TLS session resumption through libpurple's GnuTLS plugin
+
+	libpurple has no API for TLS sessions. This relies on the plugin keeping gnutls_session_t as the
+	first member of PurpleSslConnection::private_data, and on it starting the handshake from a timeout
+	after purple_ssl_connect_with_host_fd returns (libpurple 2.7.0 and later). The last session of each
+	host:port is offered to the next connection there, by any account.
+*/
+static void mb_tls_datum_free(gpointer data)
+{
+	gnutls_datum_t * datum = data;
+
+	gnutls_free(datum->data);
+	g_free(datum);
+}
+
+/*
+	Whether TLS connections are made by GnuTLS plugin of a libpurple known to lay out its data as expected
+*/
+static gboolean mb_tls_usable(void)
+{
+	PurplePlugin * gnutls, * nss;
+
+	// libpurple loaded at run time may differ from headers it was built with
+	if(purple_version_check(2, 7, 0) != NULL) {
+		return FALSE;
+	}
+	gnutls = purple_plugins_find_with_id("ssl-gnutls");
+	nss = purple_plugins_find_with_id("ssl-nss");
+	return gnutls && purple_plugin_is_loaded(gnutls) && !(nss && purple_plugin_is_loaded(nss));
+}
+
+static gnutls_session_t mb_tls_session(PurpleSslConnection * ssl)
+{
+	return *((gnutls_session_t *)ssl->private_data);
+}
+
+/*
+	Offer cached session of host to a handshake that's not started yet
+*/
+static void mb_tls_restore(MbConn * conn)
+{
+	gnutls_datum_t * datum;
+	gchar * key;
+
+	if(!mb_tls_sessions || !conn->ssl->private_data) {
+		return;
+	}
+	key = g_strdup_printf("%s:%d", conn->host, conn->port);
+	if( (datum = g_hash_table_lookup(mb_tls_sessions, key)) != NULL) {
+		gnutls_session_set_data(mb_tls_session(conn->ssl), datum->data, datum->size);
+	}
+	g_free(key);
+}
+
+/*
+	Keep session of established connection for next one
+
+	Called after handshake and again before closing, TLS 1.3 tickets only arrive after handshake.
+*/
+static void mb_tls_save(MbConn * conn)
+{
+	gnutls_datum_t * datum = g_new0(gnutls_datum_t, 1);
+
+	if(gnutls_session_get_data2(mb_tls_session(conn->ssl), datum) != GNUTLS_E_SUCCESS) {
+		g_free(datum);
+		return;
+	}
+	if(!mb_tls_sessions) {
+		mb_tls_sessions = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, mb_tls_datum_free);
+	}
+	g_hash_table_replace(mb_tls_sessions, g_strdup_printf("%s:%d", conn->host, conn->port), datum);
+}
+#endif
+
+/*
+	Take socket back from I/O thread, responses in flight are safe to touch afterwards
+*/
+static void mb_conn_io_stop(MbConn * conn)
+{
+	if(conn->io) {
+		mb_io_remove(conn->io);
+		conn->io = NULL;
+	}
+}
+
+static void mb_conn_close(MbConn * conn)
+{
+	MbConnData * data;
+
+	purple_debug_info(MB_NET, "closing connection %p to %s:%d after %u requests\n", conn, conn->host, conn->port, conn->requests);
+	mb_conn_io_stop(conn);
+	conn->pool->conns = g_list_remove(conn->pool->conns, conn);
+	while( (data = g_queue_pop_head(conn->inflight)) != NULL) {
+		data->conn = NULL;
+	}
+	g_queue_free(conn->inflight);
+	if(conn->idle_timer) {
+		purple_timeout_remove(conn->idle_timer);
+	}
+	if(conn->read_handler) {
+		purple_input_remove(conn->read_handler);
+	}
+	if(conn->write_handler) {
+		purple_input_remove(conn->write_handler);
+	}
+	if(conn->connect_data) {
+		purple_proxy_connect_cancel(conn->connect_data);
+	}
+#ifdef MB_USE_GNUTLS
+	if(conn->ssl && (conn->state != MB_CONN_CONNECTING) && mb_tls_usable()) {
+		mb_tls_save(conn);
+	}
+#endif
+	if(conn->ssl) {
+		purple_ssl_close(conn->ssl);
+	} else if(conn->fd >= 0) {
+		close(conn->fd);
+	}
+	mb_http_recv_free(&conn->recv);
+	g_free(conn->host);
+	g_free(conn);
+}
+
+static gboolean mb_conn_idle_timeout_cb(gpointer data)
+{
+	MbConn * conn = data;
+
+	conn->idle_timer = 0;
+	conn->pool->stat_idle_closed++;
+	mb_conn_close(conn);
+	return FALSE;
+}
+
+/*
+	All requests are answered, keep connection for later use
+*/
+static void mb_conn_set_idle(MbConn * conn)
+{
+	conn->state = MB_CONN_IDLE;
+	conn->write_cur = NULL;
+	conn->pipe_answered = FALSE;
+	conn->idle_timer = purple_timeout_add_seconds(conn->pool->idle_timeout, mb_conn_idle_timeout_cb, conn);
+}
+
+/*
+	Close connection, requests still in flight are either requeued or failed
+
+	The head request is failed with error_message, unless it's a request on a reused connection which
+	got no response at all and can be sent again. Requests behind it never had a chance, they are put back
+	to wait_queue, only GETs are pipelined.
+
+	@param error_message reason of closing, NULL to requeue every request
+	@return list of MbConnData to be failed with error_message, caller must call mb_conn_request_done for each
+*/
+static GList * mb_conn_drop(MbConn * conn, const gchar * error_message)
+{
+	MbConnPool * pool = conn->pool;
+	MbConnData * data;
+	GList * requeue = NULL, * failed = NULL, * it;
+	gboolean head = TRUE;
+
+	mb_conn_io_stop(conn);
+	while( (data = g_queue_pop_head(conn->inflight)) != NULL) {
+		if(!error_message || !head) {
+			requeue = g_list_prepend(requeue, data);
+		} else if( (conn->requests > 0) && !data->stale_retried && (data->response->state == MB_HTTP_STATE_INIT) && mb_conn_can_resend(data) ) {
+			// server closed the reused connection before our request reach it, just reconnect
+			// a POST already written might have been acted on, it's failed instead
+			purple_debug_info(MB_NET, "reused connection is stale, reconnecting for %p\n", data);
+			pool->stat_stale++;
+			data->stale_retried = TRUE;
+			requeue = g_list_prepend(requeue, data);
+		} else {
+			data->conn = NULL;
+			failed = g_list_append(failed, data);
+		}
+		head = FALSE;
+	}
+	// requeue is in reverse order, so pushing each to head keeps the original order
+	for(it = requeue; it; it = g_list_next(it)) {
+		mb_conn_rewind(it->data);
+		g_queue_push_head(pool->wait_queue, it->data);
+	}
+	g_list_free(requeue);
+	mb_conn_close(conn);
+	return failed;
+}
+
+/*
+	Find an idle connection for data
+
+	@param count if not NULL, set to number of connections opened to the same host
+	@return idle connection, or NULL if all connections are busy
+*/
+static MbConn * mb_conn_pool_find_idle(MbConnPool * pool, MbConnData * data, gint * count)
+{
+	GList * it;
+	MbConn * conn;
+	gint n = 0;
+
+	for(it = pool->conns; it; it = g_list_next(it)) {
+		conn = it->data;
+		if(!mb_conn_match(conn, data)) {
+			continue;
+		}
+		if(conn->state == MB_CONN_IDLE) {
+			return conn;
+		}
+		n++;
+	}
+	if(count) {
+		(*count) = n;
+	}
+	return NULL;
+}
+
+/*
+	Dispatch waiting requests which can be served now
+*/
+static void mb_conn_pool_pump(MbConnPool * pool)
+{
+	GList * it, * next;
+	MbConnData * data;
+	gint count;
+
+	for(it = pool->wait_queue->head; it; it = next) {
+		next = it->next;
+		data = it->data;
+		if(mb_conn_pool_find_idle(pool, data, &count) || (count < pool->max_per_host) ) {
+			g_queue_delete_link(pool->wait_queue, it);
+			mb_conn_pool_dispatch(pool, data);
+			// dispatch might change the queue, start over
+			next = pool->wait_queue->head;
+		}
+	}
+}
+
+static gboolean mb_conn_pool_pump_cb(gpointer data)
+{
+	MbConnPool * pool = data;
+
+	pool->pump_timer = 0;
+	mb_conn_pool_pump(pool);
+	return FALSE;
+}
+
+/*
+	Pump from main loop, for places where dispatching right away is not safe
+*/
+static void mb_conn_pool_schedule_pump(MbConnPool * pool)
+{
+	if(!pool->pump_timer) {
+		pool->pump_timer = purple_timeout_add(0, mb_conn_pool_pump_cb, pool);
+	}
+}
+
+/*
+	Fail each request in list, then free the list
+*/
+static void mb_conn_fail_list(GList * failed, const gchar * error_message)
+{
+	GList * it;
+
+	for(it = failed; it; it = g_list_next(it)) {
+		mb_conn_request_done(it->data, error_message);
+	}
+	g_list_free(failed);
+}
+
+/*
+	Connection is broken while serving requests
+*/
+static void mb_conn_broken(MbConn * conn, const gchar * error_message)
+{
+	MbConnPool * pool = conn->pool;
+
+	mb_conn_fail_list(mb_conn_drop(conn, error_message), error_message);
+	mb_conn_pool_pump(pool);
+}
+
+/*
+	Whether connection can stay open after response
+*/
+static gboolean mb_conn_response_keep(MbHttpData * response)
+{
+	const gchar * connection;
+
+	connection = mb_http_data_get_header(response, "Connection");
+	if(connection && (g_ascii_strncasecmp(connection, "close", 5) == 0)) {
+		return FALSE;
+	}
+	// body was delimited by closing the connection
+	return !( (response->body_expected < 0) && !response->chunked_content && (response->status != 204) && (response->status != HTTP_MOVED_TEMPORARILY) );
+}
+
+/*
+	Head request got its whole response, take it off the connection
+
+	@return the finished MbConnData
+*/
+static MbConnData * mb_conn_pop_finished(MbConn * conn)
+{
+	MbConnData * data = g_queue_pop_head(conn->inflight);
+
+	data->conn = NULL;
+	conn->requests++;
+	if(!g_queue_is_empty(conn->inflight)) {
+		conn->pipe_answered = TRUE;
+	}
+	return data;
+}
+
+/*
+	Take finished head request off connection
+
+	@param done list the request is appended to
+	@return FALSE if connection can't be kept for more requests
+*/
+static gboolean mb_conn_finish_head(MbConn * conn, GList ** done)
+{
+	MbConnData * data = g_queue_peek_head(conn->inflight);
+	gboolean keep = TRUE;
+
+	if(conn->write_cur && (conn->write_cur->data == data) ) {
+		// server answered before the whole request is sent, the rest can't be sent anymore
+		keep = FALSE;
+	}
+	if(!mb_conn_response_keep(data->response)) {
+		keep = FALSE;
+	}
+	(*done) = g_list_append(*done, mb_conn_pop_finished(conn));
+	return keep;
+}
+
+/*
+	Finish with connection after reading, then complete requests
+
+	@param done finished MbConnData, already taken off connection
+	@param keep FALSE if connection must be closed
+	@param error_message reason of closing
+*/
+static void mb_conn_read_done(MbConn * conn, GList * done, gboolean keep, const gchar * error_message)
+{
+	MbConnPool * pool = conn->pool;
+	GList * failed = NULL, * it;
+	gchar * key;
+
+	// Finish with connection before calling handlers, they might queue new requests
+	if(keep) {
+		if(g_queue_is_empty(conn->inflight)) {
+			mb_conn_set_idle(conn);
+		}
+	} else {
+		if(conn->pipe_answered && !g_queue_is_empty(conn->inflight)) {
+			// server gave up in the middle of a pipeline, send requests to this host one by one from now on
+			purple_debug_info(MB_NET, "%s:%d closed connection with %u requests pending, disable pipelining\n",
+					conn->host, conn->port, g_queue_get_length(conn->inflight));
+			key = mb_conn_host_key(conn->host, conn->port, conn->is_ssl);
+			g_hash_table_replace(pool->no_pipeline, key, GINT_TO_POINTER(TRUE));
+			// those requests were never answered, just send them again
+			error_message = NULL;
+		}
+		failed = mb_conn_drop(conn, error_message);
+	}
+
+	for(it = done; it; it = g_list_next(it)) {
+		mb_conn_request_done(it->data, NULL);
+	}
+	g_list_free(done);
+	mb_conn_fail_list(failed, error_message);
+	mb_conn_pool_pump(pool);
+}
+
+static void mb_conn_do_read(MbConn * conn)
+{
+	MbConnData * data;
+	MbHttpData * response;
+	gchar * buf;
+	gint retval, len, pos, consumed;
+	gboolean keep = TRUE;
+	GList * done = NULL;
+	const gchar * error_message = NULL;
+
+	// Responses come back in the order requests were sent, so each chunk of bytes
+	// is fed to the head of inflight until its response is complete, then to the next one
+	while(keep) {
+		data = g_queue_peek_head(conn->inflight);
+		response = data ? data->response : NULL;
+		buf = mb_http_recv_prepare(&conn->recv, response, &len);
+		retval = conn->ssl ? purple_ssl_read(conn->ssl, buf, len) : read(conn->fd, buf, len);
+		len = mb_http_recv_done(&conn->recv, response, retval);
+		if( (retval < 0) && (errno == EAGAIN) ) {
+			break;
+		}
+		if(retval <= 0) {
+			error_message = (retval < 0) ? g_strerror(errno) : _("Connection closed by server");
+			data = g_queue_peek_head(conn->inflight);
+			if( (retval == 0) && data && (data->response->state == MB_HTTP_STATE_CONTENT) &&
+					(data->response->body_expected < 0) && !data->response->chunked_content) {
+				// body was delimited by closing the connection
+				data->response->state = MB_HTTP_STATE_FINISHED;
+				done = g_list_append(done, mb_conn_pop_finished(conn));
+			}
+			keep = FALSE;
+			break;
+		}
+		if(len == 0) {
+			// body went straight into head response
+			if(response->state == MB_HTTP_STATE_FINISHED) {
+				keep = mb_conn_finish_head(conn, &done);
+			}
+			continue;
+		}
+		for(pos = 0; pos < len; pos += consumed) {
+			data = g_queue_peek_head(conn->inflight);
+			if(!data) {
+				// nothing is expected, connection is either closed or broken
+				keep = FALSE;
+				break;
+			}
+			response = data->response;
+			if(data->phase == MB_PHASE_WAIT) {
+				// first byte is here, only total deadline is left
+				mb_conn_set_phase(data, MB_PHASE_BODY);
+			}
+			consumed = mb_http_data_post_read(response, buf + pos, len - pos);
+			if(response->state != MB_HTTP_STATE_FINISHED) {
+				break;
+			}
+			if(!mb_conn_finish_head(conn, &done)) {
+				keep = FALSE;
+				break;
+			}
+		}
+	}
+	mb_conn_read_done(conn, done, keep, error_message);
+}
+
+static void mb_conn_read_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+	mb_conn_do_read(data);
+}
+
+/*
+	Event from I/O thread, same outcome as mb_conn_do_read
+*/
+static void mb_conn_io_cb(gpointer owner, gint event, MbHttpData * response, gint error)
+{
+	MbConn * conn = owner;
+	MbConnData * data = g_queue_peek_head(conn->inflight);
+	GList * done = NULL;
+	gboolean keep;
+
+	switch(event) {
+		case MB_IO_FIRST_BYTE :
+			if(data && (data->response == response) && (data->phase == MB_PHASE_WAIT)) {
+				// first byte is here, only total deadline is left
+				mb_conn_set_phase(data, MB_PHASE_BODY);
+			}
+			break;
+		case MB_IO_FINISHED :
+			if(!data || (data->response != response)) {
+				// can't happen, responses are expected in order of inflight
+				mb_conn_read_done(conn, NULL, FALSE, NULL);
+				break;
+			}
+			keep = mb_conn_finish_head(conn, &done);
+			mb_conn_read_done(conn, done, keep, NULL);
+			break;
+		case MB_IO_CLOSED :
+			// -1 means nothing is expected, connection is either closed or broken
+			mb_conn_read_done(conn, NULL, FALSE,
+					(error > 0) ? g_strerror(error) : ( (error == 0) ? _("Connection closed by server") : NULL) );
+			break;
+	}
+}
+
+static void mb_conn_ssl_read_cb(gpointer data, PurpleSslConnection * ssl, PurpleInputCondition cond)
+{
+	mb_conn_do_read(data);
+}
+
+static void mb_conn_write_cb(gpointer data, gint source, PurpleInputCondition cond);
+
+/*
+	Write requests in inflight, one after another without waiting for responses
+*/
+static void mb_conn_do_write(MbConn * conn)
+{
+	MbHttpData * request;
+	gint retval;
+
+	while(conn->write_cur) {
+		request = ((MbConnData *)conn->write_cur->data)->request;
+		((MbConnData *)conn->write_cur->data)->sent = TRUE;
+		retval = conn->ssl ? mb_http_data_ssl_write(conn->ssl, request) : mb_http_data_write(conn->fd, request);
+		if( (retval < 0) && (errno != EAGAIN) ) {
+			mb_conn_broken(conn, g_strerror(errno));
+			return;
+		}
+		if(request->packet) {
+			// some data still left
+			break;
+		}
+		conn->write_cur = g_list_next(conn->write_cur);
+	}
+	if(conn->write_cur) {
+		// wait until socket is writable
+		if(!conn->write_handler) {
+			conn->write_handler = purple_input_add(conn->ssl ? conn->ssl->fd : conn->fd, PURPLE_INPUT_WRITE, mb_conn_write_cb, conn);
+		}
+	} else if(conn->write_handler) {
+		purple_input_remove(conn->write_handler);
+		conn->write_handler = 0;
+	}
+}
+
+static void mb_conn_write_cb(gpointer data, gint source, PurpleInputCondition cond)
+{
+	mb_conn_do_write(data);
+}
+
+/*
+	Put request at the end of the connection's pipeline
+*/
+static void mb_conn_attach(MbConn * conn, MbConnData * data)
+{
+	if(conn->is_ssl && ( (conn->requests > 0) || !g_queue_is_empty(conn->inflight) ) ) {
+		// handshake of this connection was paid by an earlier request
+		conn->pool->stat_tls_saved++;
+	}
+	data->conn = conn;
+	mb_http_data_truncate(data->response);
+	g_queue_push_tail(conn->inflight, data);
+	if(conn->io) {
+		mb_io_expect(conn->io, data->response);
+	}
+	if(!conn->write_cur) {
+		conn->write_cur = conn->inflight->tail;
+	}
+}
+
+/*
+	Send pending requests over the connection
+*/
+static void mb_conn_send(MbConn * conn)
+{
+	GList * it;
+
+	conn->state = MB_CONN_BUSY;
+	if(conn->idle_timer) {
+		purple_timeout_remove(conn->idle_timer);
+		conn->idle_timer = 0;
+	}
+	for(it = conn->inflight->head; it; it = g_list_next(it)) {
+		// connected, waiting for response from now on
+		if(((MbConnData *)it->data)->phase == MB_PHASE_CONNECT) {
+			mb_conn_set_phase(it->data, MB_PHASE_WAIT);
+		}
+	}
+	mb_conn_do_write(conn);
+}
+
+static void mb_conn_connect_cb(gpointer data, gint source, const gchar * error_message)
+{
+	MbConn * conn = data;
+	GList * it;
+
+	conn->connect_data = NULL;
+	if(source < 0) {
+		mb_conn_broken(conn, error_message ? error_message : _("Unable to connect"));
+		return;
+	}
+	conn->fd = source;
+	if(conn->threaded && ( (conn->io = mb_io_add(conn->fd, mb_conn_io_cb, conn)) != NULL) ) {
+		for(it = conn->inflight->head; it; it = g_list_next(it)) {
+			mb_io_expect(conn->io, ((MbConnData *)it->data)->response);
+		}
+	} else {
+		conn->read_handler = purple_input_add(conn->fd, PURPLE_INPUT_READ, mb_conn_read_cb, conn);
+	}
+	mb_conn_send(conn);
+}
+
+static void mb_conn_ssl_connect_cb(gpointer data, PurpleSslConnection * ssl, PurpleInputCondition cond)
+{
+	MbConn * conn = data;
+	MbConnPool * pool = conn->pool;
+	gint64 elapsed = mb_sched_now() - conn->connect_start;
+
+	pool->stat_tls_handshakes++;
+	pool->stat_tls_time += elapsed;
+	pool->stat_tls_time_max = MAX(pool->stat_tls_time_max, elapsed);
+#ifdef MB_USE_GNUTLS
+	if(mb_tls_usable()) {
+		if(gnutls_session_is_resumed(mb_tls_session(ssl))) {
+			pool->stat_tls_resumed++;
+		}
+		mb_tls_save(conn);
+	}
+#endif
+	purple_ssl_input_add(ssl, mb_conn_ssl_read_cb, conn);
+	mb_conn_send(conn);
+}
+
+static void mb_conn_ssl_error_cb(PurpleSslConnection * ssl, PurpleSslErrorType error, gpointer data)
+{
+	MbConn * conn = data;
+
+	// libpurple will free ssl itself
+	conn->ssl = NULL;
+	mb_conn_broken(conn, purple_ssl_strerror(error));
+}
+
+#ifdef MB_USE_GNUTLS
+/*
+	TCP part of a TLS connection is up, start TLS with cached session
+*/
+static void mb_conn_tls_tcp_cb(gpointer data, gint source, const gchar * error_message)
+{
+	MbConn * conn = data;
+
+	conn->connect_data = NULL;
+	if(source < 0) {
+		mb_conn_broken(conn, error_message ? error_message : _("Unable to connect"));
+		return;
+	}
+	// libpurple owns the socket from now on, conn->fd stays unset
+	conn->ssl = purple_ssl_connect_with_host_fd(conn->ma->account, source, mb_conn_ssl_connect_cb, mb_conn_ssl_error_cb, conn->host, conn);
+	if(!conn->ssl) {
+		close(source);
+		mb_conn_broken(conn, _("Unable to connect"));
+		return;
+	}
+	mb_tls_restore(conn);
+}
+#endif
+
+/*
+	Create new persistent connection to the host of data, mb_conn_connect must be called after attaching requests
+*/
+static MbConn * mb_conn_new(MbConnPool * pool, MbConnData * data)
+{
+	MbConn * conn = g_new0(MbConn, 1);
+
+	conn->pool = pool;
+	conn->ma = data->ma;
+	conn->host = g_strdup(data->host);
+	conn->port = data->port;
+	conn->is_ssl = data->is_ssl;
+	conn->threaded = mb_conn_wants_io(data);
+	conn->state = MB_CONN_CONNECTING;
+	conn->fd = -1;
+	mb_http_recv_init(&conn->recv);
+	conn->inflight = g_queue_new();
+	pool->conns = g_list_prepend(pool->conns, conn);
+	pool->stat_new++;
+	return conn;
+}
+
+static void mb_conn_connect(MbConn * conn)
+{
+	purple_debug_info(MB_NET, "opening new connection %p to %s:%d\n", conn, conn->host, conn->port);
+	conn->connect_start = mb_sched_now();
+#ifdef MB_USE_GNUTLS
+	if(conn->is_ssl && mb_tls_usable()) {
+		// connect by ourselves, so cached session can be set before handshake starts
+		conn->connect_data = purple_proxy_connect(NULL, conn->ma->account, conn->host, conn->port, mb_conn_tls_tcp_cb, conn);
+		if(!conn->connect_data) {
+			mb_conn_broken(conn, _("Unable to connect"));
+		}
+		return;
+	}
+#endif
+	if(conn->is_ssl) {
+		conn->ssl = purple_ssl_connect(conn->ma->account, conn->host, conn->port, mb_conn_ssl_connect_cb, mb_conn_ssl_error_cb, conn);
+		if(!conn->ssl) {
+			mb_conn_broken(conn, _("Unable to connect"));
+		}
+	} else {
+		conn->connect_data = purple_proxy_connect(NULL, conn->ma->account, conn->host, conn->port, mb_conn_connect_cb, conn);
+		if(!conn->connect_data) {
+			mb_conn_broken(conn, _("Unable to connect"));
+		}
+	}
+}
+
+static void mb_conn_pool_dispatch(MbConnPool * pool, MbConnData * data)
+{
+	MbConn * conn;
+	gint count = 0;
+
+	if(pool->batch_depth > 0) {
+		// wait for mb_conn_pool_end_batch
+		pool->batch = g_list_append(pool->batch, data);
+		return;
+	}
+	if( (conn = mb_conn_pool_find_idle(pool, data, &count)) != NULL) {
+		purple_debug_info(MB_NET, "reusing connection %p for %p\n", conn, data);
+		pool->stat_reused++;
+		mb_conn_attach(conn, data);
+		mb_conn_send(conn);
+		return;
+	}
+	if(count < pool->max_per_host) {
+		conn = mb_conn_new(pool, data);
+		mb_conn_attach(conn, data);
+		mb_conn_connect(conn);
+	} else {
+		purple_debug_info(MB_NET, "all %d connections to %s are busy, queueing %p\n", count, data->host, data);
+		if(data->priority == MB_PRIO_INTERACTIVE) {
+			g_queue_push_head(pool->wait_queue, data);
+		} else {
+			g_queue_push_tail(pool->wait_queue, data);
+		}
+	}
+}
+
+void mb_conn_pool_begin_batch(MbConnPool * pool)
+{
+	pool->batch_depth++;
+}
+
+void mb_conn_pool_end_batch(MbConnPool * pool)
+{
+	GList * batch, * group, * it, * next;
+	MbConnData * data;
+	MbConn * conn;
+	gint count = 0;
+
+	if(--pool->batch_depth > 0) {
+		return;
+	}
+	batch = pool->batch;
+	pool->batch = NULL;
+	while(batch) {
+		// group this request with the following ones to the same host
+		data = batch->data;
+		batch = g_list_delete_link(batch, batch);
+		group = g_list_append(NULL, data);
+		if(mb_conn_can_pipeline(pool, data)) {
+			for(it = batch; it; it = next) {
+				next = g_list_next(it);
+				if(mb_conn_data_same_host(data, it->data) && mb_conn_can_pipeline(pool, it->data)) {
+					group = g_list_append(group, it->data);
+					batch = g_list_delete_link(batch, it);
+				}
+			}
+		}
+		if(!group->next) {
+			mb_conn_pool_dispatch(pool, data);
+			g_list_free(group);
+			continue;
+		}
+
+		if( (conn = mb_conn_pool_find_idle(pool, data, &count)) != NULL) {
+			pool->stat_reused++;
+		} else if(count < pool->max_per_host) {
+			conn = mb_conn_new(pool, data);
+		}
+		if(!conn) {
+			// pool is full, they will be sent one by one as connections become free
+			for(it = group; it; it = g_list_next(it)) {
+				g_queue_push_tail(pool->wait_queue, it->data);
+			}
+			g_list_free(group);
+			continue;
+		}
+		purple_debug_info(MB_NET, "pipelining %u requests on connection %p\n", g_list_length(group), conn);
+		for(it = group; it; it = g_list_next(it)) {
+			mb_conn_attach(conn, it->data);
+		}
+		pool->stat_pipelined += g_list_length(group) - 1;
+		if(conn->state == MB_CONN_CONNECTING) {
+			mb_conn_connect(conn);
+		} else {
+			mb_conn_send(conn);
+		}
+		g_list_free(group);
+	}
+}
+
+/*
+	Whether this request should go through a persistent connection
+*/
+static gboolean mb_conn_use_keep_alive(MbConnData * data)
+{
+	MbAccount * ma = data->ma;
+
+	if(!ma->conn_pool || !ma->mb_conf) {
+		return FALSE;
+	}
+	if(mc_name(TC_KEEP_ALIVE)) {
+		return purple_account_get_bool(ma->account, mc_name(TC_KEEP_ALIVE), mc_def_bool(TC_KEEP_ALIVE));
+	}
+	return mc_def_bool(TC_KEEP_ALIVE);
+}
+
+/*
+	Key of a GET, requests with the same key get the same response
+*/
+static gchar * mb_conn_request_key(MbConnData * data)
+{
+	GString * key = g_string_new(NULL);
+	GList * it;
+	MbHttpParam * p;
+	const gchar * value;
+
+	g_string_printf(key, "%s:%d:%d%s", data->host, data->port, data->is_ssl ? 1 : 0, data->request->path);
+	for(it = data->request->params; it; it = g_list_next(it)) {
+		p = it->data;
+		g_string_append_printf(key, "%c%s=%s", (it == data->request->params) ? '?' : '&', p->key, p->value);
+	}
+	// other validators might get another answer
+	if( (value = mb_http_data_get_header(data->request, "If-None-Match")) != NULL) {
+		g_string_append_printf(key, "\nIf-None-Match: %s", value);
+	}
+	if( (value = mb_http_data_get_header(data->request, "If-Modified-Since")) != NULL) {
+		g_string_append_printf(key, "\nIf-Modified-Since: %s", value);
+	}
+	return g_string_free(key, FALSE);
+}
+
+/*
+	Content sink of a leader with waiters, each waiter's own sink gets the same body
+*/
+static gboolean mb_conn_fanout_sink(MbHttpData * data, const gchar * buf, gint len, gpointer user_data)
+{
+	MbConnData * leader = user_data;
+	MbHttpData * response;
+	GList * it;
+	gboolean retval;
+
+	retval = leader->leader_sink(data, buf, len, leader->leader_sink_data);
+	for(it = leader->waiters; it; it = g_list_next(it)) {
+		response = ((MbConnData *)it->data)->response;
+		if(!buf) {
+			response->status = data->status;
+			response->sink_active = response->content_sink(response, NULL, 0, response->content_sink_data);
+		} else if(response->sink_active) {
+			response->content_sink(response, buf, len, response->content_sink_data);
+			response->sink_len += len;
+		}
+	}
+	return retval;
+}
+
+/*
+	Let data wait for an identical GET already in flight
+
+	@return TRUE if data is answered by another request, FALSE if it should be sent
+*/
+static gboolean mb_conn_coalesce(MbConnPool * pool, MbConnData * data)
+{
+	MbConnData * leader;
+	MbHttpData * response;
+	gchar * key;
+
+	if( (data->request->type != HTTP_GET) || data->is_stream) {
+		return FALSE;
+	}
+	key = mb_conn_request_key(data);
+	leader = g_hash_table_lookup(pool->pending, key);
+	// a retrying leader keeps its own waiters, it doesn't become one
+	if(leader && !data->waiters) {
+		response = leader->response;
+		// body passed to a sink can't be copied later, waiter must see it from the beginning
+		if( ( (response->content_sink != NULL) == (data->response->content_sink != NULL) ) &&
+				( !data->response->content_sink || (response->state < MB_HTTP_STATE_CONTENT) ) ) {
+			purple_debug_info(MB_NET, "%p waits for identical request %p\n", data, leader);
+			if(response->content_sink && (response->content_sink != mb_conn_fanout_sink) ) {
+				leader->leader_sink = response->content_sink;
+				leader->leader_sink_data = response->content_sink_data;
+				mb_http_data_set_content_sink(response, mb_conn_fanout_sink, leader);
+			}
+			leader->waiters = g_list_append(leader->waiters, data);
+			data->leader = leader;
+			pool->stat_coalesced++;
+			g_free(key);
+			return TRUE;
+		}
+	}
+	// if it's too late to share the old one, newer one is the one to wait for
+	g_hash_table_replace(pool->pending, key, data);
+	data->coalesce_key = key;
+	if(leader) {
+		g_free(leader->coalesce_key);
+		leader->coalesce_key = NULL;
+	}
+	return FALSE;
+}
+
+static void mb_conn_uncoalesce(MbConnData * data)
+{
+	MbConnPool * pool = data->ma->conn_pool;
+
+	if(data->leader) {
+		data->leader->waiters = g_list_remove(data->leader->waiters, data);
+		data->leader = NULL;
+	}
+	if(data->coalesce_key) {
+		if(pool && (g_hash_table_lookup(pool->pending, data->coalesce_key) == data) ) {
+			g_hash_table_remove(pool->pending, data->coalesce_key);
+		}
+		g_free(data->coalesce_key);
+		data->coalesce_key = NULL;
+	}
+}
+
+static gboolean mb_conn_retry_request(gpointer data)
+{
+	MbConnData * conn_data = (MbConnData *)data;
+
+	conn_data->retry_timer = 0;
+	mb_conn_process_request(conn_data);
+	return FALSE;
+}
+
+/*
+	Send failed request again later
+
+	Delay is drawn between MB_RETRY_BASE and three times the last one (decorrelated jitter),
+	so accounts hit by the same outage don't come back all at the same second.
+*/
+static void mb_conn_schedule_retry(MbConnData * conn_data)
+{
+	const gchar * retry_after;
+	gint delay, server_delay;
+
+	delay = MAX(conn_data->retry_delay, MB_RETRY_BASE);
+	delay = g_random_int_range(MB_RETRY_BASE, MIN(delay * 3, MB_RETRY_CAP) + 1);
+	// server knows better when it will be back
+	retry_after = mb_http_data_get_header(conn_data->response, "Retry-After");
+	if(retry_after) {
+		server_delay = atoi(retry_after);
+		if(server_delay > 0) {
+			delay = MAX(delay, MIN(server_delay, MB_RETRY_AFTER_MAX) * 1000);
+		}
+	}
+	conn_data->retry_delay = delay;
+	if(conn_data->ma->conn_pool) {
+		conn_data->ma->conn_pool->stat_retries++;
+	}
+	purple_debug_info(MB_NET, "retrying %p in %d ms\n", conn_data, delay);
+	mb_http_data_truncate(conn_data->response);
+	conn_data->retry_timer = purple_timeout_add(delay, mb_conn_retry_request, conn_data);
+}
+
+/*
+	Circuit breaker, one for each host which failed, shared by all accounts
+*/
+static void mb_breaker_free(MbBreaker * breaker)
+{
+	if(breaker->cooldown_timer) {
+		purple_timeout_remove(breaker->cooldown_timer);
+	}
+	g_free(breaker->key);
+	g_free(breaker);
+}
+
+/*
+	@param create whether to start tracking a host seen for the first time
+	@return breaker of host of data, NULL if host never failed and create is FALSE
+*/
+static MbBreaker * mb_breaker_get(MbConnData * data, gboolean create)
+{
+	MbBreaker * breaker = NULL;
+	gchar * key;
+
+	if(!mb_breakers && !create) {
+		return NULL;
+	}
+	key = mb_conn_host_key(data->host, data->port, data->is_ssl);
+	if(mb_breakers) {
+		breaker = g_hash_table_lookup(mb_breakers, key);
+	}
+	if(!breaker && create) {
+		if(!mb_breakers) {
+			mb_breakers = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)mb_breaker_free);
+		}
+		breaker = g_new0(MbBreaker, 1);
+		breaker->key = key;
+		breaker->state = MB_BREAKER_CLOSED;
+		breaker->cooldown = MB_BREAKER_COOLDOWN;
+		g_hash_table_insert(mb_breakers, breaker->key, breaker);
+		return breaker;
+	}
+	g_free(key);
+	return breaker;
+}
+
+/*
+	Let one request test the host, before cooldown is over if user is waiting for it
+*/
+static void mb_breaker_half_open(MbBreaker * breaker)
+{
+	purple_debug_info(MB_NET, "circuit of %s half-open, sending a probe\n", breaker->key);
+	if(breaker->cooldown_timer) {
+		purple_timeout_remove(breaker->cooldown_timer);
+		breaker->cooldown_timer = 0;
+	}
+	breaker->state = MB_BREAKER_HALF_OPEN;
+}
+
+static gboolean mb_breaker_cooldown_cb(gpointer data)
+{
+	MbBreaker * breaker = (MbBreaker *)data;
+
+	breaker->cooldown_timer = 0;
+	mb_breaker_half_open(breaker);
+	mb_sched_run();
+	return FALSE;
+}
+
+static void mb_breaker_open(MbBreaker * breaker)
+{
+	purple_debug_info(MB_NET, "circuit of %s opened after %d failures, next try in %d seconds\n", breaker->key, breaker->failures, breaker->cooldown);
+	breaker->state = MB_BREAKER_OPEN;
+	breaker->stat_opened++;
+	if(breaker->cooldown_timer) {
+		purple_timeout_remove(breaker->cooldown_timer);
+	}
+	breaker->cooldown_timer = purple_timeout_add_seconds(breaker->cooldown, mb_breaker_cooldown_cb, breaker);
+}
+
+/*
+	Count outcome of a request against its host
+*/
+static void mb_breaker_record(MbConnData * data, gboolean failed)
+{
+	// healthy hosts are not tracked until they fail
+	MbBreaker * breaker = mb_breaker_get(data, failed);
+
+	if(!breaker) {
+		return;
+	}
+	if(!failed) {
+		breaker->failures = 0;
+		if(breaker->state != MB_BREAKER_CLOSED) {
+			purple_debug_info(MB_NET, "circuit of %s closed\n", breaker->key);
+			breaker->state = MB_BREAKER_CLOSED;
+			breaker->cooldown = MB_BREAKER_COOLDOWN;
+			if(breaker->cooldown_timer) {
+				purple_timeout_remove(breaker->cooldown_timer);
+				breaker->cooldown_timer = 0;
+			}
+		}
+		return;
+	}
+	breaker->failures++;
+	breaker->stat_failures++;
+	if(breaker->state == MB_BREAKER_HALF_OPEN) {
+		// still down, wait longer before next probe
+		breaker->cooldown = MIN(breaker->cooldown * 2, MB_BREAKER_COOLDOWN_MAX);
+		mb_breaker_open(breaker);
+	} else if( (breaker->state == MB_BREAKER_CLOSED) && (breaker->failures >= MB_BREAKER_FAILURES) ) {
+		mb_breaker_open(breaker);
+	} else {
+		return;
+	}
+	// user is waiting for a host which keeps failing, drop the account once rather than for each request
+	if( (data->priority == MB_PRIO_INTERACTIVE) && !data->is_stream && data->ma->gc && (data->ma->state != PURPLE_DISCONNECTED) ) {
+		purple_connection_error_reason(data->ma->gc, PURPLE_CONNECTION_ERROR_NETWORK_ERROR, _("Server is not responding"));
+	}
+}
+
+static void mb_breaker_describe(gpointer key, gpointer value, gpointer user_data)
+{
+	static const char * names[] = { "closed", "open", "half-open" };
+	MbBreaker * breaker = (MbBreaker *)value;
+	GString * out = (GString *)user_data;
+
+	g_string_append_printf(out, "%s%s %s, %u failures, opened %u times, %u requests held",
+			(out->len > 0) ? ", " : "", breaker->key, names[breaker->state],
+			breaker->stat_failures, breaker->stat_opened, breaker->stat_held);
+}
+
+void mb_conn_describe_breakers(GString * out)
+{
+	GString * list = g_string_new(NULL);
+
+	if(mb_breakers) {
+		g_hash_table_foreach(mb_breakers, mb_breaker_describe, list);
+	}
+	g_string_append(out, (list->len > 0) ? list->str : _("no host failed"));
+	g_string_free(list, TRUE);
+}
+
+static gint64 mb_sched_now(void)
+{
+#if GLIB_CHECK_VERSION(2, 28, 0)
+	return g_get_monotonic_time();
+#else
+	GTimeVal tv;
+
+	g_get_current_time(&tv);
+	return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+#endif
+}
+
+static gint mb_sched_host_count(MbConnData * data)
+{
+	gchar * key;
+	gint retval;
+
+	if(!mb_sched_hosts) {
+		return 0;
+	}
+	key = mb_conn_host_key(data->host, data->port, data->is_ssl);
+	retval = GPOINTER_TO_INT(g_hash_table_lookup(mb_sched_hosts, key));
+	g_free(key);
+	return retval;
+}
+
+static void mb_sched_host_add(MbConnData * data, gint n)
+{
+	gchar * key = mb_conn_host_key(data->host, data->port, data->is_ssl);
+	gint count;
+
+	if(!mb_sched_hosts) {
+		mb_sched_hosts = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+	count = GPOINTER_TO_INT(g_hash_table_lookup(mb_sched_hosts, key)) + n;
+	if(count > 0) {
+		g_hash_table_replace(mb_sched_hosts, key, GINT_TO_POINTER(count));
+	} else {
+		g_hash_table_remove(mb_sched_hosts, key);
+		g_free(key);
+	}
+}
+
+static gboolean mb_sched_can_admit(MbConnPool * pool, MbConnData * data)
+{
+	MbBreaker * breaker = mb_breaker_get(data, FALSE);
+	gint limit = pool->max_in_flight;
+
+	// failing host gets nothing until cooldown is over, then a single probe
+	// user shouldn't wait out the cooldown without a word, interactive request is the probe right away
+	if(breaker && (breaker->state != MB_BREAKER_CLOSED) &&
+			( breaker->probe || ( (breaker->state == MB_BREAKER_OPEN) && (data->priority != MB_PRIO_INTERACTIVE) ) ) ) {
+		return FALSE;
+	}
+	if(mb_sched_host_count(data) >= pool->max_host_in_flight) {
+		return FALSE;
+	}
+	if(data->priority == MB_PRIO_INTERACTIVE) {
+		// user is waiting, don't make it wait behind polls
+		return TRUE;
+	}
+	if(data->priority == MB_PRIO_BACKGROUND) {
+		// always leave room for polls
+		limit = MAX(1, limit / 2);
+	}
+	return (pool->in_flight < limit);
+}
+
+static void mb_sched_record_latency(MbConnPool * pool, MbConnData * data)
+{
+	gint64 ms = (mb_sched_now() - data->queued_at) / 1000;
+	gint bucket = 0;
+
+	while( (ms > 0) && (bucket < MB_SCHED_HIST_BUCKETS - 1) ) {
+		ms >>= 1;
+		bucket++;
+	}
+	pool->stat_latency[data->priority][bucket]++;
+}
+
+/*
+	Send request once it's admitted
+*/
+static void mb_conn_start_request(MbConnData * data)
+{
+	gchar * url;
+	gboolean own_connection;
+
+	if(data->prepare_handler) {
+		data->prepare_handler(data, data->prepare_handler_data, NULL);
+	}
+
+	// purple_util_fetch_url only returns whole body, streams need our own connection
+	own_connection = data->is_stream || mb_conn_use_keep_alive(data);
+	// stream has its own stall detection
+	if(!data->is_stream) {
+		mb_conn_arm_deadlines(data, own_connection);
+	}
+	if(own_connection) {
+		mb_http_data_set_header(data->request, "Connection", "keep-alive");
+		mb_http_data_prepare_write(data->request);
+		mb_conn_pool_dispatch(data->ma->conn_pool, data);
+		return;
+	}
+
+	url = mb_conn_url_unparse(data);
+
+	// we manage user_agent by ourself so ignore this completely
+	mb_http_data_set_header(data->request, "Connection", "close");
+	mb_http_data_prepare_write(data->request);
+	mb_http_data_flatten(data->request);
+	// libpurple doesn't tell how far it got, take it as sent
+	data->sent = TRUE;
+	data->fetch_url_data = purple_util_fetch_url_request(url, TRUE, "", TRUE, data->request->packet, TRUE, mb_conn_fetch_url_cb, (gpointer)data);
+	g_free(url);
+}
+
+/*
+	Admit waiting requests while limits allow, best priority first, accounts taking turns
+*/
+static void mb_sched_run(void)
+{
+	GList * it, * qit;
+	MbConnPool * pool;
+	MbConnData * data;
+	MbBreaker * breaker;
+	gint prio;
+	gboolean progress;
+
+	if(mb_sched_running) {
+		// called back from a request started below, outer loop takes care of it
+		mb_sched_again = TRUE;
+		return;
+	}
+	mb_sched_running = TRUE;
+	do {
+		mb_sched_again = FALSE;
+		progress = FALSE;
+		for(prio = 0; (prio < MB_PRIO_MAX) && !progress; prio++) {
+			for(it = mb_sched_pools; it && !progress; it = g_list_next(it)) {
+				pool = it->data;
+				// a request to a busy host doesn't hold back others of the same class
+				for(qit = pool->sched_queue[prio]->head; qit; qit = g_list_next(qit)) {
+					data = qit->data;
+					if(mb_sched_can_admit(pool, data)) {
+						g_queue_delete_link(pool->sched_queue[prio], qit);
+						// served account goes behind the others
+						mb_sched_pools = g_list_remove_link(mb_sched_pools, it);
+						mb_sched_pools = g_list_concat(mb_sched_pools, it);
+						data->admitted = TRUE;
+						pool->in_flight++;
+						mb_sched_host_add(data, 1);
+						mb_sched_record_latency(pool, data);
+						breaker = mb_breaker_get(data, FALSE);
+						if(breaker && (breaker->state == MB_BREAKER_OPEN)) {
+							mb_breaker_half_open(breaker);
+						}
+						if(breaker && (breaker->state == MB_BREAKER_HALF_OPEN)) {
+							breaker->probe = data;
+						}
+						mb_conn_start_request(data);
+						progress = TRUE;
+						break;
+					}
+				}
+			}
+		}
+	} while(progress || mb_sched_again);
+	mb_sched_running = FALSE;
+}
+
+/*
+	Request is finished or gone, give its place to another one
+
+	@param run whether to admit waiting requests now
+*/
+static void mb_sched_release(MbConnData * data, gboolean run)
+{
+	MbConnPool * pool = data->ma->conn_pool;
+	MbBreaker * breaker;
+
+	if(!pool) {
+		return;
+	}
+	if(!data->admitted) {
+		g_queue_remove(pool->sched_queue[data->priority], data);
+		return;
+	}
+	data->admitted = FALSE;
+	pool->in_flight--;
+	mb_sched_host_add(data, -1);
+	breaker = mb_breaker_get(data, FALSE);
+	if(breaker && (breaker->probe == data)) {
+		// probe gone without answer, next request probes instead
+		breaker->probe = NULL;
+	}
+	if(run) {
+		mb_sched_run();
+	}
+}
+
+void mb_conn_process_request(MbConnData * data)
+{
+	MbConnPool * pool = data->ma->conn_pool;
+	MbBreaker * breaker;
+
+	purple_debug_info(MB_NET, "NEW mb_conn_process_request, conn_data = %p\n", data);
+
+	purple_debug_info(MB_NET, "connecting to %s on port %hd\n", data->host, data->port);
+
+	if(pool && mb_conn_coalesce(pool, data)) {
+		return;
+	}
+	// stream lasts as long as account, it's never counted
+	if(!pool || data->is_stream) {
+		mb_conn_start_request(data);
+		return;
+	}
+	data->queued_at = mb_sched_now();
+	breaker = mb_breaker_get(data, FALSE);
+	if(breaker && (breaker->state != MB_BREAKER_CLOSED)) {
+		breaker->stat_held++;
+	}
+	g_queue_push_tail(pool->sched_queue[data->priority], data);
+	mb_sched_run();
+}
+
+void mb_conn_pool_describe_tls(MbConnPool * pool, GString * out)
+{
+	g_string_append_printf(out, "%u handshakes, %u resumed, %u requests without handshake",
+			pool->stat_tls_handshakes, pool->stat_tls_resumed, pool->stat_tls_saved);
+	if(pool->stat_tls_handshakes > 0) {
+		g_string_append_printf(out, ", connect and handshake %.0f ms average, %.0f ms max",
+				pool->stat_tls_time / (pool->stat_tls_handshakes * 1000.0), pool->stat_tls_time_max / 1000.0);
+	}
+}
+
+void mb_conn_pool_describe_latency(MbConnPool * pool, GString * out)
+{
+	static const char * names[MB_PRIO_MAX] = { "interactive", "timeline", "background" };
+	guint total, count, p50, p99;
+	gint prio, i;
+
+	for(prio = 0; prio < MB_PRIO_MAX; prio++) {
+		total = 0;
+		for(i = 0; i < MB_SCHED_HIST_BUCKETS; i++) {
+			total += pool->stat_latency[prio][i];
+		}
+		g_string_append_printf(out, "%s%s %u", (prio > 0) ? ", " : "", names[prio], total);
+		if(total == 0) {
+			continue;
+		}
+		// upper bound of the bucket holding each percentile
+		p50 = 0;
+		p99 = 0;
+		for(i = 0, count = 0; i < MB_SCHED_HIST_BUCKETS; i++) {
+			count += pool->stat_latency[prio][i];
+			if( (p50 == 0) && (count * 2 >= total) ) {
+				p50 = 1 << i;
+			}
+			if(count * 100 >= total * 99) {
+				p99 = 1 << i;
+				break;
+			}
+		}
+		g_string_append_printf(out, " (p50 < %u ms, p99 < %u ms)", p50, p99);
+	}
 }
 
 void mb_conn_error(MbConnData * data, PurpleConnectionError error, const char * description)
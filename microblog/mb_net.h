@@ -44,10 +44,65 @@ enum mb_error_action {
 	MB_ERROR_RAISE_ERROR = 1,
 };
 
+#define MB_CONN_MAX_PER_HOST 2 //< maximum number of persistent connections to the same host
+#define MB_CONN_IDLE_TIMEOUT 30 //< seconds before an idle persistent connection is closed
+#define MB_CONN_DATA_FREE_MAX 8 //< maximum number of finished MbConnData kept for reuse
+
+#define MB_SCHED_MAX_IN_FLIGHT 4 //< default requests in flight per account, interactive ones are not counted against it
+#define MB_SCHED_MAX_PER_HOST 8 //< default requests in flight to one host, all accounts together
+#define MB_SCHED_HIST_BUCKETS 16 //< queue latency buckets, bucket i counts waits shorter than 2^i ms
+
+#define MB_RETRY_BASE 1000 //< shortest delay before a retry, in ms
+#define MB_RETRY_CAP 60000 //< longest delay before a retry, in ms
+#define MB_RETRY_AFTER_MAX 900 //< longest Retry-After from server we honour, in seconds
+
+#define MB_BREAKER_FAILURES 5 //< failures in a row which open the circuit of a host
+#define MB_BREAKER_COOLDOWN 30 //< seconds an opened circuit waits before a probe request
+#define MB_BREAKER_COOLDOWN_MAX 600 //< cooldown doubles with each failed probe up to this
+
+#define MB_TIMEOUT_CONNECT 20 //< default connect deadline, in seconds
+#define MB_TIMEOUT_TTFB 60 //< default wait for first byte, in seconds, pipelined requests wait behind others
+#define MB_TIMEOUT_TOTAL 120 //< default deadline of the whole request, in seconds
+
+// Deadlines of a request, each one is configured per priority class
+enum mb_conn_deadline {
+	MB_DEADLINE_CONNECT = 0, //< from admission until request is on a connected socket
+	MB_DEADLINE_TTFB, //< from sending until first byte of response
+	MB_DEADLINE_TOTAL, //< from admission until whole response
+	MB_DEADLINE_MAX,
+};
+
+// Where a request with deadlines is, MB_PHASE_NONE if it has none
+enum mb_conn_phase {
+	MB_PHASE_NONE = 0,
+	MB_PHASE_CONNECT,
+	MB_PHASE_WAIT,
+	MB_PHASE_BODY,
+};
+
+// Errors passed to handler when request didn't fail on network, compare by pointer
+extern const gchar mb_conn_timeout_error[];
+extern const gchar mb_conn_cancelled_error[];
+
+enum mb_breaker_state {
+	MB_BREAKER_CLOSED = 0, //< requests go through
+	MB_BREAKER_OPEN, //< host is failing, requests wait in scheduler queue, an interactive one is sent as probe
+	MB_BREAKER_HALF_OPEN, //< cooldown is over, one probe request decides
+};
+
+// Priority class of a request, lower is served first
+enum mb_conn_priority {
+	MB_PRIO_INTERACTIVE = 0, //< user is waiting for it, sending status, favorite, login
+	MB_PRIO_TIMELINE = 1, //< timeline polls
+	MB_PRIO_BACKGROUND = 2, //< backfill and other bulk traffic, gets half of account limit
+	MB_PRIO_MAX,
+};
+
 // if handler return
 // 0 - Everything's ok
 // -1 - Requeue the whole process again
 struct _MbConnData;
+struct _MbConn;
 
 typedef gint (*MbHandlerFunc)(struct _MbConnData * , gpointer , const char * error);
 typedef void (*MbHandlerDataFreeFunc)(gpointer);
@@ -74,8 +129,99 @@ typedef struct _MbConnData {
 
 	gboolean is_ssl;
 	PurpleUtilFetchUrlData * fetch_url_data;
+
+	// Persistent connection currently serving this request, if any
+	struct _MbConn * conn;
+	gboolean stale_retried; //< already reconnected once because a reused connection was found closed
+	gboolean is_stream; //< long-lived response read through content sink, errors go to handler only
+	gboolean sent; //< request was written at least once, server may have acted on it
+
+	// Request scheduler
+	gint priority; //< MB_PRIO_*, set before mb_conn_process_request
+	gboolean admitted; //< counted in flight by scheduler
+	gint64 queued_at; //< when it was handed to scheduler, in microseconds
+
+	// Retry policy
+	guint retry_timer; //< pending retry, 0 if none
+	gint retry_delay; //< last delay before retry in ms, next one is drawn from it
+
+	// Deadlines and cancellation
+	guint id; //< token for mb_conn_cancel, never 0 and never reused
+	gint timeout[MB_DEADLINE_MAX]; //< seconds, 0 for no limit, -1 for default of priority class
+	gint phase; //< MB_PHASE_*
+	guint phase_timer; //< connect or TTFB deadline
+	guint total_timer;
+
+	// Identical GETs in flight share one response
+	gchar * coalesce_key; //< key in pool->pending while this request is in flight
+	struct _MbConnData * leader; //< request this one shares response with, NULL if it's sent itself
+	GList * waiters; //< identical requests answered with response of this one
+	gboolean shared; //< response is a copy of leader's, its handler shows the content
+	MbHttpContentSink leader_sink; //< own content sink, once it's replaced by one feeding waiters too
+	gpointer leader_sink_data;
 } MbConnData;
 
+/*
+	Health of one host, shared by all accounts
+*/
+typedef struct _MbBreaker {
+	gchar * key; //< "host:port:ssl"
+	gint state; //< MB_BREAKER_*
+	gint failures; //< failures in a row
+	gint cooldown; //< seconds before next probe
+	guint cooldown_timer;
+	MbConnData * probe; //< request testing the host while half-open
+
+	// statistics
+	guint stat_failures; //< network errors and 5xx answers
+	guint stat_opened; //< times circuit was opened
+	guint stat_held; //< requests queued while circuit was not closed
+} MbBreaker;
+
+/*
+	Persistent connections of one account
+*/
+typedef struct _MbConnPool {
+	GList * conns; //< all MbConn, busy or idle
+	GQueue * wait_queue; //< MbConnData waiting for a free connection
+	gint max_per_host;
+	gint idle_timeout;
+	GHashTable * no_pipeline; //< "host:port:ssl" of servers which broke a pipeline
+	GHashTable * pending; //< coalesce key -> GET in flight, identical ones wait for its response
+	GList * batch; //< MbConnData collected between mb_conn_pool_begin_batch and mb_conn_pool_end_batch
+	gint batch_depth;
+	guint pump_timer;
+	GSList * free_data; //< finished MbConnData, recycled by mb_conn_data_new
+	guint free_data_len;
+
+	// statistics
+	guint stat_new; //< connections opened
+	guint stat_reused; //< requests sent over an already opened connection
+	guint stat_pipelined; //< requests sent behind another one without waiting for its response
+	guint stat_stale; //< reused connections found closed by server, then reopened
+	guint stat_idle_closed; //< connections closed by idle timeout
+	guint stat_data_hit; //< MbConnData taken from free_data
+	guint stat_data_miss; //< MbConnData allocated because free_data was empty
+	guint stat_coalesced; //< GETs answered by an identical one already in flight
+	guint stat_retries; //< requests sent again after a failure
+	guint stat_timeouts; //< requests which missed a deadline
+	guint stat_cancelled; //< requests aborted by mb_conn_cancel
+	guint stat_tls_handshakes; //< TLS connections established
+	guint stat_tls_resumed; //< of those, resumed from a cached session
+	guint stat_tls_saved; //< requests sent over a TLS connection set up for an earlier one
+	gint64 stat_tls_time; //< microseconds from connecting until TLS is up, summed over handshakes
+	gint64 stat_tls_time_max;
+
+	// Request scheduler, accounts take turns within each priority
+	GQueue * sched_queue[MB_PRIO_MAX]; //< MbConnData waiting to be admitted
+	gint in_flight; //< admitted requests not finished yet
+	gint max_in_flight;
+	gint max_host_in_flight; //< limit of requests to one host by all accounts, as seen by this account
+	guint stat_latency[MB_PRIO_MAX][MB_SCHED_HIST_BUCKETS]; //< time from mb_conn_process_request until sent
+
+	gint timeout[MB_PRIO_MAX][MB_DEADLINE_MAX]; //< deadlines of requests which don't set their own, in seconds
+} MbConnPool;
+
 /*
 	Create new connection data
 	
@@ -109,6 +255,26 @@ extern void mb_conn_data_set_retry(MbConnData * data, gint retry);
  */
 extern void mb_conn_process_request(MbConnData * data);
 
+/**
+ * Abort a request, its handler is called with mb_conn_cancelled_error
+ *
+ * @param ma MbAccount owning the request
+ * @param id MbConnData id, taken when request was made
+ * @return TRUE if request was still there
+ */
+extern gboolean mb_conn_cancel(MbAccount * ma, guint id);
+
+/**
+ * Set deadlines of a priority class, 0 for no limit
+ *
+ * @param pool MbConnPool in action
+ * @param priority MB_PRIO_*
+ * @param connect seconds to get a connection
+ * @param ttfb seconds to wait for the first byte of response once request is sent
+ * @param total seconds for the whole request
+ */
+extern void mb_conn_pool_set_timeouts(MbConnPool * pool, gint priority, gint connect, gint ttfb, gint total);
+
 /**
  * Call purple_connection_error_reason if this connection was retried more than data->max_retry already
  *
@@ -126,6 +292,73 @@ extern void mb_conn_error(MbConnData * data, PurpleConnectionError error, const
  */
 extern gchar * mb_conn_url_unparse(MbConnData * data);
 
+/**
+ * Create new connection pool
+ *
+ * @return new MbConnPool, free with mb_conn_pool_free
+ */
+extern MbConnPool * mb_conn_pool_new(void);
+
+/**
+ * Close all connections and free the pool
+ *
+ * @param pool MbConnPool to free
+ * @note all MbConnData of the account must be freed before calling this
+ */
+extern void mb_conn_pool_free(MbConnPool * pool);
+
+/**
+ * Number of connections currently opened in the pool
+ *
+ * @param pool MbConnPool in action
+ * @param idle_only count only idle connections
+ */
+extern guint mb_conn_pool_count(MbConnPool * pool, gboolean idle_only);
+
+/**
+ * Start collecting requests instead of dispatching them
+ *
+ * Requests processed until mb_conn_pool_end_batch are held back, then GET requests
+ * to the same host are pipelined on one connection. Calls can be nested.
+ *
+ * @param pool MbConnPool in action
+ */
+extern void mb_conn_pool_begin_batch(MbConnPool * pool);
+
+/**
+ * Dispatch requests collected since mb_conn_pool_begin_batch
+ *
+ * Responses are delivered to each request's handler in the order the requests were made.
+ * If the server closes the connection in the middle of a pipeline, unanswered requests
+ * are sent again one by one, and later batches to that host are not pipelined.
+ *
+ * @param pool MbConnPool in action
+ */
+extern void mb_conn_pool_end_batch(MbConnPool * pool);
+
+/**
+ * Append queue latency of each priority class, for /stats
+ *
+ * @param pool MbConnPool in action
+ * @param out string to append to
+ */
+extern void mb_conn_pool_describe_latency(MbConnPool * pool, GString * out);
+
+/**
+ * Append circuit state of every host that ever failed, for /stats
+ *
+ * @param out string to append to
+ */
+extern void mb_conn_describe_breakers(GString * out);
+
+/**
+ * Append TLS handshake counters, for /stats
+ *
+ * @param pool MbConnPool in action
+ * @param out string to append to
+ */
+extern void mb_conn_pool_describe_tls(MbConnPool * pool, GString * out);
+
 /**
  * Test if the maximu retry is already reached
  *
@@ -29,7 +29,6 @@
 #include <math.h>
 
 #include <debug.h>
-#include <cipher.h>
 
 #include "twitter.h"
 #include "mb_net.h"
@@ -45,14 +44,12 @@ static const char fixed_headers[] = "User-Agent:" TW_AGENT "\r\n" \
 "X-Twitter-Client: " TW_AGENT_SOURCE "\r\n" \
 "X-Twitter-Client-Version: 0.1\r\n" \
 "X-Twitter-Client-Url: " TW_AGENT_DESC_URL "\r\n" \
-"Connection: Close\r\n" \
 "Pragma: no-cache\r\n";
 
 
 static MbConnData * mb_oauth_init_connection(MbAccount * ma, int type, const gchar * path, MbHandlerFunc handler, gchar ** full_url);
 static gchar * mb_oauth_gen_nonce(void);
-static gchar * mb_oauth_sign_hmac_sha1(const gchar * data, const gchar * key);
-static gchar * mb_oauth_gen_sigbase(MbHttpData * data, const gchar * url, int type);
+static void mb_oauth_sign_request(MbOauth * oauth, struct _MbHttpData * http_data, const gchar * full_url, int type);
 static gint mb_oauth_request_token_handler(MbConnData * conn_data, gpointer data, const char * error);
 
 void mb_oauth_init(struct _MbAccount * ma, const gchar * c_key, const gchar * c_secret) {
@@ -64,6 +61,8 @@ void mb_oauth_init(struct _MbAccount * ma, const gchar * c_key, const gchar * c_
 	oauth->oauth_secret = NULL;
 	oauth->pin = NULL;
 	oauth->ma = ma;
+	// signer is zeroed along with MbAccount, init may run again on login so keep its buffers
+	mb_oauth_signer_set_key(&oauth->signer, oauth->c_secret, NULL);
 
 	// XXX: Should we put this other places instead?
 	srand(time(NULL));
@@ -77,6 +76,8 @@ void mb_oauth_set_token(struct _MbAccount * ma, const gchar * oauth_token, const
 
 	if(oauth->oauth_secret) g_free(oauth->oauth_secret);
 	oauth->oauth_secret = g_strdup(oauth_secret);
+
+	mb_oauth_signer_set_key(&oauth->signer, oauth->c_secret, oauth->oauth_secret);
 }
 
 void mb_oauth_set_pin(struct _MbAccount * ma, const gchar * pin) {
@@ -106,6 +107,8 @@ void mb_oauth_free(struct _MbAccount * ma)
 
 	if(oauth->pin) g_free(oauth->pin);
 
+	mb_oauth_signer_free(&oauth->signer);
+
 	oauth->c_key = NULL;
 	oauth->c_secret = NULL;
 	oauth->oauth_token = NULL;
@@ -143,6 +146,8 @@ static MbConnData * mb_oauth_init_connection(MbAccount * ma, int type, const gch
 
 	conn_data = mb_conn_data_new(ma, host, port, handler, use_https);
 	mb_conn_data_set_retry(conn_data, retry);
+	// login can't go on without it
+	conn_data->priority = MB_PRIO_INTERACTIVE;
 
 	conn_data->request->type = type;
 	if(type == HTTP_POST) {
@@ -189,75 +194,6 @@ static gchar * mb_oauth_gen_nonce(void) {
 //	return g_strdup("F_2urGzJ0q8Alzgbllio");
 }
 
-/**
- * Generate signature from data and key
- *
- * @param data to generate signature from
- * @param key key (secret)
- * @return string represent signature (must be freed by caller)
- */
-static gchar * mb_oauth_sign_hmac_sha1(const gchar * data, const gchar * key) {
-	PurpleCipherContext * context = NULL;
-	size_t out_len;
-	guchar digest[128];
-	gchar * retval = NULL;
-
-	purple_debug_info(DBGID, "signing data \"%s\"\n with key \"%s\"\n", data, key);
-	if( (context = purple_cipher_context_new_by_name("hmac", NULL)) == NULL) {
-		purple_debug_info(DBGID, "couldn't find HMAC cipher, upgrade Pidgin?\n");
-		return NULL;
-	}
-	purple_cipher_context_set_option(context, "hash", "sha1");
-	purple_cipher_context_set_key(context, (guchar *)key);
-	purple_cipher_context_append(context, (guchar *)data, strlen(data));
-
-	if(purple_cipher_context_digest(context, sizeof(digest), digest, &out_len)) {
-		//purple_debug_info(DBGID, "got digest = %s, out_len = %d\n", digest, (int)out_len);
-		retval = purple_base64_encode(digest, out_len);
-		purple_debug_info(DBGID, "got digest = %s, out_len = %d\n", retval, (int)out_len);
-	} else {
-		purple_debug_info(DBGID, "couldn't digest signature\n");
-	}
-
-	purple_cipher_context_destroy(context);
-
-	return retval;
-}
-
-/**
- * Generate signature base text
- *
- * @param ma MbAccount in action
- * @param url path part of URL
- * @param type HTTP_GET or HTTP_POST
- * @param params list of PurpleKeyValuePair
- */
-static gchar * mb_oauth_gen_sigbase(MbHttpData * data, const gchar * url, int type) {
-	gchar * type_str = NULL, * param_str = NULL, * retval = NULL, *encoded_url, *encoded_param;
-
-	// Type
-	if(type == HTTP_GET) {
-		type_str = "GET";
-	} else {
-		type_str = "POST";
-	}
-
-	// Concatenate all parameter
-	param_str = g_malloc(data->params_len + 1);
-	mb_http_data_encode_param(data, param_str, data->params_len, TRUE);
-    purple_debug_info(DBGID, "final merged param string = %s\n", param_str);
-
-    encoded_url = g_strdup(purple_url_encode(url));
-    encoded_param = g_strdup(purple_url_encode(param_str));
-    g_free(param_str);
-
-    retval = g_strdup_printf("%s&%s&%s", type_str, encoded_url, encoded_param);
-    g_free(encoded_url);
-    g_free(encoded_param);
-
-    return retval;
-}
-
 static void _do_oauth(struct _MbAccount * ma, const gchar * path, int type, MbOauthResponse func, gpointer data, MbHandlerFunc handler) {
 	MbConnData * conn_data = NULL;
 	gchar * full_url = NULL;
@@ -336,8 +272,26 @@ void mb_oauth_request_access(struct _MbAccount * ma, const gchar * path, int typ
 	_do_oauth(ma, path, type, func, data, mb_oauth_request_token_handler);
 }
 //
+/**
+ * Sign request and attach signature as parameter
+ *
+ * @param http_data request with sorted OAuth parameters
+ */
+static void mb_oauth_sign_request(MbOauth * oauth, struct _MbHttpData * http_data, const gchar * full_url, int type) {
+	gchar signature[MB_OAUTH_SIG_LEN];
+
+	// Token handlers replace oauth_secret directly, HMAC state is derived again only if it changed
+	mb_oauth_signer_set_key(&oauth->signer, oauth->c_secret, oauth->oauth_secret);
+	mb_oauth_signer_sign(&oauth->signer, http_data, full_url, type, signature);
+	purple_debug_info(DBGID, "got signature base = %s\n", oauth->signer.base->str);
+	purple_debug_info(DBGID, "signed signature = %s\n", signature);
+
+	// Attach to parameter
+	mb_http_data_add_param(http_data, "oauth_signature", signature);
+}
+
 void mb_oauth_set_http_data(MbOauth * oauth, struct _MbHttpData * http_data, const gchar * full_url, int type) {
-	gchar * nonce = NULL, * sig_base = NULL, * secret = NULL, * signature = NULL;
+	gchar * nonce = NULL;
 
 	// Attach OAuth data
 	mb_http_data_add_param(http_data, "oauth_consumer_key", oauth->c_key);
@@ -361,24 +315,11 @@ void mb_oauth_set_http_data(MbOauth * oauth, struct _MbHttpData * http_data, con
 	mb_http_data_sort_param(http_data);
 
 	// Create signature
-	sig_base = mb_oauth_gen_sigbase(http_data, full_url, type);
-	purple_debug_info(DBGID, "got signature base = %s\n", sig_base);
-
-	secret = g_strdup_printf("%s&%s", oauth->c_secret, oauth->oauth_secret ? oauth->oauth_secret : "");
-
-	signature = mb_oauth_sign_hmac_sha1(sig_base, secret);
-	g_free(secret);
-	g_free(sig_base);
-	purple_debug_info(DBGID, "signed signature = %s\n", signature);
-
-	// Attach to parameter
-	mb_http_data_add_param(http_data, "oauth_signature", signature);
-	g_free(signature);
-
+	mb_oauth_sign_request(oauth, http_data, full_url, type);
 }
 
 void mb_oauth_reset_nonce(MbOauth * oauth, struct _MbHttpData * http_data, const gchar * full_url, int type) {
-	gchar * nonce, * secret, * sig_base, * signature;
+	gchar * nonce;
 
 	mb_http_data_rm_param(http_data, "oauth_nonce");
 	mb_http_data_rm_param(http_data, "oauth_signature");
@@ -388,17 +329,5 @@ void mb_oauth_reset_nonce(MbOauth * oauth, struct _MbHttpData * http_data, const
 	g_free(nonce);
 
 	// Re-Create signature
-	sig_base = mb_oauth_gen_sigbase(http_data, full_url, type);
-	purple_debug_info(DBGID, "got signature base = %s\n", sig_base);
-
-	secret = g_strdup_printf("%s&%s", oauth->c_secret, oauth->oauth_secret ? oauth->oauth_secret : "");
-
-	signature = mb_oauth_sign_hmac_sha1(sig_base, secret);
-	g_free(secret);
-	g_free(sig_base);
-	purple_debug_info(DBGID, "signed signature = %s\n", signature);
-
-	// Attach to parameter
-	mb_http_data_add_param(http_data, "oauth_signature", signature);
-	g_free(signature);
+	mb_oauth_sign_request(oauth, http_data, full_url, type);
 }
@@ -32,6 +32,8 @@
 #  endif /* __GNUC__ >= 4 */
 #endif /* G_GNUC_NULL_TERMINATED */
 
+#include "mb_oauth_sign.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -49,6 +51,7 @@ typedef struct _MbOauth {
 	gchar * oauth_token; //< request token
 	gchar * oauth_secret; //< request secret
 	gchar * pin; //< user input PIN
+	MbOauthSigner signer; //< HMAC state of c_secret and oauth_secret
 	MbOauthResponse response_func;
 	struct _MbAccount * ma;
 	gpointer data;
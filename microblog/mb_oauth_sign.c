@@ -0,0 +1,126 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <string.h>
+
+#include "mb_http.h"
+#include "mb_urlenc.h"
+#include "mb_oauth_sign.h"
+
+void mb_oauth_signer_init(MbOauthSigner * signer)
+{
+	memset(signer, 0, sizeof(MbOauthSigner));
+}
+
+void mb_oauth_signer_free(MbOauthSigner * signer)
+{
+	if(signer->key) {
+		// secrets should not stay around in freed memory
+		memset(signer->key->str, 0, signer->key->len);
+		g_string_free(signer->key, TRUE);
+	}
+	if(signer->base) g_string_free(signer->base, TRUE);
+	if(signer->scratch) g_string_free(signer->scratch, TRUE);
+	memset(signer, 0, sizeof(MbOauthSigner));
+}
+
+void mb_oauth_signer_set_key(MbOauthSigner * signer, const gchar * c_secret, const gchar * token_secret)
+{
+	gsize c_len, t_len;
+
+	if(!c_secret) c_secret = "";
+	if(!token_secret) token_secret = "";
+	c_len = strlen(c_secret);
+	t_len = strlen(token_secret);
+	if(signer->key && (signer->key->len == (c_len + 1 + t_len)) &&
+			(memcmp(signer->key->str, c_secret, c_len) == 0) &&
+			(memcmp(signer->key->str + c_len + 1, token_secret, t_len) == 0) ) {
+		return;
+	}
+	if(!signer->key) {
+		signer->key = g_string_sized_new(c_len + 1 + t_len);
+	}
+	g_string_truncate(signer->key, 0);
+	g_string_append_len(signer->key, c_secret, c_len);
+	g_string_append_c(signer->key, '&');
+	g_string_append_len(signer->key, token_secret, t_len);
+	mb_hmac_sha1_set_key(&signer->hmac, (const guchar *)signer->key->str, signer->key->len);
+	signer->stat_rekey++;
+}
+
+/*
+	Append encoded text to string, growing it only when needed
+*/
+static void mb_oauth_signer_append_encoded(GString * str, const gchar * src, gsize len)
+{
+	gsize old_len = str->len;
+
+	g_string_set_size(str, old_len + mb_url_encode_len(src, len));
+	mb_url_encode(str->str + old_len, src, len);
+}
+
+const gchar * mb_oauth_signer_base(MbOauthSigner * signer, MbHttpData * data, const gchar * url, int type)
+{
+	GList * it;
+	MbHttpParam * p;
+
+	if(!signer->base) {
+		signer->base = g_string_sized_new(1024);
+		signer->scratch = g_string_sized_new(512);
+	}
+
+	// METHOD&url&params, params being key=value&... encoded once more as a whole
+	g_string_assign(signer->base, (type == HTTP_GET) ? "GET&" : "POST&");
+	mb_oauth_signer_append_encoded(signer->base, url, strlen(url));
+	g_string_append_c(signer->base, '&');
+	for(it = g_list_first(data->params); it; it = g_list_next(it)) {
+		p = it->data;
+		if(it != data->params) {
+			g_string_append(signer->base, "%26");
+		}
+		mb_oauth_signer_append_encoded(signer->base, p->key, strlen(p->key));
+		g_string_append(signer->base, "%3D");
+		g_string_truncate(signer->scratch, 0);
+		mb_oauth_signer_append_encoded(signer->scratch, p->value, strlen(p->value));
+		mb_oauth_signer_append_encoded(signer->base, signer->scratch->str, signer->scratch->len);
+	}
+	return signer->base->str;
+}
+
+void mb_oauth_signer_sign(MbOauthSigner * signer, MbHttpData * data, const gchar * url, int type, gchar sig[MB_OAUTH_SIG_LEN])
+{
+	guchar digest[MB_SHA1_DIGEST_LEN];
+	gint state = 0, save = 0;
+	gsize len;
+
+	if(!signer->key) {
+		mb_oauth_signer_set_key(signer, NULL, NULL);
+	}
+	mb_oauth_signer_base(signer, data, url, type);
+	mb_hmac_sha1(&signer->hmac, (const guchar *)signer->base->str, signer->base->len, digest);
+
+	len = g_base64_encode_step(digest, sizeof(digest), FALSE, sig, &state, &save);
+	len += g_base64_encode_close(FALSE, sig + len, &state, &save);
+	sig[len] = '\0';
+	signer->stat_signed++;
+}
@@ -0,0 +1,100 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * OAuth HMAC-SHA1 request signer
+ *
+ * One per account. HMAC state of "consumer secret&token secret" is derived only when
+ * the secrets change, signature base is built in a buffer kept between requests.
+ */
+
+#ifndef __MB_OAUTH_SIGN__
+#define __MB_OAUTH_SIGN__
+
+#include <glib.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include "mb_sha1.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// base64 of SHA-1 digest with terminating '\0'
+#define MB_OAUTH_SIG_LEN 29
+
+struct _MbHttpData;
+
+typedef struct _MbOauthSigner {
+	MbHmacSha1 hmac; //< derived from key
+	GString * key; //< "consumer secret&token secret", NULL before first use
+	GString * base; //< signature base of last request
+	GString * scratch; //< parameter value encoded once
+	guint stat_signed; //< requests signed
+	guint stat_rekey; //< times HMAC state was derived
+} MbOauthSigner;
+
+/*
+	Initialize signer with no key
+*/
+extern void mb_oauth_signer_init(MbOauthSigner * signer);
+
+/*
+	Free buffers of signer
+*/
+extern void mb_oauth_signer_free(MbOauthSigner * signer);
+
+/*
+	Set secrets, HMAC state is derived again only if they differ from current ones
+
+	@param token_secret may be NULL before token is granted
+*/
+extern void mb_oauth_signer_set_key(MbOauthSigner * signer, const gchar * c_secret, const gchar * token_secret);
+
+/*
+	Build signature base of request
+
+	@param data request with sorted parameters
+	@param url URL without query
+	@param type HTTP_GET or HTTP_POST
+	@return signature base, valid until next call
+*/
+extern const gchar * mb_oauth_signer_base(MbOauthSigner * signer, struct _MbHttpData * data, const gchar * url, int type);
+
+/*
+	Sign request
+
+	@param sig output, base64 of HMAC-SHA1 of signature base
+*/
+extern void mb_oauth_signer_sign(MbOauthSigner * signer, struct _MbHttpData * data, const gchar * url, int type, gchar sig[MB_OAUTH_SIG_LEN]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,176 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <string.h>
+
+#include "mb_sha1.h"
+
+#define MB_SHA1_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define MB_SHA1_STEP(f, k) do { \
+	t = MB_SHA1_ROL(a, 5) + (f) + e + (k) + w[i]; \
+	e = d; \
+	d = c; \
+	c = MB_SHA1_ROL(b, 30); \
+	b = a; \
+	a = t; \
+} while(0)
+
+static void mb_sha1_transform(guint32 h[5], const guchar * p)
+{
+	guint32 w[80], a, b, c, d, e, t;
+	gint i;
+
+	for(i = 0; i < 16; i++) {
+		w[i] = ((guint32)p[i * 4] << 24) | ((guint32)p[i * 4 + 1] << 16) | ((guint32)p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	}
+	for(i = 16; i < 80; i++) {
+		w[i] = MB_SHA1_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	}
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+	// One loop per round function, so the compiler can unroll them without branches
+	for(i = 0; i < 20; i++) {
+		MB_SHA1_STEP((b & c) | (~b & d), 0x5a827999);
+	}
+	for(; i < 40; i++) {
+		MB_SHA1_STEP(b ^ c ^ d, 0x6ed9eba1);
+	}
+	for(; i < 60; i++) {
+		MB_SHA1_STEP((b & c) | (b & d) | (c & d), 0x8f1bbcdc);
+	}
+	for(; i < 80; i++) {
+		MB_SHA1_STEP(b ^ c ^ d, 0xca62c1d6);
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+void mb_sha1_init(MbSha1 * ctx)
+{
+	ctx->h[0] = 0x67452301;
+	ctx->h[1] = 0xefcdab89;
+	ctx->h[2] = 0x98badcfe;
+	ctx->h[3] = 0x10325476;
+	ctx->h[4] = 0xc3d2e1f0;
+	ctx->total = 0;
+	ctx->block_len = 0;
+}
+
+void mb_sha1_update(MbSha1 * ctx, const guchar * data, gsize len)
+{
+	gsize n;
+
+	ctx->total += len;
+	if(ctx->block_len > 0) {
+		n = MIN(len, MB_SHA1_BLOCK_LEN - ctx->block_len);
+		memcpy(ctx->block + ctx->block_len, data, n);
+		ctx->block_len += n;
+		data += n;
+		len -= n;
+		if(ctx->block_len < MB_SHA1_BLOCK_LEN) {
+			return;
+		}
+		mb_sha1_transform(ctx->h, ctx->block);
+		ctx->block_len = 0;
+	}
+	// Whole blocks straight from input
+	for(; len >= MB_SHA1_BLOCK_LEN; data += MB_SHA1_BLOCK_LEN, len -= MB_SHA1_BLOCK_LEN) {
+		mb_sha1_transform(ctx->h, data);
+	}
+	memcpy(ctx->block, data, len);
+	ctx->block_len = len;
+}
+
+void mb_sha1_final(MbSha1 * ctx, guchar digest[MB_SHA1_DIGEST_LEN])
+{
+	guint64 bits = ctx->total * 8;
+	gint i;
+
+	ctx->block[ctx->block_len++] = 0x80;
+	if(ctx->block_len > (MB_SHA1_BLOCK_LEN - 8)) {
+		memset(ctx->block + ctx->block_len, 0, MB_SHA1_BLOCK_LEN - ctx->block_len);
+		mb_sha1_transform(ctx->h, ctx->block);
+		ctx->block_len = 0;
+	}
+	memset(ctx->block + ctx->block_len, 0, MB_SHA1_BLOCK_LEN - 8 - ctx->block_len);
+	for(i = 0; i < 8; i++) {
+		ctx->block[MB_SHA1_BLOCK_LEN - 1 - i] = (guchar)(bits >> (i * 8));
+	}
+	mb_sha1_transform(ctx->h, ctx->block);
+	for(i = 0; i < 5; i++) {
+		digest[i * 4] = (guchar)(ctx->h[i] >> 24);
+		digest[i * 4 + 1] = (guchar)(ctx->h[i] >> 16);
+		digest[i * 4 + 2] = (guchar)(ctx->h[i] >> 8);
+		digest[i * 4 + 3] = (guchar)ctx->h[i];
+	}
+}
+
+void mb_hmac_sha1_set_key(MbHmacSha1 * hmac, const guchar * key, gsize key_len)
+{
+	guchar pad[MB_SHA1_BLOCK_LEN];
+	MbSha1 ctx;
+	gsize i;
+
+	memset(pad, 0, sizeof(pad));
+	if(key_len > MB_SHA1_BLOCK_LEN) {
+		mb_sha1_init(&ctx);
+		mb_sha1_update(&ctx, key, key_len);
+		mb_sha1_final(&ctx, pad);
+	} else {
+		memcpy(pad, key, key_len);
+	}
+
+	for(i = 0; i < MB_SHA1_BLOCK_LEN; i++) {
+		pad[i] ^= 0x36;
+	}
+	mb_sha1_init(&hmac->inner);
+	mb_sha1_update(&hmac->inner, pad, MB_SHA1_BLOCK_LEN);
+
+	// 0x36 ^ 0x5c turns inner pad into outer pad
+	for(i = 0; i < MB_SHA1_BLOCK_LEN; i++) {
+		pad[i] ^= (0x36 ^ 0x5c);
+	}
+	mb_sha1_init(&hmac->outer);
+	mb_sha1_update(&hmac->outer, pad, MB_SHA1_BLOCK_LEN);
+	memset(pad, 0, sizeof(pad));
+}
+
+void mb_hmac_sha1(const MbHmacSha1 * hmac, const guchar * data, gsize len, guchar digest[MB_SHA1_DIGEST_LEN])
+{
+	MbSha1 ctx;
+	guchar inner[MB_SHA1_DIGEST_LEN];
+
+	ctx = hmac->inner;
+	mb_sha1_update(&ctx, data, len);
+	mb_sha1_final(&ctx, inner);
+
+	ctx = hmac->outer;
+	mb_sha1_update(&ctx, inner, sizeof(inner));
+	mb_sha1_final(&ctx, digest);
+}
@@ -0,0 +1,79 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * SHA-1 and HMAC-SHA1
+ *
+ * HMAC key is turned into inner and outer hash state once, signing a message then
+ * costs only the hashing of the message and of one digest.
+ */
+
+#ifndef __MB_SHA1__
+#define __MB_SHA1__
+
+#include <glib.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MB_SHA1_BLOCK_LEN 64
+#define MB_SHA1_DIGEST_LEN 20
+
+typedef struct _MbSha1 {
+	guint32 h[5];
+	guint64 total; //< bytes hashed so far
+	guchar block[MB_SHA1_BLOCK_LEN];
+	gsize block_len;
+} MbSha1;
+
+typedef struct _MbHmacSha1 {
+	MbSha1 inner; //< state after hashing key XOR ipad
+	MbSha1 outer; //< state after hashing key XOR opad
+} MbHmacSha1;
+
+extern void mb_sha1_init(MbSha1 * ctx);
+extern void mb_sha1_update(MbSha1 * ctx, const guchar * data, gsize len);
+extern void mb_sha1_final(MbSha1 * ctx, guchar digest[MB_SHA1_DIGEST_LEN]);
+
+/*
+	Derive inner and outer state from key, key longer than a block is hashed first
+*/
+extern void mb_hmac_sha1_set_key(MbHmacSha1 * hmac, const guchar * key, gsize key_len);
+
+/*
+	HMAC of data, hmac is not modified so it can sign any number of messages
+*/
+extern void mb_hmac_sha1(const MbHmacSha1 * hmac, const guchar * data, gsize len, guchar digest[MB_SHA1_DIGEST_LEN]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,266 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/*
+ * Runtime state file of an account
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#ifdef _WIN32
+#	include <win32dep.h>
+#	include <io.h>
+#endif
+
+#include <debug.h>
+#include <util.h>
+
+#include "twitter.h"
+#include "mb_cache.h"
+#include "mb_state.h"
+
+#define DBGID "mb_state"
+
+#define MB_STATE_HEADER "mbstate"
+
+MbState * mb_state_new(MbAccount * ma)
+{
+	MbState * state = g_new0(MbState, 1);
+	gchar * user = NULL, * host = NULL;
+
+	// identica doesn't initialize cache itself
+	mb_cache_init();
+	mb_get_user_host(ma, &user, &host);
+	state->path = g_strdup_printf("%s/%s/%s/state", mb_cache_base_dir(), host, user);
+	g_free(user);
+	g_free(host);
+	state->timelines = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	return state;
+}
+
+void mb_state_free(MbState * state)
+{
+	g_hash_table_destroy(state->timelines);
+	g_free(state->path);
+	g_free(state);
+}
+
+void mb_state_touch(MbState * state)
+{
+	state->dirty = TRUE;
+	state->stat_updates++;
+}
+
+unsigned long long mb_state_get_timeline(MbState * state, const gchar * key)
+{
+	mb_status_t * id = g_hash_table_lookup(state->timelines, key);
+
+	return id ? *id : 0;
+}
+
+void mb_state_set_timeline(MbState * state, const gchar * key, unsigned long long id)
+{
+	mb_status_t * cur = g_hash_table_lookup(state->timelines, key);
+
+	if(cur) {
+		if(*cur >= id) {
+			return;
+		}
+		*cur = id;
+	} else {
+		cur = g_new(mb_status_t, 1);
+		*cur = id;
+		g_hash_table_insert(state->timelines, g_strdup(key), cur);
+	}
+	mb_state_touch(state);
+}
+
+/*
+	Fields are separated by tab and records by new line, values with either can not be saved
+*/
+static gboolean mb_state_field_ok(const gchar * str)
+{
+	return !str || (strpbrk(str, "\t\r\n") == NULL);
+}
+
+static void mb_state_write_timeline(gpointer key, gpointer value, gpointer user_data)
+{
+	if(mb_state_field_ok(key)) {
+		g_string_append_printf(user_data, "timeline\t%llu\t%s\n", *(mb_status_t *)value, (gchar *)key);
+	}
+}
+
+static void mb_state_write_sent(gpointer key, gpointer value, gpointer user_data)
+{
+	if(mb_state_field_ok(key)) {
+		g_string_append_printf(user_data, "sent\t%s\n", (gchar *)key);
+	}
+}
+
+static void mb_state_write_validator(gpointer key, gpointer value, gpointer user_data)
+{
+	TwitterValidator * validator = value;
+
+	// query comes last, lines written without it are still read
+	if(mb_state_field_ok(key) && mb_state_field_ok(validator->etag) && mb_state_field_ok(validator->last_modified) &&
+			validator->query && mb_state_field_ok(validator->query)) {
+		g_string_append_printf(user_data, "validator\t%d\t%s\t%s\t%s\t%s\n", validator->body_len,
+				validator->etag ? validator->etag : "", validator->last_modified ? validator->last_modified : "", (gchar *)key, validator->query);
+	}
+}
+
+/*
+	Replace file with data, file has either old or new content if we crash in between
+*/
+static gboolean mb_state_write_file(const gchar * path, const GString * data)
+{
+	gchar * tmp_path = g_strdup_printf("%s.tmp", path);
+	FILE * fp;
+	gboolean ok;
+
+	fp = g_fopen(tmp_path, "wb");
+	if(!fp) {
+		purple_debug_error(DBGID, "can not create %s, %s\n", tmp_path, g_strerror(errno));
+		g_free(tmp_path);
+		return FALSE;
+	}
+	ok = (fwrite(data->str, 1, data->len, fp) == data->len) && (fflush(fp) == 0);
+	// data must be on disk before rename makes it the state
+#ifdef _WIN32
+	ok = ok && (_commit(_fileno(fp)) == 0);
+#else
+	ok = ok && (fsync(fileno(fp)) == 0);
+#endif
+	ok = (fclose(fp) == 0) && ok;
+#ifdef _WIN32
+	// rename doesn't replace existing file on windows
+	if(ok) {
+		g_unlink(path);
+	}
+#endif
+	if(!ok || (g_rename(tmp_path, path) != 0)) {
+		purple_debug_error(DBGID, "can not write %s, %s\n", path, g_strerror(errno));
+		g_unlink(tmp_path);
+		g_free(tmp_path);
+		return FALSE;
+	}
+	g_free(tmp_path);
+	return TRUE;
+}
+
+gboolean mb_state_flush(MbState * state, MbAccount * ma)
+{
+	GString * data;
+	gchar * dir;
+	gboolean retval;
+
+	if(!state->dirty) {
+		return TRUE;
+	}
+	dir = g_path_get_dirname(state->path);
+	if(!g_file_test(dir, G_FILE_TEST_IS_DIR)) {
+		purple_build_dir(dir, 0700);
+	}
+	g_free(dir);
+
+	data = g_string_sized_new(1024);
+	g_string_append_printf(data, "%s\t%d\n", MB_STATE_HEADER, MB_STATE_VERSION);
+	g_string_append_printf(data, "last\t%llu\n", ma->last_msg_id);
+	g_hash_table_foreach(state->timelines, mb_state_write_timeline, data);
+	if(ma->sent_id_hash) {
+		g_hash_table_foreach(ma->sent_id_hash, mb_state_write_sent, data);
+	}
+	if(ma->validators) {
+		g_hash_table_foreach(ma->validators, mb_state_write_validator, data);
+	}
+	retval = mb_state_write_file(state->path, data);
+	g_string_free(data, TRUE);
+	if(retval) {
+		state->dirty = FALSE;
+		state->stat_writes++;
+	}
+	return retval;
+}
+
+gboolean mb_state_load(MbState * state, MbAccount * ma)
+{
+	gchar * content = NULL;
+	gchar ** lines, ** line, ** fields;
+	gchar * id_str;
+	gchar header[32];
+	TwitterValidator * validator;
+
+	if(!g_file_get_contents(state->path, &content, NULL, NULL)) {
+		return FALSE;
+	}
+	snprintf(header, sizeof(header), "%s\t%d\n", MB_STATE_HEADER, MB_STATE_VERSION);
+	if(!g_str_has_prefix(content, header)) {
+		purple_debug_info(DBGID, "ignoring %s, unknown format\n", state->path);
+		g_free(content);
+		return FALSE;
+	}
+	lines = g_strsplit(content + strlen(header), "\n", 0);
+	g_free(content);
+	for(line = lines; *line; line++) {
+		fields = g_strsplit(*line, "\t", 6);
+		if(!fields[0] || !fields[1]) {
+			// empty line at the end
+		} else if(strcmp(fields[0], "last") == 0) {
+			ma->last_msg_id = strtoull(fields[1], NULL, 10);
+		} else if( (strcmp(fields[0], "timeline") == 0) && fields[2] ) {
+			mb_state_set_timeline(state, fields[2], strtoull(fields[1], NULL, 10));
+		} else if(strcmp(fields[0], "sent") == 0) {
+			id_str = g_strdup(fields[1]);
+			g_hash_table_replace(ma->sent_id_hash, id_str, id_str);
+		} else if( (strcmp(fields[0], "validator") == 0) && fields[2] && fields[3] && fields[4] ) {
+			validator = g_new0(TwitterValidator, 1);
+			validator->body_len = (gint)strtol(fields[1], NULL, 10);
+			validator->etag = (fields[2][0] != '\0') ? g_strdup(fields[2]) : NULL;
+			validator->last_modified = (fields[3][0] != '\0') ? g_strdup(fields[3]) : NULL;
+			validator->query = fields[5] ? g_strdup(fields[5]) : NULL;
+			g_hash_table_replace(ma->validators, g_strdup(fields[4]), validator);
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	// what we just read is what's on disk
+	state->dirty = FALSE;
+	state->stat_updates = 0;
+	purple_debug_info(DBGID, "state loaded from %s, last_msg_id = %llu\n", state->path, ma->last_msg_id);
+	return TRUE;
+}
@@ -0,0 +1,101 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/*
+ * Runtime state of an account, kept in a file of its own under the cache directory
+ *
+ * Last message ids, ids of messages sent by the user and timeline validators change with every
+ * response. Saving them as account settings rewrites accounts.xml each time, so they're kept here
+ * instead, marked dirty as they change and written once per response and when account is closed.
+ */
+
+#ifndef __MB_STATE__
+#define __MB_STATE__
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MB_STATE_VERSION 1
+
+struct _MbAccount;
+
+typedef struct _MbState {
+	gchar * path; //< state file, written to path.tmp then renamed over it
+	GHashTable * timelines; //< newest status id seen in each timeline, key is timeline request
+	gboolean dirty; //< changed since last write
+	guint stat_updates; //< changes marked
+	guint stat_writes; //< times the file was written
+} MbState;
+
+/*
+	Create state of account, file is in cache_dir/host/user/state
+
+	@return new state, nothing is read yet
+*/
+extern MbState * mb_state_new(struct _MbAccount * ma);
+extern void mb_state_free(MbState * state);
+
+/*
+	Read state into account
+
+	Fills ma->last_msg_id, ma->sent_id_hash and ma->validators
+	@return FALSE if there's no valid state file, nothing is changed then
+*/
+extern gboolean mb_state_load(MbState * state, struct _MbAccount * ma);
+
+/*
+	Write state if anything changed since last write
+
+	@return FALSE if the file can not be written, state stays dirty
+*/
+extern gboolean mb_state_flush(MbState * state, struct _MbAccount * ma);
+
+/*
+	Mark state changed, it's written on next mb_state_flush
+*/
+extern void mb_state_touch(MbState * state);
+
+/*
+	Newest status id seen in a timeline, 0 if none
+*/
+extern unsigned long long mb_state_get_timeline(MbState * state, const gchar * key);
+
+/*
+	Remember newest status id of a timeline, older ids are ignored
+*/
+extern void mb_state_set_timeline(MbState * state, const gchar * key, unsigned long long id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,398 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <string.h>
+
+#include "mb_urlenc.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+	(defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define MB_URLENC_X86
+#include <immintrin.h>
+#endif
+
+#define MB_URL_UNRESERVED(c) (g_ascii_isalnum(c) || ((c) == '-') || ((c) == '.') || ((c) == '_') || ((c) == '~'))
+
+static const gchar mb_url_hex[] = "0123456789ABCDEF";
+
+static gint mb_urlenc_impl = -1; //< chosen on first use
+
+/*
+	Write %XX of c
+
+	@return end of output
+*/
+static inline gchar * mb_url_put_escape(gchar * d, guchar c)
+{
+	d[0] = '%';
+	d[1] = mb_url_hex[c >> 4];
+	d[2] = mb_url_hex[c & 0xf];
+	return d + 3;
+}
+
+static gsize mb_url_encode_len_scalar(const gchar * src, gsize len)
+{
+	gsize i, out = len;
+
+	for(i = 0; i < len; i++) {
+		if(!MB_URL_UNRESERVED(src[i])) {
+			out += 2;
+		}
+	}
+	return out;
+}
+
+static gsize mb_url_encode_scalar(gchar * dst, const gchar * src, gsize len)
+{
+	gchar * d = dst;
+	gsize i;
+
+	for(i = 0; i < len; i++) {
+		if(MB_URL_UNRESERVED(src[i])) {
+			*d++ = src[i];
+		} else {
+			d = mb_url_put_escape(d, (guchar)src[i]);
+		}
+	}
+	return d - dst;
+}
+
+/*
+	Decode from src[i], which is '%'
+
+	@return end of output, i is moved past what was consumed
+*/
+static inline gchar * mb_url_take_escape(gchar * d, const gchar * src, gsize len, gsize * i)
+{
+	gint hi, lo;
+
+	if( ((*i + 2) < len) && ((hi = g_ascii_xdigit_value(src[*i + 1])) >= 0) &&
+			((lo = g_ascii_xdigit_value(src[*i + 2])) >= 0) ) {
+		*d = (gchar)((hi << 4) | lo);
+		(*i) += 3;
+	} else {
+		*d = '%';
+		(*i)++;
+	}
+	return d + 1;
+}
+
+static gsize mb_url_decode_scalar(gchar * dst, const gchar * src, gsize len)
+{
+	gchar * d = dst;
+	gsize i = 0;
+
+	while(i < len) {
+		if(src[i] == '%') {
+			d = mb_url_take_escape(d, src, len, &i);
+		} else {
+			*d++ = src[i++];
+		}
+	}
+	return d - dst;
+}
+
+#ifdef MB_URLENC_X86
+
+/*
+	SSE2 and AVX2 kernels
+
+	Signed byte compares keep bytes >= 0x80 out of every range. Letters are tested once
+	after clearing bit 0x20, which maps 'a'-'z' onto 'A'-'Z'. Encoder stores whole vectors
+	and only advances by the bytes that belong there, it runs while one more block of input
+	follows, since that block's output always covers the overhang. AVX2 kernels leave the
+	tail to SSE2 ones, after vzeroupper so the CPU does not pay for mixing encodings.
+*/
+
+__attribute__((target("sse2")))
+static inline guint32 mb_url_unreserved_mask16(__m128i v)
+{
+	__m128i digit, alpha, up, mark;
+
+	digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	up = _mm_andnot_si128(_mm_set1_epi8(0x20), v);
+	alpha = _mm_and_si128(_mm_cmpgt_epi8(up, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(up, _mm_set1_epi8('Z' + 1)));
+	mark = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')), _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))),
+			_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')), _mm_cmpeq_epi8(v, _mm_set1_epi8('~'))));
+	return (guint32)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(digit, alpha), mark));
+}
+
+__attribute__((target("sse2")))
+static gsize mb_url_encode_len_sse2(const gchar * src, gsize len)
+{
+	gsize i = 0, out = 0;
+
+	for(; (i + 16) <= len; i += 16) {
+		out += 16 + 2 * __builtin_popcount(~mb_url_unreserved_mask16(_mm_loadu_si128((const __m128i *)(src + i))) & 0xffff);
+	}
+	return out + mb_url_encode_len_scalar(src + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static gsize mb_url_encode_sse2(gchar * dst, const gchar * src, gsize len)
+{
+	gchar * d = dst;
+	gsize i = 0;
+	guint32 reserved, pos, k;
+	__m128i v;
+
+	for(; (i + 32) <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		reserved = ~mb_url_unreserved_mask16(v) & 0xffff;
+		if(!reserved) {
+			_mm_storeu_si128((__m128i *)d, v);
+			d += 16;
+			continue;
+		}
+		for(pos = 0; reserved; reserved &= reserved - 1) {
+			k = __builtin_ctz(reserved);
+			_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)(src + i + pos)));
+			d = mb_url_put_escape(d + (k - pos), (guchar)src[i + k]);
+			pos = k + 1;
+		}
+		_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)(src + i + pos)));
+		d += 16 - pos;
+	}
+	return (d - dst) + mb_url_encode_scalar(d, src + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static gsize mb_url_decode_sse2(gchar * dst, const gchar * src, gsize len)
+{
+	gchar * d = dst;
+	gsize i = 0;
+	guint32 pct;
+	__m128i v;
+
+	// Output never gets ahead of input, so a whole vector store stays inside dst
+	while((i + 16) <= len) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)d, v);
+		pct = (guint32)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('%')));
+		if(!pct) {
+			d += 16;
+			i += 16;
+			continue;
+		}
+		d += __builtin_ctz(pct);
+		i += __builtin_ctz(pct);
+		d = mb_url_take_escape(d, src, len, &i);
+	}
+	return (d - dst) + mb_url_decode_scalar(d, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline guint32 mb_url_unreserved_mask32(__m256i v)
+{
+	__m256i digit, alpha, up, mark;
+
+	digit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+	up = _mm256_andnot_si256(_mm256_set1_epi8(0x20), v);
+	alpha = _mm256_and_si256(_mm256_cmpgt_epi8(up, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), up));
+	mark = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('-')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'))),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('~'))));
+	return (guint32)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(digit, alpha), mark));
+}
+
+__attribute__((target("avx2")))
+static gsize mb_url_encode_len_avx2(const gchar * src, gsize len)
+{
+	gsize i = 0, out = 0;
+
+	for(; (i + 32) <= len; i += 32) {
+		out += 32 + 2 * __builtin_popcount(~mb_url_unreserved_mask32(_mm256_loadu_si256((const __m256i *)(src + i))));
+	}
+	_mm256_zeroupper();
+	return out + mb_url_encode_len_sse2(src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline void mb_url_copy_run16(gchar * d, const gchar * s, guint32 n)
+{
+	_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((const __m128i *)s));
+	if(n > 16) {
+		_mm_storeu_si128((__m128i *)(d + 16), _mm_loadu_si128((const __m128i *)(s + 16)));
+	}
+}
+
+__attribute__((target("avx2")))
+static gsize mb_url_encode_avx2(gchar * dst, const gchar * src, gsize len)
+{
+	gchar * d = dst;
+	gsize i = 0;
+	guint32 reserved, pos, k;
+	__m256i v;
+
+	// Runs are copied 16 bytes at a time, so only 16 bytes of lookahead are needed
+	for(; (i + 48) <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		reserved = ~mb_url_unreserved_mask32(v);
+		if(!reserved) {
+			_mm256_storeu_si256((__m256i *)d, v);
+			d += 32;
+			continue;
+		}
+		for(pos = 0; reserved; reserved &= reserved - 1) {
+			k = __builtin_ctz(reserved);
+			mb_url_copy_run16(d, src + i + pos, k - pos);
+			d = mb_url_put_escape(d + (k - pos), (guchar)src[i + k]);
+			pos = k + 1;
+		}
+		mb_url_copy_run16(d, src + i + pos, 32 - pos);
+		d += 32 - pos;
+	}
+	_mm256_zeroupper();
+	return (d - dst) + mb_url_encode_sse2(d, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static gsize mb_url_decode_avx2(gchar * dst, const gchar * src, gsize len)
+{
+	gchar * d = dst;
+	gsize i = 0;
+	guint32 pct;
+	__m256i v;
+
+	while((i + 32) <= len) {
+		v = _mm256_loadu_si256((const __m256i *)(src + i));
+		_mm256_storeu_si256((__m256i *)d, v);
+		pct = (guint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('%')));
+		if(!pct) {
+			d += 32;
+			i += 32;
+			continue;
+		}
+		d += __builtin_ctz(pct);
+		i += __builtin_ctz(pct);
+		d = mb_url_take_escape(d, src, len, &i);
+	}
+	_mm256_zeroupper();
+	return (d - dst) + mb_url_decode_sse2(d, src + i, len - i);
+}
+
+#endif
+
+gint mb_urlenc_set_impl(gint impl)
+{
+	gint best = MB_URLENC_SCALAR;
+
+#ifdef MB_URLENC_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		best = MB_URLENC_AVX2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		best = MB_URLENC_SSE2;
+	}
+#endif
+	mb_urlenc_impl = CLAMP(impl, MB_URLENC_SCALAR, best);
+	return mb_urlenc_impl;
+}
+
+const gchar * mb_urlenc_impl_name(gint impl)
+{
+	static const gchar * names[] = { "scalar", "sse2", "avx2" };
+
+	if( (impl < MB_URLENC_SCALAR) || (impl > MB_URLENC_AVX2) ) {
+		return "unknown";
+	}
+	return names[impl];
+}
+
+gsize mb_url_encode_len(const gchar * src, gsize len)
+{
+	if(G_UNLIKELY(mb_urlenc_impl < 0)) {
+		mb_urlenc_set_impl(MB_URLENC_AVX2);
+	}
+	switch(mb_urlenc_impl) {
+#ifdef MB_URLENC_X86
+		case MB_URLENC_AVX2 :
+			return mb_url_encode_len_avx2(src, len);
+		case MB_URLENC_SSE2 :
+			return mb_url_encode_len_sse2(src, len);
+#endif
+		default :
+			return mb_url_encode_len_scalar(src, len);
+	}
+}
+
+gsize mb_url_encode(gchar * dst, const gchar * src, gsize len)
+{
+	gsize out;
+
+	if(G_UNLIKELY(mb_urlenc_impl < 0)) {
+		mb_urlenc_set_impl(MB_URLENC_AVX2);
+	}
+	switch(mb_urlenc_impl) {
+#ifdef MB_URLENC_X86
+		case MB_URLENC_AVX2 :
+			out = mb_url_encode_avx2(dst, src, len);
+			break;
+		case MB_URLENC_SSE2 :
+			out = mb_url_encode_sse2(dst, src, len);
+			break;
+#endif
+		default :
+			out = mb_url_encode_scalar(dst, src, len);
+			break;
+	}
+	dst[out] = '\0';
+	return out;
+}
+
+gchar * mb_url_encode_dup(const gchar * src)
+{
+	gchar * retval;
+	gsize len;
+
+	if(!src) {
+		return NULL;
+	}
+	len = strlen(src);
+	retval = g_malloc(mb_url_encode_len(src, len) + 1);
+	mb_url_encode(retval, src, len);
+	return retval;
+}
+
+gsize mb_url_decode(gchar * dst, const gchar * src, gsize len)
+{
+	gsize out;
+
+	if(G_UNLIKELY(mb_urlenc_impl < 0)) {
+		mb_urlenc_set_impl(MB_URLENC_AVX2);
+	}
+	switch(mb_urlenc_impl) {
+#ifdef MB_URLENC_X86
+		case MB_URLENC_AVX2 :
+			out = mb_url_decode_avx2(dst, src, len);
+			break;
+		case MB_URLENC_SSE2 :
+			out = mb_url_decode_sse2(dst, src, len);
+			break;
+#endif
+		default :
+			out = mb_url_decode_scalar(dst, src, len);
+			break;
+	}
+	dst[out] = '\0';
+	return out;
+}
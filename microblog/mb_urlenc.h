@@ -0,0 +1,104 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * Percent-encoding of RFC 3986
+ *
+ * Unreserved characters (ALPHA, DIGIT, "-", ".", "_" and "~") are copied, every other byte
+ * becomes %XX with upper case hex digits, same output as purple_url_encode but without its
+ * 2048 bytes limit. Blocks of input are classified with SSE2 or AVX2 when the CPU has them.
+ */
+
+#ifndef __MB_URLENC__
+#define __MB_URLENC__
+
+#include <glib.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum mb_urlenc_impl {
+	MB_URLENC_SCALAR = 0,
+	MB_URLENC_SSE2 = 1,
+	MB_URLENC_AVX2 = 2,
+};
+
+/*
+	Length of encoded text
+
+	@param src text to encode, may contain '\0'
+	@param len length of src
+	@return length of encoded text, not counting terminating '\0'
+*/
+extern gsize mb_url_encode_len(const gchar * src, gsize len);
+
+/*
+	Encode text
+
+	@param dst output, must hold mb_url_encode_len(src, len) + 1 bytes
+	@return length of encoded text, dst is '\0' terminated
+*/
+extern gsize mb_url_encode(gchar * dst, const gchar * src, gsize len);
+
+/*
+	Encode string to newly allocated buffer
+
+	@return encoded string, free with g_free. NULL if src is NULL
+*/
+extern gchar * mb_url_encode_dup(const gchar * src);
+
+/*
+	Decode text
+
+	Only valid %XX triplets are decoded, any other '%' is copied as is. '+' is not a space here.
+
+	@param dst output, must hold len + 1 bytes
+	@return length of decoded text, dst is '\0' terminated
+*/
+extern gsize mb_url_decode(gchar * dst, const gchar * src, gsize len);
+
+/*
+	Choose implementation, for benchmark and tests
+
+	@param impl one of mb_urlenc_impl
+	@return implementation in use, lower than impl if the CPU can not run it
+*/
+extern gint mb_urlenc_set_impl(gint impl);
+
+/*
+	Name of implementation, for display
+*/
+extern const gchar * mb_urlenc_impl_name(gint impl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -45,6 +45,8 @@
 #include <version.h>
 #include <util.h>
 
+#include "mb_util.h"
+
 #ifdef _WIN32
 #	include <win32dep.h>
 #else
@@ -160,16 +162,16 @@ time_t mb_mktime(char * time_str)
 	msg_time.tm_year = strtoul(cur, NULL, 10) - 1900;
 
 //#ifdef UTEST
-	purple_debug_info(DBGID, "msg_time.tm_wday = %d\n", msg_time.tm_wday);
-	purple_debug_info(DBGID, "msg_time.tm_mday = %d\n", msg_time.tm_mday);
-	purple_debug_info(DBGID, "msg_time.tm_mon = %d\n", msg_time.tm_mon);
-	purple_debug_info(DBGID, "msg_time.tm_year = %d\n", msg_time.tm_year);
-	purple_debug_info(DBGID, "msg_time.tm_hour = %d\n", msg_time.tm_hour);
-	purple_debug_info(DBGID, "msg_time.tm_min = %d\n", msg_time.tm_min);
-	purple_debug_info(DBGID, "msg_time.tm_sec = %d\n", msg_time.tm_sec);
-	purple_debug_info(DBGID, "cur_timezone = %d\n", cur_timezone);
-	purple_debug_info(DBGID, "msg_time.tm_isdst = %d\n", msg_time.tm_isdst);
-	purple_debug_info(DBGID, "finished\n");
+	mb_debug_info(DBGID, "msg_time.tm_wday = %d\n", msg_time.tm_wday);
+	mb_debug_info(DBGID, "msg_time.tm_mday = %d\n", msg_time.tm_mday);
+	mb_debug_info(DBGID, "msg_time.tm_mon = %d\n", msg_time.tm_mon);
+	mb_debug_info(DBGID, "msg_time.tm_year = %d\n", msg_time.tm_year);
+	mb_debug_info(DBGID, "msg_time.tm_hour = %d\n", msg_time.tm_hour);
+	mb_debug_info(DBGID, "msg_time.tm_min = %d\n", msg_time.tm_min);
+	mb_debug_info(DBGID, "msg_time.tm_sec = %d\n", msg_time.tm_sec);
+	mb_debug_info(DBGID, "cur_timezone = %d\n", cur_timezone);
+	mb_debug_info(DBGID, "msg_time.tm_isdst = %d\n", msg_time.tm_isdst);
+	mb_debug_info(DBGID, "finished\n");
 //#endif
 
 #ifndef __WIN32
@@ -182,10 +184,23 @@ time_t mb_mktime(char * time_str)
 //	retval = purple_time_build(msg_time.tm_year + 1900, msg_time.tm_mon, msg_time.tm_mday, msg_time.tm_hour, msg_time.tm_min, msg_time.tm_sec);
 	retval = (mktime(&msg_time) - cur_timezone) + wpurple_get_tz_offset();
 #endif
-	purple_debug_info(DBGID, "final msg_time = %ld\n", retval);
+	mb_debug_info(DBGID, "final msg_time = %ld\n", retval);
 	return retval;
 }
 
+static GThread * mb_main_thread = NULL;
+
+void mb_set_main_thread(void)
+{
+	mb_main_thread = g_thread_self();
+}
+
+gboolean mb_is_main_thread(void)
+{
+	// until it's set there's no other thread
+	return (mb_main_thread == NULL) || (g_thread_self() == mb_main_thread);
+}
+
 const char * mb_get_uri_txt(PurpleAccount * pa)
 {
 	if (strcmp(pa->protocol_id, "prpl-mbpurple-twitter") == 0) {
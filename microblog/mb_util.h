@@ -39,6 +39,15 @@ extern void mb_account_set_idhash(PurpleAccount * account, const char * name, GH
 extern void mb_account_get_idhash(PurpleAccount * account, const char * name, GHashTable * id_hash);
 extern gchar * mb_url_unparse(const char * host, int port, const char * path, const char * params, gboolean use_https);
 
+/*
+	Remember calling thread as main thread, before any other thread runs plug-in code
+*/
+extern void mb_set_main_thread(void);
+extern gboolean mb_is_main_thread(void);
+
+/* purple_debug_info that keeps quiet off the main thread, libpurple debug UI is not thread safe */
+#define mb_debug_info(...) do { if(mb_is_main_thread()) purple_debug_info(__VA_ARGS__); } while(0)
+
 #ifdef __cplusplus
 }
 #endif
@@ -26,6 +26,11 @@
 #include <time.h>
 #include <debug.h>
 #include "tw_cmd.h"
+#include "mb_net.h"
+#include "tw_sched.h"
+#include "tw_stream.h"
+#include "mb_state.h"
+#include "mb_io.h"
 
 #define DBGID "tw_cmd"
 
@@ -48,6 +53,8 @@ static PurpleCmdRet tw_cmd_btag(PurpleConversation * conv, const gchar * cmd, gc
 static PurpleCmdRet tw_cmd_untag(PurpleConversation * conv, const gchar * cmd, gchar ** args, gchar ** error, TwCmdArg * data);
 static PurpleCmdRet tw_cmd_set_tag(PurpleConversation * conv, const gchar * cmd, gchar ** args, gchar ** error, TwCmdArg * data, gint position);
 static PurpleCmdRet tw_cmd_get_user_tweets(PurpleConversation * conv, const gchar * cmd, gchar ** args, gchar ** error, TwCmdArg * data);
+static PurpleCmdRet tw_cmd_stats(PurpleConversation * conv, const gchar * cmd, gchar ** args, gchar ** error, TwCmdArg * data);
+static PurpleCmdRet tw_cmd_status(PurpleConversation * conv, const gchar * cmd, gchar ** args, gchar ** error, TwCmdArg * data);
 
 static TwCmdEnum tw_cmd_enum[] = {
 	{"replies", "", PURPLE_CMD_P_PRPL, 0, tw_cmd_replies, NULL,
@@ -64,6 +71,10 @@ static TwCmdEnum tw_cmd_enum[] = {
 		"unset already set tag"},
 	{"get", "w", PURPLE_CMD_P_PRPL, 0, tw_cmd_get_user_tweets, NULL,
 		"get specific user timeline. Use /get <screen_name> to fetch."},
+	{"stats", "", PURPLE_CMD_P_PRPL, 0, tw_cmd_stats, NULL,
+		"show network statistics of this account."},
+	{"status", "", PURPLE_CMD_P_PRPL, 0, tw_cmd_status, NULL,
+		"show how often each timeline is polled and what's left of rate limit."},
 };
 
 PurpleCmdRet tw_cmd_tag(PurpleConversation * conv, const gchar * cmd, gchar ** args, gchar ** error, TwCmdArg * data)
@@ -136,6 +147,7 @@ PurpleCmdRet tw_cmd_refresh_rate(PurpleConversation * conv, const gchar * cmd, g
 	if( (*end_ptr) == '\0' ) {
 		if(new_rate > 10) {
 			purple_account_set_int(ma->account, mc_name(TC_MSG_REFRESH_RATE), new_rate);
+			tw_sched_set_interval(ma->sched, new_rate);
 			return PURPLE_CMD_RET_OK;
 		} else {
 			serv_got_im(ma->gc, mc_def(TC_FRIENDS_USER), _("new rate is too low, must be > 10 seconds"), PURPLE_MESSAGE_SYSTEM, time(NULL));
@@ -178,6 +190,71 @@ PurpleCmdRet tw_cmd_get_user_tweets(PurpleConversation * conv, const gchar * cmd
 	return PURPLE_CMD_RET_OK;
 }
 
+PurpleCmdRet tw_cmd_stats(PurpleConversation * conv, const gchar * cmd, gchar ** args, gchar ** error, TwCmdArg * data)
+{
+	MbAccount * ma = data->ma;
+	MbConnPool * pool = ma->conn_pool;
+	GString * msg;
+
+	purple_debug_info(DBGID, "%s called\n", __FUNCTION__);
+
+	msg = g_string_new(NULL);
+	if(pool) {
+		g_string_append_printf(msg, _("connections: %u opened, %u requests reused a connection, %u pipelined, %u stale reconnected, %u closed when idle, %u open (%u idle)"),
+				pool->stat_new, pool->stat_reused, pool->stat_pipelined, pool->stat_stale, pool->stat_idle_closed,
+				mb_conn_pool_count(pool, FALSE), mb_conn_pool_count(pool, TRUE));
+		g_string_append_printf(msg, _("; request data: %u recycled, %u allocated, %u kept free"),
+				pool->stat_data_hit, pool->stat_data_miss, pool->free_data_len);
+		g_string_append_printf(msg, _("; %u requests answered by an identical one in flight"), pool->stat_coalesced);
+		g_string_append_printf(msg, _("; %d of %d requests running, waited in queue: "), pool->in_flight, pool->max_in_flight);
+		mb_conn_pool_describe_latency(pool, msg);
+		g_string_append_printf(msg, _("; %u requests retried, %u timed out, %u cancelled; circuits: "),
+				pool->stat_retries, pool->stat_timeouts, pool->stat_cancelled);
+		mb_conn_describe_breakers(msg);
+		g_string_append(msg, _("; TLS: "));
+		mb_conn_pool_describe_tls(pool, msg);
+	}
+	g_string_append_printf(msg, _("%sconditional GET: %u timeline requests not modified, %llu bytes saved"),
+			msg->len > 0 ? "; " : "", ma->stat_not_modified, ma->stat_bytes_saved);
+	g_string_append_printf(msg, _("; gaps: %u found, %u statuses backfilled, %u not completely filled"),
+			ma->stat_gaps, ma->stat_backfilled, ma->stat_gaps_lost);
+	if(ma->state_file) {
+		g_string_append_printf(msg, _("; state file: %u changes saved in %u writes"),
+				ma->state_file->stat_updates, ma->state_file->stat_writes);
+	}
+	if(ma->use_workers) {
+		g_string_append_printf(msg, _("; decode threads: %u timelines, %.1f ms of decoding off main loop"),
+				ma->stat_worker_batches, ma->stat_worker_time * 1000.0);
+	}
+	if(ma->use_io) {
+		g_string_append(msg, _("; I/O thread: "));
+		mb_io_describe(msg);
+	}
+	if(ma->stream) {
+		g_string_append(msg, "; ");
+		tw_stream_describe(ma->stream, msg);
+	}
+	serv_got_im(ma->gc, mc_def(TC_FRIENDS_USER), msg->str, PURPLE_MESSAGE_SYSTEM, time(NULL));
+	g_string_free(msg, TRUE);
+
+	return PURPLE_CMD_RET_OK;
+}
+
+PurpleCmdRet tw_cmd_status(PurpleConversation * conv, const gchar * cmd, gchar ** args, gchar ** error, TwCmdArg * data)
+{
+	MbAccount * ma = data->ma;
+	GString * msg;
+
+	purple_debug_info(DBGID, "%s called\n", __FUNCTION__);
+
+	msg = g_string_new(NULL);
+	tw_sched_describe(ma->sched, msg);
+	serv_got_im(ma->gc, mc_def(TC_FRIENDS_USER), msg->str, PURPLE_MESSAGE_SYSTEM, time(NULL));
+	g_string_free(msg, TRUE);
+
+	return PURPLE_CMD_RET_OK;
+}
+
 /*
  * Convenient proxy for calling real function
  */
@@ -0,0 +1,544 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include <debug.h>
+
+#include "twitter.h"
+#include "mb_util.h"
+#include "mb_json.h"
+#include "mb_msg.h"
+#include "tw_decode.h"
+
+#define DBGID "tw_decode"
+
+//
+// Statuses are decoded while the response is being received, each one is turned
+// into TwitterMsg as soon as its status element or object is closed. No document tree is built.
+//
+// XML elements and JSON members are both seen as named nodes, so one state machine
+// handles both formats.
+//
+enum _TwitterMsgField {
+	TW_FIELD_NONE = -1,
+	TW_FIELD_ID = 0,
+	TW_FIELD_CREATED_AT,
+	TW_FIELD_TEXT,
+	TW_FIELD_FROM,
+	TW_FIELD_AVATAR_URL,
+	TW_FIELD_PROTECTED,
+	TW_FIELD_RT_TEXT,
+	TW_FIELD_RT_FROM,
+	TW_FIELD_MAX,
+};
+
+enum _TwitterMsgSection {
+	TW_SECTION_NONE = 0, //< outside of status
+	TW_SECTION_STATUS,
+	TW_SECTION_USER,
+	TW_SECTION_RT, //< retweeted_status
+	TW_SECTION_RT_USER,
+};
+
+enum _TwitterMsgFormat {
+	TW_FORMAT_UNKNOWN = 0, //< nothing but whitespace seen yet
+	TW_FORMAT_XML,
+	TW_FORMAT_JSON,
+};
+
+struct _TwitterMsgDecoder {
+	gint root;
+	gint format;
+	GMarkupParseContext * context; //< XML parser, created on first XML document
+	MbJsonParser * json; //< JSON parser, created on first JSON document
+	GString * json_key; //< name of the next JSON value
+	gboolean json_has_key;
+
+	gint depth; //< depth of current node, root node is 1
+	gint section;
+	gint section_depth; //< depth of node that opened current section
+	gint field; //< field being collected, TW_FIELD_NONE if text is not interesting
+	gint field_depth;
+	GString * text; //< text of field being collected
+	gchar * fields[TW_FIELD_MAX]; //< fields of current status, stored in batch
+	gboolean has_rt; //< current status is a retweet
+	gboolean failed; //< document is broken, the rest is ignored
+
+	MbMsgBatch * batch; //< decoded messages, in document order
+	time_t last_msg_time;
+	GString * line; //< partial line of a stream
+};
+
+static void tw_decoder_clear_fields(TwitterMsgDecoder * dec)
+{
+	gint i;
+
+	// strings belong to batch
+	for(i = 0; i < TW_FIELD_MAX; i++) {
+		dec->fields[i] = NULL;
+	}
+	dec->has_rt = FALSE;
+}
+
+/*
+	Current status is closed, turn it into TwitterMsg
+*/
+static void tw_decoder_emit(TwitterMsgDecoder * dec)
+{
+	gchar ** f = dec->fields;
+	TwitterMsg * cur_msg;
+	gchar * msg_txt = NULL;
+	time_t msg_time_t = 0;
+
+	if(f[TW_FIELD_CREATED_AT]) {
+		mb_debug_info(DBGID, "msg time = %s\n", f[TW_FIELD_CREATED_AT]);
+		msg_time_t = mb_mktime(f[TW_FIELD_CREATED_AT]);
+		if(dec->last_msg_time < msg_time_t) {
+			dec->last_msg_time = msg_time_t;
+		}
+	}
+	if(dec->has_rt) {
+		if(f[TW_FIELD_RT_FROM] && f[TW_FIELD_RT_TEXT]) {
+			// no field is being collected, so text buffer is free
+			g_string_printf(dec->text, "RT @%s: %s", f[TW_FIELD_RT_FROM], f[TW_FIELD_RT_TEXT]);
+			msg_txt = mb_msg_batch_strndup(dec->batch, dec->text->str, dec->text->len);
+		}
+	} else {
+		msg_txt = f[TW_FIELD_TEXT];
+	}
+
+	// user document has no text
+	if(f[TW_FIELD_FROM] && (msg_txt || (dec->root == TW_DECODE_USER)) ) {
+		cur_msg = mb_msg_batch_add(dec->batch);
+
+		mb_debug_info(DBGID, "from = %s, msg = %s\n", f[TW_FIELD_FROM], msg_txt ? msg_txt : "");
+		cur_msg->id = f[TW_FIELD_ID] ? strtoull(f[TW_FIELD_ID], NULL, 10) : 0;
+		cur_msg->from = f[TW_FIELD_FROM];
+		cur_msg->avatar_url = f[TW_FIELD_AVATAR_URL]; //< actually we don't need this for now
+		cur_msg->msg_time = msg_time_t;
+		cur_msg->is_protected = !(f[TW_FIELD_PROTECTED] && (strcmp(f[TW_FIELD_PROTECTED], "false") == 0));
+		cur_msg->flag = 0;
+		cur_msg->msg_txt = msg_txt;
+	}
+	tw_decoder_clear_fields(dec);
+}
+
+static void tw_decoder_enter(TwitterMsgDecoder * dec, gint section)
+{
+	dec->section = section;
+	dec->section_depth = dec->depth;
+}
+
+/*
+	A node is opened
+*/
+static void tw_decoder_start(TwitterMsgDecoder * dec, const gchar * name)
+{
+	gint field = TW_FIELD_NONE;
+	gint status_depth = (dec->root == TW_DECODE_TIMELINE) ? 2 : 1;
+
+	dec->depth++;
+	// <statuses><status><user><screen_name>, <status><retweeted_status><user><screen_name>
+	// only direct children of section node are interesting
+	if( (dec->section != TW_SECTION_NONE) && (dec->depth != dec->section_depth + 1) ) {
+		return;
+	}
+	switch(dec->section) {
+		case TW_SECTION_NONE :
+			if(dec->depth != status_depth) {
+				break;
+			}
+			if(dec->root == TW_DECODE_USER) {
+				if(strcmp(name, "user") == 0) {
+					tw_decoder_clear_fields(dec);
+					tw_decoder_enter(dec, TW_SECTION_USER);
+				}
+			} else if(strcmp(name, "status") == 0) {
+				tw_decoder_clear_fields(dec);
+				tw_decoder_enter(dec, TW_SECTION_STATUS);
+			}
+			break;
+		case TW_SECTION_STATUS :
+			if(strcmp(name, "id") == 0) {
+				field = TW_FIELD_ID;
+			} else if(strcmp(name, "created_at") == 0) {
+				field = TW_FIELD_CREATED_AT;
+			} else if(strcmp(name, "text") == 0) {
+				field = TW_FIELD_TEXT;
+			} else if(strcmp(name, "user") == 0) {
+				tw_decoder_enter(dec, TW_SECTION_USER);
+			} else if(strcmp(name, "retweeted_status") == 0) {
+				dec->has_rt = TRUE;
+				tw_decoder_enter(dec, TW_SECTION_RT);
+			}
+			break;
+		case TW_SECTION_USER :
+			if(strcmp(name, "screen_name") == 0) {
+				field = TW_FIELD_FROM;
+			} else if(strcmp(name, "profile_image_url") == 0) {
+				field = TW_FIELD_AVATAR_URL;
+			} else if(strcmp(name, "protected") == 0) {
+				field = TW_FIELD_PROTECTED;
+			} else if( (dec->root == TW_DECODE_USER) && (strcmp(name, "id") == 0) ) {
+				field = TW_FIELD_ID;
+			}
+			break;
+		case TW_SECTION_RT :
+			if(strcmp(name, "text") == 0) {
+				field = TW_FIELD_RT_TEXT;
+			} else if(strcmp(name, "user") == 0) {
+				tw_decoder_enter(dec, TW_SECTION_RT_USER);
+			}
+			break;
+		case TW_SECTION_RT_USER :
+			if(strcmp(name, "screen_name") == 0) {
+				field = TW_FIELD_RT_FROM;
+			}
+			break;
+	}
+	if(field != TW_FIELD_NONE) {
+		dec->field = field;
+		dec->field_depth = dec->depth;
+		g_string_truncate(dec->text, 0);
+	}
+}
+
+/*
+	Current node is closed
+*/
+static void tw_decoder_end(TwitterMsgDecoder * dec)
+{
+	if( (dec->field != TW_FIELD_NONE) && (dec->depth == dec->field_depth) ) {
+		dec->fields[dec->field] = mb_msg_batch_strndup(dec->batch, dec->text->str, dec->text->len);
+		dec->field = TW_FIELD_NONE;
+	}
+	if( (dec->section != TW_SECTION_NONE) && (dec->depth == dec->section_depth) ) {
+		// sections are nested directly in each other
+		switch(dec->section) {
+			case TW_SECTION_STATUS :
+				tw_decoder_emit(dec);
+				dec->section = TW_SECTION_NONE;
+				break;
+			case TW_SECTION_USER :
+				if(dec->root == TW_DECODE_USER) {
+					tw_decoder_emit(dec);
+					dec->section = TW_SECTION_NONE;
+				} else {
+					dec->section = TW_SECTION_STATUS;
+				}
+				break;
+			case TW_SECTION_RT :
+				dec->section = TW_SECTION_STATUS;
+				break;
+			case TW_SECTION_RT_USER :
+				dec->section = TW_SECTION_RT;
+				break;
+		}
+		dec->section_depth--;
+	}
+	dec->depth--;
+}
+
+static void tw_decoder_text(TwitterMsgDecoder * dec, const gchar * text, gsize text_len)
+{
+	if( (dec->field != TW_FIELD_NONE) && (dec->depth == dec->field_depth) ) {
+		g_string_append_len(dec->text, text, text_len);
+	}
+}
+
+static void tw_decoder_xml_start(GMarkupParseContext * context, const gchar * element_name,
+		const gchar ** attribute_names, const gchar ** attribute_values, gpointer user_data, GError ** error)
+{
+	tw_decoder_start(user_data, element_name);
+}
+
+static void tw_decoder_xml_end(GMarkupParseContext * context, const gchar * element_name, gpointer user_data, GError ** error)
+{
+	tw_decoder_end(user_data);
+}
+
+static void tw_decoder_xml_text(GMarkupParseContext * context, const gchar * text, gsize text_len, gpointer user_data, GError ** error)
+{
+	// text is already unescaped by GMarkup
+	tw_decoder_text(user_data, text, text_len);
+}
+
+static GMarkupParser tw_decoder_xml_parser = {
+	tw_decoder_xml_start,
+	tw_decoder_xml_end,
+	tw_decoder_xml_text,
+	NULL,
+	NULL,
+};
+
+/*
+	Name of a JSON value, member name inside object
+
+	Values without a name get the name of the matching XML element
+*/
+static const gchar * tw_decoder_json_name(TwitterMsgDecoder * dec)
+{
+	static const gchar * root_names[] = { "statuses", "status", "user", "status" };
+
+	if(dec->json_has_key) {
+		dec->json_has_key = FALSE;
+		return dec->json_key->str;
+	}
+	if(dec->depth == 0) {
+		return root_names[dec->root];
+	}
+	if( (dec->depth == 1) && (dec->root == TW_DECODE_TIMELINE) ) {
+		return "status";
+	}
+	return "";
+}
+
+static gboolean tw_decoder_json_token(MbJsonParser * parser, gint token, const gchar * text, gint len, gpointer user_data)
+{
+	TwitterMsgDecoder * dec = user_data;
+
+	switch(token) {
+		case MB_JSON_KEY :
+			g_string_truncate(dec->json_key, 0);
+			g_string_append_len(dec->json_key, text, len);
+			dec->json_has_key = TRUE;
+			break;
+		case MB_JSON_OBJECT_START :
+		case MB_JSON_ARRAY_START :
+			tw_decoder_start(dec, tw_decoder_json_name(dec));
+			break;
+		case MB_JSON_OBJECT_END :
+		case MB_JSON_ARRAY_END :
+			tw_decoder_end(dec);
+			break;
+		case MB_JSON_NULL :
+			// same as missing element, "retweeted_status": null is not a retweet
+			dec->json_has_key = FALSE;
+			break;
+		default :
+			// numbers are kept as written, so 64-bit id is exact
+			tw_decoder_start(dec, tw_decoder_json_name(dec));
+			tw_decoder_text(dec, text, len);
+			tw_decoder_end(dec);
+			break;
+	}
+	return TRUE;
+}
+
+TwitterMsgDecoder * tw_decoder_new(gint root)
+{
+	TwitterMsgDecoder * dec = g_new0(TwitterMsgDecoder, 1);
+
+	dec->root = root;
+	dec->text = g_string_sized_new(TW_STATUS_TXT_MAX * 2);
+	dec->json_key = g_string_sized_new(32);
+	dec->field = TW_FIELD_NONE;
+	dec->batch = mb_msg_batch_new();
+	return dec;
+}
+
+void tw_decoder_reset(TwitterMsgDecoder * dec)
+{
+	if(dec->context) {
+		// GMarkup context can not be rewound
+		g_markup_parse_context_free(dec->context);
+		dec->context = NULL;
+	}
+	if(dec->json) {
+		mb_json_parser_reset(dec->json);
+	}
+	dec->format = TW_FORMAT_UNKNOWN;
+	dec->json_has_key = FALSE;
+	if(dec->batch) {
+		mb_msg_batch_clear(dec->batch);
+	} else {
+		// previous batch was taken by tw_decoder_finish
+		dec->batch = mb_msg_batch_new();
+	}
+	tw_decoder_clear_fields(dec);
+	dec->depth = 0;
+	dec->section = TW_SECTION_NONE;
+	dec->section_depth = 0;
+	dec->field = TW_FIELD_NONE;
+	dec->failed = FALSE;
+	dec->last_msg_time = 0;
+	if(dec->line) {
+		g_string_truncate(dec->line, 0);
+	}
+}
+
+void tw_decoder_free(TwitterMsgDecoder * dec)
+{
+	tw_decoder_reset(dec);
+	mb_msg_batch_free(dec->batch);
+	if(dec->json) mb_json_parser_free(dec->json);
+	if(dec->line) g_string_free(dec->line, TRUE);
+	g_string_free(dec->json_key, TRUE);
+	g_string_free(dec->text, TRUE);
+	g_free(dec);
+}
+
+void tw_decoder_feed(TwitterMsgDecoder * dec, const gchar * buf, gint len)
+{
+	GError * error = NULL;
+	gint i;
+
+	if(dec->failed) {
+		return;
+	}
+	if(dec->format == TW_FORMAT_UNKNOWN) {
+		for(i = 0; (i < len) && g_ascii_isspace(buf[i]); i++);
+		if(i == len) {
+			return;
+		}
+		buf += i;
+		len -= i;
+		if(buf[0] == '<') {
+			dec->format = TW_FORMAT_XML;
+			dec->context = g_markup_parse_context_new(&tw_decoder_xml_parser, 0, dec, NULL);
+		} else {
+			dec->format = TW_FORMAT_JSON;
+			if(!dec->json) {
+				dec->json = mb_json_parser_new(tw_decoder_json_token, dec);
+			}
+		}
+	}
+	if(dec->format == TW_FORMAT_XML) {
+		if(!g_markup_parse_context_parse(dec->context, buf, len, &error)) {
+			mb_debug_info(DBGID, "failed to parse XML data, %s\n", error ? error->message : "");
+			g_clear_error(&error);
+			dec->failed = TRUE;
+		}
+	} else {
+		if(!mb_json_parser_feed(dec->json, buf, len)) {
+			mb_debug_info(DBGID, "failed to parse JSON data, %s\n", dec->json->error ? dec->json->error : "");
+			dec->failed = TRUE;
+		}
+	}
+}
+
+MbMsgBatch * tw_decoder_finish(TwitterMsgDecoder * dec, time_t * last_msg_time)
+{
+	MbMsgBatch * retval;
+	GError * error = NULL;
+
+	if(!dec->failed) {
+		if(dec->format == TW_FORMAT_XML) {
+			if(!g_markup_parse_context_end_parse(dec->context, &error)) {
+				mb_debug_info(DBGID, "XML data is incomplete, %s\n", error ? error->message : "");
+				g_clear_error(&error);
+			}
+		} else if( (dec->format == TW_FORMAT_UNKNOWN) || !mb_json_parser_end(dec->json) ) {
+			mb_debug_info(DBGID, "JSON data is incomplete\n");
+		}
+	}
+	if( (*last_msg_time) < dec->last_msg_time) {
+		(*last_msg_time) = dec->last_msg_time;
+	}
+	retval = dec->batch;
+	dec->batch = NULL;
+	tw_decoder_reset(dec);
+	return retval;
+}
+
+gboolean tw_decoder_sink(MbHttpData * data, const gchar * buf, gint len, gpointer user_data)
+{
+	TwitterMsgDecoder * dec = user_data;
+
+	if(buf == NULL) {
+		// new response, errors are still decoded by twitter_decode_error from content
+		tw_decoder_reset(dec);
+		return (data->status == HTTP_OK);
+	}
+	tw_decoder_feed(dec, buf, len);
+	return TRUE;
+}
+
+gboolean tw_decoder_feed_stream(TwitterMsgDecoder * dec, const gchar * buf, gint len)
+{
+	const gchar * end;
+	gint head;
+
+	if(!dec->line) {
+		dec->line = g_string_sized_new(1024);
+	}
+	// finish partial line first
+	if(dec->line->len > 0) {
+		end = memchr(buf, '\n', len);
+		if(!end) {
+			g_string_append_len(dec->line, buf, len);
+			return (dec->line->len <= TW_STREAM_RECORD_MAX);
+		}
+		head = end - buf + 1;
+		g_string_append_len(dec->line, buf, head);
+		tw_decoder_feed(dec, dec->line->str, dec->line->len);
+		g_string_truncate(dec->line, 0);
+		buf += head;
+		len -= head;
+	}
+	// complete lines are decoded straight from buf, so decoder stops between statuses
+	for(end = buf + len; (end > buf) && (end[-1] != '\n'); end--);
+	if(end > buf) {
+		tw_decoder_feed(dec, buf, end - buf);
+	}
+	g_string_append_len(dec->line, end, (buf + len) - end);
+	return !dec->failed && (dec->line->len <= TW_STREAM_RECORD_MAX);
+}
+
+MbMsgBatch * tw_decoder_take(TwitterMsgDecoder * dec, time_t * last_msg_time)
+{
+	MbMsgBatch * retval;
+
+	// strings of a status being decoded live in the batch too
+	if( (dec->batch->len == 0) || (dec->depth > 0) ) {
+		return NULL;
+	}
+	if( (*last_msg_time) < dec->last_msg_time) {
+		(*last_msg_time) = dec->last_msg_time;
+	}
+	retval = dec->batch;
+	dec->batch = mb_msg_batch_new();
+	dec->last_msg_time = 0;
+	return retval;
+}
+
+MbMsgBatch * tw_decode(const gchar * data, gint len, gint root, time_t * last_msg_time)
+{
+	TwitterMsgDecoder * dec = tw_decoder_new(root);
+	MbMsgBatch * retval;
+
+	tw_decoder_feed(dec, data, len);
+	retval = tw_decoder_finish(dec, last_msg_time);
+	tw_decoder_free(dec);
+	return retval;
+}
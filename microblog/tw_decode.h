@@ -0,0 +1,133 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * Incremental status decoder for twitter-based protocol
+ *
+ * Decodes XML or JSON responses into TwitterMsg while they are being received.
+ * Format is detected from the first byte of the document.
+ */
+
+#ifndef __TW_DECODE__
+#define __TW_DECODE__
+
+#include <glib.h>
+#include <time.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include "mb_http.h"
+#include "twitter.h"
+#include "mb_msg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+	What the document is made of
+*/
+enum tw_decode_root {
+	TW_DECODE_TIMELINE = 0, //< list of statuses, from timeline requests
+	TW_DECODE_STATUS = 1, //< one status, from status update
+	TW_DECODE_USER = 2, //< one user, from verify credentials. msg_txt of the result is NULL
+	TW_DECODE_STREAM = 3, //< statuses of streaming API, one JSON object per line
+};
+
+#define TW_STREAM_RECORD_MAX (256 * 1024) //< longest line of a stream, longer one means stream is broken
+
+typedef struct _TwitterMsgDecoder TwitterMsgDecoder;
+
+/*
+	Create new decoder
+
+	@param root kind of document to decode
+	@return new decoder, free with tw_decoder_free
+*/
+extern TwitterMsgDecoder * tw_decoder_new(gint root);
+
+/*
+	Free decoder
+*/
+extern void tw_decoder_free(TwitterMsgDecoder * dec);
+
+/*
+	Throw away decoded messages and parser state, ready for a new document
+*/
+extern void tw_decoder_reset(TwitterMsgDecoder * dec);
+
+/*
+	Feed a piece of document
+*/
+extern void tw_decoder_feed(TwitterMsgDecoder * dec, const gchar * buf, gint len);
+
+/*
+	Document is complete, take decoded messages
+
+	@param last_msg_time updated with time of the latest message
+	@return batch of messages in the order they appear in document, free with mb_msg_batch_free.
+	Messages before a syntax error are kept.
+*/
+extern MbMsgBatch * tw_decoder_finish(TwitterMsgDecoder * dec, time_t * last_msg_time);
+
+/*
+	MbHttpContentSink for responses, only 200 responses are decoded
+
+	@param user_data TwitterMsgDecoder
+*/
+extern gboolean tw_decoder_sink(MbHttpData * data, const gchar * buf, gint len, gpointer user_data);
+
+/*
+	Feed a piece of stream, decoder must be created with TW_DECODE_STREAM
+
+	Only complete lines are decoded, a partial line is kept until the rest arrives.
+	Empty lines are keep-alive, objects other than statuses are skipped.
+
+	@return FALSE if stream is broken, it should be reconnected with a reset decoder
+*/
+extern gboolean tw_decoder_feed_stream(TwitterMsgDecoder * dec, const gchar * buf, gint len);
+
+/*
+	Take statuses decoded from stream so far
+
+	@param last_msg_time updated with time of the latest message
+	@return batch in the order statuses arrived, NULL if there's none
+*/
+extern MbMsgBatch * tw_decoder_take(TwitterMsgDecoder * dec, time_t * last_msg_time);
+
+/*
+	Decode a complete document
+
+	@return batch of messages, free with mb_msg_batch_free
+*/
+extern MbMsgBatch * tw_decode(const gchar * data, gint len, gint root, time_t * last_msg_time);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
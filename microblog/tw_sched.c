@@ -0,0 +1,396 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <debug.h>
+
+#include "twitter.h"
+#include "mb_net.h"
+#include "tw_sched.h"
+
+#define DBGID "tw_sched"
+
+static gboolean tw_sched_tick(gpointer data);
+
+TwitterSched * tw_sched_new(MbAccount * ma)
+{
+	TwitterSched * sched = g_new0(TwitterSched, 1);
+	gint i;
+
+	sched->ma = ma;
+	sched->rate_limit = -1;
+	sched->rate_remaining = -1;
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		// friends, public and user timeline, each followed by its buddy name
+		sched->slots[i].config = TC_FRIENDS_TIMELINE + (i * 2);
+	}
+	return sched;
+}
+
+void tw_sched_free(TwitterSched * sched)
+{
+	tw_sched_stop(sched);
+	g_free(sched);
+}
+
+static gint tw_sched_min_interval(TwitterSched * sched)
+{
+	return MIN(sched->base_interval, MAX(TW_SCHED_MIN_INTERVAL, sched->base_interval / 4));
+}
+
+static void tw_sched_check_slots(TwitterSched * sched)
+{
+	MbAccount * ma = sched->ma;
+	gint i;
+
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		sched->slots[i].enabled = !sched->slots[i].streamed && (purple_find_buddy(ma->account, mc_def(sched->slots[i].config + 1)) != NULL);
+	}
+}
+
+/*
+	Stretch intervals so that polls until end of rate limit window fit in what's left,
+	then find when each timeline is due
+*/
+static void tw_sched_plan(TwitterSched * sched, time_t now)
+{
+	TwitterSchedSlot * slot;
+	gdouble rate = 0, scale = 1;
+	gint i, window, budget;
+	gboolean exhausted = FALSE;
+
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		if(sched->slots[i].enabled) {
+			rate += 1.0 / sched->slots[i].interval;
+		}
+	}
+	if( (sched->rate_remaining >= 0) && (sched->rate_reset > now) ) {
+		// clock of server may be off, don't plan further than an hour
+		window = MIN(sched->rate_reset - now, 3600);
+		budget = sched->rate_remaining - TW_SCHED_RESERVE;
+		if(budget <= 0) {
+			exhausted = TRUE;
+		} else if(rate * window > budget) {
+			scale = (rate * window) / budget;
+		}
+	}
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		slot = &sched->slots[i];
+		slot->effective = (gint)(slot->interval * scale + 0.5);
+		slot->next_poll = slot->last_poll + slot->effective;
+		if(exhausted && (slot->next_poll <= sched->rate_reset)) {
+			slot->next_poll = sched->rate_reset + 1;
+		}
+	}
+}
+
+/*
+	Set timer for the earliest due timeline
+*/
+static void tw_sched_arm(TwitterSched * sched, time_t now)
+{
+	TwitterSchedSlot * slot;
+	time_t due = 0;
+	gint i;
+
+	if(sched->timer) {
+		purple_timeout_remove(sched->timer);
+		sched->timer = 0;
+	}
+	if(!sched->running) {
+		return;
+	}
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		slot = &sched->slots[i];
+		if(!slot->enabled) {
+			continue;
+		}
+		if(slot->in_flight) {
+			// come back to replace it if it's stuck
+			if( (due == 0) || (slot->last_poll + TW_SCHED_SUPERSEDE * slot->effective < due) ) {
+				due = slot->last_poll + TW_SCHED_SUPERSEDE * slot->effective;
+			}
+		} else if( (due == 0) || (slot->next_poll < due) ) {
+			due = slot->next_poll;
+		}
+	}
+	if(due == 0) {
+		// nothing to poll now, look again for timeline buddies later
+		due = now + sched->base_interval;
+	}
+	sched->timer = purple_timeout_add_seconds(MAX(due - now, 1), tw_sched_tick, sched);
+}
+
+/*
+	Send poll of one timeline, full page so that a gap since last poll is found and backfilled
+*/
+static void tw_sched_send(TwitterSched * sched, gint i)
+{
+	MbAccount * ma = sched->ma;
+	TwitterSchedSlot * slot = &sched->slots[i];
+	TwitterTimeLineReq * tlr;
+	const gchar * tl_path;
+
+	tl_path = purple_account_get_string(ma->account, mc_name(slot->config), mc_def(slot->config));
+	tlr = twitter_new_tlr(tl_path, mc_def(slot->config + 1), slot->config, TW_STATUS_COUNT_MAX, NULL);
+	tlr->sched_slot = i;
+	slot->in_flight = TRUE;
+	slot->polls++;
+	purple_debug_info(DBGID, "fetching updates from %s to %s, interval = %d\n", tlr->path, tlr->name, slot->effective);
+	slot->request = twitter_fetch_new_messages(ma, tlr);
+}
+
+/*
+	Send polls of due timelines, pipelined on one connection
+
+	@param all poll every enabled timeline, due or not
+*/
+static void tw_sched_poll(TwitterSched * sched, time_t now, gboolean all)
+{
+	MbAccount * ma = sched->ma;
+	TwitterSchedSlot * slot;
+	gboolean skip;
+	gint i;
+
+	tw_sched_check_slots(sched);
+	skip = twitter_skip_fetching_messages(ma->account);
+	mb_conn_pool_begin_batch(ma->conn_pool);
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		slot = &sched->slots[i];
+		if(slot->enabled && slot->in_flight && slot->request && (now >= slot->last_poll + TW_SCHED_SUPERSEDE * slot->effective) ) {
+			// still waiting for a poll sent long ago, a fresh one replaces it
+			purple_debug_info(DBGID, "poll of %s not answered in %ld seconds, cancelling\n", mc_def(slot->config + 1), (long)(now - slot->last_poll));
+			slot->superseded++;
+			mb_conn_cancel(ma, slot->request);
+		}
+		if(!slot->enabled || slot->in_flight || (!all && (slot->next_poll > now)) ) {
+			continue;
+		}
+		slot->last_poll = now;
+		if(skip) {
+			continue;
+		}
+		tw_sched_send(sched, i);
+	}
+	mb_conn_pool_end_batch(ma->conn_pool);
+	tw_sched_plan(sched, now);
+	tw_sched_arm(sched, now);
+}
+
+static gboolean tw_sched_tick(gpointer data)
+{
+	TwitterSched * sched = data;
+
+	sched->timer = 0;
+	tw_sched_poll(sched, time(NULL), FALSE);
+	return FALSE;
+}
+
+void tw_sched_start(TwitterSched * sched)
+{
+	MbAccount * ma = sched->ma;
+	time_t now = time(NULL);
+	gint i;
+
+	sched->running = TRUE;
+	sched->base_interval = purple_account_get_int(ma->account, mc_name(TC_MSG_REFRESH_RATE), mc_def_int(TC_MSG_REFRESH_RATE));
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		sched->slots[i].interval = sched->base_interval;
+		sched->slots[i].last_poll = now;
+	}
+	purple_debug_info(DBGID, "refresh interval = %d\n", sched->base_interval);
+	tw_sched_check_slots(sched);
+	tw_sched_plan(sched, now);
+	tw_sched_arm(sched, now);
+}
+
+void tw_sched_stop(TwitterSched * sched)
+{
+	sched->running = FALSE;
+	if(sched->timer) {
+		purple_debug_info(DBGID, "removing timer\n");
+		purple_timeout_remove(sched->timer);
+		sched->timer = 0;
+	}
+}
+
+void tw_sched_set_interval(TwitterSched * sched, gint interval)
+{
+	time_t now = time(NULL);
+	gint i;
+
+	sched->base_interval = interval;
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		sched->slots[i].interval = interval;
+		sched->slots[i].empty_polls = 0;
+	}
+	tw_sched_plan(sched, now);
+	tw_sched_arm(sched, now);
+}
+
+void tw_sched_set_streamed(TwitterSched * sched, gint config, gboolean streamed)
+{
+	time_t now = time(NULL);
+	gint i;
+
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		if(sched->slots[i].config != config) {
+			continue;
+		}
+		if(sched->slots[i].streamed == streamed) {
+			return;
+		}
+		sched->slots[i].streamed = streamed;
+		if(!streamed) {
+			// catch up now instead of waiting for a whole interval
+			sched->slots[i].last_poll = now - sched->slots[i].effective;
+		}
+	}
+	if(!sched->running) {
+		return;
+	}
+	tw_sched_check_slots(sched);
+	// budget of a streamed timeline goes to others
+	tw_sched_plan(sched, now);
+	tw_sched_arm(sched, now);
+}
+
+void tw_sched_catch_up(TwitterSched * sched, gint config)
+{
+	gint i;
+
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		if(sched->slots[i].config != config) {
+			continue;
+		}
+		// poll already in flight was sent before stream went live, it covers the same statuses
+		if(sched->slots[i].in_flight || twitter_skip_fetching_messages(sched->ma->account)) {
+			return;
+		}
+		sched->slots[i].last_poll = time(NULL);
+		tw_sched_send(sched, i);
+	}
+}
+
+void tw_sched_poll_all(TwitterSched * sched)
+{
+	tw_sched_poll(sched, time(NULL), TRUE);
+}
+
+void tw_sched_update_rate(TwitterSched * sched, MbHttpData * response)
+{
+	const gchar * remaining, * reset, * limit;
+
+	remaining = mb_http_data_get_header(response, "X-RateLimit-Remaining");
+	reset = mb_http_data_get_header(response, "X-RateLimit-Reset");
+	limit = mb_http_data_get_header(response, "X-RateLimit-Limit");
+	if(remaining == NULL) {
+		// newer API spells them differently
+		remaining = mb_http_data_get_header(response, "X-Rate-Limit-Remaining");
+		reset = mb_http_data_get_header(response, "X-Rate-Limit-Reset");
+		limit = mb_http_data_get_header(response, "X-Rate-Limit-Limit");
+	}
+	if( (remaining == NULL) || (reset == NULL) ) {
+		return;
+	}
+	sched->rate_remaining = (gint)strtol(remaining, NULL, 10);
+	sched->rate_reset = (time_t)strtoll(reset, NULL, 10);
+	sched->rate_limit = limit ? (gint)strtol(limit, NULL, 10) : -1;
+	purple_debug_info(DBGID, "rate limit remaining = %d, reset in %ld seconds\n", sched->rate_remaining, (long)(sched->rate_reset - time(NULL)));
+}
+
+gboolean tw_sched_rate_exhausted(TwitterSched * sched)
+{
+	return (sched->rate_remaining == 0) && (sched->rate_reset > time(NULL));
+}
+
+void tw_sched_poll_done(TwitterSched * sched, gint slot_id, gint new_msgs)
+{
+	TwitterSchedSlot * slot;
+	time_t now = time(NULL);
+
+	if( (slot_id >= 0) && (slot_id < TW_SCHED_SLOTS) ) {
+		slot = &sched->slots[slot_id];
+		slot->in_flight = FALSE;
+		slot->request = 0;
+		slot->last_new = new_msgs;
+		if(new_msgs > 0) {
+			// active timeline, come back sooner
+			slot->empty_polls = 0;
+			slot->interval = MAX(slot->interval / 2, tw_sched_min_interval(sched));
+		} else {
+			slot->empty_polls++;
+			slot->interval = MIN(slot->interval + (slot->interval / 2), sched->base_interval * TW_SCHED_BACKOFF_MAX);
+		}
+	}
+	// rate limit may have changed even for requests not sent by scheduler
+	tw_sched_plan(sched, now);
+	tw_sched_arm(sched, now);
+}
+
+void tw_sched_describe(TwitterSched * sched, GString * out)
+{
+	MbAccount * ma = sched->ma;
+	TwitterSchedSlot * slot;
+	time_t now = time(NULL);
+	gint i;
+
+	if( (sched->rate_remaining >= 0) && (sched->rate_reset > now) ) {
+		if(sched->rate_limit >= 0) {
+			g_string_append_printf(out, _("rate limit: %d of %d requests left, resets in %ld seconds"),
+					sched->rate_remaining, sched->rate_limit, (long)(sched->rate_reset - now));
+		} else {
+			g_string_append_printf(out, _("rate limit: %d requests left, resets in %ld seconds"),
+					sched->rate_remaining, (long)(sched->rate_reset - now));
+		}
+	} else {
+		g_string_append(out, _("rate limit: unknown"));
+	}
+	for(i = 0; i < TW_SCHED_SLOTS; i++) {
+		slot = &sched->slots[i];
+		g_string_append_printf(out, "; %s: ", mc_def(slot->config + 1));
+		if(slot->streamed) {
+			g_string_append(out, _("streamed"));
+			continue;
+		}
+		if(!slot->enabled) {
+			g_string_append(out, _("not polled"));
+			continue;
+		}
+		g_string_append_printf(out, _("every %d seconds"), slot->interval);
+		if(slot->effective != slot->interval) {
+			g_string_append_printf(out, _(" (%d to fit rate limit)"), slot->effective);
+		}
+		if(slot->in_flight) {
+			g_string_append(out, _(", waiting for response"));
+		} else if(sched->running) {
+			g_string_append_printf(out, _(", next in %ld seconds"), (long)MAX(slot->next_poll - now, 0));
+		}
+		g_string_append_printf(out, _(", %u polls, %u empty in a row"), slot->polls, slot->empty_polls);
+		if(slot->superseded > 0) {
+			g_string_append_printf(out, _(", %u cancelled as too slow"), slot->superseded);
+		}
+	}
+}
@@ -0,0 +1,165 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * Poll scheduler for timelines of twitter-based protocol
+ *
+ * Each timeline has its own poll interval. Timelines that keep coming back
+ * empty are polled less often, active ones more often. The rate limit reported
+ * by server in X-RateLimit-* headers is spread across all enabled timelines,
+ * so polling slows down before the limit is hit instead of failing after.
+ */
+
+#ifndef __TW_SCHED__
+#define __TW_SCHED__
+
+#include <glib.h>
+#include <time.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include "mb_http.h"
+#include "twitter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TW_SCHED_SLOTS 3 //< friends, public and user timeline
+#define TW_SCHED_MIN_INTERVAL 15 //< never poll a timeline more often than this, in seconds
+#define TW_SCHED_BACKOFF_MAX 8 //< idle timeline slows down to this many times the refresh rate
+#define TW_SCHED_RESERVE 5 //< requests left to user commands when budget is spread
+#define TW_SCHED_SUPERSEDE 2 //< poll not answered in this many intervals is cancelled and sent again
+
+typedef struct _TwitterSchedSlot {
+	gint config; //< TC_*_TIMELINE of this timeline, TC_*_USER is next to it
+	gboolean enabled; //< buddy of the timeline exists and timeline is not streamed
+	gboolean streamed; //< statuses come from streaming connection, no need to poll
+	gboolean in_flight; //< poll was sent, waiting for response
+	guint request; //< id of poll in flight, for mb_conn_cancel
+	gint interval; //< seconds between polls, from activity of timeline
+	gint effective; //< interval after rate limit budget is applied
+	time_t last_poll;
+	time_t next_poll;
+	guint polls;
+	guint empty_polls; //< polls without new message in a row
+	guint last_new; //< new messages from last poll
+	guint superseded; //< polls cancelled because they took too long
+} TwitterSchedSlot;
+
+typedef struct _TwitterSched {
+	MbAccount * ma;
+	gboolean running;
+	guint timer; //< purple timer for the next due poll, 0 if none
+	gint base_interval; //< refresh rate from account setting
+	gint rate_limit; //< requests per window, -1 if server didn't tell
+	gint rate_remaining; //< requests left in current window, -1 if unknown
+	time_t rate_reset; //< when the window restarts
+	TwitterSchedSlot slots[TW_SCHED_SLOTS];
+} TwitterSched;
+
+/*
+	Create new scheduler, nothing is polled until tw_sched_start
+
+	@return new scheduler, free with tw_sched_free
+*/
+extern TwitterSched * tw_sched_new(MbAccount * ma);
+
+/*
+	Stop and free scheduler
+*/
+extern void tw_sched_free(TwitterSched * sched);
+
+/*
+	Start polling every timeline which has a buddy, first poll after one refresh interval
+*/
+extern void tw_sched_start(TwitterSched * sched);
+
+/*
+	Stop polling, responses still in flight are reported normally
+*/
+extern void tw_sched_stop(TwitterSched * sched);
+
+/*
+	Change refresh rate, all timelines start over from the new interval
+*/
+extern void tw_sched_set_interval(TwitterSched * sched, gint interval);
+
+/*
+	Stop or resume polling a timeline which is also delivered by streaming connection
+
+	Resuming polls the timeline right away, to pick up what was missed while stream was down.
+
+	@param config TC_*_TIMELINE of the timeline
+*/
+extern void tw_sched_set_streamed(TwitterSched * sched, gint config, gboolean streamed);
+
+/*
+	Poll a timeline once now, even if it's streamed
+
+	Picks up statuses posted while stream was down. It's a full page in scheduler's slot, so a longer
+	outage is backfilled like a gap between polls.
+
+	@param config TC_*_TIMELINE of the timeline
+*/
+extern void tw_sched_catch_up(TwitterSched * sched, gint config);
+
+/*
+	Poll all enabled timelines now, except the ones already waiting for response
+*/
+extern void tw_sched_poll_all(TwitterSched * sched);
+
+/*
+	Take rate limit from headers of a response, responses without them are ignored
+*/
+extern void tw_sched_update_rate(TwitterSched * sched, MbHttpData * response);
+
+/*
+	Whether requests of current rate limit window are used up
+
+	@return TRUE if server said nothing is left and window didn't restart yet
+*/
+extern gboolean tw_sched_rate_exhausted(TwitterSched * sched);
+
+/*
+	Poll of a timeline is done
+
+	@param slot slot from TwitterTimeLineReq, -1 for requests not sent by scheduler
+	@param new_msgs number of new messages received, 0 on error or 304
+*/
+extern void tw_sched_poll_done(TwitterSched * sched, gint slot, gint new_msgs);
+
+/*
+	Human readable cadence of each timeline and rate limit, for /status
+*/
+extern void tw_sched_describe(TwitterSched * sched, GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,288 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <debug.h>
+
+#include "twitter.h"
+#include "mb_net.h"
+#include "mb_msg.h"
+#include "mb_state.h"
+#include "tw_sched.h"
+#include "tw_stream.h"
+
+#define DBGID "tw_stream"
+
+static void tw_stream_schedule(TwitterStream * stream, gint delay);
+
+TwitterStream * tw_stream_new(MbAccount * ma, const gchar * url)
+{
+	TwitterStream * stream = g_new0(TwitterStream, 1);
+
+	stream->ma = ma;
+	stream->url = g_strdup(url);
+	stream->dec = tw_decoder_new(TW_DECODE_STREAM);
+	stream->state = TW_STREAM_IDLE;
+	return stream;
+}
+
+/*
+	Forget current stream request and timers bound to it
+*/
+static void tw_stream_disconnect(TwitterStream * stream)
+{
+	MbConnData * conn_data = stream->conn_data;
+
+	if(stream->stall_timer) {
+		purple_timeout_remove(stream->stall_timer);
+		stream->stall_timer = 0;
+	}
+	if(stream->deliver_timer) {
+		purple_timeout_remove(stream->deliver_timer);
+		stream->deliver_timer = 0;
+	}
+	stream->conn_data = NULL;
+	if(conn_data) {
+		// closes the connection, handler is not called
+		mb_conn_data_free(conn_data);
+	}
+}
+
+void tw_stream_free(TwitterStream * stream)
+{
+	tw_stream_disconnect(stream);
+	if(stream->reconnect_timer) {
+		purple_timeout_remove(stream->reconnect_timer);
+	}
+	tw_decoder_free(stream->dec);
+	g_free(stream->url);
+	g_free(stream);
+}
+
+/*
+	Stream is down, let scheduler poll friends timeline again
+*/
+static void tw_stream_down(TwitterStream * stream)
+{
+	if(stream->state == TW_STREAM_LIVE) {
+		stream->stat_fallbacks++;
+		if(stream->ma->sched) {
+			tw_sched_set_streamed(stream->ma->sched, TC_FRIENDS_TIMELINE, FALSE);
+		}
+	}
+	stream->state = TW_STREAM_IDLE;
+}
+
+/*
+	Pass statuses decoded so far to friends timeline
+*/
+static void tw_stream_deliver(TwitterStream * stream)
+{
+	MbAccount * ma = stream->ma;
+	TwitterTimeLineReq * tlr;
+	MbMsgBatch * msgs;
+	time_t last_msg_time = 0;
+	const gchar * tl_path;
+	guint i, n;
+
+	if( (msgs = tw_decoder_take(stream->dec, &last_msg_time)) == NULL) {
+		return;
+	}
+	stream->stat_msgs += msgs->len;
+	tl_path = purple_account_get_string(ma->account, mc_name(TC_FRIENDS_TIMELINE), mc_def(TC_FRIENDS_TIMELINE));
+	tlr = twitter_new_tlr(tl_path, mc_def(TC_FRIENDS_USER), TL_FRIENDS, 0, NULL);
+	tlr->use_since_id = FALSE;
+	// same cursor as polling, a status fetched by the catch-up poll might come again
+	tlr->since_id = ma->state_file ? mb_state_get_timeline(ma->state_file, tl_path) : 0;
+	for(i = 0, n = 0; i < msgs->len; i++) {
+		if(mb_msg_batch_index(msgs, i)->id > tlr->since_id) {
+			*mb_msg_batch_index(msgs, n++) = *mb_msg_batch_index(msgs, i);
+		}
+	}
+	msgs->len = n;
+	// stream is oldest first, timeline responses are newest first
+	mb_msg_batch_reverse(msgs);
+	twitter_deliver_messages(ma, tlr, msgs, last_msg_time);
+}
+
+static gboolean tw_stream_deliver_cb(gpointer data)
+{
+	TwitterStream * stream = data;
+	MbAccount * ma = stream->ma;
+
+	stream->deliver_timer = 0;
+	if(stream->went_live) {
+		stream->went_live = FALSE;
+		if(ma->sched) {
+			tw_sched_set_streamed(ma->sched, TC_FRIENDS_TIMELINE, TRUE);
+			// statuses posted while stream was down come from one more poll
+			tw_sched_catch_up(ma->sched, TC_FRIENDS_TIMELINE);
+		}
+	}
+	tw_stream_deliver(stream);
+	if(stream->broken) {
+		purple_debug_info(DBGID, "stream of %s is broken, reconnecting\n", stream->url);
+		tw_stream_disconnect(stream);
+		tw_stream_down(stream);
+		tw_stream_schedule(stream, 1);
+	}
+	return FALSE;
+}
+
+static gboolean tw_stream_stall_cb(gpointer data)
+{
+	TwitterStream * stream = data;
+
+	if(time(NULL) - stream->last_data < TW_STREAM_STALL) {
+		return TRUE;
+	}
+	purple_debug_info(DBGID, "nothing from %s for %d seconds, reconnecting\n", stream->url, TW_STREAM_STALL);
+	stream->stat_stalls++;
+	stream->stall_timer = 0;
+	tw_stream_disconnect(stream);
+	tw_stream_down(stream);
+	tw_stream_schedule(stream, 1);
+	return FALSE;
+}
+
+/*
+	MbHttpContentSink of stream response
+*/
+static gboolean tw_stream_sink(MbHttpData * data, const gchar * buf, gint len, gpointer user_data)
+{
+	TwitterStream * stream = user_data;
+
+	stream->last_data = time(NULL);
+	if(!buf) {
+		if(data->status != HTTP_OK) {
+			// error body is kept for handler
+			return FALSE;
+		}
+		purple_debug_info(DBGID, "stream of %s is live\n", stream->url);
+		stream->state = TW_STREAM_LIVE;
+		stream->backoff = 0;
+		stream->stat_connects++;
+		stream->went_live = TRUE;
+	} else if(!stream->broken && !tw_decoder_feed_stream(stream->dec, buf, len)) {
+		stream->broken = TRUE;
+	}
+	// delivery may drop the connection or send requests, so it can't be done while it's being read
+	if(!stream->deliver_timer) {
+		stream->deliver_timer = purple_timeout_add(0, tw_stream_deliver_cb, stream);
+	}
+	return TRUE;
+}
+
+/*
+	Stream ended or failed, decide when to try again
+*/
+static gint tw_stream_handler(MbConnData * conn_data, gpointer data, const char * error)
+{
+	TwitterStream * stream = data;
+	gint status = conn_data->response->status;
+	gint delay;
+
+	// connection is freed by caller
+	stream->conn_data = NULL;
+	tw_stream_disconnect(stream);
+	if(!error && (status == HTTP_OK) ) {
+		tw_stream_deliver(stream);
+	}
+	// stream that went live and died before the timer fired never stopped polling
+	stream->went_live = FALSE;
+	tw_stream_down(stream);
+
+	if(error || (status == HTTP_OK) ) {
+		// network trouble, or server just closed the stream
+		purple_debug_info(DBGID, "stream of %s ended: %s\n", stream->url, error ? error : "closed");
+		delay = MIN(stream->backoff + 1, TW_STREAM_NET_BACKOFF_MAX);
+	} else if( (status == 401) || (status == 403) || (status == 404) || (status == 406) ) {
+		// not allowed or no such stream, it won't get better by retrying
+		purple_debug_info(DBGID, "stream of %s refused with status %d, polling only\n", stream->url, status);
+		stream->state = TW_STREAM_OFF;
+		return 0;
+	} else if(status == 420) {
+		// short delay left by network errors doesn't count here
+		delay = MIN(MAX(stream->backoff * 2, TW_STREAM_RATE_BACKOFF), TW_STREAM_RATE_BACKOFF_MAX);
+	} else {
+		delay = MIN(MAX(stream->backoff * 2, TW_STREAM_HTTP_BACKOFF), TW_STREAM_HTTP_BACKOFF_MAX);
+	}
+	stream->backoff = delay;
+	tw_stream_schedule(stream, delay);
+	return 0;
+}
+
+static gboolean tw_stream_reconnect_cb(gpointer data)
+{
+	TwitterStream * stream = data;
+
+	stream->reconnect_timer = 0;
+	tw_stream_start(stream);
+	return FALSE;
+}
+
+static void tw_stream_schedule(TwitterStream * stream, gint delay)
+{
+	if(stream->reconnect_timer) {
+		purple_timeout_remove(stream->reconnect_timer);
+	}
+	purple_debug_info(DBGID, "reconnecting %s in %d seconds\n", stream->url, delay);
+	stream->reconnect_timer = purple_timeout_add_seconds(delay, tw_stream_reconnect_cb, stream);
+}
+
+void tw_stream_start(TwitterStream * stream)
+{
+	MbConnData * conn_data;
+
+	if( (stream->state == TW_STREAM_OFF) || stream->conn_data) {
+		return;
+	}
+	if(stream->reconnect_timer) {
+		purple_timeout_remove(stream->reconnect_timer);
+		stream->reconnect_timer = 0;
+	}
+	purple_debug_info(DBGID, "connecting stream %s\n", stream->url);
+	tw_decoder_reset(stream->dec);
+	stream->broken = FALSE;
+	stream->went_live = FALSE;
+	stream->state = TW_STREAM_CONNECTING;
+	stream->last_data = time(NULL);
+
+	conn_data = twitter_init_stream_connection(stream->ma, stream->url, tw_stream_handler);
+	conn_data->handler_data = stream;
+	mb_http_data_set_content_sink(conn_data->response, tw_stream_sink, stream);
+	stream->conn_data = conn_data;
+	// also catches a connection that never gets through
+	stream->stall_timer = purple_timeout_add_seconds(TW_STREAM_STALL / 3, tw_stream_stall_cb, stream);
+	mb_conn_process_request(conn_data);
+}
+
+void tw_stream_describe(TwitterStream * stream, GString * out)
+{
+	static const char * state_names[] = { "reconnecting", "connecting", "live", "off" };
+
+	g_string_append_printf(out, _("stream: %s, %u statuses, %u connects, %u stalls, %u times polled instead"),
+			state_names[stream->state], stream->stat_msgs, stream->stat_connects, stream->stat_stalls, stream->stat_fallbacks);
+}
@@ -0,0 +1,114 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * Streaming connection for friends timeline
+ *
+ * One long-lived chunked HTTP response carries a status per line as soon as
+ * it's posted. Statuses go through the same delivery as polled ones. While
+ * the stream is live the scheduler stops polling friends timeline, once it
+ * breaks polling takes over until the stream is reconnected.
+ */
+
+#ifndef __TW_STREAM__
+#define __TW_STREAM__
+
+#include <glib.h>
+#include <time.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include "mb_net.h"
+#include "tw_decode.h"
+#include "twitter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TW_STREAM_STALL 90 //< server sends keep-alive every 30 seconds, no data this long means stream is dead
+#define TW_STREAM_NET_BACKOFF_MAX 16 //< network errors back off linearly up to this, in seconds
+#define TW_STREAM_HTTP_BACKOFF 10 //< HTTP errors back off exponentially from this
+#define TW_STREAM_HTTP_BACKOFF_MAX 320
+#define TW_STREAM_RATE_BACKOFF 60 //< server said 420, reconnecting too often
+#define TW_STREAM_RATE_BACKOFF_MAX 600
+
+enum tw_stream_state {
+	TW_STREAM_IDLE = 0, //< waiting to reconnect
+	TW_STREAM_CONNECTING,
+	TW_STREAM_LIVE,
+	TW_STREAM_OFF, //< server refused stream for good, polling only
+};
+
+typedef struct _TwitterStream {
+	MbAccount * ma;
+	gchar * url;
+	MbConnData * conn_data; //< current stream request, NULL if not connected
+	TwitterMsgDecoder * dec;
+	gint state;
+	gboolean broken; //< decoder gave up on current stream
+	gboolean went_live; //< polling is not stopped yet for stream that just went live
+	time_t last_data; //< last time anything arrived, keep-alive included
+	gint backoff; //< next reconnect delay in seconds, 0 if last stream went fine
+	guint reconnect_timer;
+	guint stall_timer;
+	guint deliver_timer;
+
+	guint stat_connects; //< streams that went live
+	guint stat_stalls; //< streams dropped for being silent
+	guint stat_msgs; //< statuses received from stream
+	guint stat_fallbacks; //< times polling took over from stream
+} TwitterStream;
+
+/*
+	Create stream of friends timeline for account, it's not connected until tw_stream_start
+
+	@param url address of stream
+	@return new stream, free with tw_stream_free
+*/
+extern TwitterStream * tw_stream_new(MbAccount * ma, const gchar * url);
+
+/*
+	Disconnect and free stream, polling is not resumed
+*/
+extern void tw_stream_free(TwitterStream * stream);
+
+/*
+	Connect stream, friends timeline is polled until it's live
+*/
+extern void tw_stream_start(TwitterStream * stream);
+
+/*
+	Append one line describing stream to out, for /stats
+*/
+extern void tw_stream_describe(TwitterStream * stream, GString * out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,236 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+
+#include <glib.h>
+#include <string.h>
+
+#include <debug.h>
+
+#include "twitter.h"
+#include "mb_util.h"
+#include "tw_decode.h"
+#include "tw_worker.h"
+
+#define DBGID "tw_worker"
+
+typedef struct _TwWorkerJob {
+	MbAccount * ma;
+	gchar * key; //< account and timeline, jobs of same key are delivered in order
+	TwitterTimeLineReq * tlr;
+	GString * content;
+	TwWorkerDeliver deliver;
+
+	// Filled by worker
+	MbMsgBatch * msgs;
+	time_t last_msg_time;
+	gdouble elapsed; //< seconds spent decoding
+
+	// Main thread only
+	gboolean done; //< came back from worker
+	gboolean cancelled; //< account is gone, free when it comes back
+} TwWorkerJob;
+
+// Shared by all accounts, touched from main thread only except where noted
+static gint tw_worker_users = 0;
+static gint tw_worker_threads = 0;
+static GThreadPool * tw_worker_pool = NULL;
+static GAsyncQueue * tw_worker_finished = NULL; //< jobs back from workers, any thread
+static gint tw_worker_flush_pending = 0; //< idle callback is added, any thread
+static GHashTable * tw_worker_order = NULL; //< key -> GQueue of jobs in order of submission
+
+static void tw_worker_job_free(TwWorkerJob * job)
+{
+	if(job->tlr) twitter_free_tlr(job->tlr);
+	if(job->msgs) mb_msg_batch_free(job->msgs);
+	if(job->content) g_string_free(job->content, TRUE);
+	g_free(job->key);
+	g_free(job);
+}
+
+/*
+	Hand ready batches of key to account, stops at the first one still being decoded
+*/
+static void tw_worker_deliver_ready(const gchar * key)
+{
+	GQueue * queue;
+	TwWorkerJob * job;
+
+	// look queue up every time, delivery may cancel the account
+	while( (queue = g_hash_table_lookup(tw_worker_order, key)) != NULL ) {
+		job = g_queue_peek_head(queue);
+		if(!job || !job->done) {
+			break;
+		}
+		g_queue_pop_head(queue);
+		if(g_queue_is_empty(queue)) {
+			g_hash_table_remove(tw_worker_order, key);
+		}
+		job->ma->stat_worker_batches++;
+		job->ma->stat_worker_time += job->elapsed;
+		job->deliver(job->ma, job->tlr, job->msgs, job->last_msg_time);
+		job->tlr = NULL;
+		job->msgs = NULL;
+		tw_worker_job_free(job);
+	}
+}
+
+static gboolean tw_worker_flush(gpointer data)
+{
+	TwWorkerJob * job;
+	gchar * key;
+
+	// clear first, a job pushed from now on adds another callback
+	g_atomic_int_set(&tw_worker_flush_pending, 0);
+	if(!tw_worker_finished) {
+		return FALSE;
+	}
+	while( (job = g_async_queue_try_pop(tw_worker_finished)) != NULL ) {
+		job->done = TRUE;
+		if(job->cancelled) {
+			tw_worker_job_free(job);
+			continue;
+		}
+		key = g_strdup(job->key);
+		tw_worker_deliver_ready(key);
+		g_free(key);
+	}
+	return FALSE;
+}
+
+/*
+	Worker thread, must not call into libpurple
+*/
+static void tw_worker_run(gpointer data, gpointer user_data)
+{
+	TwWorkerJob * job = data;
+	GTimer * timer = g_timer_new();
+
+	job->msgs = tw_decode(job->content->str, job->content->len, TW_DECODE_TIMELINE, &job->last_msg_time);
+	job->elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+	g_string_free(job->content, TRUE);
+	job->content = NULL;
+
+	g_async_queue_push(tw_worker_finished, job);
+	if(g_atomic_int_compare_and_exchange(&tw_worker_flush_pending, 0, 1)) {
+		g_idle_add(tw_worker_flush, NULL);
+	}
+}
+
+gboolean tw_worker_ref(gint workers)
+{
+	GError * error = NULL;
+
+	workers = CLAMP(workers, 1, TW_WORKER_MAX);
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+	if(!g_thread_supported()) {
+		purple_debug_info(DBGID, "threads are not initialized, decoding on main loop\n");
+		return FALSE;
+	}
+#endif
+	if(!tw_worker_pool) {
+		mb_set_main_thread();
+		tw_worker_pool = g_thread_pool_new(tw_worker_run, NULL, workers, FALSE, &error);
+		if(!tw_worker_pool) {
+			purple_debug_info(DBGID, "can not start workers, %s\n", error ? error->message : "");
+			if(error) g_error_free(error);
+			return FALSE;
+		}
+		tw_worker_threads = workers;
+		tw_worker_finished = g_async_queue_new();
+		tw_worker_order = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_queue_free);
+	} else if(workers > tw_worker_threads) {
+		g_thread_pool_set_max_threads(tw_worker_pool, workers, NULL);
+		tw_worker_threads = workers;
+	}
+	tw_worker_users++;
+	purple_debug_info(DBGID, "%d accounts share %d decoding threads\n", tw_worker_users, tw_worker_threads);
+	return TRUE;
+}
+
+void tw_worker_unref(void)
+{
+	TwWorkerJob * job;
+
+	if( (tw_worker_users <= 0) || (--tw_worker_users > 0) ) {
+		return;
+	}
+	// every account cancelled its jobs already, wait for the ones being decoded
+	g_thread_pool_free(tw_worker_pool, FALSE, TRUE);
+	tw_worker_pool = NULL;
+	while( (job = g_async_queue_try_pop(tw_worker_finished)) != NULL ) {
+		tw_worker_job_free(job);
+	}
+	g_async_queue_unref(tw_worker_finished);
+	tw_worker_finished = NULL;
+	g_hash_table_destroy(tw_worker_order);
+	tw_worker_order = NULL;
+	tw_worker_threads = 0;
+}
+
+void tw_worker_submit(MbAccount * ma, const gchar * timeline, TwitterTimeLineReq * tlr, GString * content, TwWorkerDeliver deliver)
+{
+	TwWorkerJob * job = g_new0(TwWorkerJob, 1);
+	GQueue * queue;
+
+	job->ma = ma;
+	job->key = g_strdup_printf("%p\n%s", ma, timeline);
+	job->tlr = tlr;
+	job->content = content ? content : g_string_new(NULL);
+	job->deliver = deliver;
+
+	queue = g_hash_table_lookup(tw_worker_order, job->key);
+	if(!queue) {
+		queue = g_queue_new();
+		g_hash_table_insert(tw_worker_order, g_strdup(job->key), queue);
+	}
+	g_queue_push_tail(queue, job);
+	g_thread_pool_push(tw_worker_pool, job, NULL);
+}
+
+static gboolean tw_worker_cancel_queue(gpointer key, gpointer value, gpointer user_data)
+{
+	GQueue * queue = value;
+	TwWorkerJob * job = g_queue_peek_head(queue);
+	GList * it;
+
+	// all jobs of a queue belong to one account
+	if(!job || (job->ma != user_data)) {
+		return FALSE;
+	}
+	for(it = queue->head; it; it = it->next) {
+		job = it->data;
+		if(job->done) {
+			tw_worker_job_free(job);
+		} else {
+			job->cancelled = TRUE;
+		}
+	}
+	return TRUE;
+}
+
+void tw_worker_cancel(MbAccount * ma)
+{
+	if(tw_worker_order) {
+		g_hash_table_foreach_remove(tw_worker_order, tw_worker_cancel_queue, ma);
+	}
+}
@@ -0,0 +1,91 @@
+/*
+    Copyright 2008-2010, Somsak Sriprayoonsakul <somsaks@gmail.com>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Some part of the code is copied from facebook-pidgin protocols.
+    For the facebook-pidgin projects, please see http://code.google.com/p/pidgin-facebookchat/.
+
+    Courtesy to eionrobb at gmail dot com
+*/
+/**
+ * Timeline decoding on worker threads
+ *
+ * Responses are decoded by a GThreadPool shared by all accounts. Decoded batches go back
+ * to the GLib main loop through an idle callback, in the order responses of the same timeline
+ * were submitted, so messages are still shown and signalled from the main thread.
+ */
+
+#ifndef __TW_WORKER__
+#define __TW_WORKER__
+
+#include <glib.h>
+#include <time.h>
+
+#ifndef G_GNUC_NULL_TERMINATED
+#  if __GNUC__ >= 4
+#    define G_GNUC_NULL_TERMINATED __attribute__((__sentinel__))
+#  else
+#    define G_GNUC_NULL_TERMINATED
+#  endif /* __GNUC__ >= 4 */
+#endif /* G_GNUC_NULL_TERMINATED */
+
+#include "twitter.h"
+#include "mb_msg.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TW_WORKER_MAX 8
+
+/*
+	Take decoded batch on main thread
+
+	@param tlr request the response belongs to, owned by callee now
+	@param msgs decoded messages, owned by callee now
+*/
+typedef void (*TwWorkerDeliver)(MbAccount * ma, TwitterTimeLineReq * tlr, MbMsgBatch * msgs, time_t last_msg_time);
+
+/*
+	Start or share worker threads
+
+	@param workers threads wanted by the account, pool grows to largest wanted
+	@return FALSE if threads are not available, account should decode on main loop then
+*/
+extern gboolean tw_worker_ref(gint workers);
+
+/*
+	Release worker threads, last user waits for running jobs and stops the pool
+*/
+extern void tw_worker_unref(void);
+
+/*
+	Decode timeline response on a worker
+
+	@param timeline key of timeline, batches with same ma and timeline are delivered in order
+	@param content body of response, owned by worker now
+*/
+extern void tw_worker_submit(MbAccount * ma, const gchar * timeline, TwitterTimeLineReq * tlr, GString * content, TwWorkerDeliver deliver);
+
+/*
+	Drop everything of account that's not delivered yet, for account going away
+*/
+extern void tw_worker_cancel(MbAccount * ma);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
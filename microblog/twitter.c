@@ -54,6 +54,14 @@
 #include "mb_net.h"
 #include "mb_util.h"
 #include "mb_cache.h"
+#include "mb_json.h"
+#include "mb_msg.h"
+#include "tw_decode.h"
+#include "tw_worker.h"
+#include "mb_state.h"
+#include "tw_sched.h"
+#include "tw_stream.h"
+#include "mb_io.h"
 
 #ifdef _WIN32
 #	include <win32dep.h>
@@ -80,7 +88,6 @@ static const char twitter_fixed_headers[] = "User-Agent:" TW_AGENT "\r\n" \
 "X-Twitter-Client: " TW_AGENT_SOURCE "\r\n" \
 "X-Twitter-Client-Version: 0.1\r\n" \
 "X-Twitter-Client-Url: " TW_AGENT_DESC_URL "\r\n" \
-"Connection: Close\r\n" \
 "Pragma: no-cache\r\n";
 
 PurplePlugin * twitgin_plugin = NULL;
@@ -94,6 +101,36 @@ gint twitter_oauth_request_finish(MbAccount * ma, MbConnData * data, gpointer us
 void twitter_verify_account(MbAccount * ma, gpointer data);
 gint twitter_verify_authen(MbConnData * conn_data, gpointer data, const char * error);
 
+/*
+	Attach OAuth header to connection if account uses it
+*/
+static void twitter_set_oauth(MbAccount * ma, MbConnData * conn_data)
+{
+	switch(ma->auth_type) {
+		case MB_OAUTH :
+		case MB_XAUTH :
+			// attach oauth header with this connection
+			if(ma->oauth.oauth_token && ma->oauth.oauth_secret) {
+				conn_data->prepare_handler = twitter_oauth_prepare;
+				conn_data->prepare_handler_data = ma;
+			}
+			break;
+		default :
+			// basic auth is default, it's in the template
+			break;
+	}
+}
+
+/*
+	Tell what request template of account is built from, password is stood for by credential generation
+
+	@return host, auth type, user and ma->cred_gen, free with g_free
+*/
+static gchar * twitter_template_key(MbAccount * ma, const gchar * host, const gchar * user_name)
+{
+	return g_strdup_printf("%s\n%d\n%s\n%u", host, ma->auth_type, user_name, ma->cred_gen);
+}
+
 /**
  * Convenient function to initialize new connection and set necessary value
  */
@@ -103,8 +140,9 @@ static MbConnData * twitter_init_connection(MbAccount * ma, gint type, const cha
 	MbConnData * conn_data = NULL;
 	gboolean use_https = purple_account_get_bool(ma->account, mc_name(TC_USE_HTTPS), mc_def_bool(TC_USE_HTTPS));
 	gint retry = purple_account_get_int(ma->account, mc_name(TC_GLOBAL_RETRY), mc_def_int(TC_GLOBAL_RETRY));
+	gboolean use_json = purple_account_get_bool(ma->account, mc_name(TC_USE_JSON), mc_def_bool(TC_USE_JSON));
 	gint port;
-	gchar * user_name = NULL, * host = NULL;
+	gchar * user_name = NULL, * host = NULL, * json_path = NULL, * tmpl_key;
 	const char * password;
 
 	if(use_https) {
@@ -116,6 +154,12 @@ static MbConnData * twitter_init_connection(MbAccount * ma, gint type, const cha
 	twitter_get_user_host(ma, &user_name, &host);
 	password = purple_account_get_password(ma->account);
 
+	// every API has JSON version at the same path, responses are decoded by tw_decode either way
+	if(use_json && g_str_has_suffix(path, ".xml")) {
+		json_path = g_strdup_printf("%.*s.json", (int)(strlen(path) - 4), path);
+		path = json_path;
+	}
+
 	conn_data = mb_conn_data_new(ma, host, port, handler, use_https);
 	mb_conn_data_set_retry(conn_data, retry);
 
@@ -124,28 +168,59 @@ static MbConnData * twitter_init_connection(MbAccount * ma, gint type, const cha
 
 	mb_http_data_set_host(conn_data->request, host);
 	mb_http_data_set_path(conn_data->request, path);
-	// XXX: Use global here -> twitter_fixed_headers
-	mb_http_data_set_fixed_headers(conn_data->request, twitter_fixed_headers);
-	mb_http_data_set_header(conn_data->request, "Host", host);
-
 
-	switch(ma->auth_type) {
-		case MB_OAUTH :
-		case MB_XAUTH :
-			// attach oauth header with this connection
-			if(ma->oauth.oauth_token && ma->oauth.oauth_secret) {
-				conn_data->prepare_handler = twitter_oauth_prepare;
-				conn_data->prepare_handler_data = ma;
-			}
-			break;
-		default :
-			// basic auth is default
-			mb_http_data_set_basicauth(conn_data->request, user_name, password);
-			break;
+	// Host, fixed headers and basic auth are the same for every request, until account setting is changed
+	tmpl_key = twitter_template_key(ma, host, user_name);
+	if(!ma->req_template || (strcmp(ma->req_template->key, tmpl_key) != 0)) {
+		if(ma->req_template) {
+			mb_http_template_unref(ma->req_template);
+		}
+		// XXX: Use global here -> twitter_fixed_headers
+		ma->req_template = mb_http_template_new(tmpl_key, host, twitter_fixed_headers,
+				( (ma->auth_type == MB_OAUTH) || (ma->auth_type == MB_XAUTH) ) ? NULL : user_name, password);
 	}
+	g_free(tmpl_key);
+	mb_http_data_set_template(conn_data->request, ma->req_template);
+	twitter_set_oauth(ma, conn_data);
+
 	if(user_name) g_free(user_name);
 	if(host) g_free(host);
+	if(json_path) g_free(json_path);
+
+	return conn_data;
+}
+
+/*
+	Connection for a long-lived stream, authenticated like other requests of account
+*/
+MbConnData * twitter_init_stream_connection(MbAccount * ma, const char * url, MbHandlerFunc handler)
+{
+	MbConnData * conn_data = NULL;
+	MbHttpTemplate * tmpl;
+	gchar * user_name = NULL, * host = NULL;
+	const char * password;
+
+	twitter_get_user_host(ma, &user_name, &host);
+	password = purple_account_get_password(ma->account);
 
+	// stream may live on another host, connection is set up from url
+	conn_data = mb_conn_data_new(ma, NULL, 0, handler, FALSE);
+	mb_http_data_set_url(conn_data->request, url);
+	conn_data->host = g_strdup(conn_data->request->host);
+	conn_data->port = conn_data->request->port;
+	conn_data->is_ssl = (conn_data->request->proto == MB_HTTPS);
+	conn_data->is_stream = TRUE;
+	conn_data->request->type = HTTP_GET;
+
+	// template of account has Host of API, this one is used once per connect
+	tmpl = mb_http_template_new(url, conn_data->host, twitter_fixed_headers,
+			( (ma->auth_type == MB_OAUTH) || (ma->auth_type == MB_XAUTH) ) ? NULL : user_name, password);
+	mb_http_data_set_template(conn_data->request, tmpl);
+	mb_http_template_unref(tmpl);
+	twitter_set_oauth(ma, conn_data);
+
+	g_free(user_name);
+	g_free(host);
 	return conn_data;
 }
 
@@ -187,6 +262,11 @@ TwitterTimeLineReq * twitter_new_tlr(const char * path, const char * name, int i
 	tlr->timeline_id = id;
 	tlr->use_since_id = TRUE;
 	tlr->screen_name = NULL;
+	tlr->decoder = NULL;
+	tlr->sched_slot = -1;
+	tlr->since_id = 0;
+	tlr->max_id = 0;
+	tlr->backfill_page = 0;
 	if(sys_msg) {
 		tlr->sys_msg = g_strdup(sys_msg);
 	} else {
@@ -200,6 +280,7 @@ void twitter_free_tlr(TwitterTimeLineReq * tlr)
 	if(tlr->path != NULL) g_free(tlr->path);
 	if(tlr->name != NULL) g_free(tlr->name);
 	if(tlr->sys_msg != NULL) g_free(tlr->sys_msg);
+	if(tlr->decoder != NULL) tw_decoder_free(tlr->decoder);
 	g_free(tlr);
 }
 
@@ -274,29 +355,13 @@ void twitter_fetch_first_new_messages(MbAccount * ma)
 	twitter_fetch_new_messages(ma, tlr);
 }
 
-// Function to fetch all new messages periodically
+// Function to fetch all new messages now, periodic polls are done by scheduler
 gboolean twitter_fetch_all_new_messages(gpointer data)
 {
 	MbAccount * ma = data;
-	TwitterTimeLineReq * tlr = NULL;
-	gint i;
-	const gchar * tl_path;
 
-	if(twitter_skip_fetching_messages(ma->account)) {
-		return TRUE;
-	}
-	
-	for(i = TC_FRIENDS_TIMELINE; i <= TC_USER_TIMELINE; i+=2) {
-		//FIXME: i + 1 is not a very good strategy here
-		if(!purple_find_buddy(ma->account, mc_def(i + 1))) {
-			purple_debug_info(DBGID, "skipping %s\n", tlr->name);
-			continue;
-		}
-		tl_path = purple_account_get_string(ma->account, mc_name(i), mc_def(i));
-		tlr = twitter_new_tlr(tl_path, mc_def(i + 1), i, TW_STATUS_COUNT_MAX, NULL);
-		purple_debug_info(DBGID, "fetching updates from %s to %s\n", tlr->path, tlr->name);
-		twitter_fetch_new_messages(ma, tlr);
-	}
+	// all timeline requests are pipelined on one connection, responses come back to each tlr in order
+	tw_sched_poll_all(ma->sched);
 	return TRUE;
 }
 
@@ -307,6 +372,43 @@ static void twitter_list_sent_id_hash(gpointer key, gpointer value, gpointer use
 }
 #endif
 
+//
+// Error message from JSON response, {"error":"..."} or {"errors":[{"message":"..."}]}
+//
+typedef struct _TwitterJsonError {
+	gboolean want; //< next string is the message
+	gchar * error_str;
+} TwitterJsonError;
+
+static gboolean twitter_json_error_token(MbJsonParser * parser, gint token, const gchar * text, gint len, gpointer user_data)
+{
+	TwitterJsonError * err = user_data;
+
+	if(token == MB_JSON_KEY) {
+		err->want = ( (parser->depth == 1) && (len == 5) && (strncmp(text, "error", len) == 0) ) ||
+			( (parser->depth == 3) && (len == 7) && (strncmp(text, "message", len) == 0) );
+		return TRUE;
+	}
+	if(err->want && (token == MB_JSON_STRING)) {
+		err->error_str = g_strndup(text, len);
+		return FALSE;
+	}
+	err->want = FALSE;
+	return TRUE;
+}
+
+static char * twitter_decode_json_error(const char * data)
+{
+	TwitterJsonError err = { FALSE, NULL };
+	MbJsonParser * parser = mb_json_parser_new(twitter_json_error_token, &err);
+
+	if(!mb_json_parser_feed(parser, data, strlen(data)) && !err.error_str) {
+		purple_debug_info(DBGID, "failed to parse JSON data from error response, %s\n", parser->error ? parser->error : "");
+	}
+	mb_json_parser_free(parser);
+	return err.error_str;
+}
+
 //
 // Decode error message from twitter
 //
@@ -315,6 +417,10 @@ char * twitter_decode_error(const char * data)
 	xmlnode * top = NULL, * error = NULL;
 	gchar * error_str = NULL;
 
+	while(g_ascii_isspace(*data)) data++;
+	if( (*data != '<') && (*data != '\0') ) {
+		return twitter_decode_json_error(data);
+	}
 	top = xmlnode_from_str(data, -1);
 	if(top == NULL) {
 		purple_debug_info(DBGID, "failed to parse XML data from error response\n");
@@ -332,133 +438,189 @@ char * twitter_decode_error(const char * data)
 //
 // Decode timeline message
 //
-GList * twitter_decode_messages(const char * data, time_t * last_msg_time)
+MbMsgBatch * twitter_decode_messages(const char * data, time_t * last_msg_time)
 {
-	GList * retval = NULL;
-	xmlnode * top = NULL, *id_node, *time_node, *status, * text, * user, * user_name, * image_url, * user_is_protected, * retweeted_status;
-	gchar * from, * msg_txt, * avatar_url = NULL, *xml_str = NULL, * is_protected = NULL;
-	TwitterMsg * cur_msg = NULL;
-	mb_status_t cur_id;
-	time_t msg_time_t;
-
 	purple_debug_info(DBGID, "%s called\n", __FUNCTION__);
-	top = xmlnode_from_str(data, -1);
-	if(top == NULL) {
-		purple_debug_info(DBGID, "failed to parse XML data\n");
-		return NULL;
+	return tw_decode(data, strlen(data), TW_DECODE_TIMELINE, last_msg_time);
+}
+
+static void twitter_validator_free(TwitterValidator * validator)
+{
+	g_free(validator->etag);
+	g_free(validator->last_modified);
+	g_free(validator->query);
+	g_free(validator);
+}
+
+/*
+	Key of validators, same path with different screen_name is different content
+*/
+static gchar * twitter_validator_key(TwitterTimeLineReq * tlr)
+{
+	if(tlr->screen_name) {
+		return g_strdup_printf("%s?screen_name=%s", tlr->path, tlr->screen_name);
 	}
+	return g_strdup(tlr->path);
+}
 
-	purple_debug_info(DBGID, "successfully parse XML\n");
-	status = xmlnode_get_child(top, "status");
-	purple_debug_info(DBGID, "timezone = %ld\n", timezone);
-	
-	while(status) {
-		msg_txt = from = xml_str = NULL;
-		retweeted_status = NULL;
-		//skip = FALSE;
-		
-		// ID
-		id_node = xmlnode_get_child(status, "id");
-		if(id_node) {
-			xml_str = xmlnode_get_data_unescaped(id_node);
-		}
-		cur_id = strtoull(xml_str, NULL, 10);
-		g_free(xml_str);
+/*
+	Query parameters which change content of a timeline response, besides its key
+*/
+static gchar * twitter_validator_query(TwitterTimeLineReq * tlr)
+{
+	return g_strdup_printf("count=%d&since_id=%llu", tlr->count, tlr->use_since_id ? tlr->since_id : 0);
+}
 
-		// time
-		time_node = xmlnode_get_child(status, "created_at");
-		if(time_node) {
-			xml_str = xmlnode_get_data_unescaped(time_node);
-		}
-		purple_debug_info(DBGID, "msg time = %s\n", xml_str);
-		msg_time_t = mb_mktime(xml_str);
-		if( (*last_msg_time) < msg_time_t) {
-			(*last_msg_time) = msg_time_t;
-		}
-		g_free(xml_str);
-		
-		// message
 /*
-		text = xmlnode_get_child(status, "text");
-		if(text) {
-			msg_txt = xmlnode_get_data_unescaped(text);
-		}
+	Remember ETag and Last-Modified of a full timeline response
 */
-		retweeted_status = xmlnode_get_child(status, "retweeted_status");
-		if(retweeted_status) {
-			xmlnode * rt_text = NULL, * rt_user = NULL, * rt_user_name = NULL;
+static void twitter_validator_update(MbAccount * ma, TwitterTimeLineReq * tlr, MbHttpData * response)
+{
+	const gchar * etag = mb_http_data_get_header(response, "ETag");
+	const gchar * last_modified = mb_http_data_get_header(response, "Last-Modified");
+	TwitterValidator * validator;
+	gchar * key = twitter_validator_key(tlr);
+
+	mb_state_touch(ma->state_file);
+	if(!etag && !last_modified) {
+		g_hash_table_remove(ma->validators, key);
+		g_free(key);
+		return;
+	}
+	validator = g_new0(TwitterValidator, 1);
+	validator->etag = g_strdup(etag);
+	validator->last_modified = g_strdup(last_modified);
+	validator->body_len = response->content_len;
+	validator->query = twitter_validator_query(tlr);
+	// key is owned by hash table now
+	g_hash_table_replace(ma->validators, key, validator);
+}
 
-			rt_text = xmlnode_get_child(retweeted_status, "text");
-			rt_user = xmlnode_get_child(retweeted_status, "user");
+/*
+	Timeline request is over, let scheduler know how active the timeline is
+*/
+static void twitter_timeline_done(MbAccount * ma, TwitterTimeLineReq * tlr, gint new_msgs)
+{
+	if(ma->sched) {
+		tw_sched_poll_done(ma->sched, tlr->sched_slot, new_msgs);
+	}
+	if(tlr->max_id > 0) {
+		ma->backfills--;
+	}
+	// everything this response changed goes to disk at once
+	mb_state_flush(ma->state_file, ma);
+	twitter_free_tlr(tlr);
+}
 
-			if(rt_user) {
-				rt_user_name = xmlnode_get_child(rt_user, "screen_name");
-			}
+/*
+	Backfill page didn't come, rest of its gap is not fetched anymore
+*/
+static void twitter_backfill_failed(MbAccount * ma, TwitterTimeLineReq * tlr)
+{
+	if(tlr->max_id > 0) {
+		purple_debug_info(DBGID, "backfill of %s failed, since_id = %llu, max_id = %llu\n", tlr->path, tlr->since_id, tlr->max_id);
+		ma->stat_gaps_lost++;
+	}
+}
 
-			if(rt_user_name && rt_text) {
-				gchar * user, * text;
+/*
+	Fetch statuses of a timeline missed between tlr->since_id and max_id
 
-				user = xmlnode_get_data(rt_user_name);
-				text = xmlnode_get_data_unescaped(rt_text);
-				msg_txt = g_strdup_printf("RT @%s: %s", user, text);
-				g_free(user);
-				g_free(text);
-			}
-		} else {
-			text = xmlnode_get_child(status, "text");
-			if(text) {
-				msg_txt = xmlnode_get_data_unescaped(text);
-			}
- 		}
+	Runs beside normal polling, one page at a time, until a page isn't full
+*/
+static void twitter_backfill(MbAccount * ma, TwitterTimeLineReq * tlr, mb_status_t max_id)
+{
+	TwitterTimeLineReq * gap;
+
+	if(tlr->max_id == 0) {
+		ma->stat_gaps++;
+	}
+	// next page of a gap takes the place of the current one
+	if( (tlr->backfill_page >= TW_BACKFILL_PAGES) || ( (tlr->max_id == 0) && (ma->backfills >= TW_BACKFILL_MAX) ) ) {
+		purple_debug_info(DBGID, "giving up gap of %s, since_id = %llu, max_id = %llu\n", tlr->path, tlr->since_id, max_id);
+		ma->stat_gaps_lost++;
+		return;
+	}
+	purple_debug_info(DBGID, "backfilling %s, since_id = %llu, max_id = %llu\n", tlr->path, tlr->since_id, max_id);
+	gap = twitter_new_tlr(tlr->path, tlr->name, tlr->timeline_id, TW_STATUS_COUNT_MAX, NULL);
+	gap->use_since_id = FALSE;
+	gap->since_id = tlr->since_id;
+	gap->max_id = max_id;
+	gap->backfill_page = tlr->backfill_page + 1;
+	ma->backfills++;
+	twitter_fetch_new_messages(ma, gap);
+}
+
+/*
+	Show decoded messages of a timeline, takes ownership of tlr and msgs
+*/
+void twitter_deliver_messages(MbAccount * ma, TwitterTimeLineReq * tlr, MbMsgBatch * msgs, time_t last_msg_time_t)
+{
+	TwitterMsg * cur_msg = NULL, * signal_msg = NULL;
+	mb_status_t newest_id = 0, oldest_id = 0;
+	gint i, new_msgs = 0;
+	gboolean hide_myself;
+	gchar * id_str = NULL, * msg_txt = NULL, * tl_key;
+
+	if(msgs->len == 0) {
+		mb_msg_batch_free(msgs);
+		twitter_timeline_done(ma, tlr, 0);
+		return;
+	}
 	
+	// go through the batch from the oldest one
+	// only if id > last_msg_id
+	hide_myself = purple_account_get_bool(ma->account, mc_name(TC_HIDE_SELF), mc_def_bool(TC_HIDE_SELF));
+	tl_key = twitter_validator_key(tlr);
+	for(i = msgs->len - 1; i >= 0; i--) {
 
-		// user name
-		user = xmlnode_get_child(status, "user");
-		if(user) {
-			user_name = xmlnode_get_child(user, "screen_name");
-			if(user_name) {
-				from = xmlnode_get_data(user_name);
-			}
-			image_url = xmlnode_get_child(user, "profile_image_url");
-			if(image_url) {
-				avatar_url = xmlnode_get_data(image_url);
-			}
-			user_is_protected = xmlnode_get_child(user, "protected");
-			if(user_is_protected) {
-				is_protected = xmlnode_get_data(user_is_protected);
-			}
+		cur_msg = mb_msg_batch_index(msgs, i);
+		purple_debug_info(DBGID, "**twitpocalypse** cur_msg->id = %llu, ma->last_msg_id = %llu\n", cur_msg->id, ma->last_msg_id);
+		if(cur_msg->id > tlr->since_id) {
+			new_msgs++;
 		}
-
-		if(from && msg_txt) {
-			cur_msg = g_new(TwitterMsg, 1);
-			
-			purple_debug_info(DBGID, "from = %s, msg = %s\n", from, msg_txt);
-			cur_msg->id = cur_id;
-			cur_msg->from = from;
-			cur_msg->avatar_url = avatar_url; //< actually we don't need this for now
-			cur_msg->msg_time = msg_time_t;
-			if(is_protected && (strcmp(is_protected, "false") == 0) ) {
-				cur_msg->is_protected = FALSE;
-				g_free(is_protected);
-			} else {
-				cur_msg->is_protected = TRUE;
-			}
-			cur_msg->flag = 0;
-			/*
-			if(skip) {
-				cur_msg->flag |= TW_MSGFLAG_SKIP;
-			}
-			*/
-			cur_msg->msg_txt = msg_txt;
-			
-			//purple_debug_info(DBGID, "appending message with id = %llu\n", cur_id);
-			retval = g_list_append(retval, cur_msg);
+		if(cur_msg->id > ma->last_msg_id) {
+			ma->last_msg_id = cur_msg->id;
+			mb_state_touch(ma->state_file);
+		}
+		if(cur_msg->id > newest_id) {
+			newest_id = cur_msg->id;
 		}
-		status = xmlnode_get_next_twin(status);
+		if( (oldest_id == 0) || (cur_msg->id < oldest_id) ) {
+			oldest_id = cur_msg->id;
+		}
+		id_str = g_strdup_printf("%llu", cur_msg->id);
+		if(!(hide_myself && (g_hash_table_remove(ma->sent_id_hash, id_str) == TRUE))) {
+			msg_txt = g_strdup_printf("%s: %s", cur_msg->from, cur_msg->msg_txt);
+			// we still call serv_got_im here, so purple take the message to the log
+			serv_got_im(ma->gc, tlr->name, msg_txt, PURPLE_MESSAGE_RECV, cur_msg->msg_time);
+			// by handling diaplying-im-msg, the message shouldn't be displayed anymore
+			// handlers may replace strings of the message, so they get their own copy
+			signal_msg = mb_msg_copy(cur_msg);
+			purple_signal_emit(mc_def(TC_PLUGIN), "twitter-message", ma, tlr->name, signal_msg);
+			mb_msg_free(signal_msg);
+			g_free(msg_txt);
+		}
+		g_free(id_str);
 	}
-	xmlnode_free(top);
-
-	return retval;
+	if(ma->last_msg_time < last_msg_time_t) {
+		ma->last_msg_time = last_msg_time_t;
+	}
+	mb_state_set_timeline(ma->state_file, tl_key, newest_id);
+	g_free(tl_key);
+	if(tlr->max_id > 0) {
+		ma->stat_backfilled += msgs->len;
+	}
+	// full page may not reach back to since_id, there could be more statuses in between
+	// first fetch after login is limited by initial tweets option on purpose
+	if( ( (tlr->sched_slot >= 0) || (tlr->max_id > 0) ) && (tlr->since_id > 0) && (tlr->count > 0) && (msgs->len >= (guint)tlr->count) && (oldest_id > tlr->since_id + 1) ) {
+		twitter_backfill(ma, tlr, oldest_id - 1);
+	}
+	mb_msg_batch_free(msgs);
+	if(tlr->sys_msg) {
+		serv_got_im(ma->gc, tlr->name, tlr->sys_msg, PURPLE_MESSAGE_SYSTEM, time(NULL));
+	}
+	twitter_timeline_done(ma, tlr, new_msgs);
 }
 
 gint twitter_fetch_new_messages_handler(MbConnData * conn_data, gpointer data, const char * error)
@@ -468,29 +630,50 @@ gint twitter_fetch_new_messages_handler(MbConnData * conn_data, gpointer data, c
 	MbHttpData * response = conn_data->response;
 	TwitterTimeLineReq * tlr = data;
 	time_t last_msg_time_t = 0;
-	GList * msg_list = NULL, *it = NULL;
-	TwitterMsg * cur_msg = NULL;
-	gboolean hide_myself;
-	gchar * id_str = NULL, * msg_txt = NULL;
+	MbMsgBatch * msgs = NULL;
+	TwitterValidator * validator;
+	gchar * validator_key;
 	
 	purple_debug_info(DBGID, "%s called\n", __FUNCTION__);
 	purple_debug_info(DBGID, "received result from %s\n", tlr->path);
 	
 	if(error) {
-		// we don't want to handle network error
+		// network error, timeout or superseded by a newer poll, timeline is polled again later
+		twitter_backfill_failed(ma, tlr);
+		twitter_timeline_done(ma, tlr, 0);
 		return 0;
 	}
+	if(ma->sched) {
+		tw_sched_update_rate(ma->sched, response);
+	}
 
 	username = (const gchar *)purple_account_get_username(ma->account);
 	
 	if(response->status == HTTP_MOVED_TEMPORARILY) {
-		// no new messages
-		twitter_free_tlr(tlr);
+		// no new messages, there's no body to read or decode
+		validator_key = twitter_validator_key(tlr);
+		validator = g_hash_table_lookup(ma->validators, validator_key);
+		if(validator) {
+			ma->stat_not_modified++;
+			ma->stat_bytes_saved += validator->body_len;
+		}
+		g_free(validator_key);
+		twitter_timeline_done(ma, tlr, 0);
 		purple_debug_info(DBGID, "no new messages\n");
 		return 0;
 	}
 	if(response->status != HTTP_OK) {
-		twitter_free_tlr(tlr);
+		twitter_backfill_failed(ma, tlr);
+		twitter_timeline_done(ma, tlr, 0);
+		if(ma->sched && tw_sched_rate_exhausted(ma->sched)) {
+			// scheduler waits for the next rate limit window, no need to drop the account
+			purple_debug_info(DBGID, "rate limit exceeded, status = %d\n", response->status);
+			return 0;
+		}
+		if(response->status == HTTP_UNAUTHORIZE) {
+			// password may have been changed since template was built, next request reads it again
+			ma->cred_gen++;
+		}
 		if((response->status == HTTP_BAD_REQUEST) || (response->status == HTTP_UNAUTHORIZE)) {
 			// rate limit exceed?
 			if(response->content_len > 0) {
@@ -509,64 +692,48 @@ gint twitter_fetch_new_messages_handler(MbConnData * conn_data, gpointer data, c
 			return 0; //< should we return -1 instead?
 		}
 	}
+	if(conn_data->shared) {
+		// identical poll was answered with the same response, its handler shows the statuses
+		purple_debug_info(DBGID, "response of %s shared with an identical request\n", tlr->path);
+		twitter_timeline_done(ma, tlr, 0);
+		return 0;
+	}
+	if(tlr->max_id == 0) {
+		twitter_validator_update(ma, tlr, response);
+	}
 	if(response->content_len == 0) {
 		purple_debug_info(DBGID, "no data to parse\n");
-		twitter_free_tlr(tlr);
+		twitter_timeline_done(ma, tlr, 0);
 		return 0;
 	}
-	purple_debug_info(DBGID, "http_data = #%s#\n", response->content->str);
-	msg_list = twitter_decode_messages(response->content->str, &last_msg_time_t);
-	if(msg_list == NULL) {
-		twitter_free_tlr(tlr);
+	if(tlr->decoder) {
+		// body was already decoded while it's received
+		msgs = tw_decoder_finish(tlr->decoder, &last_msg_time_t);
+	} else if(ma->use_workers) {
+		// worker takes the body, messages come back to twitter_deliver_messages on main loop
+		validator_key = twitter_validator_key(tlr);
+		tw_worker_submit(ma, validator_key, tlr, response->content, twitter_deliver_messages);
+		response->content = NULL;
+		g_free(validator_key);
 		return 0;
+	} else {
+		purple_debug_info(DBGID, "http_data = #%s#\n", response->content->str);
+		msgs = twitter_decode_messages(response->content->str, &last_msg_time_t);
 	}
-	
-	// reverse the list and append it
-	// only if id > last_msg_id
-	hide_myself = purple_account_get_bool(ma->account, mc_name(TC_HIDE_SELF), mc_def_bool(TC_HIDE_SELF));
-	msg_list = g_list_reverse(msg_list);
-	for(it = g_list_first(msg_list); it; it = g_list_next(it)) {
-
-		cur_msg = it->data;
-		purple_debug_info(DBGID, "**twitpocalypse** cur_msg->id = %llu, ma->last_msg_id = %llu\n", cur_msg->id, ma->last_msg_id);
-		if(cur_msg->id > ma->last_msg_id) {
-			ma->last_msg_id = cur_msg->id;
-			mb_account_set_ull(ma->account, TW_ACCT_LAST_MSG_ID, ma->last_msg_id);
-		}
-		id_str = g_strdup_printf("%llu", cur_msg->id);
-		if(!(hide_myself && (g_hash_table_remove(ma->sent_id_hash, id_str) == TRUE))) {
-			msg_txt = g_strdup_printf("%s: %s", cur_msg->from, cur_msg->msg_txt);
-			// we still call serv_got_im here, so purple take the message to the log
-			serv_got_im(ma->gc, tlr->name, msg_txt, PURPLE_MESSAGE_RECV, cur_msg->msg_time);
-			// by handling diaplying-im-msg, the message shouldn't be displayed anymore
-			purple_signal_emit(mc_def(TC_PLUGIN), "twitter-message", ma, tlr->name, cur_msg);
-			g_free(msg_txt);
-		}
-		g_free(id_str);
-		g_free(cur_msg->msg_txt);
-		g_free(cur_msg->from);
-		g_free(cur_msg->avatar_url);
-		g_free(cur_msg);
-		it->data = NULL;
-	}
-	if(ma->last_msg_time < last_msg_time_t) {
-		ma->last_msg_time = last_msg_time_t;
-	}
-	g_list_free(msg_list);
-	if(tlr->sys_msg) {
-		serv_got_im(ma->gc, tlr->name, tlr->sys_msg, PURPLE_MESSAGE_SYSTEM, time(NULL));
-	}
-	twitter_free_tlr(tlr);
+	twitter_deliver_messages(ma, tlr, msgs, last_msg_time_t);
 	return 0;
 }
 
 
 //
-// Check for new message periodically
+// Check for new message periodically, returns id of the request for mb_conn_cancel
 //
-void twitter_fetch_new_messages(MbAccount * ma, TwitterTimeLineReq * tlr)
+guint twitter_fetch_new_messages(MbAccount * ma, TwitterTimeLineReq * tlr)
 {
 	MbConnData * conn_data;
+	TwitterValidator * validator;
+	gchar * validator_key, * query;
+	guint id;
 	
 	purple_debug_info(DBGID, "%s called\n", __FUNCTION__);
 	
@@ -576,15 +743,62 @@ void twitter_fetch_new_messages(MbAccount * ma, TwitterTimeLineReq * tlr)
 		purple_debug_info(DBGID, "tlr->count = %d\n", tlr->count);
 		mb_http_data_add_param_int(conn_data->request, "count", tlr->count);
 	}
-	if(tlr->use_since_id && (ma->last_msg_id > 0) ) {
-		mb_http_data_add_param_ull(conn_data->request, "since_id", ma->last_msg_id);
+	validator_key = twitter_validator_key(tlr);
+	if(tlr->max_id > 0) {
+		// backfill page of a gap
+		mb_http_data_add_param_ull(conn_data->request, "since_id", tlr->since_id);
+		mb_http_data_add_param_ull(conn_data->request, "max_id", tlr->max_id);
+	} else if(tlr->use_since_id) {
+		// each timeline continues from its own newest status
+		tlr->since_id = mb_state_get_timeline(ma->state_file, validator_key);
+		if(tlr->since_id == 0) {
+			// no cursor yet, older versions kept one for all timelines
+			tlr->since_id = ma->last_msg_id;
+		}
+		if(tlr->since_id > 0) {
+			mb_http_data_add_param_ull(conn_data->request, "since_id", tlr->since_id);
+		}
 	}
 	if(tlr->screen_name != NULL) {
 		mb_http_data_add_param(conn_data->request, "screen_name", tlr->screen_name);
 	}
+	// server answers 304 without body if timeline didn't change since last full response
+	// to the same query, a response to another since_id or count says nothing about this one
+	validator = (tlr->max_id == 0) ? g_hash_table_lookup(ma->validators, validator_key) : NULL;
+	g_free(validator_key);
+	if(validator) {
+		query = twitter_validator_query(tlr);
+		if(!validator->query || (strcmp(validator->query, query) != 0) ) {
+			validator = NULL;
+		}
+		g_free(query);
+	}
+	if(validator) {
+		if(validator->etag) {
+			mb_http_data_set_header(conn_data->request, "If-None-Match", validator->etag);
+		}
+		if(validator->last_modified) {
+			mb_http_data_set_header(conn_data->request, "If-Modified-Since", validator->last_modified);
+		}
+	}
+	if(!ma->use_workers) {
+		// decode while receiving, workers decode whole body instead
+		if(tlr->decoder == NULL) {
+			tlr->decoder = tw_decoder_new(TW_DECODE_TIMELINE);
+		}
+		mb_http_data_set_content_sink(conn_data->response, tw_decoder_sink, tlr->decoder);
+	}
 	conn_data->handler_data = tlr;
+	if(tlr->max_id > 0) {
+		conn_data->priority = MB_PRIO_BACKGROUND;
+	} else if(tlr->screen_name != NULL) {
+		// asked for with /get
+		conn_data->priority = MB_PRIO_INTERACTIVE;
+	}
+	id = conn_data->id;
 	
 	mb_conn_process_request(conn_data);
+	return id;
 }
 
 
@@ -637,11 +851,10 @@ MbAccount * mb_account_new(PurpleAccount * acct)
 	const gchar * oauth_token = NULL, * oauth_secret = NULL;
 	
 	purple_debug_info(DBGID, "%s\n", __FUNCTION__);
-	ma = g_new(MbAccount, 1);
+	ma = g_new0(MbAccount, 1);
 	ma->account = acct;
 	ma->gc = acct->gc;
 	ma->state = PURPLE_CONNECTING;
-	ma->timeline_timer = -1;
 	ma->last_msg_id = mb_account_get_ull(acct, TW_ACCT_LAST_MSG_ID, 0);
 	ma->last_msg_time = 0;
 	ma->conn_data_list = NULL;
@@ -650,6 +863,37 @@ MbAccount * mb_account_new(PurpleAccount * acct)
 	ma->tag_pos = MB_TAG_NONE;
 	ma->reply_to_status_id = 0;
 	ma->mb_conf = _mb_conf;
+	ma->conn_pool = mb_conn_pool_new();
+	ma->validators = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)twitter_validator_free);
+	ma->stat_not_modified = 0;
+	ma->stat_bytes_saved = 0;
+	ma->sched = tw_sched_new(ma);
+	ma->state_file = mb_state_new(ma);
+	if(!mb_state_load(ma->state_file, ma)) {
+		// first run with state file, take what older versions kept in account settings
+		mb_account_get_idhash(acct, TW_ACCT_SENT_MSG_IDS, ma->sent_id_hash);
+		mb_state_touch(ma->state_file);
+	}
+	if(mc_name(TC_DECODE_WORKERS)) {
+		i = purple_account_get_int(acct, mc_name(TC_DECODE_WORKERS), mc_def_int(TC_DECODE_WORKERS));
+		ma->use_workers = (i > 0) && tw_worker_ref(i);
+	}
+	if(mc_name(TC_MAX_IN_FLIGHT)) {
+		ma->conn_pool->max_in_flight = MAX(1, purple_account_get_int(acct, mc_name(TC_MAX_IN_FLIGHT), mc_def_int(TC_MAX_IN_FLIGHT)));
+		ma->conn_pool->max_host_in_flight = MAX(1, purple_account_get_int(acct, mc_name(TC_MAX_HOST_IN_FLIGHT), mc_def_int(TC_MAX_HOST_IN_FLIGHT)));
+	}
+	if(mc_name(TC_REQUEST_TIMEOUT)) {
+		i = MAX(0, purple_account_get_int(acct, mc_name(TC_REQUEST_TIMEOUT), mc_def_int(TC_REQUEST_TIMEOUT)));
+		mb_conn_pool_set_timeouts(ma->conn_pool, MB_PRIO_TIMELINE, (i > 0) ? MB_TIMEOUT_CONNECT : 0, (i > 0) ? MB_TIMEOUT_TTFB : 0, i);
+	}
+	if(mc_name(TC_IO_THREAD)) {
+		ma->use_io = purple_account_get_bool(acct, mc_name(TC_IO_THREAD), mc_def_bool(TC_IO_THREAD)) && mb_io_ref();
+	}
+	if(mc_name(TC_USE_STREAM) && purple_account_get_bool(acct, mc_name(TC_USE_STREAM), mc_def_bool(TC_USE_STREAM))) {
+		ma->stream = tw_stream_new(ma, purple_account_get_string(acct, mc_name(TC_STREAM_URL), mc_def(TC_STREAM_URL)));
+	}
+	ma->req_template = NULL;
+	ma->cred_gen = 0;
 
 	// Cache
 //	ma->cache = mb_cache_new();
@@ -734,9 +978,19 @@ void mb_account_free(MbAccount * ma)
 	ma->tag_pos = MB_TAG_NONE;
 	ma->state = PURPLE_DISCONNECTED;
 	
-	if(ma->timeline_timer != -1) {
-		purple_debug_info(DBGID, "removing timer\n");
-		purple_timeout_remove(ma->timeline_timer);
+	if(ma->use_workers) {
+		// batches still being decoded are dropped when they come back
+		tw_worker_cancel(ma);
+		tw_worker_unref();
+		ma->use_workers = FALSE;
+	}
+	if(ma->stream) {
+		tw_stream_free(ma->stream);
+		ma->stream = NULL;
+	}
+	if(ma->sched) {
+		tw_sched_free(ma->sched);
+		ma->sched = NULL;
 	}
 
 	while(ma->conn_data_list) {
@@ -744,10 +998,36 @@ void mb_account_free(MbAccount * ma)
 		mb_conn_data_free(ma->conn_data_list->data);
 		// don't need to delete the list, it will be deleted by conn_data_free eventually
 	}
+	if(ma->conn_pool) {
+		mb_conn_pool_free(ma->conn_pool);
+		ma->conn_pool = NULL;
+	}
+	if(ma->use_io) {
+		// every socket of account is closed with the pool
+		mb_io_unref();
+		ma->use_io = FALSE;
+	}
+	if(ma->state_file) {
+		num_remove = g_hash_table_foreach_remove(ma->sent_id_hash, foreach_remove_expire_idhash, ma);
+		purple_debug_info(DBGID, "%u key removed\n", num_remove);
+		if(num_remove > 0) {
+			mb_state_touch(ma->state_file);
+		}
+		mb_state_flush(ma->state_file, ma);
+		mb_state_free(ma->state_file);
+		ma->state_file = NULL;
+		// keep last id in account settings too, it's only written here
+		mb_account_set_ull(ma->account, TW_ACCT_LAST_MSG_ID, ma->last_msg_id);
+	}
+	if(ma->validators) {
+		g_hash_table_destroy(ma->validators);
+		ma->validators = NULL;
+	}
+	if(ma->req_template) {
+		mb_http_template_unref(ma->req_template);
+		ma->req_template = NULL;
+	}
 
-	num_remove = g_hash_table_foreach_remove(ma->sent_id_hash, foreach_remove_expire_idhash, ma);
-	purple_debug_info(DBGID, "%u key removed\n", num_remove);
-	mb_account_set_idhash(ma->account, TW_ACCT_SENT_MSG_IDS, ma->sent_id_hash);
 	if(ma->sent_id_hash) {
 		purple_debug_info(DBGID, "destroying sent_id hash\n");
 		g_hash_table_destroy(ma->sent_id_hash);
@@ -770,9 +1050,6 @@ void twitter_login(PurpleAccount *acct)
 	// Create account data
 	ma = mb_account_new(acct);
 
-	purple_debug_info(DBGID, "creating id hash for sentid\n");
-	mb_account_get_idhash(acct, TW_ACCT_SENT_MSG_IDS,ma->sent_id_hash);
-
 	twitter_request_access(ma);
 
 	// connect to twitgin here
@@ -917,6 +1194,7 @@ void twitter_verify_account(MbAccount * ma, gpointer data)
 	purple_debug_info(DBGID, "path = %s\n", path);
 
 	conn_data = twitter_init_connection(ma, HTTP_GET, path, twitter_verify_authen);
+	conn_data->priority = MB_PRIO_INTERACTIVE;
 
 	mb_conn_process_request(conn_data);
 	g_free(path);
@@ -937,34 +1215,30 @@ gint twitter_verify_authen(MbConnData * conn_data, gpointer data, const char * e
 		purple_debug_info(DBGID, "response = %s\n", response->content->str);
 	}
 	if(response->status == HTTP_OK) {
-		gint interval = purple_account_get_int(conn_data->ma->account, mc_name(TC_MSG_REFRESH_RATE), mc_def_int(TC_MSG_REFRESH_RATE));
-
 		// extract the username and set it
 		if(response->content_len > 0) {
-			xmlnode * top = NULL, * screen_name = NULL;
+			MbMsgBatch * users;
+			time_t last_msg_time_t = 0;
 			gchar * screen_name_str = NULL;
 			gchar * user_name = NULL, * host = NULL;
 
-			top = xmlnode_from_str(response->content->str, -1);
-			if(top != NULL) {
-				screen_name = xmlnode_get_child(top, "screen_name");
-				if(screen_name) {
-					screen_name_str = xmlnode_get_data_unescaped(screen_name);
-				}
+			users = tw_decode(response->content->str, response->content->len, TW_DECODE_USER, &last_msg_time_t);
+			if(users->len > 0) {
+				screen_name_str = g_strdup(mb_msg_batch_index(users, 0)->from);
 			}
-			xmlnode_free(top);
+			mb_msg_batch_free(users);
 			if(screen_name_str) {
-				purple_debug_info(DBGID, "old username = %s\n", purple_account_get_username(conn_data->ma->account));
-				twitter_get_user_host(conn_data->ma, &user_name, &host);
+				purple_debug_info(DBGID, "old username = %s\n", purple_account_get_username(ma->account));
+				twitter_get_user_host(ma, &user_name, &host);
 				if(host) {
 					// libpurple host is embed in username, so we need to keep it
 					gchar * tmp;
 
 					tmp = g_strdup_printf("%s@%s", screen_name_str, host);
-					purple_account_set_username(conn_data->ma->account, tmp);
+					purple_account_set_username(ma->account, tmp);
 					g_free(tmp);
 				} else {
-					purple_account_set_username(conn_data->ma->account, screen_name_str);
+					purple_account_set_username(ma->account, screen_name_str);
 				}
 				g_free(user_name);
 				g_free(host);
@@ -975,12 +1249,14 @@ gint twitter_verify_authen(MbConnData * conn_data, gpointer data, const char * e
 		}
 
 		// now prepare for timeline refresher
-		purple_connection_set_state(conn_data->ma->gc, PURPLE_CONNECTED);
-		conn_data->ma->state = PURPLE_CONNECTED;
-		twitter_get_buddy_list(conn_data->ma);
-		purple_debug_info(DBGID, "refresh interval = %d\n", interval);
-		conn_data->ma->timeline_timer = purple_timeout_add_seconds(interval, (GSourceFunc)twitter_fetch_all_new_messages, conn_data->ma);
-		twitter_fetch_first_new_messages(conn_data->ma);
+		purple_connection_set_state(ma->gc, PURPLE_CONNECTED);
+		ma->state = PURPLE_CONNECTED;
+		twitter_get_buddy_list(ma);
+		tw_sched_start(ma->sched);
+		twitter_fetch_first_new_messages(ma);
+		if(ma->stream) {
+			tw_stream_start(ma->stream);
+		}
 		return 0;
 	} else {
 		// XXX: Crash at the line below
@@ -999,10 +1275,8 @@ void twitter_close(PurpleConnection *gc)
 
 	purple_debug_info(DBGID, "twitter_close\n");
 
-	if(ma->timeline_timer != -1) {
-		purple_debug_info(DBGID, "removing timer\n");
-		purple_timeout_remove(ma->timeline_timer);
-		ma->timeline_timer = -1;
+	if(ma->sched) {
+		tw_sched_stop(ma->sched);
 	}
 	//purple_timeout_add(300, (GSourceFunc)twitter_close_timer, ma);
 	mb_account_free(ma);
@@ -1014,7 +1288,8 @@ gint twitter_send_im_handler(MbConnData * conn_data, gpointer data, const char *
 	MbAccount * ma = conn_data->ma;
 	MbHttpData * response = conn_data->response;
 	gchar * id_str = NULL, * who = (gchar *)data;
-	xmlnode * top, *id_node;
+	MbMsgBatch * statuses;
+	time_t last_msg_time_t = 0;
 	
 	purple_debug_info(DBGID, "%s\n", __FUNCTION__);
 
@@ -1054,26 +1329,26 @@ gint twitter_send_im_handler(MbConnData * conn_data, gpointer data, const char *
 
 	purple_debug_info(DBGID, "http_data = #%s#\n", response->content->str);
 	
-	// parse response XML
-	top = xmlnode_from_str(response->content->str, -1);
-	if(top == NULL) {
-		purple_debug_info(DBGID, "failed to parse XML data\n");
+	// parse response, XML or JSON
+	statuses = tw_decode(response->content->str, response->content->len, TW_DECODE_STATUS, &last_msg_time_t);
+	if(statuses->len == 0) {
+		purple_debug_info(DBGID, "failed to parse status data\n");
+		mb_msg_batch_free(statuses);
 		return -1;
 	}
-	purple_debug_info(DBGID, "successfully parse XML\n");
+	purple_debug_info(DBGID, "successfully parse status\n");
 
 	// ID
-	id_node = xmlnode_get_child(top, "id");
-	if(id_node) {
-		id_str = xmlnode_get_data_unescaped(id_node);
-	}
+	id_str = g_strdup_printf("%llu", mb_msg_batch_index(statuses, 0)->id);
+	mb_msg_batch_free(statuses);
 
 	// save it to account
 	g_hash_table_insert(ma->sent_id_hash, id_str, id_str);
+	mb_state_touch(ma->state_file);
+	mb_state_flush(ma->state_file, ma);
 	
 	//hash_table supposed to free this for use
 	//g_free(id_str);
-	xmlnode_free(top);
 	return 0;
 }
 
@@ -1144,6 +1419,7 @@ int twitter_send_im(PurpleConnection *gc, const gchar *who, const gchar *message
 	mb_http_data_set_content(conn_data->request, post_data, len);
 	*/
 	//	g_free(post_data);
+	conn_data->priority = MB_PRIO_INTERACTIVE;
 	
 	mb_conn_process_request(conn_data);
 	g_free(path);
@@ -1193,6 +1469,7 @@ void twitter_favorite_message(MbAccount * ma, gchar * msg_id)
 	path = g_strdup_printf("/favorites/create/%s.xml", msg_id);
 
 	conn_data = twitter_init_connection(ma, HTTP_POST, path, NULL);
+	conn_data->priority = MB_PRIO_INTERACTIVE;
 
 	mb_conn_process_request(conn_data);
 	g_free(path);
@@ -1212,6 +1489,7 @@ void twitter_retweet_message(MbAccount * ma, gchar * msg_id)
 	path = g_strdup_printf("/statuses/retweet/%s.xml", msg_id);
 
 	conn_data = twitter_init_connection(ma, HTTP_POST, path, NULL);
+	conn_data->priority = MB_PRIO_INTERACTIVE;
 	mb_conn_process_request(conn_data);
 	g_free(path);
 
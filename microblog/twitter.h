@@ -67,6 +67,8 @@ extern "C" {
 #define TW_INTERVAL 60
 #define TW_STATUS_COUNT_MAX 200
 #define TW_INIT_TWEET 15
+#define TW_BACKFILL_MAX 4 //< gaps of an account being backfilled at once
+#define TW_BACKFILL_PAGES 5 //< pages fetched to fill one gap
 #define TW_STATUS_TXT_MAX 140
 
 #ifdef MBADIUM
@@ -91,6 +93,8 @@ enum _TweetProxyDataErrorActions {
 	TW_RAISE_ERROR = 1,
 };
 
+struct _TwitterMsgDecoder;
+
 // Hold parameter for statuses request
 typedef struct _TwitterTimeLineReq {
 	gchar * path;
@@ -100,6 +104,11 @@ typedef struct _TwitterTimeLineReq {
 	gboolean use_since_id;
 	gchar * sys_msg;
 	gchar * screen_name; // for /get command to fetch other user TL
+	struct _TwitterMsgDecoder * decoder; // decodes statuses while response is received
+	gint sched_slot; // slot in poll scheduler, -1 if not sent by scheduler
+	unsigned long long since_id; // newest id already seen in this timeline, 0 to fetch latest
+	unsigned long long max_id; // non-zero to backfill a gap, fetch ids up to this one
+	gint backfill_page; // page number of gap being backfilled
 } TwitterTimeLineReq;
 
 extern TwitterTimeLineReq * twitter_new_tlr(const char * path, const char * name, int count, int id, const char * sys_msg);
@@ -129,6 +138,15 @@ enum _TweetConfig {
 	TC_REPLIES_TIMELINE,
 	TC_REPLIES_USER,
 	TC_AUTH_TYPE,
+	TC_KEEP_ALIVE,
+	TC_USE_JSON,
+	TC_DECODE_WORKERS,
+	TC_USE_STREAM,
+	TC_STREAM_URL,
+	TC_MAX_IN_FLIGHT,
+	TC_MAX_HOST_IN_FLIGHT,
+	TC_REQUEST_TIMEOUT,
+	TC_IO_THREAD,
 
 	// OAuth stuff
 	TC_OAUTH_TOKEN,
@@ -160,13 +178,28 @@ extern MbConfig * _mb_conf;
 
 typedef unsigned long long int mb_status_t;
 
+struct _MbConnPool;
+struct _TwitterSched;
+struct _MbState;
+struct _TwitterStream;
+struct _MbConnData;
+struct _MbMsgBatch;
+
+// Validators of last full response of a timeline, for conditional GET
+typedef struct _TwitterValidator {
+	gchar * etag;
+	gchar * last_modified;
+	gint body_len; //< body size of last full response, what a 304 saves
+	gchar * query; //< count and since_id it was sent with, other queries don't match it
+} TwitterValidator;
+
 typedef struct _MbAccount {
 	PurpleAccount *account;
 	PurpleConnection *gc;
 	gchar *login_challenge;
 	PurpleConnectionState state;
 	GSList * conn_data_list;
-	guint timeline_timer;
+	struct _TwitterSched * sched; //< polls timelines
 	mb_status_t last_msg_id;
 	time_t last_msg_time;
 	GHashTable * sent_id_hash;
@@ -177,6 +210,22 @@ typedef struct _MbAccount {
 	gint auth_type;
 	MbConfig * mb_conf;
 	MbOauth oauth;
+	struct _MbConnPool * conn_pool; //< persistent HTTP connections
+	struct _MbHttpTemplate * req_template; //< Host, fixed headers and basic auth of every request
+	guint cred_gen; //< bumped when credentials may have changed, request template is rebuilt then
+	GHashTable * validators; //< TwitterValidator of each timeline request
+	guint stat_not_modified; //< timeline requests answered with 304
+	unsigned long long stat_bytes_saved; //< body bytes not sent thanks to 304
+	gboolean use_workers; //< timelines are decoded by tw_worker threads
+	guint stat_worker_batches; //< timeline responses decoded off main loop
+	gdouble stat_worker_time; //< seconds of decoding done off main loop
+	gboolean use_io; //< plain HTTP responses are read by mb_io thread
+	struct _MbState * state_file; //< last ids, sent ids and validators kept across sessions
+	gint backfills; //< gap backfill requests in flight
+	guint stat_gaps; //< full pages that didn't reach back to since_id
+	guint stat_gaps_lost; //< gaps not completely backfilled
+	guint stat_backfilled; //< statuses fetched by backfill
+	struct _TwitterStream * stream; //< streaming connection of friends timeline, NULL if polled
 } MbAccount;
 
 enum tag_position {
@@ -242,8 +291,13 @@ extern void twitter_buddy_free(PurpleBuddy * buddy);
 extern void twitter_get_user_host(const MbAccount * ta, char ** user_name, char ** host);
 #define mb_get_user_host(a, b, c) twitter_get_user_host(a, b, c)
 
-extern void twitter_fetch_new_messages(MbAccount * ta, TwitterTimeLineReq * tlr);
+extern guint twitter_fetch_new_messages(MbAccount * ta, TwitterTimeLineReq * tlr);
+extern void twitter_fetch_first_new_messages(MbAccount * ma);
+extern void twitter_deliver_messages(MbAccount * ma, TwitterTimeLineReq * tlr, struct _MbMsgBatch * msgs, time_t last_msg_time);
+extern struct _MbConnData * twitter_init_stream_connection(MbAccount * ma, const char * url,
+		gint (*handler)(struct _MbConnData *, gpointer, const char *));
 extern gboolean twitter_fetch_all_new_messages(gpointer data);
+extern gboolean twitter_skip_fetching_messages(PurpleAccount * acct);
 extern void * twitter_on_replying_message(gchar * proto, mb_status_t msg_id, MbAccount * ma);
 extern void twitter_favorite_message(MbAccount * ta, gchar * msg_id);
 extern void twitter_retweet_message(MbAccount * ta, gchar * msg_id);
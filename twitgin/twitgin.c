@@ -56,6 +56,7 @@
 #include "mb_http.h"
 #include "mb_net.h"
 #include "mb_util.h"
+#include "mb_urlenc.h"
 #include "twitpref.h"
 
 #define DBGID "twitgin"
@@ -562,8 +563,7 @@ char * twitter_reformat_msg(MbAccount * ma, const TwitterMsg * msg, PurpleConver
 	gchar sym, old_char, previous_char;
 	int i = 0, j = 0;
 	gboolean from_eq_username = FALSE;
-	const char * embed_ort_txt = NULL;
-	const char * embed_ra_txt = NULL;
+	gchar * embed_txt = NULL; //< msg_txt encoded for ort and ra links
 	gboolean reply_link = purple_prefs_get_bool(TW_PREF_REPLY_LINK);
 	const gchar * account = (const gchar *)purple_account_get_username(ma->account);
    gboolean lb_before_links = FALSE, lb_after_msg = FALSE;
@@ -720,25 +720,27 @@ char * twitter_reformat_msg(MbAccount * ma, const TwitterMsg * msg, PurpleConver
 		// display ort link, if enabled
 		if( (msg->id > 0) && purple_prefs_get_bool(TW_PREF_ORT_LINK) && !msg->is_protected) {
 			// text for retweet url
-			embed_ort_txt = purple_url_encode(msg->msg_txt);
-			purple_debug_info(DBGID, "url embed text for retweet = ##%s##\n", embed_ort_txt);
+			embed_txt = mb_url_encode_dup(msg->msg_txt);
+			purple_debug_info(DBGID, "url embed text for retweet = ##%s##\n", embed_txt);
 
 #if PURPLE_VERSION_CHECK(2, 6, 0)
-			ort_txt = g_strdup_printf(" <a href=\"%s:///ort?src=%s&account=%s&from=%s&msg=%s\">ort</a> ", uri_txt, conv->name, account, msg->from, embed_ort_txt);
+			ort_txt = g_strdup_printf(" <a href=\"%s:///ort?src=%s&account=%s&from=%s&msg=%s\">ort</a> ", uri_txt, conv->name, account, msg->from, embed_txt);
 #else
-			ort_txt = g_strdup_printf(" <a href=\"%s:ort?src=%s&account=%s&from=%s&msg=%s\">ort</a> ", uri_txt, conv->name, account, msg->from, embed_ort_txt);
+			ort_txt = g_strdup_printf(" <a href=\"%s:ort?src=%s&account=%s&from=%s&msg=%s\">ort</a> ", uri_txt, conv->name, account, msg->from, embed_txt);
 #endif
 		}
 
 		// display reply all link, if enabled
 		if( (msg->id > 0) && purple_prefs_get_bool(TW_PREF_REPLYALL_LINK) && !msg->is_protected) {
-			embed_ra_txt = purple_url_encode(msg->msg_txt);
-			purple_debug_info(DBGID, "url embed text for replyall = ##%s##\n", embed_ra_txt);
+			if(!embed_txt) {
+				embed_txt = mb_url_encode_dup(msg->msg_txt);
+			}
+			purple_debug_info(DBGID, "url embed text for replyall = ##%s##\n", embed_txt);
 
 #if PURPLE_VERSION_CHECK(2, 6, 0)
-			ra_txt = g_strdup_printf(" <a href=\"%s:///replyall?src=%s&to=%s&account=%s&id=%llu&msg=%s\">ra</a> ", uri_txt, conv->name, msg->from, account, msg->id, embed_ra_txt);
+			ra_txt = g_strdup_printf(" <a href=\"%s:///replyall?src=%s&to=%s&account=%s&id=%llu&msg=%s\">ra</a> ", uri_txt, conv->name, msg->from, account, msg->id, embed_txt);
 #else
-			ra_txt = g_strdup_printf(" <a href=\"%s:replyall?src=%s&to=%s&account=%s&id=%llu&msg=%s\">ra</a> ", uri_txt, conv->name, msg->from, account, msg->id, embed_ra_txt);
+			ra_txt = g_strdup_printf(" <a href=\"%s:replyall?src=%s&to=%s&account=%s&id=%llu&msg=%s\">ra</a> ", uri_txt, conv->name, msg->from, account, msg->id, embed_txt);
 #endif
 
 		}
@@ -781,6 +783,7 @@ char * twitter_reformat_msg(MbAccount * ma, const TwitterMsg * msg, PurpleConver
 	if(rt_txt) g_free(rt_txt);
 	if(ort_txt) g_free(ort_txt);
 	if(ra_txt) g_free(ra_txt);
+	if(embed_txt) g_free(embed_txt);
 	if(datetime_txt) g_free(datetime_txt);
 
 	purple_debug_info(DBGID, "displaying text = ##%s##\n", displaying_txt);